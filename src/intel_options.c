@@ -25,6 +25,11 @@ const OptionInfoRec intel_options[] = {
 	{OPTION_ZAPHOD,		"ZaphodHeads",	OPTV_STRING,	{0},	0},
 	{OPTION_TEAR_FREE,	"TearFree",	OPTV_BOOLEAN,	{0},	0},
 	{OPTION_CRTC_PIXMAPS,	"PerCrtcPixmaps", OPTV_BOOLEAN,	{0},	0},
+	{OPTION_THREADS,	"Threads",	OPTV_INTEGER,	{0},	0},
+	{OPTION_THREAD_AFFINITY, "ThreadAffinity", OPTV_STRING,	{0},	0},
+	{OPTION_ASYNC_RETIRE,	"AsyncRetire",	OPTV_BOOLEAN,	{0},	0},
+	{OPTION_DEBUG_STATS,	"DebugStats",	OPTV_BOOLEAN,	{0},	0},
+	{OPTION_VMA_CACHE_SIZE,	"VMACacheSize",	OPTV_INTEGER,	{0},	0},
 #endif
 #ifdef USE_UXA
 	{OPTION_FALLBACKDEBUG,	"FallbackDebug",OPTV_BOOLEAN,	{0},	0},
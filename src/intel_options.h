@@ -32,6 +32,11 @@ enum intel_options {
 	OPTION_ZAPHOD,
 	OPTION_TEAR_FREE,
 	OPTION_CRTC_PIXMAPS,
+	OPTION_THREADS,
+	OPTION_THREAD_AFFINITY,
+	OPTION_ASYNC_RETIRE,
+	OPTION_DEBUG_STATS,
+	OPTION_VMA_CACHE_SIZE,
 #endif
 #ifdef USE_UXA
 	OPTION_FALLBACKDEBUG,
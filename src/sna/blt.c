@@ -35,90 +35,70 @@
 #define USE_SSE2 1
 #endif
 
+#if USE_SSE2 && HAS_GCC_TARGET
+#define USE_SSE4_1 1
+#define USE_AVX2 1
+#endif
+
+/* Copies larger than this bypass the cache with non-temporal stores, as
+ * they would only evict everything else on their way to the GPU.
+ */
+#define NT_THRESHOLD (512*1024)
+
 #if USE_SSE2
 #include <xmmintrin.h>
-
-#if __x86_64__
 #define have_sse2() 1
-#else
-enum {
-	MMX = 0x1,
-	MMX_EXTENSIONS = 0x2,
-	SSE = 0x6,
-	SSE2 = 0x8,
-	CMOV = 0x10
-};
+#endif
 
-#ifdef __GNUC__
-static unsigned int
-detect_cpu_features(void)
-{
-	unsigned int features;
-	unsigned int result = 0;
-
-	char vendor[13];
-	vendor[0] = 0;
-	vendor[12] = 0;
-
-	asm (
-	     "pushf\n"
-	     "pop %%eax\n"
-	     "mov %%eax, %%ecx\n"
-	     "xor $0x00200000, %%eax\n"
-	     "push %%eax\n"
-	     "popf\n"
-	     "pushf\n"
-	     "pop %%eax\n"
-	     "mov $0x0, %%edx\n"
-	     "xor %%ecx, %%eax\n"
-	     "jz 1f\n"
-
-	     "mov $0x00000000, %%eax\n"
-	     "push %%ebx\n"
-	     "cpuid\n"
-	     "mov %%ebx, %%eax\n"
-	     "pop %%ebx\n"
-	     "mov %%eax, %1\n"
-	     "mov %%edx, %2\n"
-	     "mov %%ecx, %3\n"
-	     "mov $0x00000001, %%eax\n"
-	     "push %%ebx\n"
-	     "cpuid\n"
-	     "pop %%ebx\n"
-	     "1:\n"
-	     "mov %%edx, %0\n"
-	     : "=r" (result), "=m" (vendor[0]), "=m" (vendor[4]), "=m" (vendor[8])
-	     :: "%eax", "%ecx", "%edx");
-
-	features = 0;
-	if (result) {
-		/* result now contains the standard feature bits */
-		if (result & (1 << 15))
-			features |= CMOV;
-		if (result & (1 << 23))
-			features |= MMX;
-		if (result & (1 << 25))
-			features |= SSE;
-		if (result & (1 << 26))
-			features |= SSE2;
-	}
-	return features;
-}
-#else
-static unsigned int detect_cpu_features(void) { return 0; }
+#if USE_SSE4_1 || USE_AVX2
+#include <immintrin.h>
 #endif
 
-static bool have_sse2(void)
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+
+static unsigned xgetbv(void)
 {
-	static int sse2_present = -1;
+	unsigned lo, hi;
+
+	/* xgetbv %ecx=0, spelt out for older assemblers */
+	asm(".byte 0x0f, 0x01, 0xd0" : "=a" (lo), "=d" (hi) : "c" (0));
+	return lo;
+}
 
-	if (sse2_present == -1)
-		sse2_present = detect_cpu_features() & SSE2;
+unsigned sna_cpu_detect(void)
+{
+	unsigned max, eax, ebx, ecx, edx;
+	unsigned features = 0;
+	bool has_avx = false;
+
+	max = __get_cpuid_max(0, NULL);
+	if (max >= 1) {
+		__cpuid(1, eax, ebx, ecx, edx);
+		if (edx & (1 << 26))
+			features |= CPU_SSE2;
+		if (ecx & (1 << 19))
+			features |= CPU_SSE4_1;
+
+		/* AVX (bit 28) is only usable if the OS saves the ymm
+		 * state (OSXSAVE, bit 27, and XCR0 bits 1 and 2).
+		 */
+		if ((ecx & (3 << 27)) == (3 << 27))
+			has_avx = (xgetbv() & 6) == 6;
+	}
+	if (max >= 7 && has_avx) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		if (ebx & (1 << 5))
+			features |= CPU_AVX2;
+	}
 
-	return sse2_present;
+	return features;
 }
+#else
+unsigned sna_cpu_detect(void) { return 0; }
 #endif
 
+#if USE_SSE2
 static inline __m128i
 xmm_create_mask_32(uint32_t mask)
 {
@@ -138,12 +118,12 @@ xmm_save_128(__m128i *dst, __m128i data)
 }
 #endif
 
-void
-memcpy_blt(const void *src, void *dst, int bpp,
-	   int32_t src_stride, int32_t dst_stride,
-	   int16_t src_x, int16_t src_y,
-	   int16_t dst_x, int16_t dst_y,
-	   uint16_t width, uint16_t height)
+static void
+memcpy_blt__generic(const void *src, void *dst, int bpp,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height)
 {
 	const uint8_t *src_bytes;
 	uint8_t *dst_bytes;
@@ -213,12 +193,12 @@ memcpy_blt(const void *src, void *dst, int bpp,
 	}
 }
 
-void
-memcpy_to_tiled_x(const void *src, void *dst, int bpp, int swizzling,
-		  int32_t src_stride, int32_t dst_stride,
-		  int16_t src_x, int16_t src_y,
-		  int16_t dst_x, int16_t dst_y,
-		  uint16_t width, uint16_t height)
+static force_inline void
+__memcpy_to_tiled_x(const void *src, void *dst, int bpp, int swizzling,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height)
 {
 	const unsigned tile_width = 512;
 	const unsigned tile_height = 8;
@@ -330,11 +310,248 @@ memcpy_to_tiled_x(const void *src, void *dst, int bpp, int swizzling,
 	}
 }
 
-void
-memmove_box(const void *src, void *dst,
-	    int bpp, int32_t stride,
-	    const BoxRec *box,
-	    int dx, int dy)
+static force_inline void
+__memcpy_from_tiled_x(const void *src, void *dst, int bpp, int swizzling,
+		      int32_t src_stride, int32_t dst_stride,
+		      int16_t src_x, int16_t src_y,
+		      int16_t dst_x, int16_t dst_y,
+		      uint16_t width, uint16_t height)
+{
+	const unsigned tile_width = 512;
+	const unsigned tile_height = 8;
+	const unsigned tile_size = 4096;
+
+	const unsigned cpp = bpp / 8;
+	const unsigned stride_tiles = src_stride / tile_width;
+	const unsigned swizzle_pixels = (swizzling ? 64 : tile_width) / cpp;
+	const unsigned tile_pixels = ffs(tile_width / cpp) - 1;
+	const unsigned tile_mask = (1 << tile_pixels) - 1;
+
+	unsigned x, y;
+
+	DBG(("%s(bpp=%d, swizzling=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, bpp, swizzling, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+
+	dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp;
+
+	for (y = 0; y < height; ++y) {
+		const uint32_t sy = y + src_y;
+		const uint32_t tile_row =
+			(sy / tile_height * stride_tiles * tile_size +
+			 (sy & (tile_height-1)) * tile_width);
+		uint8_t *dst_row = (uint8_t *)dst + dst_stride * y;
+		uint32_t sx = src_x, offset;
+
+		x = width * cpp;
+		if (sx & (swizzle_pixels - 1)) {
+			const uint32_t swizzle_bound_pixels = ALIGN(sx + 1, swizzle_pixels);
+			const uint32_t length = min(src_x + width, swizzle_bound_pixels) - sx;
+			offset = tile_row +
+				(sx >> tile_pixels) * tile_size +
+				(sx & tile_mask) * cpp;
+			switch (swizzling) {
+			case I915_BIT_6_SWIZZLE_NONE:
+				break;
+			case I915_BIT_6_SWIZZLE_9:
+				offset ^= (offset >> 3) & 64;
+				break;
+			case I915_BIT_6_SWIZZLE_9_10:
+				offset ^= ((offset ^ (offset >> 1)) >> 3) & 64;
+				break;
+			case I915_BIT_6_SWIZZLE_9_11:
+				offset ^= ((offset ^ (offset >> 2)) >> 3) & 64;
+				break;
+			}
+
+			memcpy(dst_row, (const char *)src + offset, length * cpp);
+
+			dst_row += length * cpp;
+			x -= length * cpp;
+			sx += length;
+		}
+		if (swizzling) {
+			while (x >= 64) {
+				offset = tile_row +
+					(sx >> tile_pixels) * tile_size +
+					(sx & tile_mask) * cpp;
+				switch (swizzling) {
+				case I915_BIT_6_SWIZZLE_9:
+					offset ^= (offset >> 3) & 64;
+					break;
+				case I915_BIT_6_SWIZZLE_9_10:
+					offset ^= ((offset ^ (offset >> 1)) >> 3) & 64;
+					break;
+				case I915_BIT_6_SWIZZLE_9_11:
+					offset ^= ((offset ^ (offset >> 2)) >> 3) & 64;
+					break;
+				}
+
+				memcpy(dst_row, (const char *)src + offset, 64);
+
+				dst_row += 64;
+				x -= 64;
+				sx += swizzle_pixels;
+			}
+		} else {
+			while (x >= 512) {
+				assert((sx & tile_mask) == 0);
+				offset = tile_row + (sx >> tile_pixels) * tile_size;
+
+				memcpy(dst_row, (const char *)src + offset, 512);
+
+				dst_row += 512;
+				x -= 512;
+				sx += swizzle_pixels;
+			}
+		}
+		if (x) {
+			offset = tile_row +
+				(sx >> tile_pixels) * tile_size +
+				(sx & tile_mask) * cpp;
+			switch (swizzling) {
+			case I915_BIT_6_SWIZZLE_NONE:
+				break;
+			case I915_BIT_6_SWIZZLE_9:
+				offset ^= (offset >> 3) & 64;
+				break;
+			case I915_BIT_6_SWIZZLE_9_10:
+				offset ^= ((offset ^ (offset >> 1)) >> 3) & 64;
+				break;
+			case I915_BIT_6_SWIZZLE_9_11:
+				offset ^= ((offset ^ (offset >> 2)) >> 3) & 64;
+				break;
+			}
+
+			memcpy(dst_row, (const char *)src + offset, x);
+		}
+	}
+}
+
+/* A Y-tile is 128 bytes wide and 32 rows high, stored as 8 columns of
+ * 16 byte OWords, each column 32 rows deep. So a row of a tile is 8 OWords
+ * spaced 512 bytes apart, and as an OWord never crosses bit 6 it remains
+ * contiguous after swizzling.
+ */
+static inline uint32_t
+tiled_y_row(uint32_t y, unsigned stride_tiles)
+{
+	return y / 32 * stride_tiles * 4096 + (y & 31) * 16;
+}
+
+static inline uint32_t
+swizzle_bit_6(uint32_t offset, int swizzling)
+{
+	switch (swizzling) {
+	case I915_BIT_6_SWIZZLE_NONE:
+		break;
+	case I915_BIT_6_SWIZZLE_9:
+		offset ^= (offset >> 3) & 64;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10:
+		offset ^= ((offset ^ (offset >> 1)) >> 3) & 64;
+		break;
+	case I915_BIT_6_SWIZZLE_9_11:
+		offset ^= ((offset ^ (offset >> 2)) >> 3) & 64;
+		break;
+	}
+
+	return offset;
+}
+
+static force_inline void
+__memcpy_to_tiled_y(const void *src, void *dst, int bpp, int swizzling,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height)
+{
+	const unsigned cpp = bpp / 8;
+	const unsigned stride_tiles = dst_stride / 128;
+	unsigned y;
+
+	DBG(("%s(bpp=%d, swizzling=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, bpp, swizzling, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+
+	src = (const uint8_t *)src + src_y * src_stride + src_x * cpp;
+
+	for (y = 0; y < height; ++y) {
+		const uint8_t *src_row = (const uint8_t *)src + src_stride * y;
+		const uint32_t row = tiled_y_row(dst_y + y, stride_tiles);
+		uint32_t dx = dst_x * cpp, x = width * cpp;
+
+		while (x) {
+			uint32_t col = row + dx / 128 * 4096 + (dx & 127) / 16 * 512 + (dx & 15);
+			uint32_t len = 16 - (dx & 15);
+
+			/* Walk the OWords of this tile row */
+			do {
+				if (len > x)
+					len = x;
+
+				memcpy((char *)dst + swizzle_bit_6(col, swizzling),
+				       src_row, len);
+
+				src_row += len;
+				dx += len;
+				x -= len;
+
+				col = (col & ~15) + 512;
+				len = 16;
+			} while (x && dx & 127);
+		}
+	}
+}
+
+static force_inline void
+__memcpy_from_tiled_y(const void *src, void *dst, int bpp, int swizzling,
+		      int32_t src_stride, int32_t dst_stride,
+		      int16_t src_x, int16_t src_y,
+		      int16_t dst_x, int16_t dst_y,
+		      uint16_t width, uint16_t height)
+{
+	const unsigned cpp = bpp / 8;
+	const unsigned stride_tiles = src_stride / 128;
+	unsigned y;
+
+	DBG(("%s(bpp=%d, swizzling=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, bpp, swizzling, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+
+	dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp;
+
+	for (y = 0; y < height; ++y) {
+		uint8_t *dst_row = (uint8_t *)dst + dst_stride * y;
+		const uint32_t row = tiled_y_row(src_y + y, stride_tiles);
+		uint32_t sx = src_x * cpp, x = width * cpp;
+
+		while (x) {
+			uint32_t col = row + sx / 128 * 4096 + (sx & 127) / 16 * 512 + (sx & 15);
+			uint32_t len = 16 - (sx & 15);
+
+			/* Walk the OWords of this tile row */
+			do {
+				if (len > x)
+					len = x;
+
+				memcpy(dst_row,
+				       (const char *)src + swizzle_bit_6(col, swizzling),
+				       len);
+
+				dst_row += len;
+				sx += len;
+				x -= len;
+
+				col = (col & ~15) + 512;
+				len = 16;
+			} while (x && sx & 127);
+		}
+	}
+}
+
+static void
+memmove_box__generic(const void *src, void *dst,
+		     int bpp, int32_t stride,
+		     const BoxRec *box,
+		     int dx, int dy)
 {
 	union {
 		uint8_t u8;
@@ -478,13 +695,13 @@ memmove_box(const void *src, void *dst,
 	}
 }
 
-void
-memcpy_xor(const void *src, void *dst, int bpp,
-	   int32_t src_stride, int32_t dst_stride,
-	   int16_t src_x, int16_t src_y,
-	   int16_t dst_x, int16_t dst_y,
-	   uint16_t width, uint16_t height,
-	   uint32_t and, uint32_t or)
+static void
+memcpy_xor__generic(const void *src, void *dst, int bpp,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height,
+		    uint32_t and, uint32_t or)
 {
 	const uint8_t *src_bytes;
 	uint8_t *dst_bytes;
@@ -668,3 +885,625 @@ memcpy_xor(const void *src, void *dst, int bpp,
 		}
 	}
 }
+
+static void
+memcpy_to_tiled_x__generic(const void *src, void *dst, int bpp, int swizzling,
+			   int32_t src_stride, int32_t dst_stride,
+			   int16_t src_x, int16_t src_y,
+			   int16_t dst_x, int16_t dst_y,
+			   uint16_t width, uint16_t height)
+{
+	__memcpy_to_tiled_x(src, dst, bpp, swizzling,
+			    src_stride, dst_stride,
+			    src_x, src_y, dst_x, dst_y,
+			    width, height);
+}
+
+static void
+memcpy_from_tiled_x__generic(const void *src, void *dst, int bpp, int swizzling,
+			     int32_t src_stride, int32_t dst_stride,
+			     int16_t src_x, int16_t src_y,
+			     int16_t dst_x, int16_t dst_y,
+			     uint16_t width, uint16_t height)
+{
+	__memcpy_from_tiled_x(src, dst, bpp, swizzling,
+			      src_stride, dst_stride,
+			      src_x, src_y, dst_x, dst_y,
+			      width, height);
+}
+
+static void
+memcpy_to_tiled_y__generic(const void *src, void *dst, int bpp, int swizzling,
+			   int32_t src_stride, int32_t dst_stride,
+			   int16_t src_x, int16_t src_y,
+			   int16_t dst_x, int16_t dst_y,
+			   uint16_t width, uint16_t height)
+{
+	__memcpy_to_tiled_y(src, dst, bpp, swizzling,
+			    src_stride, dst_stride,
+			    src_x, src_y, dst_x, dst_y,
+			    width, height);
+}
+
+static void
+memcpy_from_tiled_y__generic(const void *src, void *dst, int bpp, int swizzling,
+			     int32_t src_stride, int32_t dst_stride,
+			     int16_t src_x, int16_t src_y,
+			     int16_t dst_x, int16_t dst_y,
+			     uint16_t width, uint16_t height)
+{
+	__memcpy_from_tiled_y(src, dst, bpp, swizzling,
+			      src_stride, dst_stride,
+			      src_x, src_y, dst_x, dst_y,
+			      width, height);
+}
+
+#if USE_SSE4_1
+/* Reading from an uncached (WC) mapping, such as through the GTT, is only
+ * fast using streaming loads, which are no slower for cached memory.
+ */
+static sse4_1 void
+copy_row__sse4_1(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	unsigned head;
+
+	assert(len >= 32);
+
+	/* Align the source, overlapping the first aligned load */
+	_mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+	head = 16 - ((uintptr_t)src & 15);
+	dst += head;
+	src += head;
+	len -= head;
+
+	while (len >= 64) {
+		__m128i xmm0, xmm1, xmm2, xmm3;
+
+		xmm0 = _mm_stream_load_si128((__m128i *)src + 0);
+		xmm1 = _mm_stream_load_si128((__m128i *)src + 1);
+		xmm2 = _mm_stream_load_si128((__m128i *)src + 2);
+		xmm3 = _mm_stream_load_si128((__m128i *)src + 3);
+
+		_mm_storeu_si128((__m128i *)dst + 0, xmm0);
+		_mm_storeu_si128((__m128i *)dst + 1, xmm1);
+		_mm_storeu_si128((__m128i *)dst + 2, xmm2);
+		_mm_storeu_si128((__m128i *)dst + 3, xmm3);
+
+		dst += 64;
+		src += 64;
+		len -= 64;
+	}
+
+	while (len >= 16) {
+		_mm_storeu_si128((__m128i *)dst,
+				 _mm_stream_load_si128((__m128i *)src));
+		dst += 16;
+		src += 16;
+		len -= 16;
+	}
+
+	if (len)
+		_mm_storeu_si128((__m128i *)(dst + len - 16),
+				 _mm_loadu_si128((const __m128i *)(src + len - 16)));
+}
+
+static sse4_1 void
+memcpy_blt__sse4_1(const void *src, void *dst, int bpp,
+		   int32_t src_stride, int32_t dst_stride,
+		   int16_t src_x, int16_t src_y,
+		   int16_t dst_x, int16_t dst_y,
+		   uint16_t width, uint16_t height)
+{
+	const uint8_t *src_bytes;
+	uint8_t *dst_bytes;
+	size_t byte_width;
+
+	byte_width = width * (bpp / 8);
+	if (byte_width < 32) {
+		memcpy_blt__generic(src, dst, bpp,
+				    src_stride, dst_stride,
+				    src_x, src_y, dst_x, dst_y,
+				    width, height);
+		return;
+	}
+
+	DBG(("%s: src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+
+	bpp /= 8;
+	src_bytes = (const uint8_t *)src + src_stride * src_y + src_x * bpp;
+	dst_bytes = (uint8_t *)dst + dst_stride * dst_y + dst_x * bpp;
+
+	if (byte_width == src_stride && byte_width == dst_stride) {
+		byte_width *= height;
+		height = 1;
+	}
+
+	do {
+		copy_row__sse4_1(dst_bytes, src_bytes, byte_width);
+		src_bytes += src_stride;
+		dst_bytes += dst_stride;
+	} while (--height);
+}
+#endif
+
+#if USE_AVX2
+static avx2 void
+copy_row__avx2(uint8_t *dst, const uint8_t *src, size_t len, bool nt)
+{
+	unsigned head;
+
+	assert(len >= 64);
+
+	/* Align the destination, overlapping the first aligned store */
+	_mm256_storeu_si256((__m256i *)dst,
+			    _mm256_loadu_si256((const __m256i *)src));
+	head = 32 - ((uintptr_t)dst & 31);
+	dst += head;
+	src += head;
+	len -= head;
+
+	if (nt) {
+		while (len >= 128) {
+			__m256i ymm0, ymm1, ymm2, ymm3;
+
+			ymm0 = _mm256_loadu_si256((const __m256i *)src + 0);
+			ymm1 = _mm256_loadu_si256((const __m256i *)src + 1);
+			ymm2 = _mm256_loadu_si256((const __m256i *)src + 2);
+			ymm3 = _mm256_loadu_si256((const __m256i *)src + 3);
+
+			_mm256_stream_si256((__m256i *)dst + 0, ymm0);
+			_mm256_stream_si256((__m256i *)dst + 1, ymm1);
+			_mm256_stream_si256((__m256i *)dst + 2, ymm2);
+			_mm256_stream_si256((__m256i *)dst + 3, ymm3);
+
+			dst += 128;
+			src += 128;
+			len -= 128;
+		}
+	} else {
+		while (len >= 128) {
+			__m256i ymm0, ymm1, ymm2, ymm3;
+
+			ymm0 = _mm256_loadu_si256((const __m256i *)src + 0);
+			ymm1 = _mm256_loadu_si256((const __m256i *)src + 1);
+			ymm2 = _mm256_loadu_si256((const __m256i *)src + 2);
+			ymm3 = _mm256_loadu_si256((const __m256i *)src + 3);
+
+			_mm256_store_si256((__m256i *)dst + 0, ymm0);
+			_mm256_store_si256((__m256i *)dst + 1, ymm1);
+			_mm256_store_si256((__m256i *)dst + 2, ymm2);
+			_mm256_store_si256((__m256i *)dst + 3, ymm3);
+
+			dst += 128;
+			src += 128;
+			len -= 128;
+		}
+	}
+
+	while (len >= 32) {
+		_mm256_store_si256((__m256i *)dst,
+				   _mm256_loadu_si256((const __m256i *)src));
+		dst += 32;
+		src += 32;
+		len -= 32;
+	}
+
+	if (len)
+		_mm256_storeu_si256((__m256i *)(dst + len - 32),
+				    _mm256_loadu_si256((const __m256i *)(src + len - 32)));
+}
+
+static avx2 void
+memcpy_blt__avx2(const void *src, void *dst, int bpp,
+		 int32_t src_stride, int32_t dst_stride,
+		 int16_t src_x, int16_t src_y,
+		 int16_t dst_x, int16_t dst_y,
+		 uint16_t width, uint16_t height)
+{
+	const uint8_t *src_bytes;
+	uint8_t *dst_bytes;
+	size_t byte_width;
+	bool nt;
+
+	byte_width = width * (bpp / 8);
+	if (byte_width < 64) {
+		memcpy_blt__generic(src, dst, bpp,
+				    src_stride, dst_stride,
+				    src_x, src_y, dst_x, dst_y,
+				    width, height);
+		return;
+	}
+
+	DBG(("%s: src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+
+	bpp /= 8;
+	src_bytes = (const uint8_t *)src + src_stride * src_y + src_x * bpp;
+	dst_bytes = (uint8_t *)dst + dst_stride * dst_y + dst_x * bpp;
+
+	if (byte_width == src_stride && byte_width == dst_stride) {
+		byte_width *= height;
+		height = 1;
+	}
+
+	nt = byte_width * height >= NT_THRESHOLD;
+	do {
+		copy_row__avx2(dst_bytes, src_bytes, byte_width, nt);
+		src_bytes += src_stride;
+		dst_bytes += dst_stride;
+	} while (--height);
+
+	/* Order the streaming stores before the GPU is told to read them */
+	if (nt)
+		_mm_sfence();
+}
+
+static avx2 void
+memmove_box__avx2(const void *src, void *dst,
+		  int bpp, int32_t stride,
+		  const BoxRec *box,
+		  int dx, int dy)
+{
+	const uint8_t *src_bytes;
+	uint8_t *dst_bytes;
+	int width, height;
+
+	width = (box->x2 - box->x1) * (bpp / 8);
+	height = box->y2 - box->y1;
+
+	/* Only whole rows that do not overlap themselves are worth
+	 * vectorising, the rest are left to memmove().
+	 */
+	src_bytes = (const uint8_t *)src + box->y1 * stride + box->x1 * (bpp / 8);
+	dst_bytes = (uint8_t *)dst + box->y1 * stride + box->x1 * (bpp / 8);
+	if (width < 64 || width == stride ||
+	    (dst_bytes < src_bytes + width && src_bytes < dst_bytes + width)) {
+		memmove_box__generic(src, dst, bpp, stride, box, dx, dy);
+		return;
+	}
+
+	DBG(("%s: box=(%d, %d), (%d, %d), pitch=%d, bpp=%d, dx=%d, dy=%d\n",
+	     __FUNCTION__,
+	     box->x1, box->y1, box->x2, box->y2,
+	     stride, bpp, dx, dy));
+
+	if (dy >= 0) {
+		do {
+			copy_row__avx2(dst_bytes, src_bytes, width, false);
+			src_bytes += stride;
+			dst_bytes += stride;
+		} while (--height);
+	} else {
+		src_bytes += (height-1) * stride;
+		dst_bytes += (height-1) * stride;
+		do {
+			copy_row__avx2(dst_bytes, src_bytes, width, false);
+			src_bytes -= stride;
+			dst_bytes -= stride;
+		} while (--height);
+	}
+}
+
+static avx2 void
+memcpy_xor__avx2(const void *src, void *dst, int bpp,
+		 int32_t src_stride, int32_t dst_stride,
+		 int16_t src_x, int16_t src_y,
+		 int16_t dst_x, int16_t dst_y,
+		 uint16_t width, uint16_t height,
+		 uint32_t and, uint32_t or)
+{
+	const uint8_t *src_bytes;
+	uint8_t *dst_bytes;
+	__m256i ymm_and, ymm_or;
+	int byte_width;
+
+	byte_width = width * (bpp / 8);
+	if (byte_width < 64 || byte_width & 3) {
+		memcpy_xor__generic(src, dst, bpp,
+				    src_stride, dst_stride,
+				    src_x, src_y, dst_x, dst_y,
+				    width, height,
+				    and, or);
+		return;
+	}
+
+	DBG(("%s: src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d, bpp=%d, and=%x, xor=%x\n",
+	     __FUNCTION__,
+	     src_x, src_y, dst_x, dst_y,
+	     width, height,
+	     src_stride, dst_stride,
+	     bpp, and, or));
+
+	/* Operate on whole dwords by replicating the masks for each pixel */
+	switch (bpp) {
+	case 8:
+		and = (and & 0xff) * 0x01010101;
+		or = (or & 0xff) * 0x01010101;
+		break;
+	case 16:
+		and = (and & 0xffff) * 0x00010001;
+		or = (or & 0xffff) * 0x00010001;
+		break;
+	}
+	ymm_and = _mm256_set1_epi32(and);
+	ymm_or = _mm256_set1_epi32(or);
+
+	bpp /= 8;
+	src_bytes = (const uint8_t *)src + src_stride * src_y + src_x * bpp;
+	dst_bytes = (uint8_t *)dst + dst_stride * dst_y + dst_x * bpp;
+
+	do {
+		uint32_t *d = (uint32_t *)dst_bytes;
+		const uint32_t *s = (const uint32_t *)src_bytes;
+		int i = byte_width / 4;
+
+		if (((uintptr_t)d & 3) == 0) {
+			while ((uintptr_t)d & 31) {
+				*d++ = (*s++ & and) | or;
+				i--;
+			}
+		}
+
+		while (i >= 32) {
+			__m256i ymm0, ymm1, ymm2, ymm3;
+
+			ymm0 = _mm256_loadu_si256((const __m256i *)s + 0);
+			ymm1 = _mm256_loadu_si256((const __m256i *)s + 1);
+			ymm2 = _mm256_loadu_si256((const __m256i *)s + 2);
+			ymm3 = _mm256_loadu_si256((const __m256i *)s + 3);
+
+			ymm0 = _mm256_or_si256(_mm256_and_si256(ymm0, ymm_and), ymm_or);
+			ymm1 = _mm256_or_si256(_mm256_and_si256(ymm1, ymm_and), ymm_or);
+			ymm2 = _mm256_or_si256(_mm256_and_si256(ymm2, ymm_and), ymm_or);
+			ymm3 = _mm256_or_si256(_mm256_and_si256(ymm3, ymm_and), ymm_or);
+
+			_mm256_storeu_si256((__m256i *)d + 0, ymm0);
+			_mm256_storeu_si256((__m256i *)d + 1, ymm1);
+			_mm256_storeu_si256((__m256i *)d + 2, ymm2);
+			_mm256_storeu_si256((__m256i *)d + 3, ymm3);
+
+			d += 32;
+			s += 32;
+			i -= 32;
+		}
+
+		while (i >= 8) {
+			__m256i ymm0 = _mm256_loadu_si256((const __m256i *)s);
+
+			ymm0 = _mm256_or_si256(_mm256_and_si256(ymm0, ymm_and), ymm_or);
+			_mm256_storeu_si256((__m256i *)d, ymm0);
+
+			d += 8;
+			s += 8;
+			i -= 8;
+		}
+
+		while (i) {
+			*d++ = (*s++ & and) | or;
+			i--;
+		}
+
+		src_bytes += src_stride;
+		dst_bytes += dst_stride;
+	} while (--height);
+}
+
+/* The tiled copies are built from fixed size memcpy() of whole swizzle
+ * runs, which the compiler expands inline using the widest registers.
+ */
+static avx2 void
+memcpy_to_tiled_x__avx2(const void *src, void *dst, int bpp, int swizzling,
+			int32_t src_stride, int32_t dst_stride,
+			int16_t src_x, int16_t src_y,
+			int16_t dst_x, int16_t dst_y,
+			uint16_t width, uint16_t height)
+{
+	__memcpy_to_tiled_x(src, dst, bpp, swizzling,
+			    src_stride, dst_stride,
+			    src_x, src_y, dst_x, dst_y,
+			    width, height);
+}
+
+static avx2 void
+memcpy_from_tiled_x__avx2(const void *src, void *dst, int bpp, int swizzling,
+			  int32_t src_stride, int32_t dst_stride,
+			  int16_t src_x, int16_t src_y,
+			  int16_t dst_x, int16_t dst_y,
+			  uint16_t width, uint16_t height)
+{
+	__memcpy_from_tiled_x(src, dst, bpp, swizzling,
+			      src_stride, dst_stride,
+			      src_x, src_y, dst_x, dst_y,
+			      width, height);
+}
+
+static avx2 void
+memcpy_to_tiled_y__avx2(const void *src, void *dst, int bpp, int swizzling,
+			int32_t src_stride, int32_t dst_stride,
+			int16_t src_x, int16_t src_y,
+			int16_t dst_x, int16_t dst_y,
+			uint16_t width, uint16_t height)
+{
+	__memcpy_to_tiled_y(src, dst, bpp, swizzling,
+			    src_stride, dst_stride,
+			    src_x, src_y, dst_x, dst_y,
+			    width, height);
+}
+
+static avx2 void
+memcpy_from_tiled_y__avx2(const void *src, void *dst, int bpp, int swizzling,
+			  int32_t src_stride, int32_t dst_stride,
+			  int16_t src_x, int16_t src_y,
+			  int16_t dst_x, int16_t dst_y,
+			  uint16_t width, uint16_t height)
+{
+	__memcpy_from_tiled_y(src, dst, bpp, swizzling,
+			      src_stride, dst_stride,
+			      src_x, src_y, dst_x, dst_y,
+			      width, height);
+}
+#endif
+
+typedef void (*tiled_func)(const void *src, void *dst, int bpp, int swizzling,
+			   int32_t src_stride, int32_t dst_stride,
+			   int16_t src_x, int16_t src_y,
+			   int16_t dst_x, int16_t dst_y,
+			   uint16_t width, uint16_t height);
+
+static const struct blt_kernels {
+	const char *name;
+	unsigned required;
+
+	void (*copy)(const void *src, void *dst, int bpp,
+		     int32_t src_stride, int32_t dst_stride,
+		     int16_t src_x, int16_t src_y,
+		     int16_t dst_x, int16_t dst_y,
+		     uint16_t width, uint16_t height);
+	void (*copy_xor)(const void *src, void *dst, int bpp,
+			 int32_t src_stride, int32_t dst_stride,
+			 int16_t src_x, int16_t src_y,
+			 int16_t dst_x, int16_t dst_y,
+			 uint16_t width, uint16_t height,
+			 uint32_t and, uint32_t or);
+	void (*move)(const void *src, void *dst,
+		     int bpp, int32_t stride,
+		     const BoxRec *box,
+		     int dx, int dy);
+	tiled_func to_tiled_x, from_tiled_x;
+	tiled_func to_tiled_y, from_tiled_y;
+} blt_kernels[] = {
+#if USE_AVX2
+	{
+		"avx2", CPU_AVX2,
+		memcpy_blt__avx2,
+		memcpy_xor__avx2,
+		memmove_box__avx2,
+		memcpy_to_tiled_x__avx2, memcpy_from_tiled_x__avx2,
+		memcpy_to_tiled_y__avx2, memcpy_from_tiled_y__avx2,
+	},
+#endif
+#if USE_SSE4_1
+	{
+		"sse4.1", CPU_SSE4_1,
+		memcpy_blt__sse4_1,
+		memcpy_xor__generic,
+		memmove_box__generic,
+		memcpy_to_tiled_x__generic, memcpy_from_tiled_x__generic,
+		memcpy_to_tiled_y__generic, memcpy_from_tiled_y__generic,
+	},
+#endif
+	{
+		"generic", 0,
+		memcpy_blt__generic,
+		memcpy_xor__generic,
+		memmove_box__generic,
+		memcpy_to_tiled_x__generic, memcpy_from_tiled_x__generic,
+		memcpy_to_tiled_y__generic, memcpy_from_tiled_y__generic,
+	},
+};
+
+static const struct blt_kernels *blt = &blt_kernels[ARRAY_SIZE(blt_kernels) - 1];
+
+const char *sna_blt_init(unsigned features)
+{
+	unsigned n;
+
+	for (n = 0; n < ARRAY_SIZE(blt_kernels) - 1; n++) {
+		if ((blt_kernels[n].required & features) == blt_kernels[n].required)
+			break;
+	}
+	blt = &blt_kernels[n];
+
+	DBG(("%s(features=%x): using %s\n", __FUNCTION__, features, blt->name));
+	return blt->name;
+}
+
+void
+memcpy_blt(const void *src, void *dst, int bpp,
+	   int32_t src_stride, int32_t dst_stride,
+	   int16_t src_x, int16_t src_y,
+	   int16_t dst_x, int16_t dst_y,
+	   uint16_t width, uint16_t height)
+{
+	blt->copy(src, dst, bpp,
+		  src_stride, dst_stride,
+		  src_x, src_y, dst_x, dst_y,
+		  width, height);
+}
+
+void
+memcpy_xor(const void *src, void *dst, int bpp,
+	   int32_t src_stride, int32_t dst_stride,
+	   int16_t src_x, int16_t src_y,
+	   int16_t dst_x, int16_t dst_y,
+	   uint16_t width, uint16_t height,
+	   uint32_t and, uint32_t or)
+{
+	blt->copy_xor(src, dst, bpp,
+		      src_stride, dst_stride,
+		      src_x, src_y, dst_x, dst_y,
+		      width, height,
+		      and, or);
+}
+
+void
+memmove_box(const void *src, void *dst,
+	    int bpp, int32_t stride,
+	    const BoxRec *box,
+	    int dx, int dy)
+{
+	blt->move(src, dst, bpp, stride, box, dx, dy);
+}
+
+void
+memcpy_to_tiled_x(const void *src, void *dst, int bpp, int swizzling,
+		  int32_t src_stride, int32_t dst_stride,
+		  int16_t src_x, int16_t src_y,
+		  int16_t dst_x, int16_t dst_y,
+		  uint16_t width, uint16_t height)
+{
+	blt->to_tiled_x(src, dst, bpp, swizzling,
+			src_stride, dst_stride,
+			src_x, src_y, dst_x, dst_y,
+			width, height);
+}
+
+void
+memcpy_from_tiled_x(const void *src, void *dst, int bpp, int swizzling,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height)
+{
+	blt->from_tiled_x(src, dst, bpp, swizzling,
+			  src_stride, dst_stride,
+			  src_x, src_y, dst_x, dst_y,
+			  width, height);
+}
+
+void
+memcpy_to_tiled_y(const void *src, void *dst, int bpp, int swizzling,
+		  int32_t src_stride, int32_t dst_stride,
+		  int16_t src_x, int16_t src_y,
+		  int16_t dst_x, int16_t dst_y,
+		  uint16_t width, uint16_t height)
+{
+	blt->to_tiled_y(src, dst, bpp, swizzling,
+			src_stride, dst_stride,
+			src_x, src_y, dst_x, dst_y,
+			width, height);
+}
+
+void
+memcpy_from_tiled_y(const void *src, void *dst, int bpp, int swizzling,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height)
+{
+	blt->from_tiled_y(src, dst, bpp, swizzling,
+			  src_stride, dst_stride,
+			  src_x, src_y, dst_x, dst_y,
+			  width, height);
+}
@@ -48,6 +48,20 @@
 #define __packed__
 #endif
 
+/* Compile individual functions for instruction sets beyond the baseline,
+ * for use only after checking the CPU with sna_cpu_detect().
+ */
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAS_GCC_TARGET 1
+#define sse4_1 __attribute__((target("sse4.1,sse2")))
+#define avx2 __attribute__((target("avx2,sse4.1,sse2")))
+#else
+#define HAS_GCC_TARGET 0
+#define sse4_1
+#define avx2
+#endif
+
 #ifdef HAVE_VALGRIND
 #define VG(x) x
 #else
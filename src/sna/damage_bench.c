@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Replay synthetic rendering patterns through sna_damage, linked against
+ * nothing but pixman, and report the cost per operation, the number of
+ * reductions and the peak heap usage as the pattern grows. Each pattern is
+ * run with and without the tile map, and the resulting damage compared.
+ * Returns non-zero if the two disagree.
+ *
+ * By default, as run by make check, only short patterns are replayed so
+ * that the comparison stays quick; pass --bench for the full sweep.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+#include "sna_damage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#define SCREEN_WIDTH 1920
+#define SCREEN_HEIGHT 1080
+
+static int failures;
+
+/* Just enough of the server for sna_damage.c */
+BoxRec RegionEmptyBox;
+RegDataRec RegionEmptyData;
+RegDataRec RegionBrokenData;
+
+void ErrorF(const char *f, ...)
+{
+	va_list ap;
+
+	va_start(ap, f);
+	vfprintf(stderr, f, ap);
+	va_end(ap);
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 +
+		(now.tv_nsec - start->tv_nsec);
+}
+
+static size_t heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	return mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+	return (unsigned)mallinfo().uordblks;
+#else
+	return 0;
+#endif
+}
+
+struct pattern {
+	const char *name;
+	void (*op)(struct sna_damage **damage, int i);
+};
+
+static int queries;
+
+static void random_box(BoxPtr box, int w, int h)
+{
+	box->x1 = random() % (SCREEN_WIDTH - w);
+	box->y1 = random() % (SCREEN_HEIGHT - h);
+	box->x2 = box->x1 + w;
+	box->y2 = box->y1 + h;
+}
+
+/* A terminal: a line of glyphs at a time, checking whether the line is
+ * already damaged before drawing. Once the bottom is reached the page is
+ * consumed, as if by a migration, and we start again from the top.
+ */
+static void text_op(struct sna_damage **damage, int i)
+{
+	const int cols = SCREEN_WIDTH / 9, rows = SCREEN_HEIGHT / 18;
+	int row = i % rows;
+	BoxRec glyphs[SCREEN_WIDTH / 9], line;
+	int n;
+
+	line.x1 = 0;
+	line.x2 = cols * 9;
+	line.y1 = row * 18;
+	line.y2 = line.y1 + 16;
+	queries += sna_damage_contains_box(*damage, &line);
+
+	for (n = 0; n < cols; n++) {
+		glyphs[n].x1 = n * 9;
+		glyphs[n].x2 = glyphs[n].x1 + 1 + random() % 8;
+		glyphs[n].y1 = line.y1 + random() % 4;
+		glyphs[n].y2 = line.y2 - random() % 4;
+	}
+	sna_damage_add_boxes(damage, glyphs, cols, 0, 0);
+
+	if (row == rows - 1) {
+		line.y1 = 0;
+		line.y2 = rows * 18;
+		sna_damage_subtract_box(damage, &line);
+	}
+}
+
+/* Individual glyphs scattered across the screen, with the occasional
+ * readback of a small area.
+ */
+static void glyphs_op(struct sna_damage **damage, int i)
+{
+	BoxRec box;
+
+	random_box(&box, 4 + random() % 8, 8 + random() % 12);
+	sna_damage_add_box(damage, &box);
+
+	if ((i & 15) == 15) {
+		random_box(&box, 64, 64);
+		queries += sna_damage_contains_box(*damage, &box);
+		if (queries & 1)
+			sna_damage_subtract_box(damage, &box);
+	}
+}
+
+/* Large solid fills covering most of the screen, interleaved with
+ * readbacks of a two-box region.
+ */
+static void fill_op(struct sna_damage **damage, int i)
+{
+	xRectangle r[16];
+	RegionRec region;
+	BoxRec box[2];
+	int n;
+
+	for (n = 0; n < 16; n++) {
+		r[n].x = random() % (SCREEN_WIDTH / 2);
+		r[n].y = random() % (SCREEN_HEIGHT / 2);
+		r[n].width = 1 + random() % (SCREEN_WIDTH / 2);
+		r[n].height = 1 + random() % (SCREEN_HEIGHT / 2);
+	}
+	sna_damage_add_rectangles(damage, r, 16, 0, 0);
+
+	random_box(&box[0], 256, 128);
+	box[1] = box[0];
+	box[1].y1 = box[0].y2;
+	box[1].y2 = box[1].y1 + 64;
+	box[1].x1 += 32;
+	box[1].x2 -= 32;
+	pixman_region_init_rects(&region, box, 2);
+	sna_damage_subtract(damage, &region);
+	queries += sna_damage_contains_box(*damage, &region.extents);
+	pixman_region_fini(&region);
+}
+
+/* A wide FillSpans, written straight into the damage as sna_fill_spans_blt
+ * does, followed by a readback of a band across the middle.
+ */
+static void spans_op(struct sna_damage **damage, int i)
+{
+	BoxRec box[64], *b, *start, *end;
+	int n = 256, y = random() % (SCREEN_HEIGHT - n / 2);
+
+	b = start = sna_damage_reserve(damage, box, ARRAY_SIZE(box), &end);
+	do {
+		b->x1 = random() % (SCREEN_WIDTH / 2);
+		b->x2 = b->x1 + 1 + random() % (SCREEN_WIDTH / 2);
+		b->y1 = y + n / 2;
+		b->y2 = b->y1 + 1;
+		if (++b == end) {
+			sna_damage_commit(damage, start, end - start);
+			b = start = sna_damage_reserve(damage, box, ARRAY_SIZE(box), &end);
+		}
+	} while (--n);
+	sna_damage_commit(damage, start, b - start);
+
+	if ((i & 7) == 7) {
+		BoxRec band = { 0, SCREEN_HEIGHT / 2 - 32,
+				SCREEN_WIDTH, SCREEN_HEIGHT / 2 + 32 };
+		queries += sna_damage_contains_box(*damage, &band);
+		sna_damage_subtract_box(damage, &band);
+	}
+}
+
+/* A window being dragged: expose what it uncovered and damage where it
+ * now lies.
+ */
+static void move_op(struct sna_damage **damage, int i)
+{
+	static const int w = 400, h = 300;
+	int t = i % 512;
+	int x = t < 256 ? 4 * t : 4 * (511 - t);
+	int y = (3 * t) % (SCREEN_HEIGHT - h);
+	BoxRec old, new;
+	RegionRec region;
+
+	old.x1 = x;
+	old.y1 = y;
+	old.x2 = x + w;
+	old.y2 = y + h;
+
+	new = old;
+	new.x1 += t < 256 ? 4 : -4;
+	new.x2 += t < 256 ? 4 : -4;
+	new.y1 += 3;
+	new.y2 += 3;
+	if (new.y2 > SCREEN_HEIGHT) {
+		new.y1 = 0;
+		new.y2 = h;
+	}
+
+	pixman_region_init_rects(&region, &old, 1);
+	pixman_region_subtract(&region, &region, &(RegionRec){ new, NULL });
+	if (pixman_region_not_empty(&region))
+		sna_damage_add(damage, &region);
+	pixman_region_fini(&region);
+
+	queries += sna_damage_contains_box(*damage, &new);
+	sna_damage_subtract_box(damage, &new);
+}
+
+static void run(const struct pattern *p, int count)
+{
+	pixman_region16_t ref;
+	int tiles;
+
+	pixman_region_init(&ref);
+	for (tiles = 0; tiles <= 1; tiles++) {
+		struct sna_damage *damage = NULL;
+		struct sna_damage_stats stats;
+		struct timespec start;
+		size_t base, peak;
+		BoxPtr boxes = NULL;
+		double ns, reduce;
+		int i, n;
+
+		sna_damage_set_tiles(tiles);
+
+		/* First pass to time the operations ... */
+		srandom(0);
+		stats = sna_damage_stats;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++)
+			p->op(&damage, i);
+		ns = elapsed(&start);
+		stats.reductions = sna_damage_stats.reductions - stats.reductions;
+		stats.reduced_boxes = sna_damage_stats.reduced_boxes - stats.reduced_boxes;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		n = damage ? sna_damage_get_boxes(damage, &boxes) : 0;
+		reduce = elapsed(&start);
+
+		if (tiles == 0) {
+			pixman_region_init_rects(&ref, boxes, n);
+		} else {
+			pixman_region16_t r;
+
+			pixman_region_init_rects(&r, boxes, n);
+			if (!pixman_region_equal(&r, &ref)) {
+				printf("%s: damage differs with tiles\n", p->name);
+				failures++;
+			}
+			pixman_region_fini(&r);
+		}
+		sna_damage_destroy(&damage);
+
+		/* ... and a second to sample the heap after every step */
+		srandom(0);
+		base = peak = heap_used();
+		for (i = 0; i < count; i++) {
+			size_t used;
+
+			p->op(&damage, i);
+
+			used = heap_used();
+			if (used > peak)
+				peak = used;
+		}
+		sna_damage_destroy(&damage);
+
+		printf("damage %-6s %-6s x %6d: %8.1f ns/op, %6lu reductions of %8lu boxes, reduce %7.1f us to %5d boxes, peak %6lu KiB\n",
+		       p->name, tiles ? "tiles" : "region", count,
+		       ns / count,
+		       stats.reductions, stats.reduced_boxes,
+		       reduce / 1000, n,
+		       (unsigned long)(peak - base) >> 10);
+	}
+	pixman_region_fini(&ref);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct pattern patterns[] = {
+		{ "text", text_op },
+		{ "glyphs", glyphs_op },
+		{ "fill", fill_op },
+		{ "spans", spans_op },
+		{ "move", move_op },
+	};
+	int n, count, max = 512;
+
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+		max = 65536;
+
+	for (n = 0; n < ARRAY_SIZE(patterns); n++)
+		for (count = 64; count <= max; count *= 8)
+			run(&patterns[n], count);
+
+	sna_damage_set_tiles(true);
+
+	if (failures)
+		printf("%d checks failed\n", failures);
+
+	return failures != 0;
+}
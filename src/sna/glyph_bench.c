@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Replay streams of glyphs through the glyph cache slot allocator, as
+ * glyph_cache() and the composite paths would, and report the hit rate,
+ * evictions and bytes uploaded under both random and clock replacement,
+ * first with a single page per atlas and then allowing the atlas to grow.
+ *
+ * Besides the built-in synthetic streams, a recorded stream may be given
+ * on the command line as a file of "id width height format" lines, where
+ * format is 0 for a8 and 1 for argb glyphs. Glyphs larger than
+ * GLYPH_MAX_SIZE are skipped, as they bypass the cache.
+ *
+ * By default, as run by make check, the synthetic streams are kept short
+ * enough to check the eviction bookkeeping quickly; pass --bench first
+ * for the full-length streams.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+struct event {
+	uint32_t id;
+	uint8_t width, height, format;
+};
+
+struct stream {
+	const char *name;
+	struct event *events;
+	int count, size, max_id;
+};
+
+static int failures;
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 +
+		(now.tv_nsec - start->tv_nsec);
+}
+
+static void stream_add(struct stream *s, uint32_t id,
+		       int width, int height, int format)
+{
+	struct event *e;
+
+	if (width > GLYPH_MAX_SIZE || height > GLYPH_MAX_SIZE)
+		return;
+
+	if (s->count == s->size) {
+		s->size = s->size ? 2 * s->size : 1024;
+		s->events = realloc(s->events, s->size * sizeof(struct event));
+		if (s->events == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	e = &s->events[s->count++];
+	e->id = id;
+	e->width = width;
+	e->height = height;
+	e->format = format != 0;
+	if (id >= s->max_id)
+		s->max_id = id + 1;
+}
+
+/* Draw from num_glyphs with a Zipf distribution, as text tends to */
+struct zipf {
+	double *cdf;
+	int n;
+};
+
+static void zipf_init(struct zipf *z, int n, double s)
+{
+	double sum = 0;
+	int i;
+
+	z->cdf = malloc(n * sizeof(double));
+	z->n = n;
+	for (i = 0; i < n; i++)
+		z->cdf[i] = sum += 1 / pow(i + 1, s);
+	for (i = 0; i < n; i++)
+		z->cdf[i] /= sum;
+}
+
+static int zipf_next(const struct zipf *z)
+{
+	double r = random() / (RAND_MAX + 1.);
+	int lo = 0, hi = z->n - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (z->cdf[mid] < r)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void zipf_fini(struct zipf *z)
+{
+	free(z->cdf);
+}
+
+/* A terminal full of latin text at a single size: the entire working set
+ * fits, so this measures the cost of a hit.
+ */
+static void latin_stream(struct stream *s, int count)
+{
+	struct zipf z;
+
+	zipf_init(&z, 96, 1.);
+	while (count--)
+		stream_add(s, zipf_next(&z), 7, 13, 0);
+	zipf_fini(&z);
+}
+
+/* CJK text at 16px: many thousands of distinct glyphs, with a heavy head
+ * of common characters and a long tail that overflows the atlas.
+ */
+static void cjk_stream(struct stream *s, int count)
+{
+	struct zipf z;
+
+	zipf_init(&z, 20000, .9);
+	while (count--)
+		stream_add(s, zipf_next(&z), 15, 16, 0);
+	zipf_fini(&z);
+}
+
+/* The same text rendered for a HiDPI display, where even body text
+ * needs the larger squares.
+ */
+static void hidpi_stream(struct stream *s, int count)
+{
+	static const struct {
+		int size, format;
+	} faces[] = {
+		{ 28, 0 }, { 36, 0 }, { 48, 0 }, { 72, 0 }, { 120, 0 },
+		{ 28, 1 }, { 36, 1 },
+	};
+	struct zipf z, face;
+
+	zipf_init(&z, 500, 1.);
+	zipf_init(&face, ARRAY_SIZE(faces), 1.5);
+	while (count--) {
+		int f = zipf_next(&face);
+		stream_add(s, f * 500 + zipf_next(&z),
+			   faces[f].size - 4, faces[f].size,
+			   faces[f].format);
+	}
+	zipf_fini(&face);
+	zipf_fini(&z);
+}
+
+/* A browser-like mixture of body text, headings and subpixel antialiased
+ * labels, so that the size classes compete for the same squares.
+ */
+static void mixed_stream(struct stream *s, int count)
+{
+	static const struct {
+		int size, format;
+	} faces[] = {
+		{ 12, 0 }, { 14, 0 }, { 20, 0 }, { 28, 0 }, { 48, 0 },
+		{ 12, 1 }, { 14, 1 },
+	};
+	struct zipf z, face;
+
+	zipf_init(&z, 2000, 1.);
+	zipf_init(&face, ARRAY_SIZE(faces), 1.5);
+	while (count--) {
+		int f = zipf_next(&face);
+		stream_add(s, f * 2000 + zipf_next(&z),
+			   faces[f].size - 2, faces[f].size,
+			   faces[f].format);
+	}
+	zipf_fini(&face);
+	zipf_fini(&z);
+}
+
+/* The mixed text again, but from a client using subpixel positioning.
+ * RENDER only places glyphs on whole pixels, so such clients rasterise
+ * each glyph at several horizontal phases and send every phase as a
+ * glyph of its own, one pixel wider than the original.
+ */
+static void subpixel_stream(struct stream *s, int count)
+{
+	static const struct {
+		int size, format;
+	} faces[] = {
+		{ 12, 0 }, { 14, 0 }, { 20, 0 }, { 28, 0 }, { 48, 0 },
+		{ 12, 1 }, { 14, 1 },
+	};
+	struct zipf z, face;
+
+	zipf_init(&z, 2000, 1.);
+	zipf_init(&face, ARRAY_SIZE(faces), 1.5);
+	while (count--) {
+		int f = zipf_next(&face);
+		stream_add(s, (f * 2000 + zipf_next(&z)) * 4 + random() % 4,
+			   faces[f].size - 1, faces[f].size,
+			   faces[f].format);
+	}
+	zipf_fini(&face);
+	zipf_fini(&z);
+}
+
+static bool load_stream(struct stream *s, const char *filename)
+{
+	unsigned id, width, height, format;
+	FILE *file;
+
+	file = fopen(filename, "r");
+	if (file == NULL) {
+		perror(filename);
+		return false;
+	}
+
+	while (fscanf(file, "%u %u %u %u", &id, &width, &height, &format) == 4)
+		stream_add(s, id, width, height, format);
+
+	fclose(file);
+	return true;
+}
+
+static void replay(const struct stream *s, bool clock, int pages)
+{
+	static int atlas[2][GLYPH_CACHE_MAX_PAGES];
+	struct sna_glyph_cache cache[2];
+	struct sna_glyph *glyphs;
+	struct timespec start;
+	unsigned long hits, misses, evictions;
+	uint64_t uploaded;
+	double ns;
+	int i, used;
+
+	glyphs = calloc(s->max_id, sizeof(struct sna_glyph));
+	memset(cache, 0, sizeof(cache));
+	for (i = 0; i < 2; i++) {
+		sna_glyph_cache_init(&cache[i]);
+		cache[i].max_pages = pages;
+		if (!sna_glyph_cache_add_page(&cache[i], (PicturePtr)&atlas[i][0]) ||
+		    glyphs == NULL) {
+			perror("alloc");
+			exit(1);
+		}
+	}
+
+	sna_glyph_cache_set_clock(clock);
+	srand(0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < s->count; i++) {
+		const struct event *e = &s->events[i];
+		struct sna_glyph_cache *c = &cache[e->format];
+		struct sna_glyph *priv = &glyphs[e->id];
+		int size, pos;
+
+		if (priv->atlas != NULL) {
+			sna_glyph_cache_hit(c, priv);
+			continue;
+		}
+
+		for (size = GLYPH_MIN_SIZE; size <= GLYPH_MAX_SIZE; size *= 2)
+			if (e->width <= size && e->height <= size)
+				break;
+
+		if (sna_glyph_cache_full(c, size) && c->num_pages < c->max_pages)
+			sna_glyph_cache_add_page(c, (PicturePtr)&atlas[e->format][c->num_pages]);
+
+		pos = sna_glyph_cache_alloc(c, size);
+		if (c->glyphs[pos] != NULL) {
+			printf("%s: slot %d still occupied\n", s->name, pos);
+			failures++;
+		}
+
+		c->glyphs[pos] = priv;
+		priv->atlas = c->picture[pos / GLYPH_CACHE_SIZE];
+		priv->size = size;
+		priv->pos = pos << 1 | e->format;
+		c->stats.uploaded += e->width * e->height * (e->format ? 4 : 1);
+	}
+	ns = elapsed(&start);
+
+	hits = misses = evictions = 0;
+	uploaded = 0;
+	used = 0;
+	for (i = 0; i < 2; i++) {
+		used += cache[i].num_pages;
+		hits += cache[i].stats.hits;
+		misses += cache[i].stats.misses;
+		evictions += cache[i].stats.evictions;
+		uploaded += cache[i].stats.uploaded;
+		sna_glyph_cache_fini(&cache[i]);
+	}
+	free(glyphs);
+
+	if (hits + misses != s->count) {
+		printf("%s: %lu hits + %lu misses != %d glyphs\n",
+		       s->name, hits, misses, s->count);
+		failures++;
+	}
+
+	printf("glyphs %-8s %-6s %d pages x %8d: %6.1f ns/glyph, hit rate %5.1f%%, %8lu evictions, %8llu KiB uploaded\n",
+	       s->name, clock ? "clock" : "random", used, s->count,
+	       ns / s->count,
+	       100. * hits / s->count,
+	       evictions,
+	       (unsigned long long)uploaded >> 10);
+}
+
+static void run(struct stream *s)
+{
+	replay(s, false, 1);
+	replay(s, true, 1);
+	replay(s, true, GLYPH_CACHE_MAX_PAGES);
+	free(s->events);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*func)(struct stream *s, int count);
+	} synthetic[] = {
+		{ "latin", latin_stream },
+		{ "cjk", cjk_stream },
+		{ "mixed", mixed_stream },
+		{ "hidpi", hidpi_stream },
+		{ "subpixel", subpixel_stream },
+	};
+	int n, count = 1 << 16;
+
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+		count = 1 << 20;
+		argv++, argc--;
+	}
+
+	if (argc > 1) {
+		for (n = 1; n < argc; n++) {
+			struct stream s = { argv[n] };
+
+			if (!load_stream(&s, argv[n])) {
+				failures++;
+				continue;
+			}
+			run(&s);
+		}
+	} else {
+		for (n = 0; n < ARRAY_SIZE(synthetic); n++) {
+			struct stream s = { synthetic[n].name };
+
+			srandom(0);
+			synthetic[n].func(&s, count);
+			run(&s);
+		}
+	}
+
+	sna_glyph_cache_set_clock(true);
+
+	if (failures)
+		printf("%d checks failed\n", failures);
+
+	return failures != 0;
+}
@@ -38,6 +38,8 @@
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <xf86drm.h>
 
@@ -73,6 +75,10 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 #define DBG_NO_PINNED_BATCHES 0
 #define DBG_NO_FAST_RELOC 0
 #define DBG_NO_HANDLE_LUT 0
+#define DBG_NO_SLAB 0
+#define DBG_NO_SIZE_INDEX 0
+#define DBG_NO_BATCH_RING 0
+#define DBG_NO_UPLOAD_RING 0
 #define DBG_DUMP 0
 
 #ifndef DEBUG_SYNC
@@ -101,6 +107,7 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 
 #define MAX_GTT_VMA_CACHE 512
 #define MAX_CPU_VMA_CACHE INT16_MAX
+#define MAX_VMA_BUDGET_32 (256 << 20)
 #define MAP_PRESERVE_TIME 10
 
 #define MAP(ptr) ((void*)((uintptr_t)(ptr) & ~3))
@@ -146,6 +153,15 @@ struct local_i915_gem_cacheing {
 #define LOCAL_I915_GEM_SET_CACHEING	0x2f
 #define LOCAL_IOCTL_I915_GEM_SET_CACHEING DRM_IOW(DRM_COMMAND_BASE + LOCAL_I915_GEM_SET_CACHEING, struct local_i915_gem_cacheing)
 
+struct local_i915_gem_wait {
+	uint32_t handle;
+	uint32_t flags;
+	int64_t timeout_ns;
+};
+
+#define LOCAL_I915_GEM_WAIT	0x2c
+#define LOCAL_IOCTL_I915_GEM_WAIT DRM_IOWR(DRM_COMMAND_BASE + LOCAL_I915_GEM_WAIT, struct local_i915_gem_wait)
+
 struct kgem_buffer {
 	struct kgem_bo base;
 	void *mem;
@@ -155,10 +171,217 @@ struct kgem_buffer {
 	uint32_t mmapped : 1;
 };
 
-static struct kgem_bo *__kgem_freed_bo;
-static struct kgem_request *__kgem_freed_request;
 static struct drm_i915_gem_exec_object2 _kgem_dummy_exec;
 
+/* The small, fixed-size structs tracking bo, requests and upload buffers
+ * are churned through at a high rate, so rather than return each to the
+ * heap we carve them out of cacheline-aligned slabs. Slabs that become
+ * entirely free are kept until the next kgem_expire_cache().
+ */
+#define SLAB_SIZE (16*1024)
+#define SLAB_ALIGN 64
+
+struct slab {
+	struct list link;
+	struct slab_cache *cache;
+	void *freelist;
+	int inuse;
+};
+
+struct slab_cache {
+	const char *name;
+	unsigned size;
+	struct list partial, full, empty;
+	unsigned long allocs, frees;
+	unsigned long inuse, peak;
+	unsigned long slabs, reaped;
+};
+
+#define SLAB_CACHE(var, type) \
+	static struct slab_cache var = { \
+		#type, ALIGN(sizeof(struct type), SLAB_ALIGN), \
+		{ &var.partial, &var.partial }, \
+		{ &var.full, &var.full }, \
+		{ &var.empty, &var.empty }, \
+	}
+
+SLAB_CACHE(slab_bo, kgem_bo);
+SLAB_CACHE(slab_request, kgem_request);
+SLAB_CACHE(slab_buffer, kgem_buffer);
+
+static inline int slab_objects(const struct slab_cache *cache)
+{
+	return (SLAB_SIZE - ALIGN(sizeof(struct slab), SLAB_ALIGN)) / cache->size;
+}
+
+static struct slab *slab_create(struct slab_cache *cache)
+{
+	struct slab *slab;
+	char *ptr;
+	int n;
+
+	if (posix_memalign((void **)&slab, SLAB_SIZE, SLAB_SIZE))
+		return NULL;
+
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->freelist = NULL;
+
+	ptr = (char *)slab + ALIGN(sizeof(struct slab), SLAB_ALIGN);
+	for (n = slab_objects(cache); n--; ) {
+		void *obj = ptr + n * cache->size;
+		*(void **)obj = slab->freelist;
+		slab->freelist = obj;
+	}
+
+	cache->slabs++;
+	list_add(&slab->link, &cache->partial);
+	return slab;
+}
+
+static void *slab_alloc(struct slab_cache *cache)
+{
+	struct slab *slab;
+	void *obj;
+
+	if (DBG_NO_SLAB)
+		return malloc(cache->size);
+
+	if (list_is_empty(&cache->partial)) {
+		if (!list_is_empty(&cache->empty)) {
+			list_move(cache->empty.next, &cache->partial);
+		} else if (slab_create(cache) == NULL)
+			return NULL;
+	}
+
+	slab = list_first_entry(&cache->partial, struct slab, link);
+	assert(slab->freelist);
+
+	obj = slab->freelist;
+	slab->freelist = *(void **)obj;
+	if (++slab->inuse == slab_objects(cache))
+		list_move(&slab->link, &cache->full);
+
+	cache->allocs++;
+	if (++cache->inuse > cache->peak)
+		cache->peak = cache->inuse;
+
+	return obj;
+}
+
+/* The owning cache is found through the slab header, as a kgem_buffer may
+ * be released through its embedded kgem_bo.
+ */
+static void slab_free(void *obj)
+{
+	struct slab_cache *cache;
+	struct slab *slab;
+
+	if (DBG_NO_SLAB) {
+		free(obj);
+		return;
+	}
+
+	slab = (struct slab *)((uintptr_t)obj & ~(uintptr_t)(SLAB_SIZE - 1));
+	assert(slab->inuse > 0);
+	cache = slab->cache;
+
+	*(void **)obj = slab->freelist;
+	slab->freelist = obj;
+	if (slab->inuse-- == slab_objects(cache))
+		list_move(&slab->link, &cache->partial);
+	if (slab->inuse == 0)
+		list_move(&slab->link, &cache->empty);
+
+	cache->frees++;
+	cache->inuse--;
+}
+
+static void slab_reap(struct slab_cache *cache)
+{
+	while (!list_is_empty(&cache->empty)) {
+		struct slab *slab;
+
+		slab = list_first_entry(&cache->empty, struct slab, link);
+		list_del(&slab->link);
+		free(slab);
+
+		cache->slabs--;
+		cache->reaped++;
+	}
+}
+
+static void kgem_reap_slabs(void)
+{
+	DBG(("%s: bo=%ld/%ld slabs, request=%ld/%ld, buffer=%ld/%ld\n",
+	     __FUNCTION__,
+	     slab_bo.inuse, slab_bo.slabs,
+	     slab_request.inuse, slab_request.slabs,
+	     slab_buffer.inuse, slab_buffer.slabs));
+
+	slab_reap(&slab_bo);
+	slab_reap(&slab_request);
+	slab_reap(&slab_buffer);
+}
+
+int kgem_get_slab_stats(struct kgem_slab_stats *stats, int max)
+{
+	struct slab_cache *caches[] = { &slab_bo, &slab_request, &slab_buffer };
+	int n;
+
+	for (n = 0; n < max && n < (int)ARRAY_SIZE(caches); n++) {
+		stats[n].name = caches[n]->name;
+		stats[n].size = caches[n]->size;
+		stats[n].allocs = caches[n]->allocs;
+		stats[n].frees = caches[n]->frees;
+		stats[n].inuse = caches[n]->inuse;
+		stats[n].peak = caches[n]->peak;
+		stats[n].slabs = caches[n]->slabs;
+		stats[n].reaped = caches[n]->reaped;
+	}
+
+	return n;
+}
+
+static void buffer_free(struct kgem_buffer *bo)
+{
+	/* Buffers with inline data are too large for the slab */
+	if (bo->mmapped)
+		slab_free(bo);
+	else
+		free(bo);
+}
+
+static const struct kgem_device_ops __kgem_device_ops = {
+	drmIoctl,
+	mmap,
+	munmap,
+};
+static const struct kgem_device_ops *kgem_device_ops = &__kgem_device_ops;
+
+void kgem_set_device_ops(const struct kgem_device_ops *ops)
+{
+	if (ops == NULL)
+		ops = &__kgem_device_ops;
+	kgem_device_ops = ops;
+}
+
+static inline int do_ioctl(int fd, unsigned long request, void *arg)
+{
+	return kgem_device_ops->ioctl(fd, request, arg);
+}
+
+static inline void *do_mmap(void *addr, size_t length,
+			    int prot, int flags, int fd, off_t offset)
+{
+	return kgem_device_ops->mmap(addr, length, prot, flags, fd, offset);
+}
+
+static inline int do_munmap(void *addr, size_t length)
+{
+	return kgem_device_ops->munmap(addr, length);
+}
+
 static inline int bytes(struct kgem_bo *bo)
 {
 	return __kgem_bo_size(bo);
@@ -214,7 +437,7 @@ static bool gem_set_tiling(int fd, uint32_t handle, int tiling, int stride)
 		set_tiling.tiling_mode = tiling;
 		set_tiling.stride = stride;
 
-		ret = ioctl(fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling);
+		ret = do_ioctl(fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling);
 	} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
 	return ret == 0;
 }
@@ -226,7 +449,7 @@ static bool gem_set_cacheing(int fd, uint32_t handle, int cacheing)
 	VG_CLEAR(arg);
 	arg.handle = handle;
 	arg.cacheing = cacheing;
-	return drmIoctl(fd, LOCAL_IOCTL_I915_GEM_SET_CACHEING, &arg) == 0;
+	return do_ioctl(fd, LOCAL_IOCTL_I915_GEM_SET_CACHEING, &arg) == 0;
 }
 
 static uint32_t gem_userptr(int fd, void *ptr, int size, int read_only)
@@ -240,9 +463,9 @@ static uint32_t gem_userptr(int fd, void *ptr, int size, int read_only)
 	if (read_only)
 		arg.flags |= I915_USERPTR_READ_ONLY;
 
-	if (drmIoctl(fd, LOCAL_IOCTL_I915_GEM_USERPTR, &arg)) {
+	if (do_ioctl(fd, LOCAL_IOCTL_I915_GEM_USERPTR, &arg)) {
 		arg.flags &= ~I915_USERPTR_UNSYNCHRONIZED;
-		if (drmIoctl(fd, LOCAL_IOCTL_I915_GEM_USERPTR, &arg)) {
+		if (do_ioctl(fd, LOCAL_IOCTL_I915_GEM_USERPTR, &arg)) {
 			DBG(("%s: failed to map %p + %d bytes: %d\n",
 			     __FUNCTION__, ptr, size, errno));
 			return 0;
@@ -288,7 +511,7 @@ static void *__kgem_bo_map__gtt(struct kgem *kgem, struct kgem_bo *bo)
 retry_gtt:
 	VG_CLEAR(mmap_arg);
 	mmap_arg.handle = bo->handle;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_MMAP_GTT, &mmap_arg)) {
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_MMAP_GTT, &mmap_arg)) {
 		ErrorF("%s: failed to retrieve GTT offset for handle=%d: %d\n",
 		       __FUNCTION__, bo->handle, errno);
 		(void)__kgem_throttle_retire(kgem, 0);
@@ -304,7 +527,7 @@ retry_gtt:
 	}
 
 retry_mmap:
-	ptr = mmap(0, bytes(bo), PROT_READ | PROT_WRITE, MAP_SHARED,
+	ptr = do_mmap(0, bytes(bo), PROT_READ | PROT_WRITE, MAP_SHARED,
 		   kgem->fd, mmap_arg.offset);
 	if (ptr == MAP_FAILED) {
 		ErrorF("%s: failed to mmap %d, %d bytes, into GTT domain: %d\n",
@@ -337,7 +560,7 @@ static int __gem_write(int fd, uint32_t handle,
 	pwrite.offset = offset;
 	pwrite.size = length;
 	pwrite.data_ptr = (uintptr_t)src;
-	return drmIoctl(fd, DRM_IOCTL_I915_GEM_PWRITE, &pwrite);
+	return do_ioctl(fd, DRM_IOCTL_I915_GEM_PWRITE, &pwrite);
 }
 
 static int gem_write(int fd, uint32_t handle,
@@ -361,7 +584,7 @@ static int gem_write(int fd, uint32_t handle,
 		pwrite.size = length;
 		pwrite.data_ptr = (uintptr_t)src;
 	}
-	return drmIoctl(fd, DRM_IOCTL_I915_GEM_PWRITE, &pwrite);
+	return do_ioctl(fd, DRM_IOCTL_I915_GEM_PWRITE, &pwrite);
 }
 
 static int gem_read(int fd, uint32_t handle, const void *dst,
@@ -378,7 +601,7 @@ static int gem_read(int fd, uint32_t handle, const void *dst,
 	pread.offset = offset;
 	pread.size = length;
 	pread.data_ptr = (uintptr_t)dst;
-	ret = drmIoctl(fd, DRM_IOCTL_I915_GEM_PREAD, &pread);
+	ret = do_ioctl(fd, DRM_IOCTL_I915_GEM_PREAD, &pread);
 	if (ret) {
 		DBG(("%s: failed, errno=%d\n", __FUNCTION__, errno));
 		return ret;
@@ -395,7 +618,7 @@ bool __kgem_busy(struct kgem *kgem, int handle)
 	VG_CLEAR(busy);
 	busy.handle = handle;
 	busy.busy = !kgem->wedged;
-	(void)drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_BUSY, &busy);
+	(void)do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_BUSY, &busy);
 	DBG(("%s: handle=%d, busy=%d, wedged=%d\n",
 	     __FUNCTION__, handle, busy.busy, kgem->wedged));
 
@@ -448,7 +671,7 @@ static uint32_t gem_create(int fd, int num_pages)
 	VG_CLEAR(create);
 	create.handle = 0;
 	create.size = PAGE_SIZE * num_pages;
-	(void)drmIoctl(fd, DRM_IOCTL_I915_GEM_CREATE, &create);
+	(void)do_ioctl(fd, DRM_IOCTL_I915_GEM_CREATE, &create);
 
 	return create.handle;
 }
@@ -467,7 +690,7 @@ kgem_bo_set_purgeable(struct kgem *kgem, struct kgem_bo *bo)
 	VG_CLEAR(madv);
 	madv.handle = bo->handle;
 	madv.madv = I915_MADV_DONTNEED;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_MADVISE, &madv) == 0) {
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_MADVISE, &madv) == 0) {
 		bo->purged = 1;
 		kgem->need_purge |= !madv.retained && bo->domain == DOMAIN_GPU;
 		return madv.retained;
@@ -491,7 +714,7 @@ kgem_bo_is_retained(struct kgem *kgem, struct kgem_bo *bo)
 	VG_CLEAR(madv);
 	madv.handle = bo->handle;
 	madv.madv = I915_MADV_DONTNEED;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_MADVISE, &madv) == 0)
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_MADVISE, &madv) == 0)
 		return madv.retained;
 
 	return false;
@@ -511,7 +734,7 @@ kgem_bo_clear_purgeable(struct kgem *kgem, struct kgem_bo *bo)
 	VG_CLEAR(madv);
 	madv.handle = bo->handle;
 	madv.madv = I915_MADV_WILLNEED;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_MADVISE, &madv) == 0) {
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_MADVISE, &madv) == 0) {
 		bo->purged = !madv.retained;
 		kgem->need_purge |= !madv.retained && bo->domain == DOMAIN_GPU;
 		return madv.retained;
@@ -527,7 +750,7 @@ static void gem_close(int fd, uint32_t handle)
 
 	VG_CLEAR(close);
 	close.handle = handle;
-	(void)drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &close);
+	(void)do_ioctl(fd, DRM_IOCTL_GEM_CLOSE, &close);
 }
 
 constant inline static unsigned long __fls(unsigned long word)
@@ -576,14 +799,9 @@ static struct kgem_bo *__kgem_bo_alloc(int handle, int num_pages)
 {
 	struct kgem_bo *bo;
 
-	if (__kgem_freed_bo) {
-		bo = __kgem_freed_bo;
-		__kgem_freed_bo = *(struct kgem_bo **)bo;
-	} else {
-		bo = malloc(sizeof(*bo));
-		if (bo == NULL)
-			return NULL;
-	}
+	bo = slab_alloc(&slab_bo);
+	if (bo == NULL)
+		return NULL;
 
 	return __kgem_bo_init(bo, handle, num_pages);
 }
@@ -592,18 +810,14 @@ static struct kgem_request *__kgem_request_alloc(struct kgem *kgem)
 {
 	struct kgem_request *rq;
 
-	rq = __kgem_freed_request;
-	if (rq) {
-		__kgem_freed_request = *(struct kgem_request **)rq;
-	} else {
-		rq = malloc(sizeof(*rq));
-		if (rq == NULL)
-			rq = &kgem->static_request;
-	}
+	rq = slab_alloc(&slab_request);
+	if (rq == NULL)
+		rq = &kgem->static_request;
 
 	list_init(&rq->buffers);
 	rq->bo = NULL;
 	rq->ring = 0;
+	rq->queued = false;
 
 	return rq;
 }
@@ -611,8 +825,7 @@ static struct kgem_request *__kgem_request_alloc(struct kgem *kgem)
 static void __kgem_request_free(struct kgem_request *rq)
 {
 	_list_del(&rq->list);
-	*(struct kgem_request **)rq = __kgem_freed_request;
-	__kgem_freed_request = rq;
+	slab_free(rq);
 }
 
 static struct list *inactive(struct kgem *kgem, int num_pages)
@@ -629,6 +842,239 @@ static struct list *active(struct kgem *kgem, int num_pages, int tiling)
 	return &kgem->active[cache_bucket(num_pages)][tiling];
 }
 
+static struct kgem_size_index *inactive_index(struct kgem *kgem, int num_pages)
+{
+	assert(cache_bucket(num_pages) < NUM_CACHE_BUCKETS);
+	return &kgem->inactive_index[cache_bucket(num_pages)];
+}
+
+static struct kgem_size_index *active_index(struct kgem *kgem, int num_pages, int tiling)
+{
+	assert(cache_bucket(num_pages) < NUM_CACHE_BUCKETS);
+	return &kgem->active_index[cache_bucket(num_pages)][tiling];
+}
+
+struct kgem_size_class {
+	uint32_t num_pages;
+	uint32_t tiling;
+	uint32_t pitch;
+	struct list bos;
+};
+
+static inline int
+size_class_cmp(const struct kgem_size_class *class,
+	       uint32_t num_pages, uint32_t tiling, uint32_t pitch)
+{
+	if (class->num_pages != num_pages)
+		return class->num_pages < num_pages ? -1 : 1;
+	if (class->tiling != tiling)
+		return class->tiling < tiling ? -1 : 1;
+	if (class->pitch != pitch)
+		return class->pitch < pitch ? -1 : 1;
+	return 0;
+}
+
+/* Returns the position of the first class not less than the key */
+static int
+size_index_search(const struct kgem_size_index *index,
+		  uint32_t num_pages, uint32_t tiling, uint32_t pitch)
+{
+	int lo = 0, hi = index->count;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (size_class_cmp(index->class[mid],
+				   num_pages, tiling, pitch) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void size_index_add(struct kgem_size_index *index, struct kgem_bo *bo)
+{
+	struct kgem_size_class *class;
+	uint32_t pitch = bo->tiling ? bo->pitch : 0;
+	int n;
+
+	assert(bo->size_class == NULL);
+
+	n = size_index_search(index, num_pages(bo), bo->tiling, pitch);
+	if (n < index->count &&
+	    size_class_cmp(index->class[n],
+			   num_pages(bo), bo->tiling, pitch) == 0) {
+		class = index->class[n];
+	} else {
+		/* On allocation failure the bo is left unindexed, and so may
+		 * be overlooked by searches until it expires.
+		 */
+		if (index->count == index->size) {
+			int size = index->size ? 2*index->size : 16;
+			void *ptr;
+
+			ptr = realloc(index->class, size*sizeof(*index->class));
+			if (ptr == NULL)
+				return;
+
+			index->class = ptr;
+			index->size = size;
+		}
+
+		class = malloc(sizeof(*class));
+		if (class == NULL)
+			return;
+
+		class->num_pages = num_pages(bo);
+		class->tiling = bo->tiling;
+		class->pitch = pitch;
+		list_init(&class->bos);
+
+		memmove(index->class + n + 1, index->class + n,
+			(index->count - n) * sizeof(*index->class));
+		index->class[n] = class;
+		index->count++;
+	}
+
+	list_add(&bo->size_link, &class->bos);
+	bo->size_class = class;
+}
+
+static inline void size_index_del(struct kgem_bo *bo)
+{
+	if (bo->size_class) {
+		list_del(&bo->size_link);
+		bo->size_class = NULL;
+	}
+}
+
+/* Find the most recently used bo of the smallest class that is at least
+ * num_pages large with a matching tiling and pitch.
+ */
+static struct kgem_bo *
+size_index_find(struct kgem_size_index *index,
+		uint32_t num_pages, uint32_t tiling, uint32_t pitch)
+{
+	int n;
+
+	if (DBG_NO_SIZE_INDEX)
+		return NULL;
+
+	if (tiling == I915_TILING_NONE)
+		pitch = 0;
+
+	for (n = size_index_search(index, num_pages, 0, 0); n < index->count; n++) {
+		struct kgem_size_class *class = index->class[n];
+		struct kgem_bo *bo;
+
+		if (class->tiling != tiling || class->pitch != pitch)
+			continue;
+
+		if (list_is_empty(&class->bos))
+			continue;
+
+		bo = list_first_entry(&class->bos, struct kgem_bo, size_link);
+		assert(bo->size_class == class);
+		assert(num_pages(bo) >= num_pages);
+		assert(bo->tiling == tiling);
+		assert(tiling == I915_TILING_NONE || bo->pitch == pitch);
+		return bo;
+	}
+
+	return NULL;
+}
+
+static inline bool linear_map_compatible(struct kgem_bo *bo, unsigned flags)
+{
+	if (flags & (CREATE_CPU_MAP | CREATE_GTT_MAP))
+		return bo->map && IS_CPU_MAP(bo->map) == !!(flags & CREATE_CPU_MAP);
+	else
+		return bo->map == NULL;
+}
+
+/* Find an untiled bo at least num_pages large for search_linear_cache(),
+ * walking each class from the smallest in MRU order for one with the
+ * requested mapping. Failing that, settle for the smallest with the wrong
+ * mapping, and then for a tiled bo that the caller must retile.
+ */
+static struct kgem_bo *
+size_index_find_linear(struct kgem_size_index *index,
+		       uint32_t num_pages, unsigned flags)
+{
+	struct kgem_bo *bo, *first = NULL, *tiled = NULL;
+	int n;
+
+	for (n = size_index_search(index, num_pages, 0, 0); n < index->count; n++) {
+		struct kgem_size_class *class = index->class[n];
+
+		if (list_is_empty(&class->bos))
+			continue;
+
+		if (class->tiling != I915_TILING_NONE) {
+			if (tiled == NULL)
+				tiled = list_first_entry(&class->bos,
+							 struct kgem_bo,
+							 size_link);
+			continue;
+		}
+
+		list_for_each_entry(bo, &class->bos, size_link) {
+			assert(bo->size_class == class);
+			assert(num_pages(bo) >= num_pages);
+			assert(bo->tiling == I915_TILING_NONE);
+
+			if (linear_map_compatible(bo, flags))
+				return bo;
+
+			if (first == NULL)
+				first = bo;
+		}
+	}
+
+	if (first)
+		return first;
+
+	/* Retiling discards the mapping, so only a fresh bo will do */
+	if (flags & (CREATE_CPU_MAP | CREATE_GTT_MAP))
+		return NULL;
+
+	return tiled;
+}
+
+/* Empty classes are kept so that a bo cycling through the cache does not
+ * cost an allocation each time, and are only released on expiry.
+ */
+static void size_index_prune(struct kgem_size_index *index)
+{
+	int n, m;
+
+	for (n = m = 0; n < index->count; n++) {
+		if (list_is_empty(&index->class[n]->bos))
+			free(index->class[n]);
+		else
+			index->class[m++] = index->class[n];
+	}
+	index->count = m;
+
+	if (m == 0) {
+		free(index->class);
+		index->class = NULL;
+		index->size = 0;
+	}
+}
+
+static void kgem_prune_size_index(struct kgem *kgem)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(kgem->inactive_index); i++) {
+		size_index_prune(&kgem->inactive_index[i]);
+		for (j = 0; j < ARRAY_SIZE(kgem->active_index[i]); j++)
+			size_index_prune(&kgem->active_index[i][j]);
+	}
+}
+
 static size_t
 agp_aperture_size(struct pci_device *dev, unsigned gen)
 {
@@ -683,7 +1129,7 @@ static int gem_param(struct kgem *kgem, int name)
 	VG_CLEAR(gp);
 	gp.param = name;
 	gp.value = &v;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GETPARAM, &gp))
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GETPARAM, &gp))
 		return -1;
 
 	VG(VALGRIND_MAKE_MEM_DEFINED(&v, sizeof(v)));
@@ -697,7 +1143,7 @@ static bool test_has_execbuffer2(struct kgem *kgem)
 	memset(&execbuf, 0, sizeof(execbuf));
 	execbuf.buffer_count = 1;
 
-	return (drmIoctl(kgem->fd,
+	return (do_ioctl(kgem->fd,
 			 DRM_IOCTL_I915_GEM_EXECBUFFER2,
 			 &execbuf) == -1 &&
 		errno == EFAULT);
@@ -745,10 +1191,20 @@ static bool test_has_semaphores_enabled(struct kgem *kgem)
 
 static bool __kgem_throttle(struct kgem *kgem)
 {
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_THROTTLE, NULL) == 0)
-		return false;
+	struct timespec start, end;
+	int err = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_THROTTLE, NULL))
+		err = errno;
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-	return errno == EIO;
+	kgem->stats.throttles++;
+	kgem->stats.throttle_ns +=
+		(int64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+		(end.tv_nsec - start.tv_nsec);
+
+	return err == EIO;
 }
 
 static bool is_hw_supported(struct kgem *kgem,
@@ -905,7 +1361,7 @@ static bool kgem_init_pinned_batches(struct kgem *kgem)
 			}
 
 			pin.alignment = 0;
-			if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_PIN, &pin)) {
+			if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_PIN, &pin)) {
 				gem_close(kgem->fd, pin.handle);
 				goto err;
 			}
@@ -984,6 +1440,7 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	}
 	kgem->vma[MAP_GTT].count = -MAX_GTT_VMA_CACHE;
 	kgem->vma[MAP_CPU].count = -MAX_CPU_VMA_CACHE;
+	kgem->vma_budget = sizeof(void *) == 4 ? MAX_VMA_BUDGET_32 : 0;
 
 	kgem->has_blt = gem_param(kgem, LOCAL_I915_PARAM_HAS_BLT) > 0;
 	DBG(("%s: has BLT ring? %d\n", __FUNCTION__,
@@ -1046,7 +1503,8 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 		kgem->wedged = 1;
 	}
 
-	kgem->batch_size = ARRAY_SIZE(kgem->batch);
+	kgem->batch = kgem->batch_data;
+	kgem->batch_size = ARRAY_SIZE(kgem->batch_data);
 	if (gen == 020 && !kgem->has_pinned_batches)
 		/* Limited to what we can pin */
 		kgem->batch_size = 4*1024;
@@ -1067,6 +1525,15 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	DBG(("%s: maximum batch size? %d\n", __FUNCTION__,
 	     kgem->batch_size));
 
+	/* With a shared LLC we can write the commands straight into a
+	 * CPU mapping of the batch and so avoid the copy through pwrite.
+	 */
+	kgem->has_batch_ring =
+		!DBG_NO_BATCH_RING &&
+		kgem->has_llc && !kgem->has_pinned_batches;
+	DBG(("%s: batch ring enabled? %d\n", __FUNCTION__,
+	     kgem->has_batch_ring));
+
 	kgem->min_alignment = 4;
 	if (gen < 040)
 		kgem->min_alignment = 64;
@@ -1083,7 +1550,7 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 
 	VG_CLEAR(aperture);
 	aperture.aper_size = 0;
-	(void)drmIoctl(fd, DRM_IOCTL_I915_GEM_GET_APERTURE, &aperture);
+	(void)do_ioctl(fd, DRM_IOCTL_I915_GEM_GET_APERTURE, &aperture);
 	if (aperture.aper_size == 0)
 		aperture.aper_size = 64*1024*1024;
 
@@ -1442,6 +1909,20 @@ static void kgem_bo_binding_free(struct kgem *kgem, struct kgem_bo *bo)
 	}
 }
 
+static void vma_cache_add(struct kgem *kgem, struct kgem_bo *bo, int type)
+{
+	list_add(&bo->vma, &kgem->vma[type].inactive[bucket(bo)]);
+	kgem->vma[type].bytes += bytes(bo);
+	kgem->vma[type].count++;
+}
+
+static void vma_cache_del(struct kgem *kgem, struct kgem_bo *bo, int type)
+{
+	list_del(&bo->vma);
+	kgem->vma[type].bytes -= bytes(bo);
+	kgem->vma[type].count--;
+}
+
 static void kgem_bo_release_map(struct kgem *kgem, struct kgem_bo *bo)
 {
 	int type = IS_CPU_MAP(bo->map);
@@ -1453,13 +1934,11 @@ static void kgem_bo_release_map(struct kgem *kgem, struct kgem_bo *bo)
 	     bo->handle, kgem->vma[type].count));
 
 	VG(if (type) VALGRIND_MAKE_MEM_NOACCESS(MAP(bo->map), bytes(bo)));
-	munmap(MAP(bo->map), bytes(bo));
+	do_munmap(MAP(bo->map), bytes(bo));
 	bo->map = NULL;
 
-	if (!list_is_empty(&bo->vma)) {
-		list_del(&bo->vma);
-		kgem->vma[type].count--;
-	}
+	if (!list_is_empty(&bo->vma))
+		vma_cache_del(kgem, bo, type);
 }
 
 static void kgem_bo_free(struct kgem *kgem, struct kgem_bo *bo)
@@ -1489,15 +1968,15 @@ static void kgem_bo_free(struct kgem *kgem, struct kgem_bo *bo)
 		kgem_bo_release_map(kgem, bo);
 	assert(list_is_empty(&bo->vma));
 
+	size_index_del(bo);
 	_list_del(&bo->list);
 	_list_del(&bo->request);
 	gem_close(kgem->fd, bo->handle);
 
-	if (!bo->io) {
-		*(struct kgem_bo **)bo = __kgem_freed_bo;
-		__kgem_freed_bo = bo;
-	} else
-		free(bo);
+	if (!bo->io)
+		slab_free(bo);
+	else
+		buffer_free((struct kgem_buffer *)bo);
 }
 
 inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
@@ -1519,6 +1998,7 @@ inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
 
 	kgem->need_expire = true;
 
+	size_index_del(bo);
 	if (bucket(bo) >= NUM_CACHE_BUCKETS) {
 		list_move(&bo->list, &kgem->large_inactive);
 		return;
@@ -1526,17 +2006,16 @@ inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
 
 	assert(bo->flush == false);
 	list_move(&bo->list, &kgem->inactive[bucket(bo)]);
+	size_index_add(&kgem->inactive_index[bucket(bo)], bo);
 	if (bo->map) {
 		int type = IS_CPU_MAP(bo->map);
 		if (bucket(bo) >= NUM_CACHE_BUCKETS ||
 		    (!type && !__kgem_bo_is_mappable(kgem, bo))) {
-			munmap(MAP(bo->map), bytes(bo));
+			do_munmap(MAP(bo->map), bytes(bo));
 			bo->map = NULL;
 		}
-		if (bo->map) {
-			list_add(&bo->vma, &kgem->vma[type].inactive[bucket(bo)]);
-			kgem->vma[type].count++;
-		}
+		if (bo->map)
+			vma_cache_add(kgem, bo, type);
 	}
 }
 
@@ -1548,7 +2027,7 @@ static struct kgem_bo *kgem_bo_replace_io(struct kgem_bo *bo)
 		return bo;
 
 	assert(!bo->snoop);
-	base = malloc(sizeof(*base));
+	base = slab_alloc(&slab_bo);
 	if (base) {
 		DBG(("%s: transferring io handle=%d to bo\n",
 		     __FUNCTION__, bo->handle));
@@ -1558,7 +2037,7 @@ static struct kgem_bo *kgem_bo_replace_io(struct kgem_bo *bo)
 		list_init(&base->list);
 		list_replace(&bo->request, &base->request);
 		list_replace(&bo->vma, &base->vma);
-		free(bo);
+		buffer_free((struct kgem_buffer *)bo);
 		bo = base;
 	} else
 		bo->reusable = false;
@@ -1572,12 +2051,12 @@ inline static void kgem_bo_remove_from_inactive(struct kgem *kgem,
 	DBG(("%s: removing handle=%d from inactive\n", __FUNCTION__, bo->handle));
 
 	list_del(&bo->list);
+	size_index_del(bo);
 	assert(bo->rq == NULL);
 	assert(bo->exec == NULL);
 	if (bo->map) {
 		assert(!list_is_empty(&bo->vma));
-		list_del(&bo->vma);
-		kgem->vma[IS_CPU_MAP(bo->map)].count--;
+		vma_cache_del(kgem, bo, IS_CPU_MAP(bo->map));
 	}
 }
 
@@ -1587,6 +2066,7 @@ inline static void kgem_bo_remove_from_active(struct kgem *kgem,
 	DBG(("%s: removing handle=%d from active\n", __FUNCTION__, bo->handle));
 
 	list_del(&bo->list);
+	size_index_del(bo);
 	assert(bo->rq != NULL);
 	if (bo->rq == (void *)kgem)
 		list_del(&bo->request);
@@ -1660,7 +2140,7 @@ static void kgem_bo_move_to_snoop(struct kgem *kgem, struct kgem_bo *bo)
 }
 
 static struct kgem_bo *
-search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+__search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 {
 	struct kgem_bo *bo, *first = NULL;
 
@@ -1717,6 +2197,19 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 	return NULL;
 }
 
+static struct kgem_bo *
+search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+{
+	struct kgem_bo *bo;
+
+	bo = __search_snoop_cache(kgem, num_pages, flags);
+	if (bo)
+		kgem->stats.snoop_hit++;
+	else
+		kgem->stats.snoop_miss++;
+	return bo;
+}
+
 static void __kgem_bo_destroy(struct kgem *kgem, struct kgem_bo *bo)
 {
 	DBG(("%s: handle=%d\n", __FUNCTION__, bo->handle));
@@ -1784,9 +2277,10 @@ static void __kgem_bo_destroy(struct kgem *kgem, struct kgem_bo *bo)
 		struct list *cache;
 
 		DBG(("%s: handle=%d -> active\n", __FUNCTION__, bo->handle));
-		if (bucket(bo) < NUM_CACHE_BUCKETS)
+		if (bucket(bo) < NUM_CACHE_BUCKETS) {
 			cache = &kgem->active[bucket(bo)][bo->tiling];
-		else
+			size_index_add(&kgem->active_index[bucket(bo)][bo->tiling], bo);
+		} else
 			cache = &kgem->large;
 		list_add(&bo->list, cache);
 		return;
@@ -1955,22 +2449,261 @@ static bool __kgem_retire_rq(struct kgem *kgem, struct kgem_request *rq)
 		}
 	}
 
-	assert(rq->bo->rq == NULL);
-	assert(list_is_empty(&rq->bo->request));
+	assert(rq->bo->rq == NULL);
+	assert(list_is_empty(&rq->bo->request));
+
+	if (--rq->bo->refcnt == 0) {
+		if (kgem_bo_set_purgeable(kgem, rq->bo)) {
+			kgem_bo_move_to_inactive(kgem, rq->bo);
+			retired = true;
+		} else {
+			DBG(("%s: closing %d\n",
+			     __FUNCTION__, rq->bo->handle));
+			kgem_bo_free(kgem, rq->bo);
+		}
+	}
+
+	__kgem_request_free(rq);
+	return retired;
+}
+
+/* Rather than poll the oldest request on each ring with a busy-ioctl
+ * whenever we want to retire, we can have a thread per ring sleep in
+ * GEM_WAIT on each request in turn. Requests on a ring complete in order,
+ * so the thread need only publish the seqno of the last request that it
+ * saw complete; the X server reads that without taking any lock and
+ * retires everything up to it. The cache manipulation itself remains on
+ * the X server thread.
+ *
+ * The X server may retire a request before the thread has seen it
+ * complete, so each queued request holds a reference to its batch bo.
+ * This prevents the handle from being closed and then reused for another
+ * object whilst the thread may still be waiting upon it. The reference is
+ * dropped by the X server once the thread has moved past that request.
+ */
+#define RETIRE_QUEUE_SIZE 64
+#define RETIRE_WAIT_NS (100*1000*1000LL)
+
+struct kgem_retire_thread {
+	struct retire_ring {
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		int fd;
+		bool stop;
+
+		/* Requests awaiting completion, guarded by mutex */
+		struct {
+			struct kgem_bo *bo;
+			uint32_t handle;
+			uint32_t seqno;
+		} queue[RETIRE_QUEUE_SIZE];
+		unsigned head, tail;
+
+		/* Completed requests whose bo we still hold, X server only */
+		unsigned released;
+
+		/* Written only by the thread */
+		atomic_t completed;
+	} ring[2];
+};
+
+static inline bool seqno_passed(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) >= 0;
+}
+
+static void *retire_thread(void *arg)
+{
+	struct retire_ring *r = arg;
+	sigset_t signals;
+
+	/* Disable all signals in the helper as X uses them for IO */
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	for (;;) {
+		struct local_i915_gem_wait wait;
+		uint32_t seqno;
+
+		pthread_mutex_lock(&r->mutex);
+		while (r->head == r->tail && !r->stop)
+			pthread_cond_wait(&r->cond, &r->mutex);
+		if (r->stop) {
+			pthread_mutex_unlock(&r->mutex);
+			break;
+		}
+		wait.handle = r->queue[r->head % RETIRE_QUEUE_SIZE].handle;
+		seqno = r->queue[r->head % RETIRE_QUEUE_SIZE].seqno;
+		pthread_mutex_unlock(&r->mutex);
+
+		/* Wake up periodically to check whether we are stopping */
+		wait.flags = 0;
+		wait.timeout_ns = RETIRE_WAIT_NS;
+		if (do_ioctl(r->fd, LOCAL_IOCTL_I915_GEM_WAIT, &wait) &&
+		    errno == ETIME)
+			continue;
+
+		/* Any other error means the request is no longer outstanding:
+		 * either the handle has already been retired and closed, or
+		 * the GPU was reset.
+		 */
+		atomic_set(&r->completed, seqno);
+
+		pthread_mutex_lock(&r->mutex);
+		r->head++;
+		pthread_mutex_unlock(&r->mutex);
+	}
+
+	return NULL;
+}
+
+/* Drop our references to the batches of the requests up to end */
+static void retire_ring_release(struct kgem *kgem,
+				struct retire_ring *r, unsigned end)
+{
+	while (r->released != end) {
+		struct kgem_bo *bo = r->queue[r->released++ % RETIRE_QUEUE_SIZE].bo;
+
+		DBG(("%s: releasing handle=%d\n", __FUNCTION__, bo->handle));
+		kgem_bo_destroy(kgem, bo);
+	}
+}
+
+static void retire_thread_release(struct kgem *kgem, int ring)
+{
+	struct retire_ring *r = &kgem->retire_thread->ring[ring];
+	unsigned head;
+
+	pthread_mutex_lock(&r->mutex);
+	head = r->head;
+	pthread_mutex_unlock(&r->mutex);
+
+	retire_ring_release(kgem, r, head);
+}
+
+static void retire_thread_push(struct kgem *kgem, struct kgem_request *rq)
+{
+	struct retire_ring *r = &kgem->retire_thread->ring[rq->ring];
+
+	retire_thread_release(kgem, rq->ring);
+
+	pthread_mutex_lock(&r->mutex);
+	if (r->tail - r->released < RETIRE_QUEUE_SIZE) {
+		r->queue[r->tail % RETIRE_QUEUE_SIZE].bo = kgem_bo_reference(rq->bo);
+		r->queue[r->tail % RETIRE_QUEUE_SIZE].handle = rq->bo->handle;
+		r->queue[r->tail % RETIRE_QUEUE_SIZE].seqno = rq->seqno;
+		r->tail++;
+		rq->queued = true;
+		pthread_cond_signal(&r->cond);
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static bool __kgem_request_busy(struct kgem *kgem, struct kgem_request *rq)
+{
+	if (kgem->retire_thread) {
+		struct retire_ring *r = &kgem->retire_thread->ring[rq->ring];
+
+		if (seqno_passed(atomic_read(&r->completed), rq->seqno))
+			return false;
+
+		/* Leave it to the retire thread to tell us */
+		if (rq->queued)
+			return true;
+	}
+
+	return __kgem_busy(kgem, rq->bo->handle);
+}
+
+bool kgem_start_retire_thread(struct kgem *kgem)
+{
+	struct kgem_retire_thread *t;
+	struct local_i915_gem_wait wait;
+	int n;
+
+	if (kgem->retire_thread)
+		return true;
+
+	/* Probe for GEM_WAIT, which rejects the invalid handle with ENOENT */
+	wait.handle = 0;
+	wait.flags = 0;
+	wait.timeout_ns = 0;
+	if (do_ioctl(kgem->fd, LOCAL_IOCTL_I915_GEM_WAIT, &wait) == 0 ||
+	    errno != ENOENT) {
+		DBG(("%s: GEM_WAIT not supported\n", __FUNCTION__));
+		return false;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return false;
+
+	for (n = 0; n < ARRAY_SIZE(t->ring); n++) {
+		struct retire_ring *r = &t->ring[n];
+
+		r->fd = kgem->fd;
+		atomic_set(&r->completed, kgem->seqno);
+		pthread_mutex_init(&r->mutex, NULL);
+		pthread_cond_init(&r->cond, NULL);
+		if (pthread_create(&r->thread, NULL, retire_thread, r)) {
+			pthread_mutex_destroy(&r->mutex);
+			pthread_cond_destroy(&r->cond);
+			goto err;
+		}
+	}
+
+	DBG(("%s: started\n", __FUNCTION__));
+	kgem->retire_thread = t;
+	return true;
+
+err:
+	while (n--) {
+		struct retire_ring *r = &t->ring[n];
+
+		pthread_mutex_lock(&r->mutex);
+		r->stop = true;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->mutex);
+
+		pthread_join(r->thread, NULL);
+		pthread_mutex_destroy(&r->mutex);
+		pthread_cond_destroy(&r->cond);
+	}
+	free(t);
+	return false;
+}
+
+void kgem_stop_retire_thread(struct kgem *kgem)
+{
+	struct kgem_retire_thread *t = kgem->retire_thread;
+	struct kgem_request *rq;
+	int n;
+
+	if (t == NULL)
+		return;
+
+	DBG(("%s\n", __FUNCTION__));
+
+	kgem->retire_thread = NULL;
+	for (n = 0; n < ARRAY_SIZE(t->ring); n++) {
+		struct retire_ring *r = &t->ring[n];
 
-	if (--rq->bo->refcnt == 0) {
-		if (kgem_bo_set_purgeable(kgem, rq->bo)) {
-			kgem_bo_move_to_inactive(kgem, rq->bo);
-			retired = true;
-		} else {
-			DBG(("%s: closing %d\n",
-			     __FUNCTION__, rq->bo->handle));
-			kgem_bo_free(kgem, rq->bo);
-		}
-	}
+		pthread_mutex_lock(&r->mutex);
+		r->stop = true;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->mutex);
 
-	__kgem_request_free(rq);
-	return retired;
+		pthread_join(r->thread, NULL);
+		pthread_mutex_destroy(&r->mutex);
+		pthread_cond_destroy(&r->cond);
+
+		retire_ring_release(kgem, r, r->tail);
+
+		list_for_each_entry(rq, &kgem->requests[n], list)
+			rq->queued = false;
+	}
+	free(t);
 }
 
 static bool kgem_retire__requests_ring(struct kgem *kgem, int ring)
@@ -1983,12 +2716,15 @@ static bool kgem_retire__requests_ring(struct kgem *kgem, int ring)
 		rq = list_first_entry(&kgem->requests[ring],
 				      struct kgem_request,
 				      list);
-		if (__kgem_busy(kgem, rq->bo->handle))
+		if (__kgem_request_busy(kgem, rq))
 			break;
 
 		retired |= __kgem_retire_rq(kgem, rq);
 	}
 
+	if (kgem->retire_thread)
+		retire_thread_release(kgem, ring);
+
 #if HAS_DEBUG_FULL
 	{
 		struct kgem_bo *bo;
@@ -2024,6 +2760,65 @@ static bool kgem_retire__requests(struct kgem *kgem)
 	return retired;
 }
 
+static void kgem_select_batch(struct kgem *kgem)
+{
+	int n;
+
+	kgem->batch = kgem->batch_data;
+	kgem->batch_bo = NULL;
+
+	if (!kgem->has_batch_ring || kgem->wedged)
+		return;
+
+	/* Following an allocation failure we must synchronously
+	 * complete the batch, so keep it simple.
+	 */
+	if (kgem->next_request == &kgem->static_request)
+		return;
+
+	for (n = 0; n < ARRAY_SIZE(kgem->batch_ring); n++) {
+		int i = (kgem->batch_ring_next + n) % ARRAY_SIZE(kgem->batch_ring);
+		struct kgem_bo *bo = kgem->batch_ring[i];
+		void *ptr;
+
+		if (bo == NULL) {
+			bo = kgem_create_linear(kgem,
+						PAGE_ALIGN(kgem->batch_size*sizeof(uint32_t)),
+						CREATE_CPU_MAP | CREATE_NO_THROTTLE);
+			if (bo == NULL)
+				return;
+
+			kgem->batch_ring[i] = bo;
+		}
+
+		if (bo->rq) {
+			assert(RQ(bo->rq)->bo == bo);
+			if (__kgem_request_busy(kgem, RQ(bo->rq))) {
+				DBG(("%s: batch[%d] handle=%d still busy\n",
+				     __FUNCTION__, i, bo->handle));
+				continue;
+			}
+
+			__kgem_retire_rq(kgem, RQ(bo->rq));
+		}
+		assert(bo->rq == NULL);
+		assert(bo->exec == NULL);
+
+		ptr = kgem_bo_map__cpu(kgem, bo);
+		if (ptr == NULL)
+			return;
+
+		DBG(("%s: writing into batch[%d] handle=%d\n",
+		     __FUNCTION__, i, bo->handle));
+		kgem->batch = ptr;
+		kgem->batch_bo = bo;
+		kgem->batch_ring_next = (i + 1) % ARRAY_SIZE(kgem->batch_ring);
+		return;
+	}
+
+	DBG(("%s: all batches busy, falling back to pwrite\n", __FUNCTION__));
+}
+
 bool kgem_retire(struct kgem *kgem)
 {
 	bool retired = false;
@@ -2036,6 +2831,21 @@ bool kgem_retire(struct kgem *kgem)
 	retired |= kgem_retire__requests(kgem);
 	retired |= kgem_retire__buffers(kgem);
 
+	/* If we had to fall back to the static batch as the whole ring was
+	 * busy, switch back if the oldest is now idle and nothing has yet
+	 * been emitted.
+	 */
+	if (kgem->batch_bo == NULL && kgem->has_batch_ring &&
+	    kgem->nbatch == 0 && kgem->surface == kgem->batch_size &&
+	    kgem->nreloc == 0 && kgem->nexec == 0 &&
+	    kgem->mode == KGEM_NONE) {
+		struct kgem_bo *bo;
+
+		bo = kgem->batch_ring[kgem->batch_ring_next];
+		if (bo && bo->rq == NULL)
+			kgem_select_batch(kgem);
+	}
+
 	DBG(("%s -- retired=%d, need_retire=%d\n",
 	     __FUNCTION__, retired, kgem->need_retire));
 
@@ -2052,7 +2862,7 @@ bool __kgem_ring_is_idle(struct kgem *kgem, int ring)
 
 	rq = list_last_entry(&kgem->requests[ring],
 			     struct kgem_request, list);
-	if (__kgem_busy(kgem, rq->bo->handle)) {
+	if (__kgem_request_busy(kgem, rq)) {
 		DBG(("%s: last requests handle=%d still busy\n",
 		     __FUNCTION__, rq->bo->handle));
 		return false;
@@ -2061,8 +2871,14 @@ bool __kgem_ring_is_idle(struct kgem *kgem, int ring)
 	DBG(("%s: ring=%d idle (handle=%d)\n",
 	     __FUNCTION__, ring, rq->bo->handle));
 
-	kgem_retire__requests_ring(kgem, ring);
-	assert(list_is_empty(&kgem->requests[ring]));
+	/* Requests complete in order, so all before the last are idle too,
+	 * even if the retire thread has yet to report them.
+	 */
+	do {
+		rq = list_first_entry(&kgem->requests[ring],
+				      struct kgem_request, list);
+		__kgem_retire_rq(kgem, rq);
+	} while (!list_is_empty(&kgem->requests[ring]));
 	return true;
 }
 
@@ -2070,6 +2886,7 @@ static void kgem_commit(struct kgem *kgem)
 {
 	struct kgem_request *rq = kgem->next_request;
 	struct kgem_bo *bo, *next;
+	bool relocated = false;
 
 	list_for_each_entry_safe(bo, next, &rq->buffers, request) {
 		assert(next->request.prev == &bo->request);
@@ -2084,6 +2901,16 @@ static void kgem_commit(struct kgem *kgem)
 		assert(bo->proxy == NULL || bo->exec == &_kgem_dummy_exec);
 		assert(RQ(bo->rq) == rq || (RQ(bo->proxy->rq) == rq));
 
+		/* The kernel reports back where it placed each object; if
+		 * none moved, the offsets we wrote into the batch were
+		 * correct and NO_RELOC let it skip the relocations.
+		 */
+		if (bo->proxy == NULL && bo->presumed_offset != bo->exec->offset) {
+			DBG(("%s: handle=%d moved from %x to %x\n",
+			     __FUNCTION__, bo->handle,
+			     bo->presumed_offset, (unsigned)bo->exec->offset));
+			relocated = true;
+		}
 		bo->presumed_offset = bo->exec->offset;
 		bo->exec = NULL;
 		bo->target_handle = -1;
@@ -2107,6 +2934,16 @@ static void kgem_commit(struct kgem *kgem)
 		kgem->scanout_busy |= bo->scanout;
 	}
 
+	if (!kgem->wedged) {
+		kgem->stats.batches[kgem->ring]++;
+		kgem->stats.batch_bytes += sizeof(uint32_t) *
+			(kgem->nbatch + kgem->batch_size - kgem->surface);
+		kgem->stats.relocs += kgem->nreloc;
+		kgem->stats.exec_objects += kgem->nexec;
+		if (kgem->has_no_reloc && !relocated)
+			kgem->stats.no_reloc++;
+	}
+
 	if (rq == &kgem->static_request) {
 		struct drm_i915_gem_set_domain set_domain;
 
@@ -2116,7 +2953,7 @@ static void kgem_commit(struct kgem *kgem)
 		set_domain.handle = rq->bo->handle;
 		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
 		set_domain.write_domain = I915_GEM_DOMAIN_GTT;
-		if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain)) {
+		if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain)) {
 			DBG(("%s: sync: GPU hang detected\n", __FUNCTION__));
 			kgem_throttle(kgem);
 		}
@@ -2127,8 +2964,11 @@ static void kgem_commit(struct kgem *kgem)
 		gem_close(kgem->fd, rq->bo->handle);
 		kgem_cleanup_cache(kgem);
 	} else {
+		rq->seqno = ++kgem->seqno;
 		list_add_tail(&rq->list, &kgem->requests[rq->ring]);
 		kgem->need_throttle = kgem->need_retire = 1;
+		if (kgem->retire_thread)
+			retire_thread_push(kgem, rq);
 	}
 
 	kgem->next_request = NULL;
@@ -2442,6 +3282,7 @@ void kgem_reset(struct kgem *kgem)
 	kgem->batch_flags = kgem->batch_flags_base;
 
 	kgem->next_request = __kgem_request_alloc(kgem);
+	kgem_select_batch(kgem);
 
 	kgem_sna_reset(kgem);
 }
@@ -2530,7 +3371,7 @@ out_16384:
 		set_domain.handle = bo->handle;
 		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
 		set_domain.write_domain = I915_GEM_DOMAIN_GTT;
-		if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain)) {
+		if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain)) {
 			DBG(("%s: sync: GPU hang detected\n", __FUNCTION__));
 			kgem_throttle(kgem);
 			return NULL;
@@ -2577,11 +3418,18 @@ void _kgem_submit(struct kgem *kgem)
 #endif
 
 	rq = kgem->next_request;
-	if (kgem->surface != kgem->batch_size)
-		size = compact_batch_surface(kgem);
-	else
-		size = kgem->nbatch * sizeof(kgem->batch[0]);
-	rq->bo = kgem_create_batch(kgem, size);
+	if (kgem->batch_bo) {
+		/* Already written in place, so the layout must be kept */
+		assert(kgem->batch == MAP(kgem->batch_bo->map));
+		size = kgem_bo_size(kgem->batch_bo);
+		rq->bo = kgem_bo_reference(kgem->batch_bo);
+	} else {
+		if (kgem->surface != kgem->batch_size)
+			size = compact_batch_surface(kgem);
+		else
+			size = kgem->nbatch * sizeof(kgem->batch[0]);
+		rq->bo = kgem_create_batch(kgem, size);
+	}
 	if (rq->bo) {
 		uint32_t handle = rq->bo->handle;
 		int i;
@@ -2606,7 +3454,8 @@ void _kgem_submit(struct kgem *kgem)
 
 		kgem_fixup_self_relocs(kgem, rq->bo);
 
-		if (kgem_batch_write(kgem, handle, size) == 0) {
+		if (kgem->batch_bo ||
+		    kgem_batch_write(kgem, handle, size) == 0) {
 			struct drm_i915_gem_execbuffer2 execbuf;
 			int ret, retry = 3;
 
@@ -2633,12 +3482,12 @@ void _kgem_submit(struct kgem *kgem)
 				}
 			}
 
-			ret = drmIoctl(kgem->fd,
+			ret = do_ioctl(kgem->fd,
 				       DRM_IOCTL_I915_GEM_EXECBUFFER2,
 				       &execbuf);
 			while (ret == -1 && errno == EBUSY && retry--) {
 				__kgem_throttle(kgem);
-				ret = drmIoctl(kgem->fd,
+				ret = do_ioctl(kgem->fd,
 					       DRM_IOCTL_I915_GEM_EXECBUFFER2,
 					       &execbuf);
 			}
@@ -2650,7 +3499,7 @@ void _kgem_submit(struct kgem *kgem)
 				set_domain.read_domains = I915_GEM_DOMAIN_GTT;
 				set_domain.write_domain = I915_GEM_DOMAIN_GTT;
 
-				ret = drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
+				ret = do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
 			}
 			if (ret == -1) {
 				DBG(("%s: GPU hang detected [%d]\n",
@@ -2732,6 +3581,41 @@ void kgem_throttle(struct kgem *kgem)
 	}
 }
 
+void kgem_dump_stats(struct kgem *kgem)
+{
+	const struct kgem_stats *stats = &kgem->stats;
+	int scrn = kgem_get_screen_index(kgem);
+	unsigned long batches;
+
+	batches = stats->batches[KGEM_RENDER] +
+		stats->batches[KGEM_BSD] +
+		stats->batches[KGEM_BLT];
+
+	xf86DrvMsg(scrn, X_INFO,
+		   "kgem: %lu batches (render %lu, bsd %lu, blt %lu), %llu bytes, %lu relocations, %lu objects\n",
+		   batches,
+		   stats->batches[KGEM_RENDER],
+		   stats->batches[KGEM_BSD],
+		   stats->batches[KGEM_BLT],
+		   (unsigned long long)stats->batch_bytes,
+		   stats->relocs, stats->exec_objects);
+	xf86DrvMsg(scrn, X_INFO,
+		   "kgem: %lu batches without relocation, %lu flushed early by aperture/exec checks\n",
+		   stats->no_reloc, stats->check_flush);
+	xf86DrvMsg(scrn, X_INFO,
+		   "kgem: %lu throttles, %.3f ms stalled\n",
+		   stats->throttles, stats->throttle_ns / 1e6);
+	xf86DrvMsg(scrn, X_INFO,
+		   "kgem: bo cache %lu hits, %lu misses; snoop cache %lu hits, %lu misses\n",
+		   stats->cache_hit, stats->cache_miss,
+		   stats->snoop_hit, stats->snoop_miss);
+	xf86DrvMsg(scrn, X_INFO,
+		   "kgem: GTT vma %lu hits, %lu misses; CPU vma %lu hits, %lu misses; %lld KiB cached\n",
+		   stats->vma_hit[MAP_GTT], stats->vma_miss[MAP_GTT],
+		   stats->vma_hit[MAP_CPU], stats->vma_miss[MAP_CPU],
+		   (long long)(kgem->vma[MAP_GTT].bytes + kgem->vma[MAP_CPU].bytes) >> 10);
+}
+
 void kgem_purge_cache(struct kgem *kgem)
 {
 	struct kgem_bo *bo, *next;
@@ -2750,26 +3634,35 @@ void kgem_purge_cache(struct kgem *kgem)
 	kgem->need_purge = false;
 }
 
+static void kgem_release_upload_ring(struct kgem *kgem)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(kgem->upload_ring); i++) {
+		if (kgem->upload_ring[i]) {
+			kgem_bo_destroy(kgem, kgem->upload_ring[i]);
+			kgem->upload_ring[i] = NULL;
+		}
+	}
+	kgem->upload_ring_idle = 0;
+}
+
 bool kgem_expire_cache(struct kgem *kgem)
 {
 	time_t now, expire;
 	struct kgem_bo *bo;
 	unsigned int size = 0, count = 0;
-	bool idle;
+	bool idle, ring;
 	unsigned int i;
 
 	time(&now);
 
-	while (__kgem_freed_bo) {
-		bo = __kgem_freed_bo;
-		__kgem_freed_bo = *(struct kgem_bo **)bo;
-		free(bo);
-	}
+	kgem_reap_slabs();
+	kgem_prune_size_index(kgem);
 
-	while (__kgem_freed_request) {
-		struct kgem_request *rq = __kgem_freed_request;
-		__kgem_freed_request = *(struct kgem_request **)rq;
-		free(rq);
+	for (i = 0; i < NUM_CACHE_BUCKETS; i++) {
+		kgem->vma[MAP_GTT].heat[i] >>= 1;
+		kgem->vma[MAP_CPU].heat[i] >>= 1;
 	}
 
 	while (!list_is_empty(&kgem->large_inactive)) {
@@ -2820,6 +3713,21 @@ bool kgem_expire_cache(struct kgem *kgem)
 	if (kgem->wedged)
 		kgem_cleanup(kgem);
 
+	/* Large uploads come in bursts, release the staging in between
+	 * once it has gone unused for as long as an inactive bo would.
+	 */
+	ring = false;
+	for (i = 0; i < ARRAY_SIZE(kgem->upload_ring); i++)
+		ring |= kgem->upload_ring[i] != NULL;
+	if (ring) {
+		if (kgem->upload_ring_idle == 0) {
+			kgem->upload_ring_idle = now;
+		} else if (kgem->upload_ring_idle <= now - MAX_INACTIVE_TIME) {
+			kgem_release_upload_ring(kgem);
+			ring = false;
+		}
+	}
+
 	kgem->expire(kgem);
 
 	if (kgem->need_purge)
@@ -2827,7 +3735,7 @@ bool kgem_expire_cache(struct kgem *kgem)
 
 	expire = 0;
 
-	idle = !kgem->need_retire;
+	idle = !kgem->need_retire && !ring;
 	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
 		idle &= list_is_empty(&kgem->inactive[i]);
 		list_for_each_entry(bo, &kgem->inactive[i], list) {
@@ -2847,7 +3755,7 @@ bool kgem_expire_cache(struct kgem *kgem)
 	if (expire == 0)
 		return true;
 
-	idle = !kgem->need_retire;
+	idle = !kgem->need_retire && !ring;
 	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
 		struct list preserve;
 
@@ -2922,7 +3830,7 @@ void kgem_cleanup_cache(struct kgem *kgem)
 			set_domain.handle = rq->bo->handle;
 			set_domain.read_domains = I915_GEM_DOMAIN_GTT;
 			set_domain.write_domain = I915_GEM_DOMAIN_GTT;
-			(void)drmIoctl(kgem->fd,
+			(void)do_ioctl(kgem->fd,
 				       DRM_IOCTL_I915_GEM_SET_DOMAIN,
 				       &set_domain);
 		}
@@ -2931,6 +3839,19 @@ void kgem_cleanup_cache(struct kgem *kgem)
 	kgem_retire(kgem);
 	kgem_cleanup(kgem);
 
+	kgem_release_upload_ring(kgem);
+
+	/* Keep only the batch currently being written */
+	for (n = 0; n < ARRAY_SIZE(kgem->batch_ring); n++) {
+		struct kgem_bo *bo = kgem->batch_ring[n];
+
+		if (bo == NULL || bo == kgem->batch_bo)
+			continue;
+
+		kgem_bo_destroy(kgem, bo);
+		kgem->batch_ring[n] = NULL;
+	}
+
 	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
 		while (!list_is_empty(&kgem->inactive[i]))
 			kgem_bo_free(kgem,
@@ -2943,21 +3864,19 @@ void kgem_cleanup_cache(struct kgem *kgem)
 			     list_last_entry(&kgem->snoop,
 					     struct kgem_bo, list));
 
-	while (__kgem_freed_bo) {
-		struct kgem_bo *bo = __kgem_freed_bo;
-		__kgem_freed_bo = *(struct kgem_bo **)bo;
-		free(bo);
-	}
+	kgem_reap_slabs();
+	kgem_prune_size_index(kgem);
 
 	kgem->need_purge = false;
 	kgem->need_expire = false;
 }
 
 static struct kgem_bo *
-search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+__search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 {
 	struct kgem_bo *bo, *first = NULL;
 	bool use_active = (flags & CREATE_INACTIVE) == 0;
+	struct kgem_size_index *index;
 	struct list *cache;
 
 	DBG(("%s: num_pages=%d, flags=%x, use_active? %d\n",
@@ -3041,6 +3960,50 @@ search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 			return NULL;
 	}
 
+	index = use_active ? active_index(kgem, num_pages, I915_TILING_NONE) : inactive_index(kgem, num_pages);
+	while (!DBG_NO_SIZE_INDEX &&
+	       (bo = size_index_find_linear(index, num_pages, flags))) {
+		assert(bo->refcnt == 0);
+		assert(bo->reusable);
+		assert(!!bo->rq == !!use_active);
+		assert(bo->proxy == NULL);
+		assert(!bo->scanout);
+
+		if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
+			kgem_bo_free(kgem, bo);
+			continue;
+		}
+
+		if (I915_TILING_NONE != bo->tiling) {
+			assert(!use_active);
+			if (!gem_set_tiling(kgem->fd, bo->handle,
+					    I915_TILING_NONE, 0))
+				return NULL;
+
+			bo->tiling = I915_TILING_NONE;
+		}
+
+		if (use_active)
+			kgem_bo_remove_from_active(kgem, bo);
+		else
+			kgem_bo_remove_from_inactive(kgem, bo);
+
+		bo->pitch = 0;
+		bo->delta = 0;
+		DBG(("  %s: found handle=%d (num_pages=%d, map? %d) in linear %s index\n",
+		     __FUNCTION__, bo->handle, num_pages(bo),
+		     linear_map_compatible(bo, flags),
+		     use_active ? "active" : "inactive"));
+		assert(list_is_empty(&bo->list));
+		assert(use_active || bo->domain != DOMAIN_GPU);
+		assert(!bo->needs_flush || use_active);
+		ASSERT_MAYBE_IDLE(kgem, bo->handle, !use_active);
+		return bo;
+	}
+	if (!DBG_NO_SIZE_INDEX)
+		return NULL;
+
+	/* Without the index, walk the bucket looking for the same */
 	cache = use_active ? active(kgem, num_pages, I915_TILING_NONE) : inactive(kgem, num_pages);
 	list_for_each_entry(bo, cache, list) {
 		assert(bo->refcnt == 0);
@@ -3075,6 +4038,9 @@ search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 
 			bo->tiling = I915_TILING_NONE;
 			bo->pitch = 0;
+
+			size_index_del(bo);
+			size_index_add(index, bo);
 		}
 
 		if (bo->map) {
@@ -3145,6 +4111,19 @@ search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 	return NULL;
 }
 
+static struct kgem_bo *
+search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+{
+	struct kgem_bo *bo;
+
+	bo = __search_linear_cache(kgem, num_pages, flags);
+	if (bo)
+		kgem->stats.cache_hit++;
+	else
+		kgem->stats.cache_miss++;
+	return bo;
+}
+
 struct kgem_bo *kgem_create_for_name(struct kgem *kgem, uint32_t name)
 {
 	struct drm_gem_open open_arg;
@@ -3154,7 +4133,7 @@ struct kgem_bo *kgem_create_for_name(struct kgem *kgem, uint32_t name)
 
 	VG_CLEAR(open_arg);
 	open_arg.name = name;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_GEM_OPEN, &open_arg))
+	if (do_ioctl(kgem->fd, DRM_IOCTL_GEM_OPEN, &open_arg))
 		return NULL;
 
 	DBG(("%s: new handle=%d\n", __FUNCTION__, open_arg.handle));
@@ -3183,12 +4162,12 @@ struct kgem_bo *kgem_create_for_prime(struct kgem *kgem, int name, uint32_t size
 	VG_CLEAR(args);
 	args.fd = name;
 	args.flags = 0;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &args))
+	if (do_ioctl(kgem->fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &args))
 		return NULL;
 
 	VG_CLEAR(tiling);
 	tiling.handle = args.handle;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_GET_TILING, &tiling)) {
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_GET_TILING, &tiling)) {
 		gem_close(kgem->fd, args.handle);
 		return NULL;
 	}
@@ -3220,7 +4199,7 @@ int kgem_bo_export_to_prime(struct kgem *kgem, struct kgem_bo *bo)
 	args.handle = bo->handle;
 	args.flags = O_CLOEXEC;
 
-	if (drmIoctl(kgem->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &args))
+	if (do_ioctl(kgem->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &args))
 		return -1;
 
 	bo->reusable = false;
@@ -3678,6 +4657,28 @@ large_inactive:
 		retry = 3;
 search_again:
 	assert(bucket < NUM_CACHE_BUCKETS);
+	bo = size_index_find(&kgem->active_index[bucket][tiling],
+			     size, tiling, pitch);
+	if (bo) {
+		assert(!bo->purged);
+		assert(bo->refcnt == 0);
+		assert(bucket(bo) == bucket);
+		assert(bo->reusable);
+		assert(bo->flush == false);
+		assert(!bo->scanout);
+
+		kgem_bo_remove_from_active(kgem, bo);
+
+		bo->pitch = pitch;
+		bo->unique_id = kgem_get_unique_id(kgem);
+		bo->delta = 0;
+		DBG(("  1:from active index: pitch=%d, tiling=%d, handle=%d, id=%d\n",
+		     bo->pitch, bo->tiling, bo->handle, bo->unique_id));
+		assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
+		bo->refcnt = 1;
+		return bo;
+	}
+
 	cache = &kgem->active[bucket][tiling];
 	if (tiling) {
 		tiled_height = kgem_aligned_height(kgem, height, tiling);
@@ -3840,6 +4841,32 @@ skip_active_search:
 search_inactive:
 	/* Now just look for a close match and prefer any currently active */
 	assert(bucket < NUM_CACHE_BUCKETS);
+	bo = size_index_find(&kgem->inactive_index[bucket], size, tiling, pitch);
+	if (bo) {
+		assert(bucket(bo) == bucket);
+		assert(bo->reusable);
+		assert(!bo->scanout);
+		assert(bo->flush == false);
+
+		if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
+			kgem_bo_free(kgem, bo);
+		} else {
+			kgem_bo_remove_from_inactive(kgem, bo);
+
+			bo->pitch = pitch;
+			bo->delta = 0;
+			bo->unique_id = kgem_get_unique_id(kgem);
+			DBG(("  from inactive index: pitch=%d, tiling=%d: handle=%d, id=%d\n",
+			     bo->pitch, bo->tiling, bo->handle, bo->unique_id));
+			assert(bo->refcnt == 0);
+			assert((flags & CREATE_INACTIVE) == 0 || bo->domain != DOMAIN_GPU);
+			ASSERT_MAYBE_IDLE(kgem, bo->handle, flags & CREATE_INACTIVE);
+			assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
+			bo->refcnt = 1;
+			return bo;
+		}
+	}
+
 	cache = &kgem->inactive[bucket];
 	list_for_each_entry(bo, cache, list) {
 		assert(bucket(bo) == bucket);
@@ -4042,7 +5069,7 @@ void _kgem_bo_destroy(struct kgem *kgem, struct kgem_bo *bo)
 			_kgem_bo_delete_buffer(kgem, bo);
 		kgem_bo_unref(kgem, bo->proxy);
 		kgem_bo_binding_free(kgem, bo);
-		free(bo);
+		slab_free(bo);
 		return;
 	}
 
@@ -4068,6 +5095,13 @@ inline static bool needs_semaphore(struct kgem *kgem, struct kgem_bo *bo)
 	return kgem->nreloc && bo->rq && RQ_RING(bo->rq) != kgem->ring;
 }
 
+static bool kgem_check_failed(struct kgem *kgem)
+{
+	/* The caller must now submit the current batch to make room */
+	kgem->stats.check_flush += kgem->nbatch != 0;
+	return false;
+}
+
 bool kgem_check_bo(struct kgem *kgem, ...)
 {
 	va_list ap;
@@ -4084,7 +5118,7 @@ bool kgem_check_bo(struct kgem *kgem, ...)
 			continue;
 
 		if (needs_semaphore(kgem, bo))
-			return false;
+			return kgem_check_failed(kgem);
 
 		num_pages += num_pages(bo);
 		num_exec++;
@@ -4100,25 +5134,25 @@ bool kgem_check_bo(struct kgem *kgem, ...)
 		return true;
 
 	if (kgem_flush(kgem, flush))
-		return false;
+		return kgem_check_failed(kgem);
 
 	if (kgem->aperture > kgem->aperture_low &&
 	    kgem_ring_is_idle(kgem, kgem->ring)) {
 		DBG(("%s: current aperture usage (%d) is greater than low water mark (%d)\n",
 		     __FUNCTION__, kgem->aperture, kgem->aperture_low));
-		return false;
+		return kgem_check_failed(kgem);
 	}
 
 	if (num_pages + kgem->aperture > kgem->aperture_high) {
 		DBG(("%s: final aperture usage (%d) is greater than high water mark (%d)\n",
 		     __FUNCTION__, num_pages + kgem->aperture, kgem->aperture_high));
-		return false;
+		return kgem_check_failed(kgem);
 	}
 
 	if (kgem->nexec + num_exec >= KGEM_EXEC_SIZE(kgem)) {
 		DBG(("%s: out of exec slots (%d + %d / %d)\n", __FUNCTION__,
 		     kgem->nexec, num_exec, KGEM_EXEC_SIZE(kgem)));
-		return false;
+		return kgem_check_failed(kgem);
 	}
 
 	return true;
@@ -4135,49 +5169,49 @@ bool kgem_check_bo_fenced(struct kgem *kgem, struct kgem_bo *bo)
 		    bo->tiling != I915_TILING_NONE &&
 		    (bo->exec->flags & EXEC_OBJECT_NEEDS_FENCE) == 0) {
 			if (kgem->nfence >= kgem->fence_max)
-				return false;
+				return kgem_check_failed(kgem);
 
 			if (3*kgem->aperture_fenced > kgem->aperture_mappable &&
 			    kgem_ring_is_idle(kgem, kgem->ring))
-				return false;
+				return kgem_check_failed(kgem);
 
 			size = kgem->aperture_fenced;
 			size += kgem_bo_fenced_size(kgem, bo);
 			if (3*size > 2*kgem->aperture_mappable)
-				return false;
+				return kgem_check_failed(kgem);
 		}
 
 		return true;
 	}
 
 	if (needs_semaphore(kgem, bo))
-		return false;
+		return kgem_check_failed(kgem);
 
 	if (kgem_flush(kgem, bo->flush))
-		return false;
+		return kgem_check_failed(kgem);
 
 	if (kgem->nexec >= KGEM_EXEC_SIZE(kgem) - 1)
-		return false;
+		return kgem_check_failed(kgem);
 
 	if (kgem->aperture > kgem->aperture_low &&
 	    kgem_ring_is_idle(kgem, kgem->ring))
-		return false;
+		return kgem_check_failed(kgem);
 
 	if (kgem->aperture + num_pages(bo) > kgem->aperture_high)
-		return false;
+		return kgem_check_failed(kgem);
 
 	if (kgem->gen < 040 && bo->tiling != I915_TILING_NONE) {
 		if (kgem->nfence >= kgem->fence_max)
-			return false;
+			return kgem_check_failed(kgem);
 
 		if (3*kgem->aperture_fenced > kgem->aperture_mappable &&
 		    kgem_ring_is_idle(kgem, kgem->ring))
-			return false;
+			return kgem_check_failed(kgem);
 
 		size = kgem->aperture_fenced;
 		size += kgem_bo_fenced_size(kgem, bo);
 		if (3*size > 2*kgem->aperture_mappable)
-			return false;
+			return kgem_check_failed(kgem);
 	}
 
 	return true;
@@ -4210,7 +5244,7 @@ bool kgem_check_many_bo_fenced(struct kgem *kgem, ...)
 		}
 
 		if (needs_semaphore(kgem, bo))
-			return false;
+			return kgem_check_failed(kgem);
 
 		num_pages += num_pages(bo);
 		num_exec++;
@@ -4225,29 +5259,29 @@ bool kgem_check_many_bo_fenced(struct kgem *kgem, ...)
 
 	if (num_fence) {
 		if (kgem->nfence + num_fence > kgem->fence_max)
-			return false;
+			return kgem_check_failed(kgem);
 
 		if (3*kgem->aperture_fenced > kgem->aperture_mappable &&
 		    kgem_ring_is_idle(kgem, kgem->ring))
-			return false;
+			return kgem_check_failed(kgem);
 
 		if (3*(fenced_size + kgem->aperture_fenced) > 2*kgem->aperture_mappable)
-			return false;
+			return kgem_check_failed(kgem);
 	}
 
 	if (num_pages) {
 		if (kgem_flush(kgem, flush))
-			return false;
+			return kgem_check_failed(kgem);
 
 		if (kgem->aperture > kgem->aperture_low &&
 		    kgem_ring_is_idle(kgem, kgem->ring))
-			return false;
+			return kgem_check_failed(kgem);
 
 		if (num_pages + kgem->aperture > kgem->aperture_high)
-			return false;
+			return kgem_check_failed(kgem);
 
 		if (kgem->nexec + num_exec >= KGEM_EXEC_SIZE(kgem))
-			return false;
+			return kgem_check_failed(kgem);
 	}
 
 	return true;
@@ -4334,13 +5368,68 @@ uint32_t kgem_add_reloc(struct kgem *kgem,
 	return delta;
 }
 
+/* Are there too many cached mappings? If so, victim is set to the type to
+ * discard: either the type being mapped if it has exceeded its count, or
+ * any type (-1) if the mappings together exceed the address space budget.
+ */
+static bool vma_over_budget(struct kgem *kgem, int type, int *victim)
+{
+	if (kgem->vma[type].count > 0) {
+		*victim = type;
+		return true;
+	}
+
+	if (kgem->vma_budget == 0)
+		return false;
+
+	*victim = -1;
+	return kgem->vma[MAP_GTT].bytes + kgem->vma[MAP_CPU].bytes > kgem->vma_budget;
+}
+
+static struct kgem_bo *vma_cache_victim(struct kgem *kgem, int type)
+{
+	struct kgem_bo *bo = NULL;
+	int t, i, heat = UINT16_MAX + 1;
+
+	/* Evict from the bucket we have least often had to remap of late,
+	 * preferring the larger buckets upon a tie to release more address
+	 * space, and within that bucket the least recently used mapping.
+	 * When trimming address space, both types of mapping compete.
+	 */
+	for (i = NUM_CACHE_BUCKETS; i--; ) {
+		for (t = 0; t < NUM_MAP_TYPES; t++) {
+			struct list *head = &kgem->vma[t].inactive[i];
+
+			if (type >= 0 && t != type)
+				continue;
+
+			if (list_is_empty(head) || kgem->vma[t].heat[i] >= heat)
+				continue;
+
+			bo = list_last_entry(head, struct kgem_bo, vma);
+			heat = kgem->vma[t].heat[i];
+			if (heat == 0)
+				return bo;
+		}
+	}
+
+	return bo;
+}
+
 static void kgem_trim_vma_cache(struct kgem *kgem, int type, int bucket)
 {
-	int i, j;
+	int victim;
+
+	/* We are only called just before creating a new mapping */
+	kgem->stats.vma_miss[type]++;
+	if (bucket < NUM_CACHE_BUCKETS &&
+	    kgem->vma[type].heat[bucket] < UINT16_MAX)
+		kgem->vma[type].heat[bucket]++;
 
-	DBG(("%s: type=%d, count=%d (bucket: %d)\n",
-	     __FUNCTION__, type, kgem->vma[type].count, bucket));
-	if (kgem->vma[type].count <= 0)
+	DBG(("%s: type=%d, count=%d, bytes=%lld (bucket: %d)\n",
+	     __FUNCTION__, type, kgem->vma[type].count,
+	     (long long)kgem->vma[type].bytes, bucket));
+	if (!vma_over_budget(kgem, type, &victim))
 	       return;
 
 	if (kgem->need_purge)
@@ -4351,34 +5440,31 @@ static void kgem_trim_vma_cache(struct kgem *kgem, int type, int bucket)
 	 * mappings. In order to be fair and not hog the cache,
 	 * and more importantly not to exhaust that limit and to
 	 * start failing mappings, we keep our own number of open
-	 * vma to within a conservative value.
+	 * vma to within a conservative value. Similarly, we limit
+	 * the address space held by the cached mappings to the
+	 * vma_budget, for the benefit of 32-bit processes.
 	 */
-	i = 0;
-	while (kgem->vma[type].count > 0) {
-		struct kgem_bo *bo = NULL;
-
-		for (j = 0;
-		     bo == NULL && j < ARRAY_SIZE(kgem->vma[type].inactive);
-		     j++) {
-			struct list *head = &kgem->vma[type].inactive[i++%ARRAY_SIZE(kgem->vma[type].inactive)];
-			if (!list_is_empty(head))
-				bo = list_last_entry(head, struct kgem_bo, vma);
-		}
+	while (vma_over_budget(kgem, type, &victim)) {
+		struct kgem_bo *bo;
+		int t;
+
+		bo = vma_cache_victim(kgem, victim);
 		if (bo == NULL)
 			break;
 
-		DBG(("%s: discarding inactive %s vma cache for %d\n",
+		t = IS_CPU_MAP(bo->map);
+		DBG(("%s: discarding inactive %s vma cache for %d (bucket %d, heat %d)\n",
 		     __FUNCTION__,
-		     IS_CPU_MAP(bo->map) ? "CPU" : "GTT", bo->handle));
-		assert(IS_CPU_MAP(bo->map) == type);
+		     t ? "CPU" : "GTT", bo->handle,
+		     bucket(bo), kgem->vma[t].heat[bucket(bo)]));
+		assert(victim < 0 || t == victim);
 		assert(bo->map);
 		assert(bo->rq == NULL);
 
-		VG(if (type) VALGRIND_MAKE_MEM_NOACCESS(MAP(bo->map), bytes(bo)));
-		munmap(MAP(bo->map), bytes(bo));
+		VG(if (t) VALGRIND_MAKE_MEM_NOACCESS(MAP(bo->map), bytes(bo)));
+		do_munmap(MAP(bo->map), bytes(bo));
 		bo->map = NULL;
-		list_del(&bo->vma);
-		kgem->vma[type].count--;
+		vma_cache_del(kgem, bo, t);
 
 		if (!bo->purged && !kgem_bo_set_purgeable(kgem, bo)) {
 			DBG(("%s: freeing unpurgeable old mapping\n",
@@ -4409,6 +5495,7 @@ void *kgem_bo_map__async(struct kgem *kgem, struct kgem_bo *bo)
 		kgem_bo_release_map(kgem, bo);
 
 	ptr = bo->map;
+	kgem->stats.vma_hit[MAP_GTT] += ptr != NULL;
 	if (ptr == NULL) {
 		assert(kgem_bo_size(bo) <= kgem->aperture_mappable / 2);
 
@@ -4455,6 +5542,7 @@ void *kgem_bo_map(struct kgem *kgem, struct kgem_bo *bo)
 		kgem_bo_release_map(kgem, bo);
 
 	ptr = bo->map;
+	kgem->stats.vma_hit[MAP_GTT] += ptr != NULL;
 	if (ptr == NULL) {
 		assert(kgem_bo_size(bo) <= kgem->aperture_mappable / 2);
 		assert(kgem->gen != 021 || bo->tiling != I915_TILING_Y);
@@ -4486,7 +5574,7 @@ void *kgem_bo_map(struct kgem *kgem, struct kgem_bo *bo)
 		set_domain.handle = bo->handle;
 		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
 		set_domain.write_domain = I915_GEM_DOMAIN_GTT;
-		if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain) == 0) {
+		if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain) == 0) {
 			kgem_bo_retire(kgem, bo);
 			bo->domain = DOMAIN_GTT;
 		}
@@ -4510,6 +5598,7 @@ void *kgem_bo_map__gtt(struct kgem *kgem, struct kgem_bo *bo)
 		kgem_bo_release_map(kgem, bo);
 
 	ptr = bo->map;
+	kgem->stats.vma_hit[MAP_GTT] += ptr != NULL;
 	if (ptr == NULL) {
 		assert(bytes(bo) <= kgem->aperture_mappable / 4);
 
@@ -4551,8 +5640,10 @@ void *kgem_bo_map__cpu(struct kgem *kgem, struct kgem_bo *bo)
 	assert(!bo->scanout);
 	assert(bo->proxy == NULL);
 
-	if (IS_CPU_MAP(bo->map))
+	if (IS_CPU_MAP(bo->map)) {
+		kgem->stats.vma_hit[MAP_CPU]++;
 		return MAP(bo->map);
+	}
 
 	if (bo->map)
 		kgem_bo_release_map(kgem, bo);
@@ -4564,7 +5655,7 @@ retry:
 	mmap_arg.handle = bo->handle;
 	mmap_arg.offset = 0;
 	mmap_arg.size = bytes(bo);
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_MMAP, &mmap_arg)) {
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_MMAP, &mmap_arg)) {
 		ErrorF("%s: failed to mmap %d, %d bytes, into CPU domain: %d\n",
 		       __FUNCTION__, bo->handle, bytes(bo), errno);
 		if (__kgem_throttle_retire(kgem, 0))
@@ -4604,7 +5695,7 @@ retry:
 	mmap_arg.handle = bo->handle;
 	mmap_arg.offset = 0;
 	mmap_arg.size = bytes(bo);
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_MMAP, &mmap_arg)) {
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_MMAP, &mmap_arg)) {
 		ErrorF("%s: failed to mmap %d, %d bytes, into CPU domain: %d\n",
 		       __FUNCTION__, bo->handle, bytes(bo), errno);
 		if (__kgem_throttle_retire(kgem, 0))
@@ -4641,7 +5732,7 @@ void __kgem_bo_unmap__cpu(struct kgem *kgem, struct kgem_bo *bo, void *ptr)
                 return;
         }
 
-	munmap(ptr, bytes(bo));
+	do_munmap(ptr, bytes(bo));
 }
 
 uint32_t kgem_bo_flink(struct kgem *kgem, struct kgem_bo *bo)
@@ -4650,7 +5741,7 @@ uint32_t kgem_bo_flink(struct kgem *kgem, struct kgem_bo *bo)
 
 	VG_CLEAR(flink);
 	flink.handle = bo->handle;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_GEM_FLINK, &flink))
+	if (do_ioctl(kgem->fd, DRM_IOCTL_GEM_FLINK, &flink))
 		return 0;
 
 	DBG(("%s: flinked handle=%d to name=%d, marking non-reusable\n",
@@ -4719,7 +5810,7 @@ void kgem_bo_sync__cpu(struct kgem *kgem, struct kgem_bo *bo)
 		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
 		set_domain.write_domain = I915_GEM_DOMAIN_CPU;
 
-		if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain) == 0) {
+		if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain) == 0) {
 			kgem_bo_retire(kgem, bo);
 			bo->domain = DOMAIN_CPU;
 		}
@@ -4742,7 +5833,7 @@ void kgem_bo_sync__cpu_full(struct kgem *kgem, struct kgem_bo *bo, bool write)
 		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
 		set_domain.write_domain = write ? I915_GEM_DOMAIN_CPU : 0;
 
-		if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain) == 0) {
+		if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain) == 0) {
 			if (write || bo->needs_flush)
 				kgem_bo_retire(kgem, bo);
 			bo->domain = write ? DOMAIN_CPU : DOMAIN_NONE;
@@ -4766,7 +5857,7 @@ void kgem_bo_sync__gtt(struct kgem *kgem, struct kgem_bo *bo)
 		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
 		set_domain.write_domain = I915_GEM_DOMAIN_GTT;
 
-		if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain) == 0) {
+		if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain) == 0) {
 			kgem_bo_retire(kgem, bo);
 			bo->domain = DOMAIN_GTT;
 		}
@@ -4827,7 +5918,7 @@ buffer_alloc(void)
 {
 	struct kgem_buffer *bo;
 
-	bo = malloc(sizeof(*bo));
+	bo = slab_alloc(&slab_buffer);
 	if (bo == NULL)
 		return NULL;
 
@@ -4876,7 +5967,7 @@ init_buffer_from_bo(struct kgem_buffer *bo, struct kgem_bo *old)
 		list_init(&bo->base.request);
 	list_replace(&old->vma, &bo->base.vma);
 	list_init(&bo->base.list);
-	free(old);
+	slab_free(old);
 
 	assert(bo->base.tiling == I915_TILING_NONE);
 
@@ -4944,7 +6035,7 @@ create_snoopable_buffer(struct kgem *kgem, unsigned alloc)
 		} else {
 			handle = gem_create(kgem->fd, alloc);
 			if (handle == 0) {
-				free(bo);
+				buffer_free(bo);
 				return NULL;
 			}
 
@@ -4981,14 +6072,14 @@ free_cacheing:
 
 		//if (posix_memalign(&ptr, 64, ALIGN(size, 64)))
 		if (posix_memalign(&bo->mem, PAGE_SIZE, alloc *PAGE_SIZE)) {
-			free(bo);
+			buffer_free(bo);
 			return NULL;
 		}
 
 		handle = gem_userptr(kgem->fd, bo->mem, alloc * PAGE_SIZE, false);
 		if (handle == 0) {
 			free(bo->mem);
-			free(bo);
+			buffer_free(bo);
 			return NULL;
 		}
 
@@ -5010,6 +6101,50 @@ free_cacheing:
 	return NULL;
 }
 
+struct kgem_bo *kgem_get_upload_bo(struct kgem *kgem, uint32_t size, void **ret)
+{
+	struct kgem_bo *bo;
+	int i;
+
+	/* Without LLC, writing through the CPU would need a clflush
+	 * before every copy, defeating the purpose.
+	 */
+	if (DBG_NO_UPLOAD_RING || !kgem->has_llc || kgem->wedged)
+		return NULL;
+
+	kgem->upload_ring_idle = 0;
+
+	i = kgem->upload_ring_next;
+	bo = kgem->upload_ring[i];
+	if (bo && kgem_bo_size(bo) < size) {
+		DBG(("%s: upload[%d] handle=%d too small, %d < %d\n",
+		     __FUNCTION__, i, bo->handle, kgem_bo_size(bo), size));
+		kgem_bo_destroy(kgem, bo);
+		kgem->upload_ring[i] = bo = NULL;
+	}
+	if (bo == NULL) {
+		bo = kgem_create_linear(kgem, PAGE_ALIGN(size),
+					CREATE_CPU_MAP | CREATE_INACTIVE);
+		if (bo == NULL)
+			return NULL;
+
+		kgem->upload_ring[i] = bo;
+		kgem->need_expire = true;
+	}
+
+	*ret = kgem_bo_map__cpu(kgem, bo);
+	if (*ret == NULL)
+		return NULL;
+
+	/* Wait for the GPU to finish reading the previous upload */
+	kgem_bo_sync__cpu(kgem, bo);
+
+	DBG(("%s: using upload[%d] handle=%d for %d bytes\n",
+	     __FUNCTION__, i, bo->handle, size));
+	kgem->upload_ring_next = (i + 1) % ARRAY_SIZE(kgem->upload_ring);
+	return kgem_bo_reference(bo);
+}
+
 struct kgem_bo *kgem_create_buffer(struct kgem *kgem,
 				   uint32_t size, uint32_t flags,
 				   void **ret)
@@ -5133,7 +6268,7 @@ struct kgem_bo *kgem_create_buffer(struct kgem *kgem,
 		} else {
 			uint32_t handle = gem_create(kgem->fd, alloc);
 			if (handle == 0) {
-				free(bo);
+				buffer_free(bo);
 				goto skip_llc;
 			}
 			__kgem_bo_init(&bo->base, handle, alloc);
@@ -5180,7 +6315,7 @@ skip_llc:
 
 			VG_CLEAR(info);
 			info.handle = handle;
-			if (drmIoctl(kgem->fd,
+			if (do_ioctl(kgem->fd,
 				     DRM_IOCTL_I915_GEM_BUFFER_INFO,
 				     &fino) == 0) {
 				old->presumed_offset = info.addr;
@@ -5293,7 +6428,7 @@ skip_llc:
 		} else {
 			uint32_t handle = gem_create(kgem->fd, alloc);
 			if (handle == 0) {
-				free(bo);
+				buffer_free(bo);
 				return NULL;
 			}
 
@@ -5494,7 +6629,7 @@ void kgem_buffer_read_sync(struct kgem *kgem, struct kgem_bo *_bo)
 		set_domain.read_domains =
 			IS_CPU_MAP(bo->base.map) ? I915_GEM_DOMAIN_CPU : I915_GEM_DOMAIN_GTT;
 
-		if (drmIoctl(kgem->fd,
+		if (do_ioctl(kgem->fd,
 			     DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain))
 			return;
 	} else {
@@ -5550,7 +6685,7 @@ int kgem_bo_get_swizzling(struct kgem *kgem, struct kgem_bo *bo)
 
 	VG_CLEAR(tiling);
 	tiling.handle = bo->handle;
-	if (drmIoctl(kgem->fd, DRM_IOCTL_I915_GEM_GET_TILING, &tiling))
+	if (do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_GET_TILING, &tiling))
 		return 0;
 
 	assert(bo->tiling == tiling.tiling_mode);
@@ -31,6 +31,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <sys/types.h>
 
 #include <i915_drm.h>
 
@@ -55,6 +56,9 @@ struct kgem_bo {
 	struct list request;
 	struct list vma;
 
+	struct kgem_size_class *size_class;
+	struct list size_link;
+
 	void *map;
 #define IS_CPU_MAP(ptr) ((uintptr_t)(ptr) & 1)
 #define IS_GTT_MAP(ptr) (ptr && ((uintptr_t)(ptr) & 1) == 0)
@@ -103,6 +107,8 @@ struct kgem_request {
 	struct kgem_bo *bo;
 	struct list buffers;
 	int ring;
+	uint32_t seqno;
+	bool queued;
 };
 
 enum {
@@ -111,6 +117,34 @@ enum {
 	NUM_MAP_TYPES,
 };
 
+/* Each cache bucket keeps its bo in LRU order on a list for expiry, and
+ * additionally groups them into classes of identical (num_pages, tiling,
+ * pitch) kept sorted in that order, so that a best-fit can be found
+ * without walking every bo in the bucket.
+ */
+struct kgem_size_index {
+	struct kgem_size_class **class;
+	int count, size;
+};
+
+/* Cheap running totals of what kgem has asked of the kernel, always
+ * compiled in so that they can be inspected on a production server,
+ * see kgem_dump_stats().
+ */
+struct kgem_stats {
+	unsigned long batches[4]; /* indexed by kgem->ring */
+	uint64_t batch_bytes;
+	unsigned long relocs;
+	unsigned long exec_objects;
+	unsigned long no_reloc; /* batches where nothing needed relocating */
+	unsigned long check_flush; /* batches flushed by a failed kgem_check_*() */
+	unsigned long throttles;
+	uint64_t throttle_ns;
+	unsigned long cache_hit, cache_miss;
+	unsigned long snoop_hit, snoop_miss;
+	unsigned long vma_hit[NUM_MAP_TYPES], vma_miss[NUM_MAP_TYPES];
+};
+
 struct kgem {
 	int fd;
 	int wedged;
@@ -131,6 +165,8 @@ struct kgem {
 	struct list large_inactive;
 	struct list active[NUM_CACHE_BUCKETS][3];
 	struct list inactive[NUM_CACHE_BUCKETS];
+	struct kgem_size_index active_index[NUM_CACHE_BUCKETS][3];
+	struct kgem_size_index inactive_index[NUM_CACHE_BUCKETS];
 	struct list pinned_batches[2];
 	struct list snoop;
 	struct list scanout;
@@ -139,14 +175,25 @@ struct kgem {
 	struct list requests[2];
 	struct kgem_request *next_request;
 	struct kgem_request static_request;
+	struct kgem_retire_thread *retire_thread;
+	uint32_t seqno;
 
+	/* Mappings kept on inactive bo, see kgem_trim_vma_cache(). The heat
+	 * of each bucket counts how often we have recently had to create a
+	 * new mapping for a bo of that size, and is halved upon expiry.
+	 */
 	struct {
 		struct list inactive[NUM_CACHE_BUCKETS];
+		uint16_t heat[NUM_CACHE_BUCKETS];
+		uint64_t bytes;
 		int16_t count;
 	} vma[NUM_MAP_TYPES];
+	uint64_t vma_budget; /* bytes of address space, 0 for unlimited */
 
 	uint32_t batch_flags;
 	uint32_t batch_flags_base;
+
+	struct kgem_stats stats;
 #define I915_EXEC_SECURE (1<<9)
 #define LOCAL_EXEC_OBJECT_WRITE (1<<2)
 
@@ -178,6 +225,7 @@ struct kgem {
 	uint32_t has_llc :1;
 	uint32_t has_no_reloc :1;
 	uint32_t has_handle_lut :1;
+	uint32_t has_batch_ring :1;
 
 	uint32_t can_blt_cpu :1;
 
@@ -194,7 +242,23 @@ struct kgem {
 	void (*retire)(struct kgem *kgem);
 	void (*expire)(struct kgem *kgem);
 
-	uint32_t batch[64*1024-8];
+	/* Commands are written directly into one of a ring of persistently
+	 * mapped batch bo when possible, otherwise into batch_data which is
+	 * then uploaded upon submission.
+	 */
+	uint32_t *batch;
+	struct kgem_bo *batch_bo;
+	struct kgem_bo *batch_ring[3];
+	int batch_ring_next;
+
+	/* Staging bo reused in turn by large uploads, so that the CPU can
+	 * fill one whilst the GPU is still copying from the other.
+	 */
+	struct kgem_bo *upload_ring[2];
+	int upload_ring_next;
+	uint32_t upload_ring_idle; /* first seen unused by expire, or 0 */
+
+	uint32_t batch_data[64*1024-8];
 	struct drm_i915_gem_exec_object2 exec[256];
 	struct drm_i915_gem_relocation_entry reloc[4096];
 	uint16_t reloc__self[256];
@@ -219,8 +283,30 @@ struct kgem {
 #define KGEM_EXEC_SIZE(K) (int)(ARRAY_SIZE((K)->exec)-KGEM_EXEC_RESERVED)
 #define KGEM_RELOC_SIZE(K) (int)(ARRAY_SIZE((K)->reloc)-KGEM_RELOC_RESERVED)
 
+/* Entry points used to talk to the kernel. By default these are drmIoctl(),
+ * mmap() and munmap(), but they may be replaced (before kgem_init()) so
+ * that the buffer manager can be driven against an emulated device.
+ */
+struct kgem_device_ops {
+	int (*ioctl)(int fd, unsigned long request, void *arg);
+	void *(*mmap)(void *addr, size_t length,
+		      int prot, int flags, int fd, off_t offset);
+	int (*munmap)(void *addr, size_t length);
+};
+void kgem_set_device_ops(const struct kgem_device_ops *ops);
+
+struct kgem_slab_stats {
+	const char *name;
+	unsigned size;
+	unsigned long allocs, frees;
+	unsigned long inuse, peak;
+	unsigned long slabs, reaped;
+};
+int kgem_get_slab_stats(struct kgem_slab_stats *stats, int max);
+
 void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen);
 void kgem_reset(struct kgem *kgem);
+void kgem_dump_stats(struct kgem *kgem);
 
 struct kgem_bo *kgem_create_map(struct kgem *kgem,
 				void *ptr, uint32_t size,
@@ -286,6 +372,9 @@ int kgem_bo_get_swizzling(struct kgem *kgem, struct kgem_bo *bo);
 
 bool kgem_retire(struct kgem *kgem);
 
+bool kgem_start_retire_thread(struct kgem *kgem);
+void kgem_stop_retire_thread(struct kgem *kgem);
+
 bool __kgem_ring_is_idle(struct kgem *kgem, int ring);
 static inline bool kgem_ring_is_idle(struct kgem *kgem, int ring)
 {
@@ -667,6 +756,7 @@ struct kgem_bo *kgem_create_buffer_2d(struct kgem *kgem,
 				      uint32_t flags,
 				      void **ret);
 bool kgem_buffer_is_inplace(struct kgem_bo *bo);
+struct kgem_bo *kgem_get_upload_bo(struct kgem *kgem, uint32_t size, void **ret);
 void kgem_buffer_read_sync(struct kgem *kgem, struct kgem_bo *bo);
 
 void kgem_throttle(struct kgem *kgem);
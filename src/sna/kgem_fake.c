@@ -0,0 +1,956 @@
+/*
+ * Copyright (c) 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+#include "kgem_fake.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xf86drm.h>
+
+#define FAKE_PAGE_SHIFT 12
+#define FAKE_NUM_PARAMS 64
+#define FAKE_NUM_RINGS 4
+#define FAKE_THROTTLE_NS (20*1000*1000ULL)
+
+#define LOCAL_I915_EXEC_NO_RELOC		(1<<11)
+#define LOCAL_I915_EXEC_HANDLE_LUT		(1<<12)
+
+#define LOCAL_I915_GEM_SET_CACHEING	0x2f
+#define LOCAL_IOCTL_I915_GEM_SET_CACHEING DRM_IOW(DRM_COMMAND_BASE + LOCAL_I915_GEM_SET_CACHEING, struct local_i915_gem_cacheing)
+struct local_i915_gem_cacheing {
+	uint32_t handle;
+	uint32_t cacheing;
+};
+
+#define LOCAL_I915_GEM_WAIT	0x2c
+#define LOCAL_IOCTL_I915_GEM_WAIT DRM_IOWR(DRM_COMMAND_BASE + LOCAL_I915_GEM_WAIT, struct local_i915_gem_wait)
+struct local_i915_gem_wait {
+	uint32_t handle;
+	uint32_t flags;
+	int64_t timeout_ns;
+};
+
+struct fake_bo {
+	uint32_t handle;
+	uint64_t size;
+	uint64_t offset;
+	uint64_t busy_until;
+	void *mem;
+	uint32_t tiling;
+	uint32_t stride;
+	uint32_t cacheing;
+	uint32_t madv;
+	int bound;
+};
+
+struct fake_request {
+	uint64_t submitted;
+	uint64_t completed;
+};
+
+struct kgem_fake {
+	pthread_mutex_t mutex;
+	pthread_cond_t advance;
+	int fd;
+
+	struct fake_bo **bo;
+	uint32_t num_bo;
+	uint32_t free_handle;
+
+	int param[FAKE_NUM_PARAMS];
+	uint64_t aperture;
+	uint64_t next_offset;
+	int swizzle;
+
+	uint64_t now;
+	uint64_t latency[FAKE_NUM_RINGS];
+	uint64_t ring_tail[FAKE_NUM_RINGS];
+	uint64_t (*latency_func)(void *closure, int ring,
+				 const struct drm_i915_gem_execbuffer2 *eb);
+	void *latency_closure;
+
+	struct fake_request *rq;
+	int num_rq, max_rq;
+
+	struct kgem_fake_stats stats;
+};
+
+static struct kgem_fake *fake_device;
+
+static int fake_error(int err)
+{
+	errno = err;
+	return -1;
+}
+
+static struct fake_bo *fake_lookup(struct kgem_fake *fake, uint32_t handle)
+{
+	if (handle == 0 || handle >= fake->num_bo)
+		return NULL;
+
+	return fake->bo[handle];
+}
+
+static void *fake_backing(struct fake_bo *bo)
+{
+	void *ptr;
+
+	if (bo->mem)
+		return bo->mem;
+
+	/* Only touched pages are ever populated */
+	ptr = mmap(NULL, bo->size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	bo->mem = ptr;
+	return ptr;
+}
+
+static void fake_bind(struct kgem_fake *fake, struct fake_bo *bo)
+{
+	if (bo->bound)
+		return;
+
+	/* Offsets are handed out once and then remain stable, as they would
+	 * be on an idle system with plenty of aperture.
+	 */
+	if (fake->next_offset + bo->size > fake->aperture)
+		fake->next_offset = 0;
+
+	bo->offset = fake->next_offset;
+	bo->bound = 1;
+	fake->next_offset += ALIGN(bo->size, 1 << FAKE_PAGE_SHIFT);
+}
+
+static void fake_wait(struct kgem_fake *fake, uint64_t until)
+{
+	if (until <= fake->now)
+		return;
+
+	fake->stats.stalls++;
+	fake->stats.stall_ns += until - fake->now;
+	fake->now = until;
+	pthread_cond_broadcast(&fake->advance);
+}
+
+static void fake_retire(struct kgem_fake *fake)
+{
+	int n, m;
+
+	for (n = m = 0; n < fake->num_rq; n++) {
+		if (fake->rq[n].completed > fake->now)
+			fake->rq[m++] = fake->rq[n];
+	}
+	fake->num_rq = m;
+}
+
+static int fake_getparam(struct kgem_fake *fake, drm_i915_getparam_t *gp)
+{
+	if (gp->param < 0 || gp->param >= FAKE_NUM_PARAMS ||
+	    fake->param[gp->param] == -1)
+		return fake_error(EINVAL);
+
+	*gp->value = fake->param[gp->param];
+	return 0;
+}
+
+static int fake_get_aperture(struct kgem_fake *fake,
+			     struct drm_i915_gem_get_aperture *arg)
+{
+	arg->aper_size = fake->aperture;
+	arg->aper_available_size = fake->aperture;
+	return 0;
+}
+
+static int fake_create(struct kgem_fake *fake,
+		       struct drm_i915_gem_create *arg)
+{
+	struct fake_bo *bo;
+	uint32_t handle;
+
+	if (arg->size == 0)
+		return fake_error(EINVAL);
+
+	bo = calloc(1, sizeof(*bo));
+	if (bo == NULL)
+		return fake_error(ENOMEM);
+
+	for (handle = fake->free_handle; handle < fake->num_bo; handle++)
+		if (fake->bo[handle] == NULL)
+			break;
+	if (handle == fake->num_bo) {
+		uint32_t num = fake->num_bo ? 2*fake->num_bo : 1024;
+		struct fake_bo **array;
+
+		array = realloc(fake->bo, num * sizeof(*array));
+		if (array == NULL) {
+			free(bo);
+			return fake_error(ENOMEM);
+		}
+		memset(array + fake->num_bo, 0,
+		       (num - fake->num_bo) * sizeof(*array));
+		if (fake->num_bo == 0)
+			handle = 1;
+		fake->bo = array;
+		fake->num_bo = num;
+	}
+	fake->free_handle = handle + 1;
+
+	bo->handle = handle;
+	bo->size = ALIGN(arg->size, 1 << FAKE_PAGE_SHIFT);
+	bo->madv = I915_MADV_WILLNEED;
+	fake->bo[handle] = bo;
+
+	fake->stats.create++;
+	fake->stats.live_objects++;
+	fake->stats.live_bytes += bo->size;
+
+	arg->handle = handle;
+	return 0;
+}
+
+static int fake_close(struct kgem_fake *fake, struct drm_gem_close *arg)
+{
+	struct fake_bo *bo;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	fake->stats.close++;
+	fake->stats.live_objects--;
+	fake->stats.live_bytes -= bo->size;
+
+	if (bo->mem)
+		munmap(bo->mem, bo->size);
+	fake->bo[bo->handle] = NULL;
+	if (bo->handle < fake->free_handle)
+		fake->free_handle = bo->handle;
+	free(bo);
+
+	/* Release anybody waiting upon the handle */
+	pthread_cond_broadcast(&fake->advance);
+	return 0;
+}
+
+static int fake_busy(struct kgem_fake *fake, struct drm_i915_gem_busy *arg)
+{
+	struct fake_bo *bo;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	fake->stats.busy++;
+	arg->busy = bo->busy_until > fake->now;
+	fake->stats.busy_true += arg->busy;
+	return 0;
+}
+
+static int fake_set_domain(struct kgem_fake *fake,
+			   struct drm_i915_gem_set_domain *arg)
+{
+	struct fake_bo *bo;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	fake->stats.set_domain++;
+	fake_wait(fake, bo->busy_until);
+	return 0;
+}
+
+/* Unlike set-domain, GEM_WAIT does not move the device clock forward:
+ * instead the caller sleeps (in real time) until somebody else advances
+ * the clock past the request, or the handle is closed.
+ */
+static int fake_gem_wait(struct kgem_fake *fake,
+			 struct local_i915_gem_wait *arg)
+{
+	struct fake_bo *bo;
+	struct timespec deadline;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	fake->stats.wait++;
+	if (bo->busy_until <= fake->now)
+		return 0;
+
+	if (arg->timeout_ns == 0)
+		return fake_error(ETIME);
+
+	if (arg->timeout_ns > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += arg->timeout_ns / 1000000000;
+		deadline.tv_nsec += arg->timeout_ns % 1000000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_nsec -= 1000000000;
+			deadline.tv_sec++;
+		}
+	}
+
+	do {
+		if (arg->timeout_ns < 0)
+			pthread_cond_wait(&fake->advance, &fake->mutex);
+		else if (pthread_cond_timedwait(&fake->advance, &fake->mutex,
+						&deadline) == ETIMEDOUT)
+			return fake_error(ETIME);
+
+		bo = fake_lookup(fake, arg->handle);
+		if (bo == NULL)
+			return fake_error(ENOENT);
+	} while (bo->busy_until > fake->now);
+
+	return 0;
+}
+
+static int fake_set_tiling(struct kgem_fake *fake,
+			   struct drm_i915_gem_set_tiling *arg)
+{
+	struct fake_bo *bo;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	if (arg->tiling_mode > I915_TILING_Y)
+		return fake_error(EINVAL);
+
+	if (arg->tiling_mode != I915_TILING_NONE &&
+	    (arg->stride == 0 || arg->stride & 127))
+		return fake_error(EINVAL);
+
+	fake->stats.set_tiling++;
+	bo->tiling = arg->tiling_mode;
+	bo->stride = bo->tiling ? arg->stride : 0;
+	arg->swizzle_mode = bo->tiling ? fake->swizzle : I915_BIT_6_SWIZZLE_NONE;
+	return 0;
+}
+
+static int fake_get_tiling(struct kgem_fake *fake,
+			   struct drm_i915_gem_get_tiling *arg)
+{
+	struct fake_bo *bo;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	arg->tiling_mode = bo->tiling;
+	arg->swizzle_mode = bo->tiling ? fake->swizzle : I915_BIT_6_SWIZZLE_NONE;
+	return 0;
+}
+
+static int fake_set_cacheing(struct kgem_fake *fake,
+			     struct local_i915_gem_cacheing *arg)
+{
+	struct fake_bo *bo;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	bo->cacheing = arg->cacheing;
+	return 0;
+}
+
+static int fake_madvise(struct kgem_fake *fake,
+			struct drm_i915_gem_madvise *arg)
+{
+	struct fake_bo *bo;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	fake->stats.madvise++;
+	bo->madv = arg->madv;
+	arg->retained = 1;
+	return 0;
+}
+
+static int fake_mmap_cpu(struct kgem_fake *fake,
+			 struct drm_i915_gem_mmap *arg)
+{
+	struct fake_bo *bo;
+	char *ptr;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	if (arg->offset + arg->size > bo->size)
+		return fake_error(EINVAL);
+
+	ptr = fake_backing(bo);
+	if (ptr == NULL)
+		return fake_error(ENOMEM);
+
+	fake->stats.mmap_cpu++;
+	arg->addr_ptr = (uintptr_t)(ptr + arg->offset);
+	return 0;
+}
+
+static int fake_mmap_gtt(struct kgem_fake *fake,
+			 struct drm_i915_gem_mmap_gtt *arg)
+{
+	struct fake_bo *bo;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	fake->stats.mmap_gtt++;
+	arg->offset = (uint64_t)bo->handle << FAKE_PAGE_SHIFT;
+	return 0;
+}
+
+static int fake_pwrite(struct kgem_fake *fake,
+		       struct drm_i915_gem_pwrite *arg)
+{
+	struct fake_bo *bo;
+	char *ptr;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	if (arg->offset + arg->size > bo->size)
+		return fake_error(EINVAL);
+
+	ptr = fake_backing(bo);
+	if (ptr == NULL)
+		return fake_error(ENOMEM);
+
+	fake_wait(fake, bo->busy_until);
+	memcpy(ptr + arg->offset, (void *)(uintptr_t)arg->data_ptr, arg->size);
+
+	fake->stats.pwrite++;
+	fake->stats.pwrite_bytes += arg->size;
+	return 0;
+}
+
+static int fake_pread(struct kgem_fake *fake,
+		      struct drm_i915_gem_pread *arg)
+{
+	struct fake_bo *bo;
+	char *ptr;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	if (arg->offset + arg->size > bo->size)
+		return fake_error(EINVAL);
+
+	ptr = fake_backing(bo);
+	if (ptr == NULL)
+		return fake_error(ENOMEM);
+
+	fake_wait(fake, bo->busy_until);
+	memcpy((void *)(uintptr_t)arg->data_ptr, ptr + arg->offset, arg->size);
+
+	fake->stats.pread++;
+	fake->stats.pread_bytes += arg->size;
+	return 0;
+}
+
+static int fake_pin(struct kgem_fake *fake, struct drm_i915_gem_pin *arg)
+{
+	struct fake_bo *bo;
+
+	bo = fake_lookup(fake, arg->handle);
+	if (bo == NULL)
+		return fake_error(ENOENT);
+
+	fake_bind(fake, bo);
+	arg->offset = bo->offset;
+	return 0;
+}
+
+static int fake_throttle(struct kgem_fake *fake)
+{
+	uint64_t until = 0;
+	int n;
+
+	/* Wait upon the last request emitted more than 20ms ago */
+	fake->stats.throttle++;
+	for (n = 0; n < fake->num_rq; n++) {
+		if (fake->rq[n].submitted + FAKE_THROTTLE_NS > fake->now)
+			continue;
+
+		if (fake->rq[n].completed > until)
+			until = fake->rq[n].completed;
+	}
+	fake_wait(fake, until);
+	fake_retire(fake);
+	return 0;
+}
+
+static int fake_relocate(struct kgem_fake *fake,
+			 struct drm_i915_gem_execbuffer2 *eb,
+			 struct drm_i915_gem_exec_object2 *exec,
+			 struct fake_bo **bo,
+			 int n)
+{
+	struct drm_i915_gem_relocation_entry *reloc;
+	char *ptr = NULL;
+	unsigned i;
+
+	reloc = (void *)(uintptr_t)exec[n].relocs_ptr;
+	for (i = 0; i < exec[n].relocation_count; i++) {
+		struct fake_bo *target;
+		uint32_t value;
+
+		if (eb->flags & LOCAL_I915_EXEC_HANDLE_LUT) {
+			if (reloc[i].target_handle >= eb->buffer_count)
+				return fake_error(ENOENT);
+			target = bo[reloc[i].target_handle];
+		} else {
+			int j;
+
+			target = NULL;
+			for (j = 0; j < (int)eb->buffer_count; j++) {
+				if (exec[j].handle == reloc[i].target_handle) {
+					target = bo[j];
+					break;
+				}
+			}
+			if (target == NULL)
+				return fake_error(ENOENT);
+		}
+
+		if (reloc[i].offset + sizeof(value) > bo[n]->size)
+			return fake_error(EINVAL);
+
+		if (eb->flags & LOCAL_I915_EXEC_NO_RELOC &&
+		    reloc[i].presumed_offset == target->offset) {
+			fake->stats.relocs_skipped++;
+			continue;
+		}
+
+		if (ptr == NULL) {
+			ptr = fake_backing(bo[n]);
+			if (ptr == NULL)
+				return fake_error(ENOMEM);
+		}
+
+		value = target->offset + reloc[i].delta;
+		memcpy(ptr + reloc[i].offset, &value, sizeof(value));
+		reloc[i].presumed_offset = target->offset;
+		fake->stats.relocs++;
+	}
+
+	return 0;
+}
+
+static int fake_execbuffer2(struct kgem_fake *fake,
+			    struct drm_i915_gem_execbuffer2 *eb)
+{
+	struct drm_i915_gem_exec_object2 *exec;
+	struct fake_bo **bo;
+	uint64_t latency, completed;
+	int ring, n, ret;
+
+	if (eb->buffer_count == 0)
+		return fake_error(EINVAL);
+
+	if (eb->buffers_ptr == 0)
+		return fake_error(EFAULT);
+
+	ring = eb->flags & I915_EXEC_RING_MASK;
+	if (ring >= FAKE_NUM_RINGS)
+		return fake_error(EINVAL);
+	if (ring == I915_EXEC_DEFAULT)
+		ring = I915_EXEC_RENDER;
+
+	exec = (void *)(uintptr_t)eb->buffers_ptr;
+	bo = malloc(eb->buffer_count * sizeof(*bo));
+	if (bo == NULL)
+		return fake_error(ENOMEM);
+
+	for (n = 0; n < (int)eb->buffer_count; n++) {
+		bo[n] = fake_lookup(fake, exec[n].handle);
+		if (bo[n] == NULL) {
+			free(bo);
+			return fake_error(ENOENT);
+		}
+		fake_bind(fake, bo[n]);
+	}
+
+	for (n = 0; n < (int)eb->buffer_count; n++) {
+		ret = fake_relocate(fake, eb, exec, bo, n);
+		if (ret) {
+			free(bo);
+			return ret;
+		}
+	}
+
+	if (fake->latency_func)
+		latency = fake->latency_func(fake->latency_closure, ring, eb);
+	else
+		latency = fake->latency[ring];
+
+	completed = fake->ring_tail[ring];
+	if (completed < fake->now)
+		completed = fake->now;
+	completed += latency;
+	fake->ring_tail[ring] = completed;
+
+	for (n = 0; n < (int)eb->buffer_count; n++) {
+		exec[n].offset = bo[n]->offset;
+		if (bo[n]->busy_until < completed)
+			bo[n]->busy_until = completed;
+	}
+	free(bo);
+
+	fake_retire(fake);
+	if (fake->num_rq == fake->max_rq) {
+		int max = fake->max_rq ? 2*fake->max_rq : 64;
+		struct fake_request *rq;
+
+		rq = realloc(fake->rq, max * sizeof(*rq));
+		if (rq == NULL)
+			return fake_error(ENOMEM);
+
+		fake->rq = rq;
+		fake->max_rq = max;
+	}
+	fake->rq[fake->num_rq].submitted = fake->now;
+	fake->rq[fake->num_rq].completed = completed;
+	fake->num_rq++;
+
+	fake->stats.execbuffer++;
+	fake->stats.exec_objects += eb->buffer_count;
+	return 0;
+}
+
+static int fake_dispatch(struct kgem_fake *fake,
+			 unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_I915_GETPARAM:
+		return fake_getparam(fake, arg);
+	case DRM_IOCTL_I915_GEM_GET_APERTURE:
+		return fake_get_aperture(fake, arg);
+	case DRM_IOCTL_I915_GEM_CREATE:
+		return fake_create(fake, arg);
+	case DRM_IOCTL_GEM_CLOSE:
+		return fake_close(fake, arg);
+	case DRM_IOCTL_I915_GEM_BUSY:
+		return fake_busy(fake, arg);
+	case DRM_IOCTL_I915_GEM_SET_DOMAIN:
+		return fake_set_domain(fake, arg);
+	case LOCAL_IOCTL_I915_GEM_WAIT:
+		return fake_gem_wait(fake, arg);
+	case DRM_IOCTL_I915_GEM_SET_TILING:
+		return fake_set_tiling(fake, arg);
+	case DRM_IOCTL_I915_GEM_GET_TILING:
+		return fake_get_tiling(fake, arg);
+	case LOCAL_IOCTL_I915_GEM_SET_CACHEING:
+		return fake_set_cacheing(fake, arg);
+	case DRM_IOCTL_I915_GEM_MADVISE:
+		return fake_madvise(fake, arg);
+	case DRM_IOCTL_I915_GEM_MMAP:
+		return fake_mmap_cpu(fake, arg);
+	case DRM_IOCTL_I915_GEM_MMAP_GTT:
+		return fake_mmap_gtt(fake, arg);
+	case DRM_IOCTL_I915_GEM_PWRITE:
+		return fake_pwrite(fake, arg);
+	case DRM_IOCTL_I915_GEM_PREAD:
+		return fake_pread(fake, arg);
+	case DRM_IOCTL_I915_GEM_PIN:
+		return fake_pin(fake, arg);
+	case DRM_IOCTL_I915_GEM_THROTTLE:
+		return fake_throttle(fake);
+	case DRM_IOCTL_I915_GEM_EXECBUFFER2:
+		return fake_execbuffer2(fake, arg);
+	default:
+		/* userptr, flink, prime etc are not supported */
+		return fake_error(ENODEV);
+	}
+}
+
+static int fake_ioctl(int fd, unsigned long request, void *arg)
+{
+	struct kgem_fake *fake = fake_device;
+	int ret;
+
+	if (fake == NULL || fd != fake->fd)
+		return fake_error(EBADF);
+
+	pthread_mutex_lock(&fake->mutex);
+	fake->stats.ioctls++;
+	ret = fake_dispatch(fake, request, arg);
+	pthread_mutex_unlock(&fake->mutex);
+
+	return ret;
+}
+
+static void *fake_mmap(void *addr, size_t length,
+		       int prot, int flags, int fd, off_t offset)
+{
+	struct kgem_fake *fake = fake_device;
+	struct fake_bo *bo;
+	void *ptr = MAP_FAILED;
+
+	if (fake == NULL || fd != fake->fd)
+		return mmap(addr, length, prot, flags, fd, offset);
+
+	pthread_mutex_lock(&fake->mutex);
+	bo = fake_lookup(fake, (uint64_t)offset >> FAKE_PAGE_SHIFT);
+	if (bo == NULL || length > bo->size) {
+		errno = EINVAL;
+	} else {
+		ptr = fake_backing(bo);
+		if (ptr == NULL) {
+			errno = ENOMEM;
+			ptr = MAP_FAILED;
+		}
+	}
+	pthread_mutex_unlock(&fake->mutex);
+
+	return ptr;
+}
+
+static int fake_munmap(void *addr, size_t length)
+{
+	struct kgem_fake *fake = fake_device;
+	uint32_t handle;
+
+	if (fake == NULL)
+		return munmap(addr, length);
+
+	/* Every mapping of an object shares its backing store, which is
+	 * only released when the object is closed.
+	 */
+	pthread_mutex_lock(&fake->mutex);
+	for (handle = 1; handle < fake->num_bo; handle++) {
+		struct fake_bo *bo = fake->bo[handle];
+		if (bo && bo->mem == addr)
+			break;
+	}
+	pthread_mutex_unlock(&fake->mutex);
+
+	if (handle < fake->num_bo)
+		return 0;
+
+	return munmap(addr, length);
+}
+
+const struct kgem_device_ops kgem_fake_ops = {
+	fake_ioctl,
+	fake_mmap,
+	fake_munmap,
+};
+
+struct kgem_fake *kgem_fake_create(void)
+{
+	struct kgem_fake *fake;
+	int n;
+
+	if (fake_device)
+		return NULL;
+
+	fake = calloc(1, sizeof(*fake));
+	if (fake == NULL)
+		return NULL;
+
+	/* Reserve a real descriptor so that it cannot alias any other */
+	fake->fd = open("/dev/null", O_RDWR);
+	if (fake->fd == -1) {
+		free(fake);
+		return NULL;
+	}
+
+	pthread_mutex_init(&fake->mutex, NULL);
+	pthread_cond_init(&fake->advance, NULL);
+
+	for (n = 0; n < FAKE_NUM_PARAMS; n++)
+		fake->param[n] = -1;
+	fake->param[I915_PARAM_NUM_FENCES_AVAIL] = 16;
+	fake->param[11] = 1; /* HAS_BLT */
+	fake->param[12] = 1; /* HAS_RELAXED_FENCING */
+	fake->param[15] = 1; /* HAS_RELAXED_DELTA */
+	fake->param[17] = 1; /* HAS_LLC */
+	fake->param[20] = 0; /* HAS_SEMAPHORES */
+	fake->param[23] = 0; /* HAS_SECURE_BATCHES */
+	fake->param[24] = 0; /* HAS_PINNED_BATCHES */
+	fake->param[25] = 1; /* HAS_NO_RELOC */
+	fake->param[26] = 1; /* HAS_HANDLE_LUT */
+
+	fake->aperture = 256 * 1024 * 1024;
+	fake->swizzle = I915_BIT_6_SWIZZLE_NONE;
+
+	fake_device = fake;
+	return fake;
+}
+
+void kgem_fake_destroy(struct kgem_fake *fake)
+{
+	uint32_t handle;
+
+	if (fake == NULL)
+		return;
+
+	for (handle = 1; handle < fake->num_bo; handle++) {
+		struct fake_bo *bo = fake->bo[handle];
+		if (bo == NULL)
+			continue;
+
+		if (bo->mem)
+			munmap(bo->mem, bo->size);
+		free(bo);
+	}
+	free(fake->bo);
+	free(fake->rq);
+
+	close(fake->fd);
+	pthread_cond_destroy(&fake->advance);
+	pthread_mutex_destroy(&fake->mutex);
+
+	if (fake_device == fake)
+		fake_device = NULL;
+	free(fake);
+}
+
+int kgem_fake_fd(struct kgem_fake *fake)
+{
+	return fake->fd;
+}
+
+void kgem_fake_set_param(struct kgem_fake *fake, int param, int value)
+{
+	assert(param >= 0 && param < FAKE_NUM_PARAMS);
+	fake->param[param] = value;
+}
+
+void kgem_fake_set_aperture(struct kgem_fake *fake, uint64_t size)
+{
+	fake->aperture = size;
+}
+
+void kgem_fake_set_swizzle(struct kgem_fake *fake, int swizzle)
+{
+	fake->swizzle = swizzle;
+}
+
+void kgem_fake_set_latency(struct kgem_fake *fake, int ring, uint64_t ns)
+{
+	if (ring < 0) {
+		for (ring = 0; ring < FAKE_NUM_RINGS; ring++)
+			fake->latency[ring] = ns;
+	} else {
+		assert(ring < FAKE_NUM_RINGS);
+		fake->latency[ring] = ns;
+	}
+}
+
+void kgem_fake_set_latency_func(struct kgem_fake *fake,
+				uint64_t (*func)(void *closure, int ring,
+						 const struct drm_i915_gem_execbuffer2 *eb),
+				void *closure)
+{
+	fake->latency_func = func;
+	fake->latency_closure = closure;
+}
+
+uint64_t kgem_fake_now(struct kgem_fake *fake)
+{
+	uint64_t now;
+
+	pthread_mutex_lock(&fake->mutex);
+	now = fake->now;
+	pthread_mutex_unlock(&fake->mutex);
+
+	return now;
+}
+
+void kgem_fake_advance(struct kgem_fake *fake, uint64_t ns)
+{
+	pthread_mutex_lock(&fake->mutex);
+	fake->now += ns;
+	fake_retire(fake);
+	pthread_cond_broadcast(&fake->advance);
+	pthread_mutex_unlock(&fake->mutex);
+}
+
+void kgem_fake_idle(struct kgem_fake *fake)
+{
+	int ring;
+
+	pthread_mutex_lock(&fake->mutex);
+	for (ring = 0; ring < FAKE_NUM_RINGS; ring++) {
+		if (fake->ring_tail[ring] > fake->now)
+			fake->now = fake->ring_tail[ring];
+	}
+	fake_retire(fake);
+	pthread_cond_broadcast(&fake->advance);
+	pthread_mutex_unlock(&fake->mutex);
+}
+
+void kgem_fake_get_stats(struct kgem_fake *fake, struct kgem_fake_stats *stats)
+{
+	pthread_mutex_lock(&fake->mutex);
+	*stats = fake->stats;
+	pthread_mutex_unlock(&fake->mutex);
+}
+
+void kgem_fake_reset_stats(struct kgem_fake *fake)
+{
+	pthread_mutex_lock(&fake->mutex);
+	fake->stats.ioctls = 0;
+	fake->stats.create = fake->stats.close = 0;
+	fake->stats.mmap_cpu = fake->stats.mmap_gtt = 0;
+	fake->stats.set_tiling = 0;
+	fake->stats.set_domain = 0;
+	fake->stats.wait = 0;
+	fake->stats.madvise = 0;
+	fake->stats.pwrite = fake->stats.pread = 0;
+	fake->stats.pwrite_bytes = fake->stats.pread_bytes = 0;
+	fake->stats.busy = fake->stats.busy_true = 0;
+	fake->stats.execbuffer = 0;
+	fake->stats.exec_objects = 0;
+	fake->stats.relocs = fake->stats.relocs_skipped = 0;
+	fake->stats.throttle = 0;
+	fake->stats.stalls = 0;
+	fake->stats.stall_ns = 0;
+	/* live_objects and live_bytes describe the device, not the interval */
+	pthread_mutex_unlock(&fake->mutex);
+}
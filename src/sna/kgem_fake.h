@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef KGEM_FAKE_H
+#define KGEM_FAKE_H
+
+#include <stdint.h>
+
+/* An in-process emulation of the i915 GEM interface, sufficient to drive
+ * kgem without a GPU. Time on the fake device is virtual: requests complete
+ * once the device clock has passed their retirement time, and the clock only
+ * moves forward when the caller advances it or when an ioctl has to wait
+ * (set-domain, throttle) for an outstanding request. This keeps the cache,
+ * retire and throttle paths deterministic for benchmarking and testing.
+ *
+ * Install with kgem_set_device_ops(&kgem_fake_ops) and pass
+ * kgem_fake_fd() to kgem_init(). Only a single fake device may be live.
+ */
+
+struct kgem_device_ops;
+struct drm_i915_gem_execbuffer2;
+
+extern const struct kgem_device_ops kgem_fake_ops;
+
+struct kgem_fake_stats {
+	unsigned long ioctls;
+	unsigned long create, close;
+	unsigned long mmap_cpu, mmap_gtt;
+	unsigned long set_tiling, set_domain, madvise;
+	unsigned long wait;
+	unsigned long pwrite, pread;
+	uint64_t pwrite_bytes, pread_bytes;
+	unsigned long busy, busy_true;
+	unsigned long execbuffer;
+	unsigned long exec_objects;
+	unsigned long relocs, relocs_skipped;
+	unsigned long throttle;
+	unsigned long stalls;
+	uint64_t stall_ns;
+	unsigned long live_objects;
+	uint64_t live_bytes;
+};
+
+struct kgem_fake;
+
+struct kgem_fake *kgem_fake_create(void);
+void kgem_fake_destroy(struct kgem_fake *fake);
+int kgem_fake_fd(struct kgem_fake *fake);
+
+/* Override the value reported through GETPARAM, e.g. HAS_LLC or NO_RELOC.
+ * A value of -1 makes the parameter unknown to the device.
+ */
+void kgem_fake_set_param(struct kgem_fake *fake, int param, int value);
+void kgem_fake_set_aperture(struct kgem_fake *fake, uint64_t size);
+void kgem_fake_set_swizzle(struct kgem_fake *fake, int swizzle);
+
+/* Requests on each ring execute in order, each one taking latency ns of
+ * device time after the previous one on that ring has completed. If a
+ * latency callback is set, it is consulted for every execbuffer instead.
+ */
+void kgem_fake_set_latency(struct kgem_fake *fake, int ring, uint64_t ns);
+void kgem_fake_set_latency_func(struct kgem_fake *fake,
+				uint64_t (*func)(void *closure, int ring,
+						 const struct drm_i915_gem_execbuffer2 *eb),
+				void *closure);
+
+uint64_t kgem_fake_now(struct kgem_fake *fake);
+void kgem_fake_advance(struct kgem_fake *fake, uint64_t ns);
+void kgem_fake_idle(struct kgem_fake *fake);
+
+void kgem_fake_get_stats(struct kgem_fake *fake, struct kgem_fake_stats *stats);
+void kgem_fake_reset_stats(struct kgem_fake *fake);
+
+#endif /* KGEM_FAKE_H */
@@ -0,0 +1,1177 @@
+/*
+ * Copyright (c) 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Exercise the buffer cache, retirement and throttling of kgem against the
+ * fake GEM device, and report allocation rate, cache hit rate and submission
+ * overhead. Returns non-zero if any of the regression checks fail.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+#include "sna_reg.h"
+#include "kgem_fake.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MS (1000*1000ULL)
+
+static int failures;
+
+#define check(expr) do { \
+	if (!(expr)) { \
+		printf("%s:%d: check failed: %s\n", __FUNCTION__, __LINE__, #expr); \
+		failures++; \
+	} \
+} while (0)
+
+/* Just enough of the server for kgem.c and blt.c */
+void ErrorF(const char *f, ...)
+{
+	va_list ap;
+
+	va_start(ap, f);
+	vfprintf(stderr, f, ap);
+	va_end(ap);
+}
+
+void FatalError(const char *f, ...)
+{
+	va_list ap;
+
+	va_start(ap, f);
+	vfprintf(stderr, f, ap);
+	va_end(ap);
+	abort();
+}
+
+void xf86DrvMsg(int scrnIndex, MessageType type, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
+void sna_render_flush_solid(struct sna *sna)
+{
+	sna->render.solid_cache.dirty = 0;
+}
+
+static void test_render_reset(struct sna *sna) { }
+static void test_render_flush(struct sna *sna) { }
+
+static void test_context_switch(struct kgem *kgem, int new_mode)
+{
+	if (kgem->nbatch)
+		_kgem_submit(kgem);
+	kgem->ring = new_mode;
+}
+
+static void test_retire(struct kgem *kgem) { }
+static void test_expire(struct kgem *kgem) { }
+
+struct test {
+	struct sna *sna;
+	struct kgem *kgem;
+	struct kgem_fake *fake;
+	ScrnInfoRec scrn;
+	struct pci_device pci;
+};
+
+static void test_fini(struct test *t)
+{
+	kgem_stop_retire_thread(t->kgem);
+	kgem_fake_idle(t->fake);
+	kgem_retire(t->kgem);
+	kgem_cleanup_cache(t->kgem);
+	free(t->sna);
+
+	kgem_fake_destroy(t->fake);
+	kgem_set_device_ops(NULL);
+}
+
+/* Failing to set up the fake device is itself a failure, rather than a
+ * reason to silently skip the test.
+ */
+static bool test_init(struct test *t, unsigned gen)
+{
+	memset(t, 0, sizeof(*t));
+
+	t->fake = kgem_fake_create();
+	if (t->fake == NULL)
+		goto fail;
+
+	t->sna = calloc(1, sizeof(*t->sna));
+	if (t->sna == NULL) {
+		kgem_fake_destroy(t->fake);
+		goto fail;
+	}
+
+	t->sna->scrn = &t->scrn;
+	t->sna->render.reset = test_render_reset;
+	t->sna->render.flush = test_render_flush;
+
+	kgem_set_device_ops(&kgem_fake_ops);
+
+	t->kgem = &t->sna->kgem;
+	kgem_init(t->kgem, kgem_fake_fd(t->fake), &t->pci, gen);
+	t->kgem->context_switch = test_context_switch;
+	t->kgem->retire = test_retire;
+	t->kgem->expire = test_expire;
+	kgem_reset(t->kgem);
+
+	if (t->kgem->wedged) {
+		test_fini(t);
+		goto fail;
+	}
+
+	return true;
+
+fail:
+	printf("%s: failed to initialise the fake device for gen %03o\n",
+	       __FUNCTION__, gen);
+	failures++;
+	return false;
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 +
+		(now.tv_nsec - start->tv_nsec);
+}
+
+/* Emit a batch that references each of the bo, then submit it */
+static void emit_batch(struct kgem *kgem, struct kgem_bo **bo, int count)
+{
+	int n;
+
+	kgem_set_mode(kgem, KGEM_BLT, bo[0]);
+	for (n = 0; n < count; n++) {
+		if (!kgem_check_batch(kgem, 1) ||
+		    !kgem_check_reloc_and_exec(kgem, 1) ||
+		    !kgem_check_bo(kgem, bo[n], NULL)) {
+			_kgem_submit(kgem);
+			_kgem_set_mode(kgem, KGEM_BLT);
+		}
+
+		kgem->batch[kgem->nbatch] =
+			kgem_add_reloc(kgem, kgem->nbatch, bo[n],
+				       I915_GEM_DOMAIN_RENDER << 16 |
+				       I915_GEM_DOMAIN_RENDER,
+				       0);
+		kgem->nbatch++;
+	}
+	_kgem_submit(kgem);
+}
+
+static void test_cache_reuse(void)
+{
+	struct kgem_fake_stats stats;
+	struct kgem_bo *bo, *tmp;
+	struct test t;
+	uint32_t handle;
+
+	if (!test_init(&t, 070))
+		return;
+
+	bo = kgem_create_linear(t.kgem, 64*1024, 0);
+	check(bo != NULL);
+	handle = bo->handle;
+	kgem_bo_destroy(t.kgem, bo);
+
+	kgem_fake_reset_stats(t.fake);
+	bo = kgem_create_linear(t.kgem, 64*1024, 0);
+	check(bo != NULL && bo->handle == handle);
+
+	/* An unmapped request must skip over a more recent mapped bo */
+	tmp = kgem_create_linear(t.kgem, 64*1024, 0);
+	check(tmp != NULL && kgem_bo_map__cpu(t.kgem, tmp) != NULL);
+	kgem_bo_destroy(t.kgem, bo);
+	kgem_bo_destroy(t.kgem, tmp);
+
+	bo = kgem_create_linear(t.kgem, 64*1024, 0);
+	check(bo != NULL && bo->handle == handle && bo->map == NULL);
+	kgem_bo_destroy(t.kgem, bo);
+
+	bo = kgem_create_2d(t.kgem, 512, 512, 32, I915_TILING_X, 0);
+	check(bo != NULL);
+	handle = bo->handle;
+	kgem_bo_destroy(t.kgem, bo);
+
+	bo = kgem_create_2d(t.kgem, 512, 512, 32, I915_TILING_X, 0);
+	check(bo != NULL && bo->handle == handle);
+	kgem_bo_destroy(t.kgem, bo);
+
+	/* Only the mapped and the first tiled bo should have required
+	 * a new object.
+	 */
+	kgem_fake_get_stats(t.fake, &stats);
+	check(stats.create == 2);
+
+	test_fini(&t);
+}
+
+static void test_retire_latency(void)
+{
+	struct kgem_bo *bo;
+	struct test t;
+
+	if (!test_init(&t, 070))
+		return;
+
+	kgem_fake_set_latency(t.fake, -1, 1*MS);
+
+	bo = kgem_create_linear(t.kgem, 4096, 0);
+	emit_batch(t.kgem, &bo, 1);
+
+	check(bo->rq != NULL);
+	check(kgem_bo_is_busy(bo));
+	kgem_retire(t.kgem);
+	check(bo->rq != NULL);
+
+	kgem_fake_advance(t.fake, 1*MS);
+	kgem_retire(t.kgem);
+	check(bo->rq == NULL);
+	check(!kgem_bo_is_busy(bo));
+
+	/* A destroyed but busy bo must not be reused until it is retired */
+	emit_batch(t.kgem, &bo, 1);
+	kgem_bo_destroy(t.kgem, bo);
+	bo = kgem_create_linear(t.kgem, 4096, CREATE_INACTIVE | CREATE_NO_RETIRE);
+	check(bo == NULL || !__kgem_busy(t.kgem, bo->handle));
+	if (bo)
+		kgem_bo_destroy(t.kgem, bo);
+
+	test_fini(&t);
+}
+
+static void test_retire_thread(void)
+{
+	struct kgem_fake_stats stats;
+	struct kgem_bo *bo;
+	struct test t;
+	int n;
+
+	if (!test_init(&t, 070))
+		return;
+
+	check(kgem_start_retire_thread(t.kgem));
+	kgem_fake_set_latency(t.fake, -1, 1*MS);
+
+	bo = kgem_create_linear(t.kgem, 4096, 0);
+	emit_batch(t.kgem, &bo, 1);
+	check(bo->rq != NULL);
+
+	/* Outstanding requests are left for the thread, not polled */
+	kgem_fake_reset_stats(t.fake);
+	for (n = 0; n < 10; n++)
+		kgem_retire(t.kgem);
+	check(bo->rq != NULL);
+	kgem_fake_get_stats(t.fake, &stats);
+	check(stats.busy == 0);
+
+	kgem_fake_advance(t.fake, 1*MS);
+	for (n = 0; n < 1000 && bo->rq; n++) {
+		usleep(1000);
+		kgem_retire(t.kgem);
+	}
+	check(bo->rq == NULL);
+
+	kgem_bo_destroy(t.kgem, bo);
+	test_fini(&t);
+}
+
+static void test_batch_ring(void)
+{
+	struct kgem_fake_stats stats;
+	struct kgem_bo *bo;
+	struct test t;
+	int n;
+
+	if (!test_init(&t, 070))
+		return;
+
+	check(t.kgem->has_batch_ring);
+	check(t.kgem->batch_bo != NULL);
+
+	kgem_fake_set_latency(t.fake, -1, 10*MS);
+	bo = kgem_create_linear(t.kgem, 4096, 0);
+
+	/* Whilst the ring has idle batches, commands are written in place */
+	kgem_fake_reset_stats(t.fake);
+	for (n = 0; n < ARRAY_SIZE(t.kgem->batch_ring); n++)
+		emit_batch(t.kgem, &bo, 1);
+	kgem_fake_get_stats(t.fake, &stats);
+	check(stats.pwrite == 0);
+
+	/* and once they are all busy, we fall back to uploading */
+	check(t.kgem->batch_bo == NULL);
+	emit_batch(t.kgem, &bo, 1);
+	kgem_fake_get_stats(t.fake, &stats);
+	check(stats.pwrite == 1);
+
+	/* Retiring the oldest returns us to the ring before the next batch */
+	kgem_fake_idle(t.fake);
+	kgem_retire(t.kgem);
+	check(t.kgem->batch_bo != NULL);
+	emit_batch(t.kgem, &bo, 1);
+	kgem_fake_get_stats(t.fake, &stats);
+	check(stats.pwrite == 1);
+
+	kgem_bo_destroy(t.kgem, bo);
+	test_fini(&t);
+}
+
+static void test_upload_ring(void)
+{
+	struct kgem_fake_stats stats;
+	struct kgem_bo *bo[3];
+	struct test t;
+	void *ptr;
+	int n;
+
+	if (!test_init(&t, 070))
+		return;
+
+	kgem_fake_set_latency(t.fake, -1, 10*MS);
+
+	/* The staging bo are handed out in turn */
+	for (n = 0; n < 3; n++) {
+		bo[n] = kgem_get_upload_bo(t.kgem, 1 << 20, &ptr);
+		check(bo[n] != NULL && ptr != NULL);
+		if (bo[n] == NULL)
+			goto out;
+
+		emit_batch(t.kgem, &bo[n], 1);
+		kgem_bo_destroy(t.kgem, bo[n]);
+	}
+	check(bo[0] != bo[1]);
+	check(bo[2] == bo[0]);
+
+	/* Reusing a slot waits only for the upload that last read from it */
+	kgem_fake_get_stats(t.fake, &stats);
+	check(stats.stalls >= 1);
+	check(kgem_bo_is_busy(bo[1]));
+
+	/* and a larger upload replaces the slot */
+	kgem_fake_idle(t.fake);
+	kgem_retire(t.kgem);
+	bo[0] = kgem_get_upload_bo(t.kgem, 4 << 20, &ptr);
+	check(bo[0] != NULL && kgem_bo_size(bo[0]) >= 4 << 20);
+	if (bo[0])
+		kgem_bo_destroy(t.kgem, bo[0]);
+
+	/* The ring is kept across expiry whilst uploads continue ... */
+	kgem_expire_cache(t.kgem);
+	bo[0] = kgem_get_upload_bo(t.kgem, 1 << 20, &ptr);
+	if (bo[0])
+		kgem_bo_destroy(t.kgem, bo[0]);
+	kgem_expire_cache(t.kgem);
+	check(t.kgem->upload_ring[0] != NULL && t.kgem->upload_ring[1] != NULL);
+
+	/* ... and only released once it has been left unused */
+	t.kgem->upload_ring_idle -= MAX_INACTIVE_TIME;
+	kgem_expire_cache(t.kgem);
+	check(t.kgem->upload_ring[0] == NULL && t.kgem->upload_ring[1] == NULL);
+
+out:
+	test_fini(&t);
+}
+
+static void test_no_reloc(void)
+{
+	struct kgem_fake_stats stats;
+	struct kgem_bo *bo[4];
+	struct test t;
+	int n;
+
+	if (!test_init(&t, 070))
+		return;
+
+	for (n = 0; n < ARRAY_SIZE(bo); n++)
+		bo[n] = kgem_create_2d(t.kgem, 256, 256, 32, I915_TILING_X, 0);
+
+	/* Once every object has been bound, the offsets we write into the
+	 * batch are correct and the kernel has nothing left to relocate.
+	 */
+	for (n = 0; n < 8; n++)
+		emit_batch(t.kgem, bo, ARRAY_SIZE(bo));
+
+	kgem_fake_reset_stats(t.fake);
+	memset(&t.kgem->stats, 0, sizeof(t.kgem->stats));
+	for (n = 0; n < 8; n++)
+		emit_batch(t.kgem, bo, ARRAY_SIZE(bo));
+	kgem_fake_get_stats(t.fake, &stats);
+	check(stats.relocs == 0);
+	check(stats.relocs_skipped == 8*ARRAY_SIZE(bo));
+	check(t.kgem->stats.batches[KGEM_BLT] == 8);
+	check(t.kgem->stats.no_reloc == 8);
+
+	/* Without NO_RELOC the kernel must always process the relocations */
+	t.kgem->has_no_reloc = false;
+	memset(&t.kgem->stats, 0, sizeof(t.kgem->stats));
+	emit_batch(t.kgem, bo, ARRAY_SIZE(bo));
+	check(t.kgem->stats.batches[KGEM_BLT] == 1);
+	check(t.kgem->stats.no_reloc == 0);
+
+	for (n = 0; n < ARRAY_SIZE(bo); n++)
+		kgem_bo_destroy(t.kgem, bo[n]);
+	test_fini(&t);
+}
+
+static void test_stats(void)
+{
+	struct kgem_stats *stats;
+	struct kgem_bo *bo[2];
+	struct test t;
+	int n;
+
+	if (!test_init(&t, 070))
+		return;
+
+	stats = &t.kgem->stats;
+	memset(stats, 0, sizeof(*stats));
+
+	/* Each batch accounts for its relocations and objects */
+	bo[0] = kgem_create_linear(t.kgem, 4096, 0);
+	bo[1] = kgem_create_linear(t.kgem, 4096, 0);
+	emit_batch(t.kgem, bo, 2);
+	check(stats->batches[KGEM_BLT] == 1);
+	check(stats->batches[KGEM_RENDER] == 0);
+	check(stats->relocs == 2);
+	check(stats->exec_objects == 3);
+	check(stats->batch_bytes >= 2*sizeof(uint32_t));
+
+	/* A freed bo is found again in the cache */
+	n = stats->cache_hit;
+	kgem_bo_destroy(t.kgem, bo[1]);
+	bo[1] = kgem_create_linear(t.kgem, 4096, CREATE_INACTIVE);
+	check(stats->cache_hit == n + 1);
+
+	/* Running out of exec slots forces an early flush */
+	kgem_set_mode(t.kgem, KGEM_BLT, bo[0]);
+	t.kgem->batch[t.kgem->nbatch++] = 0;
+	t.kgem->nexec = KGEM_EXEC_SIZE(t.kgem);
+	check(!kgem_check_bo(t.kgem, bo[0], NULL));
+	check(stats->check_flush == 1);
+	t.kgem->nexec = 0;
+	kgem_reset(t.kgem);
+
+	kgem_throttle(t.kgem);
+	check(stats->throttles == 1);
+
+	kgem_dump_stats(t.kgem);
+
+	kgem_bo_destroy(t.kgem, bo[0]);
+	kgem_bo_destroy(t.kgem, bo[1]);
+	test_fini(&t);
+}
+
+static void test_vma_cache(void)
+{
+	struct kgem_bo *hot[8], *cold, *bo;
+	struct test t;
+	unsigned long miss;
+	int n;
+
+	if (!test_init(&t, 070))
+		return;
+
+	/* Leave behind a frequently remapped bucket and a cold one */
+	for (n = 0; n < ARRAY_SIZE(hot); n++) {
+		hot[n] = kgem_create_linear(t.kgem, 16*1024, 0);
+		check(kgem_bo_map__cpu(t.kgem, hot[n]) != NULL);
+	}
+	cold = kgem_create_linear(t.kgem, 256*1024, 0);
+	check(kgem_bo_map__cpu(t.kgem, cold) != NULL);
+
+	for (n = 0; n < ARRAY_SIZE(hot); n++)
+		kgem_bo_destroy(t.kgem, hot[n]);
+	kgem_bo_destroy(t.kgem, cold);
+	check(t.kgem->vma[MAP_CPU].bytes == ARRAY_SIZE(hot)*16*1024 + 256*1024);
+
+	/* Going over budget must evict the cold mapping, not the hot ones */
+	t.kgem->vma_budget = 300*1024;
+	miss = t.kgem->stats.vma_miss[MAP_CPU];
+	bo = kgem_create_linear(t.kgem, 64*1024, CREATE_INACTIVE);
+	check(kgem_bo_map__cpu(t.kgem, bo) != NULL);
+	check(t.kgem->stats.vma_miss[MAP_CPU] == miss + 1);
+	check(t.kgem->vma[MAP_CPU].bytes == ARRAY_SIZE(hot)*16*1024);
+
+	/* and reusing a mapping is a hit */
+	n = t.kgem->stats.vma_hit[MAP_CPU];
+	check(kgem_bo_map__cpu(t.kgem, bo) != NULL);
+	check(t.kgem->stats.vma_hit[MAP_CPU] == n + 1);
+	kgem_bo_destroy(t.kgem, bo);
+
+	/* A GTT mapping must make room by evicting the cached CPU maps */
+	check(t.kgem->vma[MAP_GTT].bytes == 0);
+	t.kgem->vma_budget = t.kgem->vma[MAP_CPU].bytes - 1;
+	bo = kgem_create_linear(t.kgem, 128*1024, 0);
+	check(bo != NULL);
+	if (bo) {
+		check(kgem_bo_map__gtt(t.kgem, bo) != NULL);
+		check(t.kgem->vma[MAP_CPU].bytes == ARRAY_SIZE(hot)*16*1024);
+		kgem_bo_destroy(t.kgem, bo);
+	}
+
+	test_fini(&t);
+}
+
+/* Byte offset of (x, y) in a Y-tiled surface, straight from the layout */
+static uint32_t tiled_y_reference(int x, int y, int pitch, int swizzling)
+{
+	uint32_t offset;
+
+	offset = (y / 32 * (pitch / 128) + x / 128) * 4096;
+	offset += (x % 128) / 16 * 512 + (y % 32) * 16 + x % 16;
+	switch (swizzling) {
+	case I915_BIT_6_SWIZZLE_9:
+		offset ^= ((offset >> 9) & 1) << 6;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10:
+		offset ^= (((offset >> 9) ^ (offset >> 10)) & 1) << 6;
+		break;
+	case I915_BIT_6_SWIZZLE_9_11:
+		offset ^= (((offset >> 9) ^ (offset >> 11)) & 1) << 6;
+		break;
+	}
+
+	return offset;
+}
+
+static void test_detile(void)
+{
+	static const int swizzles[] = {
+		I915_BIT_6_SWIZZLE_NONE,
+		I915_BIT_6_SWIZZLE_9,
+		I915_BIT_6_SWIZZLE_9_10,
+		I915_BIT_6_SWIZZLE_9_11,
+	};
+	static const struct {
+		void (*tile)(const void *src, void *dst, int bpp, int swizzling,
+			     int32_t src_stride, int32_t dst_stride,
+			     int16_t src_x, int16_t src_y,
+			     int16_t dst_x, int16_t dst_y,
+			     uint16_t width, uint16_t height);
+		void (*detile)(const void *src, void *dst, int bpp, int swizzling,
+			       int32_t src_stride, int32_t dst_stride,
+			       int16_t src_x, int16_t src_y,
+			       int16_t dst_x, int16_t dst_y,
+			       uint16_t width, uint16_t height);
+	} tilings[] = {
+		{ memcpy_to_tiled_x, memcpy_from_tiled_x },
+		{ memcpy_to_tiled_y, memcpy_from_tiled_y },
+	};
+	const int pitch = 4096, height = 64;
+	uint8_t *tiled, *linear, *out;
+	int tiling, s, bpp, n, i;
+
+	tiled = malloc(pitch * height);
+	linear = malloc(pitch * height);
+	out = malloc(pitch * height);
+
+	/* Reading back what we tiled must return the same pixels */
+	srandom(0);
+	for (tiling = 0; tiling < ARRAY_SIZE(tilings); tiling++) {
+		for (s = 0; s < ARRAY_SIZE(swizzles); s++) {
+			for (bpp = 8; bpp <= 32; bpp <<= 1) {
+				int width = pitch / (bpp / 8);
+
+				for (n = 0; n < 64; n++) {
+					int x = random() % width, y = random() % height;
+					int w = 1 + random() % (width - x);
+					int h = 1 + random() % (height - y);
+
+					for (i = 0; i < pitch * height; i++)
+						linear[i] = random();
+					memset(tiled, 0, pitch * height);
+					memset(out, 0, pitch * height);
+
+					tilings[tiling].tile(linear, tiled, bpp, swizzles[s],
+							     pitch, pitch,
+							     x, y, x, y, w, h);
+					tilings[tiling].detile(tiled, out, bpp, swizzles[s],
+							       pitch, pitch,
+							       x, y, x, y, w, h);
+
+					for (i = y; i < y + h; i++)
+						check(memcmp(out + i * pitch + x * bpp / 8,
+							     linear + i * pitch + x * bpp / 8,
+							     w * bpp / 8) == 0);
+
+					/* and a round trip alone cannot catch a misplaced OWord */
+					if (tilings[tiling].tile == memcpy_to_tiled_y) {
+						int j, bad = 0;
+
+						for (i = y; i < y + h; i++)
+							for (j = x * bpp / 8; j < (x + w) * bpp / 8; j++)
+								bad += tiled[tiled_y_reference(j, i, pitch, swizzles[s])] != linear[i * pitch + j];
+						check(bad == 0);
+					}
+				}
+			}
+		}
+	}
+
+	free(tiled);
+	free(linear);
+	free(out);
+}
+
+static void test_blt_kernels(void)
+{
+	static const unsigned levels[] = {
+		CPU_SSE2 | CPU_SSE4_1,
+		CPU_SSE2 | CPU_SSE4_1 | CPU_AVX2,
+	};
+	/* Larger than NT_THRESHOLD, so that the streaming stores are used */
+	const int pitch = 4096, height = 192, size = pitch * height;
+	unsigned features = sna_cpu_detect();
+	uint8_t *src, *ref, *out;
+	int l, n, i;
+
+	src = malloc(size);
+	ref = malloc(size);
+	out = malloc(size);
+
+	/* Every variant must produce exactly what the portable code does */
+	srandom(0);
+	for (i = 0; i < size; i++)
+		src[i] = random();
+	for (l = 0; l < ARRAY_SIZE(levels); l++) {
+		if ((features & levels[l]) != levels[l])
+			continue;
+
+		for (n = 0; n < 256; n++) {
+			int bpp = 8 << (random() % 3);
+			int width = pitch / (bpp / 8);
+			int w = 1 + random() % (n & 1 ? width : 64);
+			int h = 1 + random() % height;
+			int sx = random() % (width - w + 1), sy = random() % (height - h + 1);
+			int dx = random() % (width - w + 1), dy = random() % (height - h + 1);
+			uint32_t and = n & 2 ? 0xffffffff : random();
+			uint32_t or = random() & (bpp == 32 ? 0xffffffff : (1 << bpp) - 1);
+			int swizzle = random() % 4;
+			int op = random() % 6;
+
+			memset(ref, 0, size);
+			memset(out, 0, size);
+			for (i = 0; i < 2; i++) {
+				uint8_t *dst = i ? out : ref;
+
+				sna_blt_init(i ? levels[l] : 0);
+				switch (op) {
+				case 0:
+					memcpy_blt(src, dst, bpp, pitch, pitch,
+						   sx, sy, dx, dy, w, h);
+					break;
+				case 1:
+					memcpy_xor(src, dst, bpp, pitch, pitch,
+						   sx, sy, dx, dy, w, h,
+						   and, or);
+					break;
+				case 2:
+					memcpy_to_tiled_x(src, dst, bpp, swizzle,
+							  pitch, pitch,
+							  sx, sy, dx, dy, w, h);
+					break;
+				case 3:
+					memcpy_from_tiled_x(src, dst, bpp, swizzle,
+							    pitch, pitch,
+							    sx, sy, dx, dy, w, h);
+					break;
+				case 4:
+					memcpy_to_tiled_y(src, dst, bpp, swizzle,
+							  pitch, pitch,
+							  sx, sy, dx, dy, w, h);
+					break;
+				case 5:
+					memcpy_from_tiled_y(src, dst, bpp, swizzle,
+							    pitch, pitch,
+							    sx, sy, dx, dy, w, h);
+					break;
+				}
+			}
+			check(memcmp(ref, out, size) == 0);
+		}
+
+		/* Whole and partial rows copied with streaming stores */
+		for (n = 0; n < 2; n++) {
+			int w = n ? 3 * pitch / 4 : pitch;
+
+			for (i = 0; i < 2; i++) {
+				uint8_t *dst = i ? out : ref;
+
+				memset(dst, 0, size);
+				sna_blt_init(i ? levels[l] : 0);
+				memcpy_blt(src, dst, 8, pitch, pitch,
+					   0, 0, n, 0, w, height);
+			}
+			check(memcmp(ref, out, size) == 0);
+		}
+
+		/* Overlapping moves within a buffer, in both directions */
+		for (n = 0; n < 256; n++) {
+			int bpp = 8 << (random() % 3);
+			int width = pitch / (bpp / 8);
+			int w = 1 + random() % (n & 1 ? width - 16 : 64);
+			int h = 1 + random() % (height - 16);
+			int dx = random() % 9 * (n & 2 ? -1 : 1);
+			int dy = random() % 9 * (n & 4 ? -1 : 1);
+			BoxRec box;
+
+			box.x1 = MAX(-dx, 0) + random() % (width - w - abs(dx) + 1);
+			box.y1 = MAX(-dy, 0) + random() % (height - h - abs(dy) + 1);
+			box.x2 = box.x1 + w;
+			box.y2 = box.y1 + h;
+
+			for (i = 0; i < 2; i++) {
+				uint8_t *dst = i ? out : ref;
+
+				memcpy(dst, src, size);
+				sna_blt_init(i ? levels[l] : 0);
+				memmove_box(dst + dy * pitch + dx * (bpp / 8), dst,
+					    bpp, pitch, &box, dx, dy);
+			}
+			check(memcmp(ref, out, size) == 0);
+		}
+	}
+	sna_blt_init(features);
+
+	free(src);
+	free(ref);
+	free(out);
+}
+
+static void test_throttle(void)
+{
+	struct kgem_fake_stats stats;
+	struct kgem_bo *bo;
+	struct test t;
+	int n;
+
+	if (!test_init(&t, 070))
+		return;
+
+	kgem_fake_set_latency(t.fake, -1, 10*MS);
+
+	bo = kgem_create_linear(t.kgem, 4096, 0);
+	for (n = 0; n < 8; n++) {
+		emit_batch(t.kgem, &bo, 1);
+		kgem_fake_advance(t.fake, 5*MS);
+	}
+
+	kgem_fake_reset_stats(t.fake);
+	kgem_throttle(t.kgem);
+	kgem_fake_get_stats(t.fake, &stats);
+	check(stats.throttle == 1);
+	check(stats.stalls == 1);
+
+	kgem_bo_destroy(t.kgem, bo);
+	test_fini(&t);
+}
+
+static void bench_alloc(void)
+{
+	static const int sizes[] = { 4096, 16384, 65536, 262144, 1048576 };
+	struct kgem_fake_stats stats;
+	struct timespec start;
+	struct kgem_bo *bo[64];
+	struct test t;
+	int loops = 20000, n, i;
+	double ns;
+
+	if (!test_init(&t, 070))
+		return;
+
+	srandom(0);
+	memset(bo, 0, sizeof(bo));
+
+	kgem_fake_reset_stats(t.fake);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < loops; n++) {
+		i = random() % ARRAY_SIZE(bo);
+		if (bo[i])
+			kgem_bo_destroy(t.kgem, bo[i]);
+		bo[i] = kgem_create_linear(t.kgem,
+					   sizes[random() % ARRAY_SIZE(sizes)],
+					   0);
+	}
+	ns = elapsed(&start);
+	kgem_fake_get_stats(t.fake, &stats);
+
+	printf("alloc: %.1f ns/op, %lu creates for %d allocations, cache hit rate %.1f%%\n",
+	       ns / loops, stats.create, loops,
+	       100. * (loops - stats.create) / loops);
+
+	for (i = 0; i < ARRAY_SIZE(bo); i++)
+		if (bo[i])
+			kgem_bo_destroy(t.kgem, bo[i]);
+	test_fini(&t);
+}
+
+/* Churn through the bo bookkeeping alone: proxies never touch the device */
+static void bench_create_destroy(void)
+{
+	struct kgem_slab_stats slab[8];
+	struct timespec start;
+	struct kgem_bo *target, *bo[256];
+	struct test t;
+	int loops = 200, n, i;
+	double ns;
+
+	if (!test_init(&t, 070))
+		return;
+
+	target = kgem_create_linear(t.kgem, 1024*1024, 0);
+	check(target != NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < loops; n++) {
+		for (i = 0; i < ARRAY_SIZE(bo); i++)
+			bo[i] = kgem_create_proxy(t.kgem, target, 4096*i, 4096);
+		for (i = 0; i < ARRAY_SIZE(bo); i++)
+			kgem_bo_destroy(t.kgem, bo[i]);
+	}
+	ns = elapsed(&start);
+
+	printf("create/destroy: %.1f ns/op\n", ns / (loops * ARRAY_SIZE(bo)));
+
+	kgem_bo_destroy(t.kgem, target);
+	test_fini(&t);
+
+	n = kgem_get_slab_stats(slab, ARRAY_SIZE(slab));
+	for (i = 0; i < n; i++)
+		printf("  slab %s[%u]: %lu allocs, %lu frees, %lu in use (peak %lu), %lu slabs, %lu reaped\n",
+		       slab[i].name, slab[i].size,
+		       slab[i].allocs, slab[i].frees,
+		       slab[i].inuse, slab[i].peak,
+		       slab[i].slabs, slab[i].reaped);
+}
+
+/* Allocate from an inactive cache populated with count bo of assorted
+ * sizes within the same bucket; the cost should not depend upon count.
+ */
+static void bench_cache_search(int count)
+{
+	struct kgem_fake_stats stats;
+	struct timespec start;
+	struct kgem_bo **bo, *tmp;
+	struct test t;
+	int loops = 20000, n;
+	double ns;
+
+	if (!test_init(&t, 070))
+		return;
+
+	bo = malloc(count * sizeof(*bo));
+	for (n = 0; n < count; n++)
+		bo[n] = kgem_create_linear(t.kgem, (256 + n % 256) * 4096, 0);
+	for (n = 0; n < count; n++)
+		kgem_bo_destroy(t.kgem, bo[n]);
+
+	srandom(0);
+	kgem_fake_reset_stats(t.fake);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < loops; n++) {
+		tmp = kgem_create_linear(t.kgem,
+					 (256 + random() % 256) * 4096,
+					 0);
+		kgem_bo_destroy(t.kgem, tmp);
+	}
+	ns = elapsed(&start);
+	kgem_fake_get_stats(t.fake, &stats);
+
+	printf("cache search[%d]: %.1f ns/op, %lu creates\n",
+	       count, ns / loops, stats.create);
+	if (count >= 256)
+		check(stats.create == 0);
+
+	free(bo);
+	test_fini(&t);
+}
+
+/* Compare reading back an X-tiled bo by detiling it on the CPU against
+ * blitting it to a linear bo, waiting and then copying from that. The
+ * fake device does not perform the blit, so the latter excludes the time
+ * the GPU would spend copying.
+ */
+static void bench_detile(int width, int height)
+{
+	struct timespec start;
+	struct kgem_bo *tiled, *linear;
+	struct test t;
+	uint8_t *src, *dst, *ptr;
+	int loops = 50, n, swizzle, size;
+	double detile_ns, blit_ns;
+
+	if (!test_init(&t, 070))
+		return;
+
+	size = width * height * 4;
+	tiled = kgem_create_2d(t.kgem, width, height, 32, I915_TILING_X, 0);
+	linear = kgem_create_linear(t.kgem, size, 0);
+	dst = malloc(size);
+	if (tiled == NULL || linear == NULL || dst == NULL)
+		goto out;
+
+	src = kgem_bo_map__cpu(t.kgem, tiled);
+	ptr = kgem_bo_map__cpu(t.kgem, linear);
+	if (src == NULL || ptr == NULL)
+		goto out;
+	memset(src, 0x5a, kgem_bo_size(tiled));
+	swizzle = kgem_bo_get_swizzling(t.kgem, tiled);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < loops; n++)
+		memcpy_from_tiled_x(src, dst, 32, swizzle,
+				    tiled->pitch, width * 4,
+				    0, 0, 0, 0, width, height);
+	detile_ns = elapsed(&start) / loops;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < loops; n++) {
+		uint32_t *b;
+
+		kgem_set_mode(t.kgem, KGEM_BLT, linear);
+		if (!kgem_check_batch(t.kgem, 8) ||
+		    !kgem_check_reloc(t.kgem, 2) ||
+		    !kgem_check_many_bo_fenced(t.kgem, linear, tiled, NULL)) {
+			_kgem_submit(t.kgem);
+			_kgem_set_mode(t.kgem, KGEM_BLT);
+		}
+
+		b = t.kgem->batch + t.kgem->nbatch;
+		b[0] = XY_SRC_COPY_BLT_CMD | BLT_WRITE_ALPHA | BLT_WRITE_RGB | BLT_SRC_TILED;
+		b[1] = 0xcc << 16 | 1 << 25 | 1 << 24 | width * 4;
+		b[2] = 0;
+		b[3] = height << 16 | width;
+		b[4] = kgem_add_reloc(t.kgem, t.kgem->nbatch + 4, linear,
+				      I915_GEM_DOMAIN_RENDER << 16 |
+				      I915_GEM_DOMAIN_RENDER |
+				      KGEM_RELOC_FENCED,
+				      0);
+		b[5] = 0;
+		b[6] = tiled->pitch >> 2;
+		b[7] = kgem_add_reloc(t.kgem, t.kgem->nbatch + 7, tiled,
+				      I915_GEM_DOMAIN_RENDER << 16 |
+				      KGEM_RELOC_FENCED,
+				      0);
+		t.kgem->nbatch += 8;
+		_kgem_submit(t.kgem);
+
+		kgem_bo_sync__cpu_full(t.kgem, linear, false);
+		memcpy(dst, ptr, size);
+	}
+	blit_ns = elapsed(&start) / loops;
+
+	printf("detile %dx%d: %.1f us (%.2f GB/s) on the CPU, %.1f us (%.2f GB/s) to blit and copy\n",
+	       width, height,
+	       detile_ns / 1000, size / detile_ns,
+	       blit_ns / 1000, size / blit_ns);
+
+out:
+	free(dst);
+	if (linear)
+		kgem_bo_destroy(t.kgem, linear);
+	if (tiled)
+		kgem_bo_destroy(t.kgem, tiled);
+	test_fini(&t);
+}
+
+static void bench_blt(void)
+{
+	static const unsigned levels[] = {
+		0,
+		CPU_SSE2 | CPU_SSE4_1,
+		CPU_SSE2 | CPU_SSE4_1 | CPU_AVX2,
+	};
+	static const char *kernels[] = {
+		"copy", "xor", "to-x", "from-x", "to-y", "from-y",
+	};
+	static const int widths[] = { 16, 256, 1920 };
+	const int pitch = 8192, height = 64, size = pitch * height;
+	unsigned features = sna_cpu_detect();
+	uint8_t *src, *dst;
+	int l, k, bpp, w, n;
+
+	src = malloc(size);
+	dst = malloc(size);
+	if (src == NULL || dst == NULL)
+		goto out;
+	memset(src, 0x5a, size);
+	memset(dst, 0xa5, size);
+
+	for (l = 0; l < ARRAY_SIZE(levels); l++) {
+		const char *name;
+
+		if ((features & levels[l]) != levels[l])
+			continue;
+
+		name = sna_blt_init(levels[l]);
+		for (k = 0; k < ARRAY_SIZE(kernels); k++) {
+			for (bpp = 8; bpp <= 32; bpp <<= 1) {
+				printf("blt %s %s %dbpp:", name, kernels[k], bpp);
+				for (w = 0; w < ARRAY_SIZE(widths); w++) {
+					int bytes = widths[w] * bpp / 8 * height;
+					int loops = (64 << 20) / bytes;
+					struct timespec start;
+					double ns;
+
+					clock_gettime(CLOCK_MONOTONIC, &start);
+					for (n = 0; n < loops; n++) {
+						switch (k) {
+						case 0:
+							memcpy_blt(src, dst, bpp, pitch, pitch,
+								   0, 0, 0, 0, widths[w], height);
+							break;
+						case 1:
+							memcpy_xor(src, dst, bpp, pitch, pitch,
+								   0, 0, 0, 0, widths[w], height,
+								   0xffffffff, 0xff);
+							break;
+						case 2:
+							memcpy_to_tiled_x(src, dst, bpp, I915_BIT_6_SWIZZLE_9,
+									  pitch, pitch,
+									  0, 0, 0, 0, widths[w], height);
+							break;
+						case 3:
+							memcpy_from_tiled_x(src, dst, bpp, I915_BIT_6_SWIZZLE_9,
+									    pitch, pitch,
+									    0, 0, 0, 0, widths[w], height);
+							break;
+						case 4:
+							memcpy_to_tiled_y(src, dst, bpp, I915_BIT_6_SWIZZLE_9,
+									  pitch, pitch,
+									  0, 0, 0, 0, widths[w], height);
+							break;
+						case 5:
+							memcpy_from_tiled_y(src, dst, bpp, I915_BIT_6_SWIZZLE_9,
+									    pitch, pitch,
+									    0, 0, 0, 0, widths[w], height);
+							break;
+						}
+					}
+					ns = elapsed(&start);
+
+					printf(" %dpx %.2f GB/s", widths[w],
+					       (double)bytes * loops / ns);
+				}
+				printf("\n");
+			}
+		}
+	}
+	sna_blt_init(features);
+
+out:
+	free(src);
+	free(dst);
+}
+
+static void bench_submit(int count)
+{
+	struct kgem_fake_stats stats;
+	struct timespec start;
+	struct kgem_bo **bo;
+	struct test t;
+	int loops = 2000, n;
+	double ns;
+
+	if (!test_init(&t, 070))
+		return;
+
+	bo = malloc(count * sizeof(*bo));
+	for (n = 0; n < count; n++)
+		bo[n] = kgem_create_2d(t.kgem, 256, 256, 32, I915_TILING_X, 0);
+
+	kgem_fake_set_latency(t.fake, -1, 100*1000);
+	kgem_fake_reset_stats(t.fake);
+	memset(&t.kgem->stats, 0, sizeof(t.kgem->stats));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < loops; n++) {
+		emit_batch(t.kgem, bo, count);
+		kgem_fake_advance(t.fake, 50*1000);
+		kgem_retire(t.kgem);
+	}
+	ns = elapsed(&start);
+	kgem_fake_get_stats(t.fake, &stats);
+
+	printf("submit[%d]: %.1f ns/batch, %lu/%lu batches without relocation, %lu relocations applied, %lu skipped, %lu stalls (%.3f ms), %lu batch uploads (%llu bytes)\n",
+	       count, ns / loops,
+	       t.kgem->stats.no_reloc, t.kgem->stats.batches[KGEM_BLT],
+	       stats.relocs, stats.relocs_skipped,
+	       stats.stalls, stats.stall_ns / 1e6,
+	       stats.pwrite, (unsigned long long)stats.pwrite_bytes);
+
+	for (n = 0; n < count; n++)
+		kgem_bo_destroy(t.kgem, bo[n]);
+	free(bo);
+	test_fini(&t);
+}
+
+int main(int argc, char **argv)
+{
+	sna_blt_init(sna_cpu_detect());
+
+	test_cache_reuse();
+	test_retire_latency();
+	test_retire_thread();
+	test_batch_ring();
+	test_upload_ring();
+	test_no_reloc();
+	test_stats();
+	test_vma_cache();
+	test_detile();
+	test_blt_kernels();
+	test_throttle();
+
+	bench_alloc();
+	bench_create_destroy();
+	bench_cache_search(64);
+	bench_cache_search(512);
+	bench_cache_search(4096);
+	bench_submit(1);
+	bench_submit(16);
+	bench_submit(128);
+	bench_detile(256, 256);
+	bench_detile(1920, 1080);
+	bench_blt();
+
+	if (failures)
+		printf("%d checks failed\n", failures);
+
+	return failures != 0;
+}
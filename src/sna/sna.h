@@ -114,6 +114,7 @@ struct sna_pixmap {
 #define PTR(ptr) ((void*)((uintptr_t)(ptr) & ~1))
 
 	struct list list;
+	struct list upload;
 
 	uint32_t stride;
 	uint32_t clear_color;
@@ -138,7 +139,8 @@ struct sna_glyph {
 	PicturePtr atlas;
 	pixman_image_t *image;
 	struct sna_coordinate coordinate;
-	uint16_t size, pos;
+	uint16_t size;
+	uint32_t pos;
 };
 
 static inline WindowPtr root(ScreenPtr screen)
@@ -207,8 +209,10 @@ struct sna {
 #define SNA_TRIPLE_BUFFER	0x4
 #define SNA_TEAR_FREE		0x10
 #define SNA_FORCE_SHADOW	0x20
+#define SNA_DEBUG_STATS		0x40
 
 	unsigned watch_flush;
+	int stats_signal;
 
 	struct timeval timer_tv;
 	uint32_t timer_expire[NUM_TIMERS];
@@ -218,6 +222,7 @@ struct sna {
 
 	struct list flush_pixmaps;
 	struct list active_pixmaps;
+	struct list upload_pixmaps;
 
 	PixmapPtr front;
 	PixmapPtr freed_pixmap;
@@ -284,6 +289,23 @@ struct sna {
 	struct kgem kgem;
 	struct sna_render render;
 
+	/* Running totals of pixmap migration between the CPU and GPU
+	 * copies, reported alongside the kgem statistics.
+	 */
+	struct sna_migrate_stats {
+		unsigned long count;
+		unsigned long tiled; /* migrations rounded out to damage tiles */
+		uint64_t touched; /* bytes covered by the damage */
+		uint64_t migrated; /* bytes actually copied */
+	} upload_stats, download_stats;
+
+	struct sna_put_image_stats {
+		unsigned long count;
+		unsigned long coalesced; /* staged for a deferred upload */
+		unsigned long flushed; /* deferred uploads from the block handler */
+		uint64_t bytes; /* bytes staged */
+	} put_image_stats;
+
 #if DEBUG_MEMORY
 	struct {
 	       int shadow_pixels_allocs;
@@ -441,6 +463,7 @@ void sna_pixmap_destroy(PixmapPtr pixmap);
 #define MOVE_WHOLE_HINT 0x20
 #define __MOVE_FORCE 0x40
 #define __MOVE_DRI 0x80
+#define MOVE_DEFER_HINT 0x100
 
 bool
 sna_pixmap_move_area_to_gpu(PixmapPtr pixmap, const BoxRec *box, unsigned int flags);
@@ -774,6 +797,20 @@ void sna_glyphs__shared(CARD8 op,
 void sna_glyph_unrealize(ScreenPtr screen, GlyphPtr glyph);
 void sna_glyphs_close(struct sna *sna);
 
+void sna_glyph_cache_init(struct sna_glyph_cache *cache);
+void sna_glyph_cache_fini(struct sna_glyph_cache *cache);
+bool sna_glyph_cache_add_page(struct sna_glyph_cache *cache, PicturePtr picture);
+bool sna_glyph_cache_full(struct sna_glyph_cache *cache, int size);
+int sna_glyph_cache_alloc(struct sna_glyph_cache *cache, int size);
+void sna_glyph_cache_set_clock(bool enable);
+
+static inline void sna_glyph_cache_hit(struct sna_glyph_cache *cache,
+				       const struct sna_glyph *priv)
+{
+	cache->used[priv->pos >> 1] = 1;
+	cache->stats.hits++;
+}
+
 void sna_read_boxes(struct sna *sna,
 		    struct kgem_bo *src_bo, int16_t src_dx, int16_t src_dy,
 		    PixmapPtr dst, int16_t dst_dx, int16_t dst_dy,
@@ -826,6 +863,24 @@ memcpy_to_tiled_x(const void *src, void *dst, int bpp, int swizzling,
 		  int16_t dst_x, int16_t dst_y,
 		  uint16_t width, uint16_t height);
 void
+memcpy_from_tiled_x(const void *src, void *dst, int bpp, int swizzling,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height);
+void
+memcpy_to_tiled_y(const void *src, void *dst, int bpp, int swizzling,
+		  int32_t src_stride, int32_t dst_stride,
+		  int16_t src_x, int16_t src_y,
+		  int16_t dst_x, int16_t dst_y,
+		  uint16_t width, uint16_t height);
+void
+memcpy_from_tiled_y(const void *src, void *dst, int bpp, int swizzling,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height);
+void
 memmove_box(const void *src, void *dst,
 	    int bpp, int32_t stride,
 	    const BoxRec *box,
@@ -839,6 +894,16 @@ memcpy_xor(const void *src, void *dst, int bpp,
 	   uint16_t width, uint16_t height,
 	   uint32_t and, uint32_t or);
 
+#define CPU_SSE2	0x1
+#define CPU_SSE4_1	0x2
+#define CPU_AVX2	0x4
+
+unsigned sna_cpu_detect(void);
+/* Select the fastest copy routines usable with the CPU features, returning
+ * their name. Until called, the portable routines are used.
+ */
+const char *sna_blt_init(unsigned features);
+
 #define SNA_CREATE_FB 0x10
 #define SNA_CREATE_SCRATCH 0x11
 #define SNA_CREATE_GLYPHS 0x12
@@ -856,7 +921,12 @@ inline static bool is_clipped(const RegionRec *r,
 		r->extents.y2 - r->extents.y1 != d->height);
 }
 
-void sna_threads_init(void);
+enum {
+	SNA_AFFINITY_NONE = 0,
+	SNA_AFFINITY_LLC,
+	SNA_AFFINITY_NODE,
+};
+int sna_threads_init(int count, int *affinity);
 int sna_use_threads (int width, int height, int threshold);
 void sna_threads_run(void (*func)(void *arg), void *arg);
 void sna_threads_wait(void);
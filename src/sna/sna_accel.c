@@ -50,6 +50,7 @@
 
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <signal.h>
 #include <unistd.h>
 
 #define FAULT_INJECTION 0
@@ -68,6 +69,9 @@
 #define USE_USERPTR_DOWNLOADS 1
 
 #define MIGRATE_ALL 0
+#define MIGRATE_TILES 1
+#define COALESCE_PUT_IMAGE 1
+#define PUT_IMAGE_COALESCE_SIZE 16384
 #define DBG_NO_CPU_UPLOAD 0
 #define DBG_NO_CPU_DOWNLOAD 0
 
@@ -635,6 +639,7 @@ static struct sna_pixmap *
 _sna_pixmap_init(struct sna_pixmap *priv, PixmapPtr pixmap)
 {
 	list_init(&priv->list);
+	list_init(&priv->upload);
 	priv->source_count = SOURCE_BIAS;
 	priv->pixmap = pixmap;
 
@@ -1286,6 +1291,7 @@ static void __sna_free_pixmap(struct sna *sna,
 			      struct sna_pixmap *priv)
 {
 	list_del(&priv->list);
+	list_del(&priv->upload);
 
 	sna_damage_destroy(&priv->gpu_damage);
 	sna_damage_destroy(&priv->cpu_damage);
@@ -1452,6 +1458,55 @@ static inline bool use_cpu_bo_for_upload(struct sna *sna,
 	return kgem_bo_is_busy(priv->gpu_bo) || kgem_bo_is_busy(priv->cpu_bo);
 }
 
+static uint64_t boxes_area(const BoxRec *box, int n)
+{
+	uint64_t area = 0;
+
+	while (n--) {
+		area += (box->x2 - box->x1) * (box->y2 - box->y1);
+		box++;
+	}
+
+	return area;
+}
+
+/* Once the damage has fragmented into many small boxes, the per-box setup
+ * of the copy dominates the migration. So long as the destination holds
+ * no damage of its own in the area (i.e. both copies agree outside of the
+ * damage), we can copy the coarse tiles touched by the damage instead.
+ */
+static int migrate_boxes(struct sna_migrate_stats *stats,
+			 struct sna_damage *damage,
+			 struct sna_damage *other,
+			 int bpp, BoxPtr *box, int n,
+			 RegionPtr tiles)
+{
+	uint64_t area;
+
+	pixman_region_init(tiles);
+
+	area = boxes_area(*box, n);
+	stats->count++;
+	stats->touched += area * bpp / 8;
+
+	if (MIGRATE_TILES && n >= 64 &&
+	    sna_damage_get_tiles(damage, tiles) &&
+	    RegionNumRects(tiles) * 4 <= n &&
+	    (other == NULL ||
+	     sna_damage_contains_box(other,
+				     &tiles->extents) == PIXMAN_REGION_OUT)) {
+		DBG(("%s: migrating %d tiles instead of %d boxes\n",
+		     __FUNCTION__, RegionNumRects(tiles), n));
+		*box = RegionRects(tiles);
+		n = RegionNumRects(tiles);
+		area = boxes_area(*box, n);
+		stats->tiled++;
+	}
+
+	stats->migrated += area * bpp / 8;
+	return n;
+}
+
 static inline bool operate_inplace(struct sna_pixmap *priv, unsigned flags)
 {
 	if ((flags & MOVE_INPLACE_HINT) == 0) {
@@ -1696,6 +1751,7 @@ skip_inplace_map:
 	}
 
 	if (priv->gpu_damage) {
+		RegionRec tiles;
 		BoxPtr box;
 		int n;
 
@@ -1703,6 +1759,10 @@ skip_inplace_map:
 		assert(priv->gpu_bo);
 
 		n = sna_damage_get_boxes(priv->gpu_damage, &box);
+		n = migrate_boxes(&sna->download_stats,
+				  priv->gpu_damage, priv->cpu_damage,
+				  pixmap->drawable.bitsPerPixel,
+				  &box, n, &tiles);
 		if (n) {
 			bool ok = false;
 
@@ -1719,6 +1779,7 @@ skip_inplace_map:
 					       pixmap, 0, 0,
 					       box, n);
 		}
+		pixman_region_fini(&tiles);
 
 		__sna_damage_destroy(DAMAGE_PTR(priv->gpu_damage));
 		priv->gpu_damage = NULL;
@@ -2162,6 +2223,7 @@ sna_drawable_move_region_to_cpu(DrawablePtr drawable,
 			}
 
 			if (region_subsumes_damage(r, priv->gpu_damage)) {
+				RegionRec tiles;
 				BoxPtr box;
 				int n;
 
@@ -2170,6 +2232,11 @@ sna_drawable_move_region_to_cpu(DrawablePtr drawable,
 
 				n = sna_damage_get_boxes(priv->gpu_damage,
 							 &box);
+				n = migrate_boxes(&sna->download_stats,
+						  priv->gpu_damage,
+						  priv->cpu_damage,
+						  pixmap->drawable.bitsPerPixel,
+						  &box, n, &tiles);
 				if (n) {
 					bool ok = false;
 
@@ -2187,6 +2254,7 @@ sna_drawable_move_region_to_cpu(DrawablePtr drawable,
 							       pixmap, 0, 0,
 							       box, n);
 				}
+				pixman_region_fini(&tiles);
 
 				sna_damage_destroy(&priv->gpu_damage);
 			} else if (DAMAGE_IS_ALL(priv->gpu_damage) ||
@@ -2283,7 +2351,7 @@ out:
 		kgem_bo_sync__cpu_full(&sna->kgem,
 				       priv->cpu_bo, flags & MOVE_WRITE);
 	}
-	priv->cpu = (flags & MOVE_ASYNC_HINT) == 0;
+	priv->cpu = (flags & (MOVE_ASYNC_HINT | MOVE_DEFER_HINT)) == 0;
 	assert(pixmap->devPrivate.ptr);
 	assert(pixmap->devKind);
 	assert_pixmap_damage(pixmap);
@@ -3013,6 +3081,7 @@ sna_pixmap_move_to_gpu(PixmapPtr pixmap, unsigned flags)
 {
 	struct sna *sna = to_sna_from_pixmap(pixmap);
 	struct sna_pixmap *priv;
+	RegionRec tiles;
 	BoxPtr box;
 	int n;
 
@@ -3138,6 +3207,10 @@ sna_pixmap_move_to_gpu(PixmapPtr pixmap, unsigned flags)
 	}
 
 	n = sna_damage_get_boxes(priv->cpu_damage, &box);
+	n = migrate_boxes(&sna->upload_stats,
+			  priv->cpu_damage, priv->gpu_damage,
+			  pixmap->drawable.bitsPerPixel,
+			  &box, n, &tiles);
 	if (n) {
 		bool ok;
 
@@ -3179,10 +3252,13 @@ sna_pixmap_move_to_gpu(PixmapPtr pixmap, unsigned flags)
 						0, 0,
 						box, n);
 			}
-			if (!ok)
+			if (!ok) {
+				pixman_region_fini(&tiles);
 				return NULL;
+			}
 		}
 	}
+	pixman_region_fini(&tiles);
 
 	__sna_damage_destroy(DAMAGE_PTR(priv->cpu_damage));
 	priv->cpu_damage = NULL;
@@ -3212,6 +3288,7 @@ active:
 	if (flags & MOVE_WRITE)
 		priv->clear = false;
 	priv->cpu = false;
+	list_del(&priv->upload);
 	assert(!priv->gpu_bo->proxy || (flags & MOVE_WRITE) == 0);
 	return sna_pixmap_mark_active(sna, priv);
 }
@@ -3417,11 +3494,71 @@ static inline void box32_add_rect(Box32Rec *box, const xRectangle *r)
 		box->y2 = v;
 }
 
+/* Streams of small PutImages into a pixmap that otherwise lives on the GPU
+ * are staged in its CPU shadow and tracked as CPU damage, but without
+ * handing the pixmap over to the CPU. The accumulated damage is then
+ * uploaded in a single pass when the GPU next needs the pixmap or, failing
+ * that, from the block handler.
+ */
+static bool put_image_coalesce(struct sna_pixmap *priv,
+			       const BoxRec *box, int bpp)
+{
+	if (!COALESCE_PUT_IMAGE)
+		return false;
+
+	if (priv == NULL || priv->gpu_bo == NULL || priv->gpu_bo->proxy)
+		return false;
+
+	if (priv->cpu || priv->clear || priv->flush || priv->shm) {
+		DBG(("%s: no, cpu=%d, clear=%d, flush=%d, shm=%d\n",
+		     __FUNCTION__, priv->cpu, priv->clear, priv->flush, priv->shm));
+		return false;
+	}
+
+	if ((int)(box->x2 - box->x1) * (int)(box->y2 - box->y1) * bpp >> 3 >
+	    PUT_IMAGE_COALESCE_SIZE) {
+		DBG(("%s: no, too large\n", __FUNCTION__));
+		return false;
+	}
+
+	if (priv->ptr == NULL && !kgem_bo_is_busy(priv->gpu_bo)) {
+		DBG(("%s: no, no shadow and GPU is idle, write inplace\n",
+		     __FUNCTION__));
+		return false;
+	}
+
+	return true;
+}
+
+static void sna_accel_flush_uploads(struct sna *sna)
+{
+	struct sna_pixmap *priv;
+
+	while (!list_is_empty(&sna->upload_pixmaps)) {
+		priv = list_first_entry(&sna->upload_pixmaps,
+					struct sna_pixmap, upload);
+		list_del(&priv->upload);
+
+		DBG(("%s: pixmap=%ld, cpu damage? %d, cpu? %d\n",
+		     __FUNCTION__, priv->pixmap->drawable.serialNumber,
+		     priv->cpu_damage != NULL, priv->cpu));
+		if (priv->cpu_damage == NULL || priv->cpu)
+			continue;
+
+		if (sna_pixmap_move_to_gpu(priv->pixmap,
+					   MOVE_READ | MOVE_ASYNC_HINT))
+			sna->put_image_stats.flushed++;
+	}
+}
+
 static bool
 sna_put_zpixmap_blt(DrawablePtr drawable, GCPtr gc, RegionPtr region,
 		    int x, int y, int w, int  h, char *bits, int stride)
 {
 	PixmapPtr pixmap = get_drawable_pixmap(drawable);
+	struct sna *sna = to_sna_from_pixmap(pixmap);
+	struct sna_pixmap *priv = sna_pixmap(pixmap);
+	unsigned flags = MOVE_WRITE;
 	BoxRec *box;
 	int16_t dx, dy;
 	int n;
@@ -3434,8 +3571,13 @@ sna_put_zpixmap_blt(DrawablePtr drawable, GCPtr gc, RegionPtr region,
 	if (drawable->depth < 8)
 		return false;
 
+	sna->put_image_stats.count++;
+	if (put_image_coalesce(priv, &region->extents,
+			       pixmap->drawable.bitsPerPixel))
+		flags |= MOVE_DEFER_HINT; /* a normal write, but keep the pixmap on the GPU */
+
 	if (!sna_drawable_move_region_to_cpu(&pixmap->drawable,
-					     region, MOVE_WRITE))
+					     region, flags))
 		return false;
 
 	get_drawable_deltas(drawable, pixmap, &dx, &dy);
@@ -3476,6 +3618,19 @@ sna_put_zpixmap_blt(DrawablePtr drawable, GCPtr gc, RegionPtr region,
 		box++;
 	} while (--n);
 
+	if (flags & MOVE_DEFER_HINT &&
+	    !priv->cpu && priv->gpu_bo && priv->cpu_damage) {
+		DBG(("%s: deferring upload of pixmap=%ld\n",
+		     __FUNCTION__, pixmap->drawable.serialNumber));
+		if (list_is_empty(&priv->upload))
+			list_add(&priv->upload, &sna->upload_pixmaps);
+		sna->put_image_stats.coalesced++;
+		sna->put_image_stats.bytes +=
+			(int)(region->extents.x2 - region->extents.x1) *
+			(int)(region->extents.y2 - region->extents.y1) *
+			pixmap->drawable.bitsPerPixel >> 3;
+	}
+
 	assert_pixmap_damage(pixmap);
 	return true;
 }
@@ -5316,6 +5471,7 @@ sna_fill_spans_blt(DrawablePtr drawable,
 	int16_t dx, dy;
 	struct sna_fill_op fill;
 	BoxRec box[512], *b = box, *const last_box = box + ARRAY_SIZE(box);
+	BoxRec *start, *end;
 	static void * const jump[] = {
 		&&no_damage,
 		&&damage,
@@ -5372,6 +5528,7 @@ no_damage:
 	goto done;
 
 damage:
+	b = start = sna_damage_reserve(damage, box, ARRAY_SIZE(box), &end);
 	do {
 		*(DDXPointRec *)b = *pt++;
 		b->x1 += dx;
@@ -5379,17 +5536,17 @@ damage:
 		b->x2 = b->x1 + (int)*width++;
 		b->y2 = b->y1 + 1;
 
-		if (++b == last_box) {
-			assert_pixmap_contains_boxes(pixmap, box, last_box-box, 0, 0);
-			fill.boxes(sna, &fill, box, last_box - box);
-			sna_damage_add_boxes(damage, box, last_box - box, 0, 0);
-			b = box;
+		if (++b == end) {
+			assert_pixmap_contains_boxes(pixmap, start, end-start, 0, 0);
+			fill.boxes(sna, &fill, start, end - start);
+			sna_damage_commit(damage, start, end - start);
+			b = start = sna_damage_reserve(damage, box, ARRAY_SIZE(box), &end);
 		}
 	} while (--n);
-	if (b != box) {
-		assert_pixmap_contains_boxes(pixmap, box, b-box, 0, 0);
-		fill.boxes(sna, &fill, box, b - box);
-		sna_damage_add_boxes(damage, box, b - box, 0, 0);
+	if (b != start) {
+		assert_pixmap_contains_boxes(pixmap, start, b-start, 0, 0);
+		fill.boxes(sna, &fill, start, b - start);
+		sna_damage_commit(damage, start, b - start);
 	}
 	goto done;
 
@@ -5514,6 +5671,7 @@ damage_clipped:
 		     clip.extents.x1, clip.extents.y1, clip.extents.x2, clip.extents.y2,
 		     n, pt->x, pt->y));
 
+		b = start = sna_damage_reserve(damage, box, ARRAY_SIZE(box), &end);
 		if (clip.data == NULL) {
 			do {
 				*(DDXPointRec *)b = *pt++;
@@ -5525,11 +5683,11 @@ damage_clipped:
 					b->x2 += dx;
 					b->y1 += dy;
 					b->y2 += dy;
-					if (++b == last_box) {
-						assert_pixmap_contains_boxes(pixmap, box, b-box, 0, 0);
-						fill.boxes(sna, &fill, box, last_box - box);
-						sna_damage_add_boxes(damage, box, b - box, 0, 0);
-						b = box;
+					if (++b == end) {
+						assert_pixmap_contains_boxes(pixmap, start, end-start, 0, 0);
+						fill.boxes(sna, &fill, start, end - start);
+						sna_damage_commit(damage, start, end - start);
+						b = start = sna_damage_reserve(damage, box, ARRAY_SIZE(box), &end);
 					}
 				}
 			} while (--n);
@@ -5584,20 +5742,20 @@ damage_clipped:
 					b->x2 += dx;
 					b->y1 = y + dy;
 					b->y2 = b->y1 + 1;
-					if (++b == last_box) {
-						assert_pixmap_contains_boxes(pixmap, box, last_box-box, 0, 0);
-						fill.boxes(sna, &fill, box, last_box - box);
-						sna_damage_add_boxes(damage, box, last_box - box, 0, 0);
-						b = box;
+					if (++b == end) {
+						assert_pixmap_contains_boxes(pixmap, start, end-start, 0, 0);
+						fill.boxes(sna, &fill, start, end - start);
+						sna_damage_commit(damage, start, end - start);
+						b = start = sna_damage_reserve(damage, box, ARRAY_SIZE(box), &end);
 					}
 				}
 			} while (--n);
 			RegionUninit(&clip);
 		}
-		if (b != box) {
-			assert_pixmap_contains_boxes(pixmap, box, b-box, 0, 0);
-			fill.boxes(sna, &fill, box, b - box);
-			sna_damage_add_boxes(damage, box, b - box, 0, 0);
+		if (b != start) {
+			assert_pixmap_contains_boxes(pixmap, start, b-start, 0, 0);
+			fill.boxes(sna, &fill, start, b - start);
+			sna_damage_commit(damage, start, b - start);
 		}
 		goto done;
 	}
@@ -7666,7 +7824,7 @@ sna_poly_segment_blt(DrawablePtr drawable,
 {
 	PixmapPtr pixmap = get_drawable_pixmap(drawable);
 	struct sna *sna = to_sna_from_pixmap(pixmap);
-	BoxRec boxes[512], *b = boxes, * const last_box = boxes + ARRAY_SIZE(boxes);
+	BoxRec boxes[512], *b = boxes, *start = boxes, *end;
 	struct sna_fill_op fill;
 	int16_t dx, dy;
 
@@ -7684,8 +7842,9 @@ sna_poly_segment_blt(DrawablePtr drawable,
 		if (dx|dy) {
 			do {
 				unsigned nbox = n;
-				if (nbox > ARRAY_SIZE(boxes))
-					nbox = ARRAY_SIZE(boxes);
+				b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
+				if (nbox > end - start)
+					nbox = end - start;
 				n -= nbox;
 				do {
 					box_from_seg(b, seg++, gc);
@@ -7698,28 +7857,27 @@ sna_poly_segment_blt(DrawablePtr drawable,
 					}
 				} while (--nbox);
 
-				if (b != boxes) {
-					fill.boxes(sna, &fill, boxes, b-boxes);
-					if (damage)
-						sna_damage_add_boxes(damage, boxes, b-boxes, 0, 0);
-					b = boxes;
+				if (b != start) {
+					fill.boxes(sna, &fill, start, b-start);
+					sna_damage_commit(damage, start, b-start);
+					b = start;
 				}
 			} while (n);
 		} else {
 			do {
 				unsigned nbox = n;
-				if (nbox > ARRAY_SIZE(boxes))
-					nbox = ARRAY_SIZE(boxes);
+				b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
+				if (nbox > end - start)
+					nbox = end - start;
 				n -= nbox;
 				do {
 					box_from_seg(b++, seg++, gc);
 				} while (--nbox);
 
-				if (b != boxes) {
-					fill.boxes(sna, &fill, boxes, b-boxes);
-					if (damage)
-						sna_damage_add_boxes(damage, boxes, b-boxes, 0, 0);
-					b = boxes;
+				if (b != start) {
+					fill.boxes(sna, &fill, start, b-start);
+					sna_damage_commit(damage, start, b-start);
+					b = start;
 				}
 			} while (n);
 		}
@@ -7731,6 +7889,8 @@ sna_poly_segment_blt(DrawablePtr drawable,
 		if (RegionNil(&clip))
 			goto done;
 
+		b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
+
 		if (clip.data) {
 			const BoxRec * const clip_start = RegionBoxptr(&clip);
 			const BoxRec * const clip_end = clip_start + clip.data->numRects;
@@ -7756,11 +7916,10 @@ sna_poly_segment_blt(DrawablePtr drawable,
 						b->x2 += dx;
 						b->y1 += dy;
 						b->y2 += dy;
-						if (++b == last_box) {
-							fill.boxes(sna, &fill, boxes, last_box-boxes);
-							if (damage)
-								sna_damage_add_boxes(damage, boxes, last_box-boxes, 0, 0);
-							b = boxes;
+						if (++b == end) {
+							fill.boxes(sna, &fill, start, end-start);
+							sna_damage_commit(damage, start, end-start);
+							b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
 						}
 					}
 				}
@@ -7777,21 +7936,19 @@ sna_poly_segment_blt(DrawablePtr drawable,
 					b->x2 += dx;
 					b->y1 += dy;
 					b->y2 += dy;
-					if (++b == last_box) {
-						fill.boxes(sna, &fill, boxes, last_box-boxes);
-						if (damage)
-							sna_damage_add_boxes(damage, boxes, last_box-boxes, 0, 0);
-						b = boxes;
+					if (++b == end) {
+						fill.boxes(sna, &fill, start, end-start);
+						sna_damage_commit(damage, start, end-start);
+						b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
 					}
 				}
 			} while (--n);
 		}
 		RegionUninit(&clip);
 	}
-	if (b != boxes) {
-		fill.boxes(sna, &fill, boxes, b - boxes);
-		if (damage)
-			sna_damage_add_boxes(damage, boxes, b - boxes, 0, 0);
+	if (b != start) {
+		fill.boxes(sna, &fill, start, b - start);
+		sna_damage_commit(damage, start, b - start);
 	}
 done:
 	fill.done(sna, &fill);
@@ -9282,7 +9439,7 @@ sna_poly_fill_rect_blt(DrawablePtr drawable,
 	PixmapPtr pixmap = get_drawable_pixmap(drawable);
 	struct sna *sna = to_sna_from_pixmap(pixmap);
 	struct sna_fill_op fill;
-	BoxRec boxes[512], *b = boxes, *const last_box = boxes+ARRAY_SIZE(boxes);
+	BoxRec boxes[512], *b = boxes, *start = boxes, *end;
 	int16_t dx, dy;
 
 	DBG(("%s x %d [(%d, %d)x(%d, %d)...]+(%d,%d), clipped?=%d\n",
@@ -9353,12 +9510,12 @@ sna_poly_fill_rect_blt(DrawablePtr drawable,
 		dx += drawable->x;
 		dy += drawable->y;
 
-		sna_damage_add_rectangles(damage, rect, n, dx, dy);
 		if (dx|dy) {
 			do {
 				unsigned nbox = n;
-				if (nbox > ARRAY_SIZE(boxes))
-					nbox = ARRAY_SIZE(boxes);
+				b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
+				if (nbox > end - start)
+					nbox = end - start;
 				n -= nbox;
 				do {
 					b->x1 = rect->x + dx;
@@ -9368,14 +9525,15 @@ sna_poly_fill_rect_blt(DrawablePtr drawable,
 					b++;
 					rect++;
 				} while (--nbox);
-				fill.boxes(sna, &fill, boxes, b-boxes);
-				b = boxes;
+				fill.boxes(sna, &fill, start, b-start);
+				sna_damage_commit(damage, start, b-start);
 			} while (n);
 		} else {
 			do {
 				unsigned nbox = n;
-				if (nbox > ARRAY_SIZE(boxes))
-					nbox = ARRAY_SIZE(boxes);
+				b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
+				if (nbox > end - start)
+					nbox = end - start;
 				n -= nbox;
 				do {
 					b->x1 = rect->x;
@@ -9385,8 +9543,8 @@ sna_poly_fill_rect_blt(DrawablePtr drawable,
 					b++;
 					rect++;
 				} while (--nbox);
-				fill.boxes(sna, &fill, boxes, b-boxes);
-				b = boxes;
+				fill.boxes(sna, &fill, start, b-start);
+				sna_damage_commit(damage, start, b-start);
 			} while (n);
 		}
 	} else {
@@ -9397,6 +9555,8 @@ sna_poly_fill_rect_blt(DrawablePtr drawable,
 		if (RegionNil(&clip))
 			goto done;
 
+		b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
+
 		if (clip.data == NULL) {
 			do {
 				b->x1 = rect->x + drawable->x;
@@ -9410,11 +9570,10 @@ sna_poly_fill_rect_blt(DrawablePtr drawable,
 					b->x2 += dx;
 					b->y1 += dy;
 					b->y2 += dy;
-					if (++b == last_box) {
-						fill.boxes(sna, &fill, boxes, last_box-boxes);
-						if (damage)
-							sna_damage_add_boxes(damage, boxes, last_box-boxes, 0, 0);
-						b = boxes;
+					if (++b == end) {
+						fill.boxes(sna, &fill, start, end-start);
+						sna_damage_commit(damage, start, end-start);
+						b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
 					}
 				}
 			} while (--n);
@@ -9445,11 +9604,10 @@ sna_poly_fill_rect_blt(DrawablePtr drawable,
 						b->x2 += dx;
 						b->y1 += dy;
 						b->y2 += dy;
-						if (++b == last_box) {
-							fill.boxes(sna, &fill, boxes, last_box-boxes);
-							if (damage)
-								sna_damage_add_boxes(damage, boxes, last_box-boxes, 0, 0);
-							b = boxes;
+						if (++b == end) {
+							fill.boxes(sna, &fill, start, end-start);
+							sna_damage_commit(damage, start, end-start);
+							b = start = sna_damage_reserve(damage, boxes, ARRAY_SIZE(boxes), &end);
 						}
 					}
 
@@ -9458,10 +9616,9 @@ sna_poly_fill_rect_blt(DrawablePtr drawable,
 		}
 
 		RegionUninit(&clip);
-		if (b != boxes) {
-			fill.boxes(sna, &fill, boxes, b-boxes);
-			if (damage)
-				sna_damage_add_boxes(damage, boxes, b-boxes, 0, 0);
+		if (b != start) {
+			fill.boxes(sna, &fill, start, b-start);
+			sna_damage_commit(damage, start, b-start);
 		}
 	}
 done:
@@ -13985,6 +14142,18 @@ static void sna_accel_expire(struct sna *sna)
 		sna_accel_disarm_timer(sna, EXPIRE_TIMER);
 }
 
+/* Shared by every screen, each dumps its own statistics upon noticing.
+ * The server's own handler is put back once the last screen closes.
+ */
+static volatile sig_atomic_t sna_stats_signal;
+static OsSigHandlerPtr sna_stats_old_handler;
+static int sna_stats_screens;
+
+static void sna_accel_stats_signal(int sig)
+{
+	sna_stats_signal++;
+}
+
 #ifdef DEBUG_MEMORY
 static bool sna_accel_do_debug_memory(struct sna *sna)
 {
@@ -14143,9 +14312,26 @@ bool sna_accel_init(ScreenPtr screen, struct sna *sna)
 
 	list_init(&sna->flush_pixmaps);
 	list_init(&sna->active_pixmaps);
+	list_init(&sna->upload_pixmaps);
 
 	AddGeneralSocket(sna->kgem.fd);
 
+	if (!sna->kgem.wedged &&
+	    xf86ReturnOptValBool(sna->Options, OPTION_ASYNC_RETIRE, FALSE))
+		xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+			   "Asynchronous retirement %s\n",
+			   kgem_start_retire_thread(&sna->kgem) ? "enabled" : "unavailable");
+
+	if (xf86ReturnOptValBool(sna->Options, OPTION_DEBUG_STATS, FALSE)) {
+		xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+			   "Batch statistics will be logged upon SIGUSR2\n");
+		sna->flags |= SNA_DEBUG_STATS;
+		sna->stats_signal = sna_stats_signal;
+		if (sna_stats_screens++ == 0)
+			sna_stats_old_handler =
+				OsSignal(SIGUSR2, sna_accel_stats_signal);
+	}
+
 #ifdef DEBUG_MEMORY
 	sna->timer_expire[DEBUG_MEMORY_TIMER] = GetTimeInMillis()+ 10 * 1000;
 #endif
@@ -14281,10 +14467,50 @@ void sna_accel_watch_flush(struct sna *sna, int enable)
 	sna->watch_flush += enable;
 }
 
+static void dump_migrate_stats(struct sna *sna, const char *name,
+			       const struct sna_migrate_stats *stats)
+{
+	xf86DrvMsg(sna->scrn->scrnIndex, X_INFO,
+		   "sna: %lu %ss (%lu by tile), %llu KiB damaged, %llu KiB copied\n",
+		   stats->count, name, stats->tiled,
+		   (unsigned long long)stats->touched >> 10,
+		   (unsigned long long)stats->migrated >> 10);
+}
+
+static void dump_glyph_stats(struct sna *sna, const char *name,
+			     const struct sna_glyph_stats *stats)
+{
+	xf86DrvMsg(sna->scrn->scrnIndex, X_INFO,
+		   "sna: %s glyph cache: %lu hits, %lu misses, %lu evictions, %llu KiB uploaded in %lu operations\n",
+		   name, stats->hits, stats->misses, stats->evictions,
+		   (unsigned long long)stats->uploaded >> 10, stats->uploads);
+}
+
+static void sna_accel_dump_stats(struct sna *sna)
+{
+	kgem_dump_stats(&sna->kgem);
+	dump_migrate_stats(sna, "upload", &sna->upload_stats);
+	dump_migrate_stats(sna, "download", &sna->download_stats);
+	xf86DrvMsg(sna->scrn->scrnIndex, X_INFO,
+		   "sna: %lu PutImages, %lu coalesced (%llu KiB), %lu deferred uploads\n",
+		   sna->put_image_stats.count,
+		   sna->put_image_stats.coalesced,
+		   (unsigned long long)sna->put_image_stats.bytes >> 10,
+		   sna->put_image_stats.flushed);
+	dump_glyph_stats(sna, "a8", &sna->render.glyph[0].stats);
+	dump_glyph_stats(sna, "argb", &sna->render.glyph[1].stats);
+}
+
 void sna_accel_close(struct sna *sna)
 {
 	DBG(("%s\n", __FUNCTION__));
 
+	if (sna->flags & SNA_DEBUG_STATS) {
+		sna_accel_dump_stats(sna);
+		if (--sna_stats_screens == 0)
+			OsSignal(SIGUSR2, sna_stats_old_handler);
+	}
+
 	sna_composite_close(sna);
 	sna_gradients_close(sna);
 	sna_glyphs_close(sna);
@@ -14299,6 +14525,7 @@ void sna_accel_close(struct sna *sna)
 
 	DeleteCallback(&FlushCallback, sna_accel_flush_callback, sna);
 
+	kgem_stop_retire_thread(&sna->kgem);
 	kgem_cleanup_cache(&sna->kgem);
 }
 
@@ -14307,6 +14534,9 @@ void sna_accel_block_handler(struct sna *sna, struct timeval **tv)
 	if (sna->timer_active)
 		UpdateCurrentTimeIf();
 
+	if (!list_is_empty(&sna->upload_pixmaps))
+		sna_accel_flush_uploads(sna);
+
 	if (sna->kgem.nbatch &&
 	    (sna->kgem.scanout_busy ||
 	     kgem_ring_is_idle(&sna->kgem, sna->kgem.ring))) {
@@ -14333,6 +14563,12 @@ void sna_accel_block_handler(struct sna *sna, struct timeval **tv)
 	if (sna_accel_do_debug_memory(sna))
 		sna_accel_debug_memory(sna);
 
+	if (sna->flags & SNA_DEBUG_STATS &&
+	    sna->stats_signal != sna_stats_signal) {
+		sna->stats_signal = sna_stats_signal;
+		sna_accel_dump_stats(sna);
+	}
+
 	if (sna->watch_flush == 1) {
 		DBG(("%s: removing watchers\n", __FUNCTION__));
 		DeleteCallback(&FlushCallback, sna_accel_flush_callback, sna);
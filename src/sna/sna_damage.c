@@ -31,6 +31,14 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "sna.h"
 #include "sna_damage.h"
 
+#if __x86_64__
+#define USE_SSE2 1
+#endif
+
+#if USE_SSE2
+#include <emmintrin.h>
+#endif
+
 /*
  * sna_damage is a batching layer on top of the regular pixman_region_t.
  * It is required as the ever-growing accumulation of invidual small
@@ -55,6 +63,8 @@ struct sna_damage_box {
 
 static struct sna_damage *__freed_damage;
 
+struct sna_damage_stats sna_damage_stats;
+
 static inline bool region_is_singular(RegionRec *r)
 {
 	return r->data == NULL;
@@ -182,6 +192,7 @@ static struct sna_damage *_sna_damage_create(void)
 	damage->mode = DAMAGE_ADD;
 	pixman_region_init(&damage->region);
 	reset_extents(damage);
+	damage->tiles = NULL;
 
 	return damage;
 }
@@ -396,6 +407,329 @@ _sna_damage_create_elt_from_points(struct sna_damage *damage,
 	return damage;
 }
 
+/*
+ * Alongside a complex region we maintain a coarse map of the damage in
+ * 64x64 tiles: one bit per tile that the damage may touch, and one bit per
+ * tile that we know to be entirely covered. Both are updated incrementally
+ * as boxes are added or subtracted (including those still pending in the
+ * box lists), so that the majority of contains_box() queries can be
+ * answered without forcing a reduction of the accumulated boxes.
+ *
+ * The invariant is: full <= damage <= touched. Everything outside the
+ * grid is known to be undamaged; adding damage outside the grid discards
+ * the map until the next reduction rebuilds it.
+ */
+#define DAMAGE_TILE_SHIFT 6
+#define DAMAGE_TILE_SIZE (1 << DAMAGE_TILE_SHIFT)
+#define DAMAGE_TILES_MIN_BOXES 16
+#define DAMAGE_TILES_MAX (32768 >> DAMAGE_TILE_SHIFT)
+
+struct sna_damage_tiles {
+	int width, height; /* in tiles */
+	int stride; /* in words */
+	uint32_t *touched;
+	uint32_t *full;
+};
+
+static bool use_damage_tiles = true;
+
+void sna_damage_set_tiles(bool enable)
+{
+	use_damage_tiles = enable;
+}
+
+static inline uint32_t tile_mask(int x, int n)
+{
+	return (n == 32 ? ~0u : (1u << n) - 1) << x;
+}
+
+static void tiles_span_set(uint32_t *row, int x1, int x2)
+{
+	while (x1 < x2) {
+		int n = MIN(32 - (x1 & 31), x2 - x1);
+		row[x1 >> 5] |= tile_mask(x1 & 31, n);
+		x1 += n;
+	}
+}
+
+static void tiles_span_clear(uint32_t *row, int x1, int x2)
+{
+	while (x1 < x2) {
+		int n = MIN(32 - (x1 & 31), x2 - x1);
+		row[x1 >> 5] &= ~tile_mask(x1 & 31, n);
+		x1 += n;
+	}
+}
+
+static bool tiles_span_any(const uint32_t *row, int x1, int x2)
+{
+	while (x1 < x2) {
+		int n = MIN(32 - (x1 & 31), x2 - x1);
+		if (row[x1 >> 5] & tile_mask(x1 & 31, n))
+			return true;
+		x1 += n;
+	}
+	return false;
+}
+
+static bool tiles_span_all(const uint32_t *row, int x1, int x2)
+{
+	while (x1 < x2) {
+		int n = MIN(32 - (x1 & 31), x2 - x1);
+		uint32_t mask = tile_mask(x1 & 31, n);
+		if ((row[x1 >> 5] & mask) != mask)
+			return false;
+		x1 += n;
+	}
+	return true;
+}
+
+/* Clip the box to the grid, returning the tiles it overlaps in @o and the
+ * tiles it completely covers in @c (which may be empty).
+ */
+static bool tiles_clip_box(const struct sna_damage_tiles *t,
+			   const BoxRec *box, BoxRec *o, BoxRec *c)
+{
+	int x1 = MAX(box->x1, 0);
+	int y1 = MAX(box->y1, 0);
+	int x2 = MIN(box->x2, t->width << DAMAGE_TILE_SHIFT);
+	int y2 = MIN(box->y2, t->height << DAMAGE_TILE_SHIFT);
+
+	if (x2 <= x1 || y2 <= y1)
+		return false;
+
+	o->x1 = x1 >> DAMAGE_TILE_SHIFT;
+	o->y1 = y1 >> DAMAGE_TILE_SHIFT;
+	o->x2 = (x2 + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT;
+	o->y2 = (y2 + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT;
+
+	c->x1 = (x1 + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT;
+	c->y1 = (y1 + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT;
+	c->x2 = x2 >> DAMAGE_TILE_SHIFT;
+	c->y2 = y2 >> DAMAGE_TILE_SHIFT;
+
+	return true;
+}
+
+static bool tiles_add_box(struct sna_damage_tiles *t, const BoxRec *box)
+{
+	BoxRec o, c;
+	int y;
+
+	if (box->x1 < 0 || box->y1 < 0 ||
+	    box->x2 > t->width << DAMAGE_TILE_SHIFT ||
+	    box->y2 > t->height << DAMAGE_TILE_SHIFT)
+		return false;
+
+	if (!tiles_clip_box(t, box, &o, &c))
+		return true;
+
+	for (y = o.y1; y < o.y2; y++)
+		tiles_span_set(t->touched + y * t->stride, o.x1, o.x2);
+
+	if (c.x2 > c.x1)
+		for (y = c.y1; y < c.y2; y++)
+			tiles_span_set(t->full + y * t->stride, c.x1, c.x2);
+
+	return true;
+}
+
+static void tiles_subtract_box(struct sna_damage_tiles *t, const BoxRec *box)
+{
+	BoxRec o, c;
+	int y;
+
+	if (!tiles_clip_box(t, box, &o, &c))
+		return;
+
+	for (y = o.y1; y < o.y2; y++)
+		tiles_span_clear(t->full + y * t->stride, o.x1, o.x2);
+
+	if (c.x2 > c.x1)
+		for (y = c.y1; y < c.y2; y++)
+			tiles_span_clear(t->touched + y * t->stride, c.x1, c.x2);
+}
+
+/* Returns PIXMAN_REGION_IN or PIXMAN_REGION_OUT if the map is conclusive,
+ * and PIXMAN_REGION_PART if the caller must consult the region.
+ */
+static int tiles_contains_box(const struct sna_damage_tiles *t,
+			      const BoxRec *box)
+{
+	BoxRec o, c;
+	bool in;
+	int y;
+
+	if (!tiles_clip_box(t, box, &o, &c))
+		return PIXMAN_REGION_OUT;
+
+	in = (box->x1 >= 0 && box->y1 >= 0 &&
+	      box->x2 <= t->width << DAMAGE_TILE_SHIFT &&
+	      box->y2 <= t->height << DAMAGE_TILE_SHIFT);
+	for (y = o.y1; in && y < o.y2; y++)
+		in = tiles_span_all(t->full + y * t->stride, o.x1, o.x2);
+	if (in)
+		return PIXMAN_REGION_IN;
+
+	for (y = o.y1; y < o.y2; y++)
+		if (tiles_span_any(t->touched + y * t->stride, o.x1, o.x2))
+			return PIXMAN_REGION_PART;
+
+	return PIXMAN_REGION_OUT;
+}
+
+static void damage_tiles_fini(struct sna_damage *damage)
+{
+	free(damage->tiles);
+	damage->tiles = NULL;
+}
+
+static void damage_tiles_init(struct sna_damage *damage)
+{
+	struct sna_damage_tiles *t;
+	const BoxRec *box;
+	int width, height, stride, n;
+
+	assert(damage->tiles == NULL);
+	assert(!damage->dirty);
+
+	if (!use_damage_tiles)
+		return;
+
+	if (REGION_NUM_RECTS(&damage->region) < DAMAGE_TILES_MIN_BOXES)
+		return;
+
+	if (damage->extents.x1 < 0 || damage->extents.y1 < 0)
+		return;
+
+	/* Leave some room for the damage to grow before we have to rebuild */
+	width = ALIGN((damage->extents.x2 + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT, 32);
+	height = ALIGN((damage->extents.y2 + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT, 8);
+	if (width > DAMAGE_TILES_MAX || height > DAMAGE_TILES_MAX)
+		return;
+
+	stride = width / 32;
+	t = calloc(1, sizeof(*t) + 2 * stride * height * sizeof(uint32_t));
+	if (t == NULL)
+		return;
+
+	t->width = width;
+	t->height = height;
+	t->stride = stride;
+	t->touched = (uint32_t *)(t + 1);
+	t->full = t->touched + stride * height;
+
+	box = REGION_RECTS(&damage->region);
+	n = REGION_NUM_RECTS(&damage->region);
+	while (n--) {
+		bool ok = tiles_add_box(t, box++);
+		assert(ok);
+		(void)ok;
+	}
+
+	DBG(("%s: %dx%d tiles for %d boxes\n", __FUNCTION__,
+	     width, height, REGION_NUM_RECTS(&damage->region)));
+	damage->tiles = t;
+}
+
+static inline bool damage_tiles_contains(const struct sna_damage *damage,
+					 const BoxRec *box)
+{
+	return (damage->tiles &&
+		tiles_contains_box(damage->tiles, box) == PIXMAN_REGION_IN);
+}
+
+static void damage_tiles_add_boxes(struct sna_damage *damage,
+				   const BoxRec *box, int n,
+				   int16_t dx, int16_t dy)
+{
+	if (damage->tiles == NULL)
+		return;
+
+	while (n--) {
+		BoxRec b;
+
+		b.x1 = box->x1 + dx;
+		b.y1 = box->y1 + dy;
+		b.x2 = box->x2 + dx;
+		b.y2 = box->y2 + dy;
+		box++;
+
+		if (!tiles_add_box(damage->tiles, &b)) {
+			DBG(("%s: damage outside tile grid, discarding\n",
+			     __FUNCTION__));
+			damage_tiles_fini(damage);
+			return;
+		}
+	}
+}
+
+static void damage_tiles_add_rectangles(struct sna_damage *damage,
+					const xRectangle *r, int n,
+					int16_t dx, int16_t dy)
+{
+	if (damage->tiles == NULL)
+		return;
+
+	while (n--) {
+		BoxRec b;
+
+		b.x1 = r->x + dx;
+		b.y1 = r->y + dy;
+		b.x2 = b.x1 + r->width;
+		b.y2 = b.y1 + r->height;
+		r++;
+
+		if (!tiles_add_box(damage->tiles, &b)) {
+			damage_tiles_fini(damage);
+			return;
+		}
+	}
+}
+
+static void damage_tiles_add_points(struct sna_damage *damage,
+				    const DDXPointRec *p, int n,
+				    int16_t dx, int16_t dy)
+{
+	if (damage->tiles == NULL)
+		return;
+
+	while (n--) {
+		BoxRec b;
+
+		b.x1 = p->x + dx;
+		b.y1 = p->y + dy;
+		b.x2 = b.x1 + 1;
+		b.y2 = b.y1 + 1;
+		p++;
+
+		if (!tiles_add_box(damage->tiles, &b)) {
+			damage_tiles_fini(damage);
+			return;
+		}
+	}
+}
+
+static void damage_tiles_subtract_boxes(struct sna_damage *damage,
+					const BoxRec *box, int n,
+					int dx, int dy)
+{
+	if (damage->tiles == NULL)
+		return;
+
+	while (n--) {
+		BoxRec b;
+
+		b.x1 = box->x1 + dx;
+		b.y1 = box->y1 + dy;
+		b.x2 = box->x2 + dx;
+		b.y2 = box->y2 + dy;
+		box++;
+
+		tiles_subtract_box(damage->tiles, &b);
+	}
+}
+
 static void free_list(struct list *head)
 {
 	while (!list_is_empty(head)) {
@@ -424,6 +758,9 @@ static void __sna_damage_reduce(struct sna_damage *damage)
 	nboxes -= damage->remain;
 	if (nboxes == 0)
 		goto done;
+
+	sna_damage_stats.reductions++;
+	sna_damage_stats.reduced_boxes += nboxes;
 	if (nboxes == 1) {
 		pixman_region16_t tmp;
 
@@ -450,8 +787,10 @@ static void __sna_damage_reduce(struct sna_damage *damage)
 	DBG(("   last box count=%d/%d, need=%d\n", n, iter->size, nboxes));
 	if (nboxes > iter->size) {
 		boxes = malloc(sizeof(BoxRec)*nboxes);
-		if (boxes == NULL)
+		if (boxes == NULL) {
+			damage_tiles_fini(damage);
 			goto done;
+		}
 
 		free_boxes = boxes;
 	}
@@ -528,10 +867,67 @@ done:
 	damage->mode = DAMAGE_ADD;
 	free_list(&damage->embedded_box.list);
 	reset_embedded_box(damage);
+	if (damage->tiles == NULL)
+		damage_tiles_init(damage);
 
 	DBG(("    reduce: after region.n=%d\n", REGION_NUM_RECTS(region)));
 }
 
+/* Compute the bounding box of a set of boxes, two at a time using the
+ * packed 16-bit min/max where available.
+ */
+static void boxes_extents(const BoxRec *box, int n, BoxRec *extents)
+{
+#if USE_SSE2
+	__m128i lo, hi, v;
+#endif
+	int i;
+
+	assert(n);
+#ifndef NDEBUG
+	for (i = 0; i < n; i++)
+		assert(box[i].x2 > box[i].x1 && box[i].y2 > box[i].y1);
+#endif
+
+#if USE_SSE2
+	if (n & 1) {
+		v = _mm_loadl_epi64((const __m128i *)box);
+		lo = hi = _mm_unpacklo_epi64(v, v);
+		box++;
+	} else {
+		lo = hi = _mm_loadu_si128((const __m128i *)box);
+		box += 2;
+		n -= 2;
+	}
+	for (i = n >> 1; i--; box += 2) {
+		v = _mm_loadu_si128((const __m128i *)box);
+		lo = _mm_min_epi16(lo, v);
+		hi = _mm_max_epi16(hi, v);
+	}
+	lo = _mm_min_epi16(lo, _mm_unpackhi_epi64(lo, lo));
+	hi = _mm_max_epi16(hi, _mm_unpackhi_epi64(hi, hi));
+
+	extents->x1 = _mm_extract_epi16(lo, 0);
+	extents->y1 = _mm_extract_epi16(lo, 1);
+	extents->x2 = _mm_extract_epi16(hi, 2);
+	extents->y2 = _mm_extract_epi16(hi, 3);
+#else
+	*extents = box[0];
+	for (i = 1; i < n; i++) {
+		if (extents->x1 > box[i].x1)
+			extents->x1 = box[i].x1;
+		if (extents->x2 < box[i].x2)
+			extents->x2 = box[i].x2;
+		if (extents->y1 > box[i].y1)
+			extents->y1 = box[i].y1;
+		if (extents->y2 < box[i].y2)
+			extents->y2 = box[i].y2;
+	}
+#endif
+
+	assert(extents->y2 > extents->y1 && extents->x2 > extents->x1);
+}
+
 static void damage_union(struct sna_damage *damage, const BoxRec *box)
 {
 	DBG(("%s: extending damage (%d, %d), (%d, %d) by (%d, %d), (%d, %d)\n",
@@ -594,14 +990,19 @@ static struct sna_damage *__sna_damage_add_box(struct sna_damage *damage,
 		assert(damage->region.extents.x2 > damage->region.extents.x1);
 		assert(damage->region.extents.y2 > damage->region.extents.y1);
 		damage_union(damage, box);
+		damage_tiles_add_boxes(damage, box, 1, 0, 0);
 		return damage;
 	}
 
+	if (damage_tiles_contains(damage, box))
+		return damage;
+
 	if (pixman_region_contains_rectangle(&damage->region,
 					     (BoxPtr)box) == PIXMAN_REGION_IN)
 		return damage;
 
 	damage_union(damage, box);
+	damage_tiles_add_boxes(damage, box, 1, 0, 0);
 	return _sna_damage_create_elt(damage, box, 1);
 }
 
@@ -631,14 +1032,25 @@ inline static struct sna_damage *__sna_damage_add(struct sna_damage *damage,
 		assert(damage->region.extents.x2 > damage->region.extents.x1);
 		assert(damage->region.extents.y2 > damage->region.extents.y1);
 		damage_union(damage, &region->extents);
+		damage_tiles_add_boxes(damage,
+				       REGION_RECTS(region),
+				       REGION_NUM_RECTS(region),
+				       0, 0);
 		return damage;
 	}
 
+	if (damage_tiles_contains(damage, &region->extents))
+		return damage;
+
 	if (pixman_region_contains_rectangle(&damage->region,
 					     &region->extents) == PIXMAN_REGION_IN)
 		return damage;
 
 	damage_union(damage, &region->extents);
+	damage_tiles_add_boxes(damage,
+			       REGION_RECTS(region),
+			       REGION_NUM_RECTS(region),
+			       0, 0);
 	return _sna_damage_create_elt(damage,
 				      REGION_RECTS(region),
 				      REGION_NUM_RECTS(region));
@@ -679,7 +1091,6 @@ __sna_damage_add_boxes(struct sna_damage *damage,
 		       int16_t dx, int16_t dy)
 {
 	BoxRec extents;
-	int i;
 
 	assert(n);
 
@@ -696,21 +1107,7 @@ __sna_damage_add_boxes(struct sna_damage *damage,
 		break;
 	}
 
-	assert(box[0].x2 > box[0].x1 && box[0].y2 > box[0].y1);
-	extents = box[0];
-	for (i = 1; i < n; i++) {
-		assert(box[i].x2 > box[i].x1 && box[i].y2 > box[i].y1);
-		if (extents.x1 > box[i].x1)
-			extents.x1 = box[i].x1;
-		if (extents.x2 < box[i].x2)
-			extents.x2 = box[i].x2;
-		if (extents.y1 > box[i].y1)
-			extents.y1 = box[i].y1;
-		if (extents.y2 < box[i].y2)
-			extents.y2 = box[i].y2;
-	}
-
-	assert(extents.y2 > extents.y1 && extents.x2 > extents.x1);
+	boxes_extents(box, n, &extents);
 
 	extents.x1 += dx;
 	extents.x2 += dx;
@@ -720,11 +1117,15 @@ __sna_damage_add_boxes(struct sna_damage *damage,
 	if (n == 1)
 		return __sna_damage_add_box(damage, &extents);
 
+	if (damage_tiles_contains(damage, &extents))
+		return damage;
+
 	if (pixman_region_contains_rectangle(&damage->region,
 					     &extents) == PIXMAN_REGION_IN)
 		return damage;
 
 	damage_union(damage, &extents);
+	damage_tiles_add_boxes(damage, box, n, dx, dy);
 	return _sna_damage_create_elt_from_boxes(damage, box, n, dx, dy);
 }
 
@@ -759,6 +1160,71 @@ struct sna_damage *_sna_damage_add_boxes(struct sna_damage *damage,
 }
 #endif
 
+/*
+ * Rather than build the list of boxes on the stack and then copy them into
+ * the damage, an operation may write its boxes directly into the pending
+ * list. The space returned is only valid until the next call upon the
+ * damage, and is never more than remains in the current chunk so that only
+ * the last chunk is ever left partially filled.
+ */
+BoxPtr _sna_damage_reserve(struct sna_damage **_damage, int *count)
+{
+	struct sna_damage *damage = *_damage;
+
+	assert(*count > 0);
+
+	if (!damage) {
+		damage = _sna_damage_create();
+		if (damage == NULL)
+			return NULL;
+		*_damage = damage;
+	} else switch (damage->mode) {
+	case DAMAGE_ALL:
+		return NULL;
+	case DAMAGE_SUBTRACT:
+		__sna_damage_reduce(damage);
+	case DAMAGE_ADD:
+		break;
+	}
+
+	if (damage->remain == 0 &&
+	    !_sna_damage_create_boxes(damage, *count))
+		return NULL;
+
+	if (*count > damage->remain)
+		*count = damage->remain;
+
+	DBG(("%s: reserved %d boxes\n", __FUNCTION__, *count));
+	return damage->box;
+}
+
+void _sna_damage_commit(struct sna_damage *damage, int n)
+{
+	BoxRec extents;
+
+	DBG(("%s: committing %d boxes\n", __FUNCTION__, n));
+
+	assert(n > 0 && n <= damage->remain);
+	assert(damage->mode == DAMAGE_ADD);
+
+	boxes_extents(damage->box, n, &extents);
+
+	/* Already damaged? Leave the reservation to be overwritten. */
+	if (damage_tiles_contains(damage, &extents))
+		return;
+
+	if (pixman_region_contains_rectangle(&damage->region,
+					     &extents) == PIXMAN_REGION_IN)
+		return;
+
+	damage_union(damage, &extents);
+	damage_tiles_add_boxes(damage, damage->box, n, 0, 0);
+
+	damage->box += n;
+	damage->remain -= n;
+	damage->dirty = true;
+}
+
 inline static struct sna_damage *
 __sna_damage_add_rectangles(struct sna_damage *damage,
 			    const xRectangle *r, int n,
@@ -809,11 +1275,15 @@ __sna_damage_add_rectangles(struct sna_damage *damage,
 		break;
 	}
 
+	if (damage_tiles_contains(damage, &extents))
+		return damage;
+
 	if (pixman_region_contains_rectangle(&damage->region,
 					     &extents) == PIXMAN_REGION_IN)
 		return damage;
 
 	damage_union(damage, &extents);
+	damage_tiles_add_rectangles(damage, r, n, dx, dy);
 	return _sna_damage_create_elt_from_rectangles(damage, r, n, dx, dy);
 }
 
@@ -893,11 +1363,15 @@ __sna_damage_add_points(struct sna_damage *damage,
 		break;
 	}
 
+	if (damage_tiles_contains(damage, &extents))
+		return damage;
+
 	if (pixman_region_contains_rectangle(&damage->region,
 					     &extents) == PIXMAN_REGION_IN)
 		return damage;
 
 	damage_union(damage, &extents);
+	damage_tiles_add_points(damage, p, n, dx, dy);
 	_sna_damage_create_elt_from_points(damage, p, n, dx, dy);
 
 	return damage;
@@ -971,6 +1445,7 @@ struct sna_damage *__sna_damage_all(struct sna_damage *damage,
 		pixman_region_fini(&damage->region);
 		free_list(&damage->embedded_box.list);
 		reset_embedded_box(damage);
+		damage_tiles_fini(damage);
 	} else {
 		damage = _sna_damage_create();
 		if (damage == NULL)
@@ -1017,6 +1492,15 @@ struct sna_damage *_sna_damage_is_all(struct sna_damage *damage,
 	return __sna_damage_all(damage, width, height);
 }
 
+static bool damage_is_empty(const struct sna_damage *damage)
+{
+	/* Boxes still pending addition are not yet part of the region */
+	if (damage->dirty && damage->mode == DAMAGE_ADD)
+		return false;
+
+	return RegionNil(&damage->region);
+}
+
 static bool box_contains(const BoxRec *a, const BoxRec *b)
 {
 	if (b->x1 < a->x1 || b->x2 > a->x2)
@@ -1034,7 +1518,7 @@ static struct sna_damage *__sna_damage_subtract(struct sna_damage *damage,
 	if (damage == NULL)
 		return NULL;
 
-	if (RegionNil(&damage->region)) {
+	if (damage_is_empty(damage)) {
 no_damage:
 		__sna_damage_destroy(damage);
 		return NULL;
@@ -1081,6 +1565,7 @@ no_damage:
 				goto no_damage;
 
 			damage->extents = damage->region.extents;
+			damage_tiles_subtract_boxes(damage, &region->extents, 1, 0, 0);
 			assert(pixman_region_not_empty(&damage->region));
 			return damage;
 		}
@@ -1088,6 +1573,10 @@ no_damage:
 		damage->mode = DAMAGE_SUBTRACT;
 	}
 
+	damage_tiles_subtract_boxes(damage,
+				    REGION_RECTS(region),
+				    REGION_NUM_RECTS(region),
+				    0, 0);
 	return _sna_damage_create_elt(damage,
 				      REGION_RECTS(region),
 				      REGION_NUM_RECTS(region));
@@ -1127,7 +1616,7 @@ inline static struct sna_damage *__sna_damage_subtract_box(struct sna_damage *da
 	if (damage == NULL)
 		return NULL;
 
-	if (RegionNil(&damage->region)) {
+	if (damage_is_empty(damage)) {
 		__sna_damage_destroy(damage);
 		return NULL;
 	}
@@ -1155,12 +1644,14 @@ inline static struct sna_damage *__sna_damage_subtract_box(struct sna_damage *da
 					       &region);
 			damage->extents = damage->region.extents;
 			damage->mode = DAMAGE_ADD;
+			damage_tiles_subtract_boxes(damage, box, 1, 0, 0);
 			return damage;
 		}
 
 		damage->mode = DAMAGE_SUBTRACT;
 	}
 
+	damage_tiles_subtract_boxes(damage, box, 1, 0, 0);
 	return _sna_damage_create_elt(damage, box, 1);
 }
 
@@ -1194,33 +1685,18 @@ static struct sna_damage *__sna_damage_subtract_boxes(struct sna_damage *damage,
 						      int dx, int dy)
 {
 	BoxRec extents;
-	int i;
 
 	if (damage == NULL)
 		return NULL;
 
-	if (RegionNil(&damage->region)) {
+	if (damage_is_empty(damage)) {
 		__sna_damage_destroy(damage);
 		return NULL;
 	}
 
 	assert(n);
 
-	assert(box[0].x2 > box[0].x1 && box[0].y2 > box[0].y1);
-	extents = box[0];
-	for (i = 1; i < n; i++) {
-		assert(box[i].x2 > box[i].x1 && box[i].y2 > box[i].y1);
-		if (extents.x1 > box[i].x1)
-			extents.x1 = box[i].x1;
-		if (extents.x2 < box[i].x2)
-			extents.x2 = box[i].x2;
-		if (extents.y1 > box[i].y1)
-			extents.y1 = box[i].y1;
-		if (extents.y2 < box[i].y2)
-			extents.y2 = box[i].y2;
-	}
-
-	assert(extents.y2 > extents.y1 && extents.x2 > extents.x1);
+	boxes_extents(box, n, &extents);
 
 	extents.x1 += dx;
 	extents.x2 += dx;
@@ -1242,6 +1718,7 @@ static struct sna_damage *__sna_damage_subtract_boxes(struct sna_damage *damage,
 		damage->mode = DAMAGE_SUBTRACT;
 	}
 
+	damage_tiles_subtract_boxes(damage, box, n, dx, dy);
 	return _sna_damage_create_elt_from_boxes(damage, box, n, dx, dy);
 }
 
@@ -1289,6 +1766,12 @@ static int __sna_damage_contains_box(struct sna_damage *damage,
 	if (!sna_damage_overlaps_box(damage, box))
 		return PIXMAN_REGION_OUT;
 
+	if (damage->tiles) {
+		ret = tiles_contains_box(damage->tiles, box);
+		if (ret != PIXMAN_REGION_PART)
+			return ret;
+	}
+
 	ret = pixman_region_contains_rectangle(&damage->region, (BoxPtr)box);
 	if (!damage->dirty)
 		return ret;
@@ -1343,6 +1826,9 @@ bool _sna_damage_contains_box__no_reduce(const struct sna_damage *damage,
 	if (!sna_damage_overlaps_box(damage, box))
 		return false;
 
+	if (damage_tiles_contains(damage, box))
+		return true;
+
 	return pixman_region_contains_rectangle((RegionPtr)&damage->region,
 						(BoxPtr)box) == PIXMAN_REGION_IN;
 }
@@ -1447,6 +1933,76 @@ int _sna_damage_get_boxes(struct sna_damage *damage, BoxPtr *boxes)
 }
 #endif
 
+bool _sna_damage_get_tiles(struct sna_damage *damage, RegionPtr region)
+{
+	const struct sna_damage_tiles *t = damage->tiles;
+	BoxPtr boxes, b;
+	int x, y, n;
+	bool ret;
+
+	if (t == NULL)
+		return false;
+
+	assert(damage->mode != DAMAGE_ALL);
+
+	/* Count the horizontal runs of touched tiles in each tile row */
+	n = 0;
+	for (y = 0; y < t->height; y++) {
+		const uint32_t *row = t->touched + y * t->stride;
+		uint32_t prev = 0;
+
+		for (x = 0; x < t->stride; x++) {
+			n += __builtin_popcount(row[x] & ~(row[x] << 1 | prev >> 31));
+			prev = row[x];
+		}
+	}
+	if (n == 0)
+		return false;
+
+	boxes = malloc(sizeof(BoxRec) * n);
+	if (boxes == NULL)
+		return false;
+
+	b = boxes;
+	for (y = 0; y < t->height; y++) {
+		const uint32_t *row = t->touched + y * t->stride;
+
+		x = 0;
+		while (x < t->width) {
+			int x1;
+
+			if (row[x >> 5] == 0) {
+				x += 32;
+				continue;
+			}
+			if ((row[x >> 5] & (1u << (x & 31))) == 0) {
+				x++;
+				continue;
+			}
+
+			x1 = x;
+			do
+				x++;
+			while (x < t->width && row[x >> 5] & (1u << (x & 31)));
+
+			b->x1 = MAX(x1 << DAMAGE_TILE_SHIFT, damage->extents.x1);
+			b->x2 = MIN(x << DAMAGE_TILE_SHIFT, damage->extents.x2);
+			b->y1 = MAX(y << DAMAGE_TILE_SHIFT, damage->extents.y1);
+			b->y2 = MIN((y + 1) << DAMAGE_TILE_SHIFT, damage->extents.y2);
+			if (b->x2 > b->x1 && b->y2 > b->y1)
+				b++;
+		}
+	}
+	assert(b - boxes <= n);
+
+	ret = pixman_region_init_rects(region, boxes, b - boxes);
+	free(boxes);
+
+	DBG(("%s: %d tile boxes for %d runs\n", __FUNCTION__,
+	     REGION_NUM_RECTS(region), n));
+	return ret && pixman_region_not_empty(region);
+}
+
 struct sna_damage *_sna_damage_combine(struct sna_damage *l,
 				       struct sna_damage *r,
 				       int dx, int dy)
@@ -1456,6 +2012,8 @@ struct sna_damage *_sna_damage_combine(struct sna_damage *l,
 
 	if (pixman_region_not_empty(&r->region)) {
 		pixman_region_translate(&r->region, dx, dy);
+		if (dx | dy)
+			damage_tiles_fini(r);
 		l = __sna_damage_add(l, &r->region);
 	}
 
@@ -1465,6 +2023,7 @@ struct sna_damage *_sna_damage_combine(struct sna_damage *l,
 void __sna_damage_destroy(struct sna_damage *damage)
 {
 	free_list(&damage->embedded_box.list);
+	free(damage->tiles);
 
 	pixman_region_fini(&damage->region);
 	*(void **)damage = __freed_damage;
@@ -1614,6 +2173,30 @@ static bool st_check_equal(struct sna_damage_selftest *test,
 	return true;
 }
 
+static bool st_check_contains(struct sna_damage_selftest *test,
+			      struct sna_damage **damage,
+			      pixman_region16_t *region)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		BoxRec box;
+		int d, r;
+
+		st_damage_init_random_box(test, &box);
+		d = sna_damage_contains_box(*damage, &box);
+		r = pixman_region_contains_rectangle(region, &box);
+		if (d != r) {
+			ErrorF("%s: damage and ref disagree on (%d, %d), (%d, %d): %d != %d\n",
+			       __FUNCTION__,
+			       box.x1, box.y1, box.x2, box.y2, d, r);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 void sna_damage_selftest(void)
 {
 	void (*const op[])(struct sna_damage_selftest *test,
@@ -1629,7 +2212,7 @@ void sna_damage_selftest(void)
 			      struct sna_damage **damage,
 			      pixman_region16_t *region) = {
 		st_check_equal,
-		//st_check_contains,
+		st_check_contains,
 	};
 	char region_buf[120];
 	char damage_buf[1000];
@@ -1647,6 +2230,7 @@ void sna_damage_selftest(void)
 		test.width = 1 + rand() % 2048;
 		test.height = 1 + rand() % 2048;
 
+		sna_damage_set_tiles(rand() & 1);
 		damage = _sna_damage_create();
 		pixman_region_init(&ref);
 
@@ -1664,6 +2248,8 @@ void sna_damage_selftest(void)
 		pixman_region_fini(&ref);
 		sna_damage_destroy(&damage);
 	}
+
+	sna_damage_set_tiles(true);
 }
 #endif
 
@@ -20,6 +20,7 @@ struct sna_damage {
 		int size;
 		BoxRec box[8];
 	} embedded_box;
+	struct sna_damage_tiles *tiles;
 };
 
 #define DAMAGE_IS_ALL(ptr) (((uintptr_t)(ptr))&1)
@@ -27,6 +28,13 @@ struct sna_damage {
 #define DAMAGE_PTR(ptr) ((struct sna_damage *)(((uintptr_t)(ptr))&~1))
 
 struct sna_damage *sna_damage_create(void);
+void sna_damage_set_tiles(bool enable);
+
+/* Running totals of the work done to reduce the accumulated boxes */
+extern struct sna_damage_stats {
+	unsigned long reductions;
+	unsigned long reduced_boxes;
+} sna_damage_stats;
 
 struct sna_damage *_sna_damage_combine(struct sna_damage *l,
 				       struct sna_damage *r,
@@ -68,6 +76,35 @@ static inline void sna_damage_add_boxes(struct sna_damage **damage,
 	*damage = _sna_damage_add_boxes(*damage, box, n, dx, dy);
 }
 
+BoxPtr _sna_damage_reserve(struct sna_damage **damage, int *count);
+static inline BoxPtr sna_damage_reserve(struct sna_damage **damage,
+					BoxPtr fallback, int count,
+					BoxPtr *end)
+{
+	BoxPtr box = fallback;
+
+	if (damage) {
+		assert(!DAMAGE_IS_ALL(*damage));
+		box = _sna_damage_reserve(damage, &count) ?: fallback;
+	}
+	*end = box + count;
+	return box;
+}
+
+void _sna_damage_commit(struct sna_damage *damage, int n);
+static inline void sna_damage_commit(struct sna_damage **damage,
+				     const BoxRec *box, int n)
+{
+	if (damage == NULL || n == 0)
+		return;
+
+	assert(!DAMAGE_IS_ALL(*damage));
+	if (*damage && box == (*damage)->box)
+		_sna_damage_commit(*damage, n);
+	else
+		*damage = _sna_damage_add_boxes(*damage, box, n, 0, 0);
+}
+
 struct sna_damage *_sna_damage_add_rectangles(struct sna_damage *damage,
 					      const xRectangle *r, int n,
 					      int16_t dx, int16_t dy);
@@ -238,6 +275,18 @@ sna_damage_get_boxes(struct sna_damage *damage, BoxPtr *boxes)
 		return _sna_damage_get_boxes(damage, boxes);
 }
 
+bool _sna_damage_get_tiles(struct sna_damage *damage, RegionPtr region);
+static inline bool
+sna_damage_get_tiles(struct sna_damage *damage, RegionPtr region)
+{
+	assert(damage);
+
+	if (DAMAGE_IS_ALL(damage))
+		return false;
+
+	return _sna_damage_get_tiles(damage, region);
+}
+
 struct sna_damage *_sna_damage_reduce(struct sna_damage *damage);
 static inline void sna_damage_reduce(struct sna_damage **damage)
 {
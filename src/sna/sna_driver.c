@@ -435,6 +435,38 @@ static Bool sna_option_cast_to_bool(struct sna *sna, int id, Bool val)
 	return val;
 }
 
+static void sna_setup_threads(struct sna *sna)
+{
+	const char *s;
+	int count = -1;
+	int affinity = SNA_AFFINITY_NONE, requested;
+
+	xf86GetOptValInteger(sna->Options, OPTION_THREADS, &count);
+
+	s = xf86GetOptValString(sna->Options, OPTION_THREAD_AFFINITY);
+	if (s) {
+		if (strcasecmp(s, "llc") == 0 || strcasecmp(s, "cache") == 0)
+			affinity = SNA_AFFINITY_LLC;
+		else if (strcasecmp(s, "node") == 0 || strcasecmp(s, "numa") == 0)
+			affinity = SNA_AFFINITY_NODE;
+		else if (strcasecmp(s, "none") != 0)
+			xf86DrvMsg(sna->scrn->scrnIndex, X_WARNING,
+				   "Unknown ThreadAffinity \"%s\", ignoring\n", s);
+	}
+
+	/* The pool is shared by all screens, only the first configures it */
+	requested = affinity;
+	count = sna_threads_init(count, &affinity);
+	xf86DrvMsg(sna->scrn->scrnIndex,
+		   xf86IsOptionSet(sna->Options, OPTION_THREADS) ? X_CONFIG : X_PROBED,
+		   "Using %d worker threads%s\n", count,
+		   affinity == SNA_AFFINITY_LLC ? ", bound to the last-level cache" :
+		   affinity == SNA_AFFINITY_NODE ? ", bound to the memory node" : "");
+	if (affinity != requested)
+		xf86DrvMsg(sna->scrn->scrnIndex, X_WARNING,
+			   "ThreadAffinity could not be applied, ignoring\n");
+}
+
 /**
  * This is called before ScreenInit to do any require probing of screen
  * configuration.
@@ -539,6 +571,10 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int flags)
 
 	intel_detect_chipset(scrn, sna->pEnt, sna->PciInfo);
 
+	xf86DrvMsg(scrn->scrnIndex, X_PROBED,
+		   "Using %s CPU copy routines\n",
+		   sna_blt_init(sna_cpu_detect()));
+
 	kgem_init(&sna->kgem, fd, sna->PciInfo, sna->info->gen);
 	if (xf86ReturnOptValBool(sna->Options, OPTION_ACCEL_DISABLE, FALSE) ||
 	    !sna_option_cast_to_bool(sna, OPTION_ACCEL_METHOD, TRUE)) {
@@ -547,6 +583,21 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int flags)
 		sna->kgem.wedged = true;
 	}
 
+	if (xf86IsOptionSet(sna->Options, OPTION_VMA_CACHE_SIZE)) {
+		int size = 0;
+
+		xf86GetOptValInteger(sna->Options, OPTION_VMA_CACHE_SIZE, &size);
+		if (size < 0)
+			size = 0;
+		sna->kgem.vma_budget = (uint64_t)size << 20;
+		if (size)
+			xf86DrvMsg(scrn->scrnIndex, X_CONFIG,
+				   "Limiting cached mappings to %d MiB\n", size);
+		else
+			xf86DrvMsg(scrn->scrnIndex, X_CONFIG,
+				   "Not limiting the size of cached mappings\n");
+	}
+
 	if (!xf86ReturnOptValBool(sna->Options,
 				  OPTION_RELAXED_FENCING,
 				  sna->kgem.has_relaxed_fencing)) {
@@ -587,6 +638,8 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int flags)
 	xf86DrvMsg(scrn->scrnIndex, X_CONFIG, "Forcing per-crtc-pixmaps? %s\n",
 		   sna->flags & SNA_FORCE_SHADOW ? "yes" : "no");
 
+	sna_setup_threads(sna);
+
 	if (!sna_mode_pre_init(scrn, sna)) {
 		PreInitCleanup(scrn);
 		return FALSE;
@@ -1190,7 +1243,5 @@ Bool sna_init_scrn(ScrnInfoPtr scrn, int entity_num)
 	xf86SetEntityInstanceForScreen(scrn, entity_num,
 				       xf86GetNumEntityInstances(entity_num)-1);
 
-	sna_threads_init();
-
 	return TRUE;
 }
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+
+/*
+ * Slot allocation for the glyph atlases.
+ *
+ * Each atlas is divided into GLYPH_MIN_SIZE squares, numbered such that
+ * every aligned run of 4^n slots forms a square of GLYPH_MIN_SIZE << n
+ * pixels. A glyph is rounded up to the next such square and recorded
+ * against the first slot it covers.
+ *
+ * The atlas may span several pages, each a separate picture of
+ * GLYPH_CACHE_SIZE slots, with the slots numbered consecutively across
+ * the pages. As GLYPH_CACHE_SIZE is a multiple of the largest square, no
+ * glyph ever straddles two pages.
+ *
+ * The atlas is filled linearly until full, at which point the caller may
+ * choose to add another page. Thereafter we replace glyphs using a clock
+ * (second-chance) policy: each size of square has its own hand sweeping
+ * over the atlas, and a square is only reused once none of the glyphs
+ * within it have been drawn since the hand last passed over them. Glyphs
+ * that are in constant use therefore remain resident, whereas the
+ * previous random replacement would regularly throw out the glyphs of
+ * the very string being drawn.
+ */
+
+static bool glyph_cache_clock = true;
+
+static inline int
+glyph_cache_slots(struct sna_glyph_cache *cache)
+{
+	return cache->num_pages * GLYPH_CACHE_SIZE;
+}
+
+static inline int
+glyph_size_to_count(int size)
+{
+	size /= GLYPH_MIN_SIZE;
+	return size * size;
+}
+
+static inline int
+glyph_count_to_mask(int count)
+{
+	return ~(count - 1);
+}
+
+static inline int
+glyph_size_to_mask(int size)
+{
+	return glyph_count_to_mask(glyph_size_to_count(size));
+}
+
+static inline int
+glyph_size_to_class(int size)
+{
+	return __builtin_ctz(size / GLYPH_MIN_SIZE);
+}
+
+/* Find the glyph covering this slot, if any */
+static int glyph_cache_owner(struct sna_glyph_cache *cache, int pos)
+{
+	int size;
+
+	for (size = GLYPH_MAX_SIZE; size >= GLYPH_MIN_SIZE; size /= 2) {
+		int i = pos & glyph_size_to_mask(size);
+		struct sna_glyph *priv = cache->glyphs[i];
+
+		if (priv && i + glyph_size_to_count(priv->size) > pos)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Clear the reference bits of every glyph within the square, reporting
+ * whether any had been set.
+ */
+static bool glyph_cache_referenced(struct sna_glyph_cache *cache,
+				   int pos, int count)
+{
+	bool used = false;
+	int end = pos + count;
+
+	while (pos < end) {
+		int i = glyph_cache_owner(cache, pos);
+		if (i < 0) {
+			pos++;
+			continue;
+		}
+
+		used |= cache->used[i];
+		cache->used[i] = 0;
+		pos = i + glyph_size_to_count(cache->glyphs[i]->size);
+	}
+
+	return used;
+}
+
+static void glyph_cache_evict(struct sna_glyph_cache *cache,
+			      int pos, int count)
+{
+	int end = pos + count;
+
+	while (pos < end) {
+		struct sna_glyph *priv;
+		int i;
+
+		i = glyph_cache_owner(cache, pos);
+		if (i < 0) {
+			pos++;
+			continue;
+		}
+
+		priv = cache->glyphs[i];
+		DBG(("%s: evicting glyph at %d, size %d\n",
+		     __FUNCTION__, i, priv->size));
+
+		cache->glyphs[i] = NULL;
+		cache->used[i] = 0;
+		priv->atlas = NULL;
+		cache->stats.evictions++;
+
+		pos = i + glyph_size_to_count(priv->size);
+	}
+}
+
+static int glyph_cache_clock_sweep(struct sna_glyph_cache *cache, int size)
+{
+	uint32_t *hand = &cache->evict[glyph_size_to_class(size)];
+	int count = glyph_size_to_count(size);
+	int pos;
+
+	/* After one revolution every reference bit has been cleared, so the
+	 * sweep is bounded.
+	 */
+	do {
+		pos = *hand;
+		*hand = pos + count;
+		if (*hand >= glyph_cache_slots(cache))
+			*hand = 0;
+	} while (glyph_cache_referenced(cache, pos, count));
+
+	DBG(("%s: size=%d, pos=%d\n", __FUNCTION__, size, pos));
+	return pos;
+}
+
+static int glyph_cache_random(struct sna_glyph_cache *cache, int size)
+{
+	return rand() % glyph_cache_slots(cache) & glyph_size_to_mask(size);
+}
+
+static inline int
+glyph_cache_next(struct sna_glyph_cache *cache, int count)
+{
+	return (cache->count + count - 1) & glyph_count_to_mask(count);
+}
+
+/* Would a glyph of this size have to evict another? */
+bool sna_glyph_cache_full(struct sna_glyph_cache *cache, int size)
+{
+	int count = glyph_size_to_count(size);
+	return glyph_cache_next(cache, count) + count > glyph_cache_slots(cache);
+}
+
+/* Reserve a square for a glyph of the given size, evicting whatever
+ * previously occupied it. Returns the first slot of the square, which is
+ * marked as referenced as the new glyph is about to be drawn.
+ */
+int sna_glyph_cache_alloc(struct sna_glyph_cache *cache, int size)
+{
+	int count = glyph_size_to_count(size);
+	int pos;
+
+	assert(size >= GLYPH_MIN_SIZE && size <= GLYPH_MAX_SIZE);
+	assert((size & (size - 1)) == 0);
+	assert(cache->num_pages);
+
+	cache->stats.misses++;
+
+	pos = glyph_cache_next(cache, count);
+	if (pos + count <= glyph_cache_slots(cache)) {
+		cache->count = pos + count;
+	} else {
+		if (glyph_cache_clock)
+			pos = glyph_cache_clock_sweep(cache, size);
+		else
+			pos = glyph_cache_random(cache, size);
+		glyph_cache_evict(cache, pos, count);
+	}
+
+	assert(glyph_cache_owner(cache, pos) < 0);
+	cache->used[pos] = 1;
+	return pos;
+}
+
+void sna_glyph_cache_init(struct sna_glyph_cache *cache)
+{
+	cache->glyphs = NULL;
+	cache->used = NULL;
+	cache->num_pages = 0;
+	cache->count = 0;
+	memset(cache->evict, 0, sizeof(cache->evict));
+}
+
+/* Extend the atlas by another page, so that the next glyph is placed
+ * there without evicting anything. The caller retains ownership of the
+ * picture.
+ */
+bool sna_glyph_cache_add_page(struct sna_glyph_cache *cache,
+			      PicturePtr picture)
+{
+	int slots = glyph_cache_slots(cache);
+	struct sna_glyph **glyphs;
+	uint8_t *used;
+
+	if (cache->num_pages == GLYPH_CACHE_MAX_PAGES)
+		return false;
+
+	glyphs = realloc(cache->glyphs,
+			 (slots + GLYPH_CACHE_SIZE) * sizeof(struct sna_glyph *));
+	if (glyphs == NULL)
+		return false;
+	cache->glyphs = glyphs;
+
+	used = realloc(cache->used, slots + GLYPH_CACHE_SIZE);
+	if (used == NULL)
+		return false;
+	cache->used = used;
+
+	memset(glyphs + slots, 0, GLYPH_CACHE_SIZE * sizeof(struct sna_glyph *));
+	memset(used + slots, 0, GLYPH_CACHE_SIZE);
+
+	DBG(("%s: adding page %d\n", __FUNCTION__, cache->num_pages));
+	cache->picture[cache->num_pages++] = picture;
+	return true;
+}
+
+void sna_glyph_cache_fini(struct sna_glyph_cache *cache)
+{
+	free(cache->glyphs);
+	cache->glyphs = NULL;
+
+	free(cache->used);
+	cache->used = NULL;
+
+	cache->num_pages = 0;
+}
+
+void sna_glyph_cache_set_clock(bool enable)
+{
+	glyph_cache_clock = enable;
+}
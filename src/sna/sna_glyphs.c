@@ -76,11 +76,12 @@
 #define NO_SMALL_MASK 0
 #define NO_GLYPHS_SLOW 0
 #define NO_DISCARD_MASK 0
+#define NO_GLYPH_UPLOAD_BATCH 0
+#define NO_GLYPH_THREADS 0
 
-#define CACHE_PICTURE_SIZE 1024
-#define GLYPH_MIN_SIZE 8
-#define GLYPH_MAX_SIZE 64
-#define GLYPH_CACHE_SIZE (CACHE_PICTURE_SIZE * CACHE_PICTURE_SIZE / (GLYPH_MIN_SIZE * GLYPH_MIN_SIZE))
+#define GLYPH_UPLOAD_MAX 64
+#define GLYPH_UPLOAD_HEIGHT 256
+#define GLYPH_THREADS_MIN 256
 
 #define N_STACK_GLYPHS 512
 
@@ -115,6 +116,11 @@ static inline struct sna_glyph *sna_glyph(GlyphPtr glyph)
 
 #define NeedsComponent(f) (PICT_FORMAT_A(f) != 0 && PICT_FORMAT_RGB(f) != 0)
 
+static const unsigned int glyph_cache_formats[] = {
+	PIXMAN_a8,
+	PIXMAN_a8r8g8b8,
+};
+
 static bool op_is_bounded(uint8_t op)
 {
 	switch (op) {
@@ -137,11 +143,12 @@ void sna_glyphs_close(struct sna *sna)
 
 	for (i = 0; i < ARRAY_SIZE(render->glyph); i++) {
 		struct sna_glyph_cache *cache = &render->glyph[i];
+		int n;
 
-		if (cache->picture)
-			FreePicture(cache->picture, 0);
+		for (n = 0; n < cache->num_pages; n++)
+			FreePicture(cache->picture[n], 0);
 
-		free(cache->glyphs);
+		sna_glyph_cache_fini(cache);
 	}
 	memset(render->glyph, 0, sizeof(render->glyph));
 
@@ -161,23 +168,106 @@ void sna_glyphs_close(struct sna *sna)
 #endif
 }
 
-/* All caches for a single format share a single pixmap for glyph storage,
- * allowing mixing glyphs of different sizes without paying a penalty
- * for switching between source pixmaps. (Note that for a size of font
- * right at the border between two sizes, we might be switching for almost
- * every glyph.)
+/* Allocate another page of glyph storage for the cache of the given
+ * format. The pixmap is pinned so that it is never paged out.
+ */
+static PicturePtr glyph_cache_create_page(ScreenPtr screen, int format)
+{
+	struct sna_pixmap *priv;
+	PixmapPtr pixmap;
+	PicturePtr picture = NULL;
+	PictFormatPtr pPictFormat;
+	CARD32 component_alpha;
+	int depth = PIXMAN_FORMAT_DEPTH(glyph_cache_formats[format]);
+	int error;
+
+	pPictFormat = PictureMatchFormat(screen, depth,
+					 glyph_cache_formats[format]);
+	if (!pPictFormat)
+		return NULL;
+
+	/* Now allocate the pixmap and picture */
+	pixmap = screen->CreatePixmap(screen,
+				      GLYPH_CACHE_PICTURE_SIZE,
+				      GLYPH_CACHE_PICTURE_SIZE,
+				      depth,
+				      SNA_CREATE_GLYPHS);
+	if (!pixmap) {
+		DBG(("%s: failed to allocate pixmap for Glyph cache\n",
+		     __FUNCTION__));
+		return NULL;
+	}
+
+	priv = sna_pixmap(pixmap);
+	if (priv != NULL) {
+		/* Prevent the cache from ever being paged out */
+		priv->pinned = PIN_SCANOUT;
+
+		component_alpha = NeedsComponent(pPictFormat->format);
+		picture = CreatePicture(0, &pixmap->drawable, pPictFormat,
+					CPComponentAlpha, &component_alpha,
+					serverClient, &error);
+	}
+
+	screen->DestroyPixmap(pixmap);
+	if (!picture)
+		return NULL;
+
+	ValidatePicture(picture);
+	assert(picture->pDrawable == &pixmap->drawable);
+	return picture;
+}
+
+static bool glyph_cache_grow(ScreenPtr screen,
+			     struct sna_glyph_cache *cache,
+			     int format)
+{
+	PicturePtr picture;
+
+	if (cache->num_pages >= cache->max_pages)
+		return false;
+
+	picture = glyph_cache_create_page(screen, format);
+	if (picture == NULL)
+		return false;
+
+	if (!sna_glyph_cache_add_page(cache, picture)) {
+		FreePicture(picture, 0);
+		return false;
+	}
+
+	return true;
+}
+
+/* Limit the pinned glyph pages to a small fraction of the aperture, so
+ * that they never crowd out the working set of a batch.
+ */
+static int glyph_cache_max_pages(struct sna *sna, int format)
+{
+	int bpp = PIXMAN_FORMAT_BPP(glyph_cache_formats[format]);
+	uint32_t page = GLYPH_CACHE_PICTURE_SIZE * GLYPH_CACHE_PICTURE_SIZE * bpp / 8;
+	uint32_t pages = sna->kgem.aperture_low / 32 / page;
+
+	if (pages < 1)
+		pages = 1;
+	if (pages > GLYPH_CACHE_MAX_PAGES)
+		pages = GLYPH_CACHE_MAX_PAGES;
+	return pages;
+}
+
+/* All glyphs for a single format share a single atlas, allowing mixing
+ * glyphs of different sizes without paying a penalty for switching
+ * between source pixmaps. The atlas starts as a single page and grows,
+ * up to a limit set by the size of the aperture, as more glyphs are
+ * needed.
  *
- * This function allocates the storage pixmap, and then fills in the
- * rest of the allocated structures for all caches with the given format.
+ * This function allocates the first page of storage, and then fills in
+ * the rest of the allocated structures for all caches.
  */
 bool sna_glyphs_create(struct sna *sna)
 {
 	ScreenPtr screen = sna->scrn->pScreen;
 	pixman_color_t white = { 0xffff, 0xffff, 0xffff, 0xffff };
-	unsigned int formats[] = {
-		PIXMAN_a8,
-		PIXMAN_a8r8g8b8,
-	};
 	unsigned int i;
 	int error;
 
@@ -205,57 +295,16 @@ bool sna_glyphs_create(struct sna *sna)
 		return true;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+	for (i = 0; i < ARRAY_SIZE(glyph_cache_formats); i++) {
 		struct sna_glyph_cache *cache = &sna->render.glyph[i];
-		struct sna_pixmap *priv;
-		PixmapPtr pixmap;
-		PicturePtr picture = NULL;
-		PictFormatPtr pPictFormat;
-		CARD32 component_alpha;
-		int depth = PIXMAN_FORMAT_DEPTH(formats[i]);
-
-		pPictFormat = PictureMatchFormat(screen, depth, formats[i]);
-		if (!pPictFormat)
-			goto bail;
 
-		/* Now allocate the pixmap and picture */
-		pixmap = screen->CreatePixmap(screen,
-					      CACHE_PICTURE_SIZE,
-					      CACHE_PICTURE_SIZE,
-					      depth,
-					      SNA_CREATE_GLYPHS);
-		if (!pixmap) {
-			DBG(("%s: failed to allocate pixmap for Glyph cache\n",
-			     __FUNCTION__));
-			goto bail;
-		}
-
-		priv = sna_pixmap(pixmap);
-		if (priv != NULL) {
-			/* Prevent the cache from ever being paged out */
-			priv->pinned = PIN_SCANOUT;
+		sna_glyph_cache_init(cache);
+		cache->max_pages = glyph_cache_max_pages(sna, i);
+		DBG(("%s: format %d, up to %d pages\n",
+		     __FUNCTION__, i, cache->max_pages));
 
-			component_alpha = NeedsComponent(pPictFormat->format);
-			picture = CreatePicture(0, &pixmap->drawable, pPictFormat,
-						CPComponentAlpha, &component_alpha,
-						serverClient, &error);
-		}
-
-		screen->DestroyPixmap(pixmap);
-		if (!picture)
+		if (!glyph_cache_grow(screen, cache, i))
 			goto bail;
-
-		ValidatePicture(picture);
-		assert(picture->pDrawable == &pixmap->drawable);
-
-		cache->count = cache->evict = 0;
-		cache->picture = picture;
-		cache->glyphs = calloc(sizeof(struct sna_glyph *),
-				       GLYPH_CACHE_SIZE);
-		if (!cache->glyphs)
-			goto bail;
-
-		cache->evict = rand() % GLYPH_CACHE_SIZE;
 	}
 
 	sna->render.white_picture =
@@ -271,7 +320,7 @@ bail:
 }
 
 static void
-glyph_cache_upload(struct sna_glyph_cache *cache,
+glyph_cache_upload(struct sna_glyph_cache *cache, PicturePtr atlas,
 		   GlyphPtr glyph, PicturePtr glyph_picture,
 		   int16_t x, int16_t y)
 {
@@ -280,8 +329,9 @@ glyph_cache_upload(struct sna_glyph_cache *cache,
 	     glyph, x, y,
 	     glyph_picture->pDrawable->width,
 	     glyph_picture->pDrawable->height));
+	cache->stats.uploads++;
 	sna_composite(PictOpSrc,
-		      glyph_picture, 0, cache->picture,
+		      glyph_picture, 0, atlas,
 		      0, 0,
 		      0, 0,
 		      x, y,
@@ -289,6 +339,255 @@ glyph_cache_upload(struct sna_glyph_cache *cache,
 		      glyph_picture->pDrawable->height);
 }
 
+static pixman_image_t *
+__sna_glyph_get_image(GlyphPtr g, ScreenPtr s)
+{
+	pixman_image_t *image;
+	PicturePtr p;
+	int dx, dy;
+
+	p = GetGlyphPicture(g, s);
+	if (unlikely(p == NULL))
+		return NULL;
+
+	image = image_from_pict(p, FALSE, &dx, &dy);
+	if (!image)
+		return NULL;
+
+	assert(dx == 0 && dy == 0);
+	return sna_glyph(g)->image = image;
+}
+
+static inline pixman_image_t *
+sna_glyph_get_image(GlyphPtr g, ScreenPtr s)
+{
+	pixman_image_t *image;
+
+	image = sna_glyph(g)->image;
+	if (image == NULL)
+		image = __sna_glyph_get_image(g, s);
+
+	return image;
+}
+
+/* Newly cached glyphs are not uploaded one composite at a time, but are
+ * packed into rows of a staging buffer and then copied into the atlas
+ * using a single copy operation per page. One batch is kept per format,
+ * each staging buffer being at most GLYPH_CACHE_PICTURE_SIZE by
+ * GLYPH_UPLOAD_HEIGHT pixels in the format of its atlas.
+ */
+struct glyph_upload {
+	struct glyph_upload_entry {
+		GlyphPtr glyph;
+		PicturePtr picture;
+		PicturePtr atlas;
+		uint32_t pos;
+		int16_t sx, sy;
+		int16_t dx, dy;
+	} entry[GLYPH_UPLOAD_MAX];
+	int count;
+	int16_t x, y, row;
+};
+
+static void glyph_upload_init(struct glyph_upload *upload)
+{
+	upload->count = 0;
+	upload->x = upload->y = upload->row = 0;
+}
+
+static void glyph_upload_fallback(struct sna_glyph_cache *cache,
+				  struct glyph_upload *upload)
+{
+	int n;
+
+	for (n = 0; n < upload->count; n++) {
+		struct glyph_upload_entry *e = &upload->entry[n];
+		struct sna_glyph *priv = sna_glyph(e->glyph);
+
+		if (priv->atlas == e->atlas && priv->pos == e->pos)
+			glyph_cache_upload(cache, e->atlas,
+					   e->glyph, e->picture,
+					   e->dx, e->dy);
+	}
+}
+
+static void glyph_upload_flush(struct sna *sna,
+			       struct sna_glyph_cache *cache,
+			       struct glyph_upload *upload)
+{
+	PixmapRec tmp;
+	struct kgem_bo *bo;
+	pixman_image_t *staging;
+	void *ptr;
+	int page, n, m;
+
+	if (upload->count == 0)
+		return;
+
+	/* A single row need only be as wide as its glyphs */
+	tmp.drawable.width = upload->y ? GLYPH_CACHE_PICTURE_SIZE : upload->x;
+	tmp.drawable.height = upload->y + upload->row;
+	tmp.drawable.depth = cache->picture[0]->pDrawable->depth;
+	tmp.drawable.bitsPerPixel = cache->picture[0]->pDrawable->bitsPerPixel;
+	tmp.devPrivate.ptr = NULL;
+
+	DBG(("%s: uploading %d glyphs from %dx%d\n", __FUNCTION__,
+	     upload->count, tmp.drawable.width, tmp.drawable.height));
+
+	bo = kgem_create_buffer_2d(&sna->kgem,
+				   tmp.drawable.width,
+				   tmp.drawable.height,
+				   tmp.drawable.bitsPerPixel,
+				   KGEM_BUFFER_WRITE_INPLACE,
+				   &ptr);
+	if (bo == NULL)
+		goto fallback;
+
+	staging = pixman_image_create_bits(cache->picture[0]->format,
+					   tmp.drawable.width,
+					   tmp.drawable.height,
+					   ptr, bo->pitch);
+	if (staging == NULL) {
+		kgem_bo_destroy(&sna->kgem, bo);
+		goto fallback;
+	}
+
+	for (n = 0; n < upload->count; n++) {
+		struct glyph_upload_entry *e = &upload->entry[n];
+		struct sna_glyph *priv = sna_glyph(e->glyph);
+		pixman_image_t *image;
+
+		/* Evicted again before we got around to uploading? */
+		if (priv->atlas != e->atlas || priv->pos != e->pos) {
+			e->glyph = NULL;
+			continue;
+		}
+
+		image = sna_glyph_get_image(e->glyph, sna->scrn->pScreen);
+		if (image == NULL) {
+			glyph_cache_upload(cache, e->atlas,
+					   e->glyph, e->picture,
+					   e->dx, e->dy);
+			e->glyph = NULL;
+			continue;
+		}
+
+		pixman_image_composite(PictOpSrc, image, NULL, staging,
+				       0, 0,
+				       0, 0,
+				       e->sx, e->sy,
+				       e->glyph->info.width,
+				       e->glyph->info.height);
+	}
+	pixman_image_unref(staging);
+
+	for (page = 0; page < cache->num_pages; page++) {
+		PicturePtr atlas = cache->picture[page];
+		PixmapPtr pixmap = get_drawable_pixmap(atlas->pDrawable);
+		struct sna_copy_op copy;
+		struct sna_pixmap *priv;
+		bool active = false;
+
+		for (n = 0; n < upload->count; n++) {
+			struct glyph_upload_entry *e = &upload->entry[n];
+
+			if (e->glyph == NULL || e->atlas != atlas)
+				continue;
+
+			if (!active) {
+				priv = sna_pixmap_move_to_gpu(pixmap, MOVE_READ | MOVE_WRITE);
+				memset(&copy, 0, sizeof(copy));
+				if (priv == NULL ||
+				    !sna->render.copy(sna, GXcopy,
+						      &tmp, bo,
+						      pixmap, priv->gpu_bo,
+						      &copy)) {
+					DBG(("%s: fallback -- copy to page %d failed\n",
+					     __FUNCTION__, page));
+					break;
+				}
+				active = true;
+			}
+
+			copy.blt(sna, &copy,
+				 e->sx, e->sy,
+				 e->glyph->info.width, e->glyph->info.height,
+				 e->dx, e->dy);
+			e->glyph = NULL;
+		}
+		if (active) {
+			copy.done(sna, &copy);
+			cache->stats.uploads++;
+		}
+	}
+	kgem_bo_destroy(&sna->kgem, bo);
+
+	/* Anything left over could not be copied */
+	for (n = m = 0; n < upload->count; n++) {
+		if (upload->entry[n].glyph)
+			upload->entry[m++] = upload->entry[n];
+	}
+	upload->count = m;
+	if (upload->count) {
+		DBG(("%s: %d glyphs left over\n", __FUNCTION__, upload->count));
+		goto fallback;
+	}
+
+	glyph_upload_init(upload);
+	return;
+
+fallback:
+	glyph_upload_fallback(cache, upload);
+	glyph_upload_init(upload);
+}
+
+/* Reserve room in the staging buffer for the glyph, flushing the batch
+ * if it is already full. Returns false if the glyph must be uploaded
+ * immediately instead.
+ */
+static bool glyph_upload_add(struct sna *sna,
+			     struct sna_glyph_cache *cache,
+			     struct glyph_upload *upload,
+			     GlyphPtr glyph, PicturePtr glyph_picture)
+{
+	struct sna_glyph *priv = sna_glyph(glyph);
+	struct glyph_upload_entry *e;
+	int w = glyph->info.width, h = glyph->info.height;
+
+	if (NO_GLYPH_UPLOAD_BATCH || upload == NULL)
+		return false;
+
+	if (!sna_drawable_move_to_cpu(glyph_picture->pDrawable, MOVE_READ))
+		return false;
+
+	if (upload->x + w > GLYPH_CACHE_PICTURE_SIZE) {
+		upload->x = 0;
+		upload->y += upload->row;
+		upload->row = 0;
+	}
+	if (upload->count == GLYPH_UPLOAD_MAX ||
+	    upload->y + h > GLYPH_UPLOAD_HEIGHT) {
+		glyph_upload_flush(sna, cache, upload);
+		assert(upload->count == 0);
+	}
+
+	e = &upload->entry[upload->count++];
+	e->glyph = glyph;
+	e->picture = glyph_picture;
+	e->atlas = priv->atlas;
+	e->pos = priv->pos;
+	e->sx = upload->x;
+	e->sy = upload->y;
+	e->dx = priv->coordinate.x;
+	e->dy = priv->coordinate.y;
+
+	upload->x += w;
+	if (h > upload->row)
+		upload->row = h;
+
+	return true;
+}
+
 static void
 glyph_extents(int nlist,
 	      GlyphListPtr list,
@@ -338,34 +637,16 @@ glyph_extents(int nlist,
 	extents->y2 = y2;
 }
 
-static inline unsigned int
-glyph_size_to_count(int size)
-{
-	size /= GLYPH_MIN_SIZE;
-	return size * size;
-}
-
-static inline unsigned int
-glyph_count_to_mask(int count)
-{
-	return ~(count - 1);
-}
-
-static inline unsigned int
-glyph_size_to_mask(int size)
-{
-	return glyph_count_to_mask(glyph_size_to_count(size));
-}
-
 static int
 glyph_cache(ScreenPtr screen,
 	    struct sna_render *render,
-	    GlyphPtr glyph)
+	    GlyphPtr glyph,
+	    struct glyph_upload *upload)
 {
 	PicturePtr glyph_picture;
 	struct sna_glyph_cache *cache;
 	struct sna_glyph *priv;
-	int size, mask, pos, s;
+	int size, format, pos, s;
 
 	if (NO_GLYPH_CACHE)
 		return false;
@@ -391,56 +672,25 @@ glyph_cache(ScreenPtr screen,
 		if (glyph->info.width <= size && glyph->info.height <= size)
 			break;
 
-	cache = &render->glyph[PICT_FORMAT_RGB(glyph_picture->format) != 0];
-	s = glyph_size_to_count(size);
-	mask = glyph_count_to_mask(s);
-	pos = (cache->count + s - 1) & mask;
-	if (pos < GLYPH_CACHE_SIZE) {
-		cache->count = pos + s;
-	} else {
-		priv = NULL;
-		for (s = size; s <= GLYPH_MAX_SIZE; s *= 2) {
-			int i = cache->evict & glyph_size_to_mask(s);
-			priv = cache->glyphs[i];
-			if (priv == NULL)
-				continue;
-
-			if (priv->size >= s) {
-				cache->glyphs[i] = NULL;
-				priv->atlas = NULL;
-				pos = i;
-			} else
-				priv = NULL;
-			break;
-		}
-		if (priv == NULL) {
-			int count = glyph_size_to_count(size);
-			pos = cache->evict & glyph_count_to_mask(count);
-			for (s = 0; s < count; s++) {
-				priv = cache->glyphs[pos + s];
-				if (priv != NULL) {
-					priv->atlas =NULL;
-					cache->glyphs[pos + s] = NULL;
-				}
-			}
-		}
-
-		/* And pick a new eviction position */
-		cache->evict = rand() % GLYPH_CACHE_SIZE;
-	}
+	format = PICT_FORMAT_RGB(glyph_picture->format) != 0;
+	cache = &render->glyph[format];
+	if (sna_glyph_cache_full(cache, size))
+		glyph_cache_grow(screen, cache, format);
+	pos = sna_glyph_cache_alloc(cache, size);
 	assert(cache->glyphs[pos] == NULL);
 
 	priv = sna_glyph(glyph);
-	DBG(("%s(%d): adding glyph to cache %d, pos %d\n",
+	DBG(("%s(%d): adding glyph to cache %d, page %d, pos %d\n",
 	     __FUNCTION__, screen->myNum,
-	     PICT_FORMAT_RGB(glyph_picture->format) != 0, pos));
+	     format, pos / GLYPH_CACHE_SIZE, pos % GLYPH_CACHE_SIZE));
 	cache->glyphs[pos] = priv;
-	priv->atlas = cache->picture;
+	priv->atlas = cache->picture[pos / GLYPH_CACHE_SIZE];
 	priv->size = size;
-	priv->pos = pos << 1 | (PICT_FORMAT_RGB(glyph_picture->format) != 0);
+	priv->pos = pos << 1 | format;
+	pos %= GLYPH_CACHE_SIZE;
 	s = pos / ((GLYPH_MAX_SIZE / GLYPH_MIN_SIZE) * (GLYPH_MAX_SIZE / GLYPH_MIN_SIZE));
-	priv->coordinate.x = s % (CACHE_PICTURE_SIZE / GLYPH_MAX_SIZE) * GLYPH_MAX_SIZE;
-	priv->coordinate.y = (s / (CACHE_PICTURE_SIZE / GLYPH_MAX_SIZE)) * GLYPH_MAX_SIZE;
+	priv->coordinate.x = s % (GLYPH_CACHE_PICTURE_SIZE / GLYPH_MAX_SIZE) * GLYPH_MAX_SIZE;
+	priv->coordinate.y = (s / (GLYPH_CACHE_PICTURE_SIZE / GLYPH_MAX_SIZE)) * GLYPH_MAX_SIZE;
 	for (s = GLYPH_MIN_SIZE; s < GLYPH_MAX_SIZE; s *= 2) {
 		if (pos & 1)
 			priv->coordinate.x += s;
@@ -449,8 +699,16 @@ glyph_cache(ScreenPtr screen,
 		pos >>= 2;
 	}
 
-	glyph_cache_upload(cache, glyph, glyph_picture,
-			   priv->coordinate.x, priv->coordinate.y);
+	cache->stats.uploaded +=
+		glyph_picture->pDrawable->width *
+		glyph_picture->pDrawable->height *
+		glyph_picture->pDrawable->bitsPerPixel >> 3;
+
+	if (!glyph_upload_add(to_sna_from_screen(screen), cache,
+			      upload ? &upload[format] : NULL,
+			      glyph, glyph_picture))
+		glyph_cache_upload(cache, priv->atlas, glyph, glyph_picture,
+				   priv->coordinate.x, priv->coordinate.y);
 
 	return true;
 }
@@ -502,6 +760,68 @@ static void apply_damage_clipped_to_dst(struct sna_composite_op *op,
 	sna_damage_add_box(op->damage, &box);
 }
 
+/* Make sure every glyph is resident in the cache before we start drawing,
+ * uploading all the misses together, and note which atlas pages they
+ * occupy so that the glyphs can then be added to the mask a page at a
+ * time, rather than switching between pages as the string dictates.
+ * Returns the number of pages used, with a NULL entry appended if some
+ * glyphs could not be cached (or were evicted again to make room for
+ * later glyphs) and so must be drawn from their own pictures.
+ */
+static int
+glyphs_prepare(struct sna *sna, ScreenPtr screen,
+	       int nlist, GlyphListPtr list, GlyphPtr *glyphs,
+	       PicturePtr *atlas)
+{
+	struct sna_glyph_cache *cache = sna->render.glyph;
+	struct glyph_upload upload[2];
+	unsigned long evictions;
+	bool uncached = false;
+	int count = 0;
+
+	glyph_upload_init(&upload[0]);
+	glyph_upload_init(&upload[1]);
+
+	evictions = cache[0].stats.evictions + cache[1].stats.evictions;
+	do {
+		int n = list->len;
+		while (n--) {
+			GlyphPtr glyph = *glyphs++;
+			struct sna_glyph *priv;
+			int i;
+
+			if (!glyph_valid(glyph))
+				continue;
+
+			priv = sna_glyph(glyph);
+			if (priv->atlas != NULL) {
+				sna_glyph_cache_hit(&cache[priv->pos & 1], priv);
+			} else if (!glyph_cache(screen, &sna->render, glyph, upload)) {
+				uncached = true;
+				continue;
+			}
+
+			for (i = 0; i < count; i++)
+				if (atlas[i] == priv->atlas)
+					break;
+			if (i == count)
+				atlas[count++] = priv->atlas;
+		}
+		list++;
+	} while (--nlist);
+
+	glyph_upload_flush(sna, &cache[0], &upload[0]);
+	glyph_upload_flush(sna, &cache[1], &upload[1]);
+
+	if (uncached ||
+	    evictions != cache[0].stats.evictions + cache[1].stats.evictions)
+		atlas[count++] = NULL;
+
+	DBG(("%s: %d pages, uncached? %d\n",
+	     __FUNCTION__, count, count && atlas[count-1] == NULL));
+	return count;
+}
+
 static bool
 glyphs_to_dst(struct sna *sna,
 	      CARD8 op,
@@ -512,7 +832,7 @@ glyphs_to_dst(struct sna *sna,
 {
 	struct sna_composite_op tmp;
 	ScreenPtr screen = dst->pDrawable->pScreen;
-	PicturePtr glyph_atlas;
+	PicturePtr glyph_atlas, atlas[2*GLYPH_CACHE_MAX_PAGES + 1];
 	BoxPtr rects;
 	int nrect;
 	int16_t x, y;
@@ -537,6 +857,11 @@ glyphs_to_dst(struct sna *sna,
 	src_x -= list->xOff + x;
 	src_y -= list->yOff + y;
 
+	/* The glyphs must be drawn in order, but we can still upload all the
+	 * misses in one go beforehand.
+	 */
+	glyphs_prepare(sna, screen, nlist, list, glyphs, atlas);
+
 	glyph_atlas = NULL;
 	while (nlist--) {
 		int n = list->len;
@@ -556,7 +881,7 @@ glyphs_to_dst(struct sna *sna,
 					tmp.done(sna, &tmp);
 					glyph_atlas = NULL;
 				}
-				if (!glyph_cache(screen, &sna->render, glyph)) {
+				if (!glyph_cache(screen, &sna->render, glyph, NULL)) {
 					/* no cache for this glyph */
 					priv.atlas = GetGlyphPicture(glyph, screen);
 					if (unlikely(priv.atlas == NULL)) {
@@ -698,8 +1023,10 @@ glyphs_slow(struct sna *sna,
 				goto next_glyph;
 
 			priv = *sna_glyph(glyph);
-			if (priv.atlas == NULL) {
-				if (!glyph_cache(screen, &sna->render, glyph)) {
+			if (priv.atlas != NULL) {
+				sna_glyph_cache_hit(&sna->render.glyph[priv.pos & 1], &priv);
+			} else {
+				if (!glyph_cache(screen, &sna->render, glyph, NULL)) {
 					/* no cache for this glyph */
 					priv.atlas = GetGlyphPicture(glyph, screen);
 					if (unlikely(priv.atlas == NULL)) {
@@ -799,35 +1126,107 @@ too_large(struct sna *sna, int width, int height)
 		height > sna->render.max_3d_size);
 }
 
-static pixman_image_t *
-__sna_glyph_get_image(GlyphPtr g, ScreenPtr s)
+/* Add all the glyphs residing on this atlas page to the mask, or if the
+ * page is NULL, those glyphs that are not in the cache.
+ */
+static bool
+glyphs_to_mask(struct sna *sna, ScreenPtr screen,
+	       PicturePtr mask, PictFormatPtr format,
+	       PicturePtr atlas, int16_t x, int16_t y,
+	       int nlist, GlyphListPtr list, GlyphPtr *glyphs)
 {
-	pixman_image_t *image;
-	PicturePtr p;
-	int dx, dy;
+	struct sna_composite_op tmp;
+	PicturePtr glyph_atlas;
 
-	p = GetGlyphPicture(g, s);
-	if (unlikely(p == NULL))
-		return NULL;
+	memset(&tmp, 0, sizeof(tmp));
+	glyph_atlas = NULL;
+	do {
+		int n = list->len;
+		x += list->xOff;
+		y += list->yOff;
+		while (n--) {
+			GlyphPtr glyph = *glyphs++;
+			struct sna_glyph *priv;
+			PicturePtr this_atlas;
+			struct sna_composite_rectangles r;
 
-	image = image_from_pict(p, FALSE, &dx, &dy);
-	if (!image)
-		return NULL;
+			if (!glyph_valid(glyph))
+				goto next_glyph;
 
-	assert(dx == 0 && dy == 0);
-	return sna_glyph(g)->image = image;
-}
+			priv = sna_glyph(glyph);
+			if (priv->atlas != atlas)
+				goto next_glyph;
 
-static inline pixman_image_t *
-sna_glyph_get_image(GlyphPtr g, ScreenPtr s)
-{
-	pixman_image_t *image;
+			if (atlas) {
+				this_atlas = atlas;
+				r.src = priv->coordinate;
+			} else {
+				/* no cache for this glyph */
+				this_atlas = GetGlyphPicture(glyph, screen);
+				if (unlikely(this_atlas == NULL)) {
+					glyph->info.width = glyph->info.height = 0;
+					goto next_glyph;
+				}
+				r.src.x = r.src.y = 0;
+			}
 
-	image = sna_glyph(g)->image;
-	if (image == NULL)
-		image = __sna_glyph_get_image(g, s);
+			if (this_atlas != glyph_atlas) {
+				bool ok;
 
-	return image;
+				if (glyph_atlas)
+					tmp.done(sna, &tmp);
+
+				DBG(("%s: atlas format=%08x, mask format=%08x\n",
+				     __FUNCTION__,
+				     (int)this_atlas->format,
+				     (int)(format->depth << 24 | format->format)));
+				if (this_atlas->format == (format->depth << 24 | format->format) &&
+				    (sna->kgem.gen >> 3) != 4) { /* XXX cache corruption? how? */
+					ok = sna->render.composite(sna, PictOpAdd,
+								   this_atlas, NULL, mask,
+								   0, 0, 0, 0, 0, 0,
+								   0, 0,
+								   &tmp);
+				} else {
+					ok = sna->render.composite(sna, PictOpAdd,
+								   sna->render.white_picture, this_atlas, mask,
+								   0, 0, 0, 0, 0, 0,
+								   0, 0,
+								   &tmp);
+				}
+				if (!ok) {
+					DBG(("%s: fallback -- can not handle PictOpAdd of glyph onto mask!\n",
+					     __FUNCTION__));
+					return false;
+				}
+
+				glyph_atlas = this_atlas;
+			}
+
+			DBG(("%s: blt glyph origin (%d, %d), offset (%d, %d), src (%d, %d), size (%d, %d)\n",
+			     __FUNCTION__,
+			     x, y,
+			     glyph->info.x, glyph->info.y,
+			     r.src.x, r.src.y,
+			     glyph->info.width, glyph->info.height));
+
+			r.mask = r.src;
+			r.dst.x = x - glyph->info.x;
+			r.dst.y = y - glyph->info.y;
+			r.width  = glyph->info.width;
+			r.height = glyph->info.height;
+			tmp.blt(sna, &tmp, &r);
+
+next_glyph:
+			x += glyph->info.xOff;
+			y += glyph->info.yOff;
+		}
+		list++;
+	} while (--nlist);
+	if (glyph_atlas)
+		tmp.done(sna, &tmp);
+
+	return true;
 }
 
 static bool
@@ -840,12 +1239,11 @@ glyphs_via_mask(struct sna *sna,
 		int nlist, GlyphListPtr list, GlyphPtr *glyphs)
 {
 	ScreenPtr screen = dst->pDrawable->pScreen;
-	struct sna_composite_op tmp;
 	CARD32 component_alpha;
 	PixmapPtr pixmap;
-	PicturePtr glyph_atlas, mask;
+	PicturePtr atlas[2*GLYPH_CACHE_MAX_PAGES + 1], mask;
 	int16_t x, y, width, height;
-	int error;
+	int natlas, i, error;
 	bool ret = false;
 	BoxRec box;
 
@@ -1075,99 +1473,14 @@ next_image:
 		if (!clear_pixmap(sna, pixmap))
 			goto err_mask;
 
-		memset(&tmp, 0, sizeof(tmp));
-		glyph_atlas = NULL;
-		do {
-			int n = list->len;
-			x += list->xOff;
-			y += list->yOff;
-			while (n--) {
-				GlyphPtr glyph = *glyphs++;
-				struct sna_glyph *priv;
-				PicturePtr this_atlas;
-				struct sna_composite_rectangles r;
-
-				if (!glyph_valid(glyph))
-					goto next_glyph;
-
-				priv = sna_glyph(glyph);
-				if (priv->atlas != NULL) {
-					this_atlas = priv->atlas;
-					r.src = priv->coordinate;
-				} else {
-					if (glyph_atlas) {
-						tmp.done(sna, &tmp);
-						glyph_atlas = NULL;
-					}
-					if (glyph_cache(screen, &sna->render, glyph)) {
-						this_atlas = priv->atlas;
-						r.src = priv->coordinate;
-					} else {
-						/* no cache for this glyph */
-						this_atlas = GetGlyphPicture(glyph, screen);
-						if (unlikely(this_atlas == NULL)) {
-							glyph->info.width = glyph->info.height = 0;
-							goto next_glyph;
-						}
-						r.src.x = r.src.y = 0;
-					}
-				}
-
-				if (this_atlas != glyph_atlas) {
-					bool ok;
-
-					if (glyph_atlas)
-						tmp.done(sna, &tmp);
-
-					DBG(("%s: atlas format=%08x, mask format=%08x\n",
-					     __FUNCTION__,
-					     (int)this_atlas->format,
-					     (int)(format->depth << 24 | format->format)));
-					if (this_atlas->format == (format->depth << 24 | format->format) &&
-					    (sna->kgem.gen >> 3) != 4) { /* XXX cache corruption? how? */
-						ok = sna->render.composite(sna, PictOpAdd,
-									   this_atlas, NULL, mask,
-									   0, 0, 0, 0, 0, 0,
-									   0, 0,
-									   &tmp);
-					} else {
-						ok = sna->render.composite(sna, PictOpAdd,
-									   sna->render.white_picture, this_atlas, mask,
-									   0, 0, 0, 0, 0, 0,
-									   0, 0,
-									   &tmp);
-					}
-					if (!ok) {
-						DBG(("%s: fallback -- can not handle PictOpAdd of glyph onto mask!\n",
-						     __FUNCTION__));
-						goto err_mask;
-					}
-
-					glyph_atlas = this_atlas;
-				}
-
-				DBG(("%s: blt glyph origin (%d, %d), offset (%d, %d), src (%d, %d), size (%d, %d)\n",
-				     __FUNCTION__,
-				     x, y,
-				     glyph->info.x, glyph->info.y,
-				     r.src.x, r.src.y,
-				     glyph->info.width, glyph->info.height));
-
-				r.mask = r.src;
-				r.dst.x = x - glyph->info.x;
-				r.dst.y = y - glyph->info.y;
-				r.width  = glyph->info.width;
-				r.height = glyph->info.height;
-				tmp.blt(sna, &tmp, &r);
-
-next_glyph:
-				x += glyph->info.xOff;
-				y += glyph->info.yOff;
-			}
-			list++;
-		} while (--nlist);
-		if (glyph_atlas)
-			tmp.done(sna, &tmp);
+		natlas = glyphs_prepare(sna, screen,
+					nlist, list, glyphs,
+					atlas);
+		for (i = 0; i < natlas; i++) {
+			if (!glyphs_to_mask(sna, screen, mask, format, atlas[i],
+					    x, y, nlist, list, glyphs))
+				goto err_mask;
+		}
 	}
 
 	sna_composite(op,
@@ -1335,6 +1648,300 @@ static bool can_discard_mask(uint8_t op, PicturePtr src, PictFormatPtr mask,
 	return color >> 24 == 0xff;
 }
 
+/* Software rasterisation of long glyph runs is split into horizontal
+ * bands of the destination, one per thread. Every band walks the glyphs
+ * in their original order, but only composites those rows of each glyph
+ * that fall within the band. As each pixel is then written by exactly
+ * one thread, in the same order as before, the result is identical to
+ * compositing the whole run serially.
+ */
+struct glyph_blt {
+	pixman_image_t *image;
+	int16_t x, y;
+	uint16_t width, height;
+	bool add; /* the glyph is in the format of dst, add it directly */
+};
+
+struct glyphs_thread {
+	pixman_op_t op;
+	pixman_image_t *src, *dst;
+	int16_t src_x, src_y;
+	const struct glyph_blt *glyphs;
+	int count;
+	int16_t y1, y2;
+};
+
+static int glyphs_use_threads(int width, int height, int count)
+{
+	if (NO_GLYPH_THREADS || count < GLYPH_THREADS_MIN)
+		return 1;
+
+	return sna_use_threads(width, height, 16);
+}
+
+static void glyphs_thread(void *arg)
+{
+	const struct glyphs_thread *t = arg;
+	const struct glyph_blt *g = t->glyphs;
+	int n;
+
+	for (n = 0; n < t->count; n++, g++) {
+		int16_t y = g->y, dy = 0;
+		int h = g->height;
+
+		if (y < t->y1) {
+			dy = t->y1 - y;
+			y = t->y1;
+			h -= dy;
+		}
+		if (y + h > t->y2)
+			h = t->y2 - y;
+		if (h <= 0)
+			continue;
+
+		if (g->add)
+			pixman_image_composite(PIXMAN_OP_ADD,
+					       g->image, NULL, t->dst,
+					       0, dy,
+					       0, 0,
+					       g->x, y,
+					       g->width, h);
+		else
+			pixman_image_composite(t->op,
+					       t->src, g->image, t->dst,
+					       t->src_x + g->x, t->src_y + y,
+					       0, dy,
+					       g->x, y,
+					       g->width, h);
+	}
+}
+
+/* Composite the glyphs into rows [y1, y2) of dst, either adding them
+ * directly, or using them as masks for src.
+ */
+static void glyphs_composite(pixman_op_t op,
+			     pixman_image_t *src, int16_t src_x, int16_t src_y,
+			     pixman_image_t *dst,
+			     const struct glyph_blt *glyphs, int count,
+			     int16_t x1, int16_t y1, int16_t x2, int16_t y2)
+{
+	struct glyphs_thread t;
+	int num_threads;
+
+	t.op = op;
+	t.src = src;
+	t.src_x = src_x;
+	t.src_y = src_y;
+	t.dst = dst;
+	t.glyphs = glyphs;
+	t.count = count;
+	t.y1 = y1;
+	t.y2 = y2;
+
+	num_threads = glyphs_use_threads(x2 - x1, y2 - y1, count);
+	if (num_threads == 1) {
+		glyphs_thread(&t);
+	} else {
+		struct glyphs_thread threads[num_threads];
+		int y, dy, n;
+
+		DBG(("%s: using %d threads for %d glyphs over %dx%d\n",
+		     __FUNCTION__, num_threads, count, x2 - x1, y2 - y1));
+
+		y = y1;
+		dy = (y2 - y1 + num_threads - 1) / num_threads;
+
+		for (n = 1; n < num_threads; n++) {
+			threads[n] = t;
+			threads[n].y1 = y;
+			threads[n].y2 = y += dy;
+
+			sna_threads_run(glyphs_thread, &threads[n]);
+		}
+
+		threads[0] = t;
+		threads[0].y1 = y;
+		glyphs_thread(&threads[0]);
+
+		sna_threads_wait();
+	}
+}
+
+#if HAS_PIXMAN_GLYPHS
+struct pixman_glyphs_thread {
+	pixman_op_t op;
+	pixman_image_t *src, *dst;
+	pixman_format_code_t mask_format;
+	int16_t src_x, src_y;
+	int16_t mask_x, mask_y;
+	int16_t dst_x, dst_y;
+	uint16_t width, height;
+	pixman_glyph_cache_t *cache;
+	const pixman_glyph_t *glyphs;
+	int count;
+};
+
+static void pixman_glyphs_thread(void *arg)
+{
+	const struct pixman_glyphs_thread *t = arg;
+
+	pixman_composite_glyphs(t->op, t->src, t->dst, t->mask_format,
+				t->src_x, t->src_y,
+				t->mask_x, t->mask_y,
+				t->dst_x, t->dst_y,
+				t->width, t->height,
+				t->cache, t->count, t->glyphs);
+}
+
+/* As pixman_composite_glyphs(), but with the destination rectangle split
+ * into bands. Each band accumulates its own mask of just those rows.
+ */
+static void sna_composite_glyphs(pixman_op_t op,
+				 pixman_image_t *src, pixman_image_t *dst,
+				 pixman_format_code_t mask_format,
+				 int16_t src_x, int16_t src_y,
+				 int16_t mask_x, int16_t mask_y,
+				 int16_t dst_x, int16_t dst_y,
+				 uint16_t width, uint16_t height,
+				 pixman_glyph_cache_t *cache,
+				 int count, const pixman_glyph_t *glyphs)
+{
+	struct pixman_glyphs_thread t;
+	int num_threads;
+
+	t.op = op;
+	t.src = src;
+	t.dst = dst;
+	t.mask_format = mask_format;
+	t.src_x = src_x;
+	t.src_y = src_y;
+	t.mask_x = mask_x;
+	t.mask_y = mask_y;
+	t.dst_x = dst_x;
+	t.dst_y = dst_y;
+	t.width = width;
+	t.height = height;
+	t.cache = cache;
+	t.glyphs = glyphs;
+	t.count = count;
+
+	num_threads = glyphs_use_threads(width, height, count);
+	if (num_threads == 1) {
+		pixman_glyphs_thread(&t);
+	} else {
+		struct pixman_glyphs_thread threads[num_threads];
+		int y, dy, n;
+
+		DBG(("%s: using %d threads for %d glyphs over %dx%d\n",
+		     __FUNCTION__, num_threads, count, width, height));
+
+		y = 0;
+		dy = (height + num_threads - 1) / num_threads;
+
+		for (n = 1; n < num_threads; n++) {
+			threads[n] = t;
+			threads[n].src_y += y;
+			threads[n].mask_y += y;
+			threads[n].dst_y += y;
+			threads[n].height = dy;
+			y += dy;
+
+			sna_threads_run(pixman_glyphs_thread, &threads[n]);
+		}
+
+		threads[0] = t;
+		threads[0].src_y += y;
+		threads[0].mask_y += y;
+		threads[0].dst_y += y;
+		threads[0].height = height - y;
+		pixman_glyphs_thread(&threads[0]);
+
+		sna_threads_wait();
+	}
+}
+
+struct pixman_glyphs_mask_thread {
+	pixman_image_t *src, *mask;
+	int16_t y;
+	pixman_glyph_cache_t *cache;
+	const pixman_glyph_t *glyphs;
+	int count;
+};
+
+static void pixman_glyphs_mask_thread(void *arg)
+{
+	const struct pixman_glyphs_mask_thread *t = arg;
+
+	pixman_composite_glyphs_no_mask(PIXMAN_OP_ADD, t->src, t->mask,
+					0, 0,
+					0, -t->y,
+					t->cache, t->count, t->glyphs);
+}
+
+/* Add the glyphs to a mask of our own, which unlike a destination has no
+ * clip, so each band can simply be a view of its rows of the mask.
+ */
+static void sna_composite_glyphs_to_mask(pixman_image_t *src,
+					 pixman_image_t *mask,
+					 pixman_glyph_cache_t *cache,
+					 int count, const pixman_glyph_t *glyphs)
+{
+	int width = pixman_image_get_width(mask);
+	int height = pixman_image_get_height(mask);
+	struct pixman_glyphs_mask_thread t;
+	int num_threads;
+
+	t.src = src;
+	t.mask = mask;
+	t.y = 0;
+	t.cache = cache;
+	t.glyphs = glyphs;
+	t.count = count;
+
+	num_threads = glyphs_use_threads(width, height, count);
+	if (num_threads > 1) {
+		struct pixman_glyphs_mask_thread threads[num_threads];
+		pixman_format_code_t format = pixman_image_get_format(mask);
+		uint8_t *bits = (uint8_t *)pixman_image_get_data(mask);
+		int stride = pixman_image_get_stride(mask);
+		int y, dy, n;
+		bool ok;
+
+		DBG(("%s: using %d threads for %d glyphs over %dx%d\n",
+		     __FUNCTION__, num_threads, count, width, height));
+
+		y = 0;
+		dy = (height + num_threads - 1) / num_threads;
+		for (n = 0; n < num_threads; n++) {
+			threads[n] = t;
+			threads[n].y = y;
+			threads[n].mask =
+				pixman_image_create_bits(format,
+							 width, MIN(dy, height - y),
+							 (uint32_t *)(bits + y * stride),
+							 stride);
+			if (threads[n].mask == NULL)
+				break;
+			y += dy;
+		}
+		ok = n == num_threads;
+		if (ok) {
+			for (n = 1; n < num_threads; n++)
+				sna_threads_run(pixman_glyphs_mask_thread,
+						&threads[n]);
+			pixman_glyphs_mask_thread(&threads[0]);
+			sna_threads_wait();
+		}
+		while (n--)
+			pixman_image_unref(threads[n].mask);
+		if (ok)
+			return;
+	}
+
+	pixman_glyphs_mask_thread(&t);
+}
+#endif
+
 static void
 glyphs_fallback(CARD8 op,
 		PicturePtr src,
@@ -1465,15 +2072,15 @@ next:
 			goto out_free_src;
 
 		if (mask_format) {
-			pixman_composite_glyphs(op, src_image, dst_image,
-						mask_format->format | (mask_format->depth << 24),
-						src_x + src_dx + region.extents.x1 - dst_x,
-						src_y + src_dy + region.extents.y1 - dst_y,
-						region.extents.x1, region.extents.y1,
-						region.extents.x1 + dst_dx, region.extents.y1 + dst_dy,
-						region.extents.x2 - region.extents.x1,
-						region.extents.y2 - region.extents.y1,
-						cache, count, pglyphs);
+			sna_composite_glyphs(op, src_image, dst_image,
+					     mask_format->format | (mask_format->depth << 24),
+					     src_x + src_dx + region.extents.x1 - dst_x,
+					     src_y + src_dy + region.extents.y1 - dst_y,
+					     region.extents.x1, region.extents.y1,
+					     region.extents.x1 + dst_dx, region.extents.y1 + dst_dy,
+					     region.extents.x2 - region.extents.x1,
+					     region.extents.y2 - region.extents.y1,
+					     cache, count, pglyphs);
 		} else {
 			pixman_composite_glyphs_no_mask(op, src_image, dst_image,
 							src_x + src_dx - dst_x, src_y + src_dy - dst_y,
@@ -1493,11 +2100,27 @@ out:
 	} else
 #endif
 	{
+		struct glyph_blt stack_blt[N_STACK_GLYPHS], *blt = stack_blt;
 		pixman_image_t *mask_image;
+		BoxRec extents;
+		int count;
+
+		count = 0;
+		for (n = 0; n < nlist; n++)
+			count += list[n].len;
+		if (count > N_STACK_GLYPHS) {
+			blt = malloc(count * sizeof(*blt));
+			if (blt == NULL)
+				goto cleanup_region;
+		}
+		count = 0;
+
+		extents.x1 = extents.y1 = MAXSHORT;
+		extents.x2 = extents.y2 = MINSHORT;
 
 		dst_image = image_from_pict(dst, TRUE, &x, &y);
 		if (dst_image == NULL)
-			goto cleanup_region;
+			goto cleanup_blt;
 		DBG(("%s: dst offset (%d, %d)\n", __FUNCTION__, x, y));
 		if (x | y) {
 			region.extents.x1 += x;
@@ -1558,65 +2181,47 @@ out:
 				if (glyph_image == NULL)
 					goto next_glyph;
 
+				blt[count].image = glyph_image;
+				blt[count].x = x - g->info.x;
+				blt[count].y = y - g->info.y;
+				blt[count].width = g->info.width;
+				blt[count].height = g->info.height;
+				blt[count].add = false;
+
+				if (blt[count].x < extents.x1)
+					extents.x1 = blt[count].x;
+				if (blt[count].y < extents.y1)
+					extents.y1 = blt[count].y;
+				if (blt[count].x + g->info.width > extents.x2)
+					extents.x2 = blt[count].x + g->info.width;
+				if (blt[count].y + g->info.height > extents.y2)
+					extents.y2 = blt[count].y + g->info.height;
+
 				if (mask_format) {
 					DBG(("%s: glyph to mask (%d, %d)x(%d, %d)\n",
 					     __FUNCTION__,
-					     x - g->info.x,
-					     y - g->info.y,
+					     blt[count].x, blt[count].y,
 					     g->info.width,
 					     g->info.height));
 
 					if (list->format == mask_format) {
 						assert(pixman_image_get_format(glyph_image) == pixman_image_get_format(mask_image));
-						pixman_image_composite(PictOpAdd,
-								       glyph_image,
-								       NULL,
-								       mask_image,
-								       0, 0,
-								       0, 0,
-								       x - g->info.x,
-								       y - g->info.y,
-								       g->info.width,
-								       g->info.height);
-					} else {
-						pixman_image_composite(PictOpAdd,
-								       sna->render.white_image,
-								       glyph_image,
-								       mask_image,
-								       0, 0,
-								       0, 0,
-								       x - g->info.x,
-								       y - g->info.y,
-								       g->info.width,
-								       g->info.height);
+						blt[count].add = true;
 					}
 				} else {
-					int xi = x - g->info.x;
-					int yi = y - g->info.y;
-
 					DBG(("%s: glyph to dst (%d, %d)x(%d, %d)/[(%d, %d)x(%d, %d)], src (%d, %d) [op=%d]\n",
 					     __FUNCTION__,
-					     xi, yi,
+					     blt[count].x, blt[count].y,
 					     g->info.width, g->info.height,
 					     dst->pDrawable->x,
 					     dst->pDrawable->y,
 					     dst->pDrawable->width,
 					     dst->pDrawable->height,
-					     src_x + xi,
-					     src_y + yi,
+					     src_x + blt[count].x,
+					     src_y + blt[count].y,
 					     op));
-
-					pixman_image_composite(op,
-							       src_image,
-							       glyph_image,
-							       dst_image,
-							       src_x + xi,
-							       src_y + yi,
-							       0, 0,
-							       xi, yi,
-							       g->info.width,
-							       g->info.height);
 				}
+				count++;
 next_glyph:
 				x += g->info.xOff;
 				y += g->info.yOff;
@@ -1624,6 +2229,19 @@ next_glyph:
 			list++;
 		} while (--nlist);
 
+		if (mask_format)
+			glyphs_composite(PIXMAN_OP_ADD,
+					 sna->render.white_image, 0, 0,
+					 mask_image, blt, count,
+					 0, 0,
+					 region.extents.x2 - region.extents.x1,
+					 region.extents.y2 - region.extents.y1);
+		else if (count)
+			glyphs_composite(op, src_image, src_x, src_y,
+					 dst_image, blt, count,
+					 extents.x1, extents.y1,
+					 extents.x2, extents.y2);
+
 		if (mask_format) {
 			DBG(("%s: glyph mask composite src=(%d+%d,%d+%d) dst=(%d, %d)x(%d, %d)\n",
 			     __FUNCTION__,
@@ -1631,12 +2249,12 @@ next_glyph:
 			     region.extents.x1, region.extents.y1,
 			     region.extents.x2 - region.extents.x1,
 			     region.extents.y2 - region.extents.y1));
-			pixman_image_composite(op, src_image, mask_image, dst_image,
-					       src_x, src_y,
-					       0, 0,
-					       region.extents.x1, region.extents.y1,
-					       region.extents.x2 - region.extents.x1,
-					       region.extents.y2 - region.extents.y1);
+			sna_image_composite(op, src_image, mask_image, dst_image,
+					    src_x, src_y,
+					    0, 0,
+					    region.extents.x1, region.extents.y1,
+					    region.extents.x2 - region.extents.x1,
+					    region.extents.y2 - region.extents.y1);
 			pixman_image_unref(mask_image);
 		}
 
@@ -1644,6 +2262,9 @@ cleanup_src:
 		free_pixman_pict(src, src_image);
 cleanup_dst:
 		free_pixman_pict(dst, dst_image);
+cleanup_blt:
+		if (blt != stack_blt)
+			free(blt);
 	}
 
 cleanup_region:
@@ -1875,19 +2496,32 @@ next_pglyph:
 			list++;
 		} while (--nlist);
 
-		pixman_composite_glyphs_no_mask(PIXMAN_OP_ADD,
-						sna->render.white_image,
-						mask_image,
-						0, 0,
-						0, 0,
-						cache, count, pglyphs);
+		sna_composite_glyphs_to_mask(sna->render.white_image,
+					     mask_image,
+					     cache, count, pglyphs);
 		pixman_glyph_cache_thaw(cache);
 		if (pglyphs != stack_glyphs)
 			free(pglyphs);
 	} else
 #endif
+	{
+		struct glyph_blt stack_blt[N_STACK_GLYPHS], *blt = stack_blt;
+		int count, n;
+
+		count = 0;
+		for (n = 0; n < nlist; ++n)
+			count += list[n].len;
+		if (count > N_STACK_GLYPHS) {
+			blt = malloc(count * sizeof(*blt));
+			if (blt == NULL) {
+				pixman_image_unref(mask_image);
+				goto err_pixmap;
+			}
+		}
+
+		count = 0;
 		do {
-			int n = list->len;
+			n = list->len;
 			x += list->xOff;
 			y += list->yOff;
 			while (n--) {
@@ -1920,28 +2554,15 @@ next_pglyph:
 				     g->info.width,
 				     g->info.height));
 
-				if (list->format == format) {
-					assert(pixman_image_get_format(glyph_image) == pixman_image_get_format(mask_image));
-					pixman_image_composite(PictOpAdd,
-							       glyph_image,
-							       NULL,
-							       mask_image,
-							       0, 0,
-							       0, 0,
-							       xi, yi,
-							       g->info.width,
-							       g->info.height);
-				} else {
-					pixman_image_composite(PictOpAdd,
-							       sna->render.white_image,
-							       glyph_image,
-							       mask_image,
-							       0, 0,
-							       0, 0,
-							       xi, yi,
-							       g->info.width,
-							       g->info.height);
-				}
+				blt[count].image = glyph_image;
+				blt[count].x = xi;
+				blt[count].y = yi;
+				blt[count].width = g->info.width;
+				blt[count].height = g->info.height;
+				blt[count].add = list->format == format;
+				assert(!blt[count].add ||
+				       pixman_image_get_format(glyph_image) == pixman_image_get_format(mask_image));
+				count++;
 
 next_image:
 				x += g->info.xOff;
@@ -1949,6 +2570,14 @@ next_image:
 			}
 			list++;
 		} while (--nlist);
+
+		glyphs_composite(PIXMAN_OP_ADD,
+				 sna->render.white_image, 0, 0,
+				 mask_image, blt, count,
+				 0, 0, width, height);
+		if (blt != stack_blt)
+			free(blt);
+	}
 	pixman_image_unref(mask_image);
 
 	component_alpha = NeedsComponent(format->format);
@@ -2060,6 +2689,7 @@ sna_glyph_unrealize(ScreenPtr screen, GlyphPtr glyph)
 		     __FUNCTION__, priv->pos >> 1, priv->pos & 1));
 		assert(cache->glyphs[priv->pos >> 1] == priv);
 		cache->glyphs[priv->pos >> 1] = NULL;
+		cache->used[priv->pos >> 1] = 0;
 		priv->atlas = NULL;
 	}
 }
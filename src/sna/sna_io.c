@@ -38,6 +38,10 @@
 #define PITCH(x, y) ALIGN((x)*(y), 4)
 
 #define FORCE_INPLACE 0 /* 1 upload directly, -1 force indirect */
+#define NO_THREADS 0
+
+/* Minimum amount of pixel data to hand to each thread */
+#define THREAD_PAGES 64
 
 /* XXX Need to avoid using GTT fenced access for I915_TILING_Y on 855GM */
 
@@ -68,18 +72,240 @@ static inline bool must_tile(struct sna *sna, int width, int height)
 		upload_too_large(sna, width, height));
 }
 
+struct copy_boxes {
+	void (*copy)(const struct copy_boxes *c, const BoxRec *box);
+	void (*tile)(const void *src, void *dst, int bpp, int swizzling,
+		     int32_t src_stride, int32_t dst_stride,
+		     int16_t src_x, int16_t src_y,
+		     int16_t dst_x, int16_t dst_y,
+		     uint16_t width, uint16_t height);
+	const void *src;
+	void *dst;
+	int bpp, swizzle;
+	int32_t src_stride, dst_stride;
+	int16_t src_dx, src_dy;
+	int16_t dst_dx, dst_dy;
+	uint32_t and, or;
+};
+
+static void copy_box__blt(const struct copy_boxes *c, const BoxRec *box)
+{
+	memcpy_blt(c->src, c->dst, c->bpp,
+		   c->src_stride, c->dst_stride,
+		   box->x1 + c->src_dx, box->y1 + c->src_dy,
+		   box->x1 + c->dst_dx, box->y1 + c->dst_dy,
+		   box->x2 - box->x1, box->y2 - box->y1);
+}
+
+static void copy_box__tiled(const struct copy_boxes *c, const BoxRec *box)
+{
+	c->tile(c->src, c->dst, c->bpp, c->swizzle,
+		c->src_stride, c->dst_stride,
+		box->x1 + c->src_dx, box->y1 + c->src_dy,
+		box->x1 + c->dst_dx, box->y1 + c->dst_dy,
+		box->x2 - box->x1, box->y2 - box->y1);
+}
+
+static void copy_box__xor(const struct copy_boxes *c, const BoxRec *box)
+{
+	memcpy_xor(c->src, c->dst, c->bpp,
+		   c->src_stride, c->dst_stride,
+		   box->x1 + c->src_dx, box->y1 + c->src_dy,
+		   box->x1 + c->dst_dx, box->y1 + c->dst_dy,
+		   box->x2 - box->x1, box->y2 - box->y1,
+		   c->and, c->or);
+}
+
+struct copy_boxes_thread {
+	const struct copy_boxes *c;
+	const BoxRec *box;
+	int n;
+	int16_t y1, y2;
+};
+
+static void copy_boxes_thread(void *arg)
+{
+	const struct copy_boxes_thread *t = arg;
+	const BoxRec *box = t->box;
+	int n = t->n;
+
+	do {
+		BoxRec b = *box++;
+
+		if (b.y1 < t->y1)
+			b.y1 = t->y1;
+		if (b.y2 > t->y2)
+			b.y2 = t->y2;
+		if (b.y2 > b.y1)
+			t->c->copy(t->c, &b);
+	} while (--n);
+}
+
+/* The height of the rows of the destination that must be written as a
+ * unit: a row of tiles for a tiled bo, or enough linear rows to begin
+ * on a cacheline (as every stride is a multiple of 4 bytes).
+ */
+static int copy_boxes_tile_height(const struct copy_boxes *c)
+{
+	if (c->copy == copy_box__tiled) {
+		if (c->tile == memcpy_to_tiled_x)
+			return 8;
+		if (c->tile == memcpy_to_tiled_y)
+			return 32;
+	}
+
+	return 16;
+}
+
+/* Large transfers are bound by memory bandwidth, which a single core
+ * cannot saturate, so split them into bands of rows across the thread
+ * pool. The band edges are placed on tile rows of the destination, so
+ * that no two threads write into the same tile or cacheline.
+ */
+static void copy_boxes(const struct copy_boxes *c, const BoxRec *box, int n)
+{
+	int num_threads, y1, y2, h, th, i;
+	int64_t bytes = 0;
+
+	y1 = box->y1;
+	y2 = box->y2;
+	for (i = 0; i < n; i++) {
+		bytes += (box[i].x2 - box[i].x1) * (box[i].y2 - box[i].y1);
+		if (box[i].y1 < y1)
+			y1 = box[i].y1;
+		if (box[i].y2 > y2)
+			y2 = box[i].y2;
+	}
+	bytes *= c->bpp / 8;
+
+	num_threads = 1;
+	if (!NO_THREADS && bytes >= 2 * THREAD_PAGES * PAGE_SIZE)
+		num_threads = sna_use_threads(PAGE_SIZE, bytes / PAGE_SIZE,
+					      THREAD_PAGES);
+	th = copy_boxes_tile_height(c);
+	h = ALIGN((y2 - y1 + num_threads - 1) / num_threads, th);
+	if (num_threads == 1 || h >= y2 - y1) {
+		do {
+			c->copy(c, box++);
+		} while (--n);
+	} else {
+		struct copy_boxes_thread threads[num_threads];
+		int y, end;
+
+		DBG(("%s: using %d threads for %lld bytes in bands of %d rows\n",
+		     __FUNCTION__, num_threads, (long long)bytes, h));
+
+		/* Walk the bands in the rows of the destination */
+		y = y1 + c->dst_dy;
+		end = y2 + c->dst_dy;
+		for (i = 0; i < num_threads - 1; i++) {
+			int next = (y + h) & ~(th - 1);
+			if (next >= end)
+				break;
+
+			threads[i].c = c;
+			threads[i].box = box;
+			threads[i].n = n;
+			threads[i].y1 = y - c->dst_dy;
+			threads[i].y2 = next - c->dst_dy;
+			sna_threads_run(copy_boxes_thread, &threads[i]);
+			y = next;
+		}
+
+		threads[i].c = c;
+		threads[i].box = box;
+		threads[i].n = n;
+		threads[i].y1 = y - c->dst_dy;
+		threads[i].y2 = y2;
+		copy_boxes_thread(&threads[i]);
+
+		sna_threads_wait();
+	}
+}
+
+static bool download_inplace__tiled(struct kgem *kgem, struct kgem_bo *bo)
+{
+#ifndef __x86_64__
+	/* See upload_inplace__tiled() */
+	return false;
+#endif
+
+	if (kgem->gen < 050) /* bit17 swizzling :( */
+		return false;
+
+	if (bo->tiling != I915_TILING_X && bo->tiling != I915_TILING_Y)
+		return false;
+
+	/* The scanout is uncached, so reading it through the CPU is as
+	 * slow as through the GTT.
+	 */
+	if (bo->scanout)
+		return false;
+
+	return bo->domain == DOMAIN_CPU || kgem->has_llc;
+}
+
+static bool
+read_boxes_inplace__tiled(struct kgem *kgem,
+			  struct kgem_bo *bo, int16_t src_dx, int16_t src_dy,
+			  PixmapPtr pixmap, int16_t dst_dx, int16_t dst_dy,
+			  const BoxRec *box, int n)
+{
+	struct copy_boxes c;
+	uint8_t *src;
+
+	switch (bo->tiling) {
+	case I915_TILING_X:
+		c.tile = memcpy_from_tiled_x;
+		break;
+	case I915_TILING_Y:
+		c.tile = memcpy_from_tiled_y;
+		break;
+	default:
+		assert(0);
+		return false;
+	}
+
+	src = __kgem_bo_map__cpu(kgem, bo);
+	if (src == NULL)
+		return false;
+
+	kgem_bo_sync__cpu_full(kgem, bo, false);
+
+	c.copy = copy_box__tiled;
+	c.src = src;
+	c.dst = pixmap->devPrivate.ptr;
+	c.bpp = pixmap->drawable.bitsPerPixel;
+	c.swizzle = kgem_bo_get_swizzling(kgem, bo);
+	c.src_stride = bo->pitch;
+	c.dst_stride = pixmap->devKind;
+	c.src_dx = src_dx;
+	c.src_dy = src_dy;
+	c.dst_dx = dst_dx;
+	c.dst_dy = dst_dy;
+	copy_boxes(&c, box, n);
+
+	__kgem_bo_unmap__cpu(kgem, bo, src);
+
+	return true;
+}
+
 static void read_boxes_inplace(struct kgem *kgem,
 			       struct kgem_bo *bo, int16_t src_dx, int16_t src_dy,
 			       PixmapPtr pixmap, int16_t dst_dx, int16_t dst_dy,
 			       const BoxRec *box, int n)
 {
-	int bpp = pixmap->drawable.bitsPerPixel;
-	void *src, *dst = pixmap->devPrivate.ptr;
-	int src_pitch = bo->pitch;
-	int dst_pitch = pixmap->devKind;
+	struct copy_boxes c;
+	void *src;
+	int i;
 
 	DBG(("%s x %d, tiling=%d\n", __FUNCTION__, n, bo->tiling));
 
+	if (download_inplace__tiled(kgem, bo) &&
+	    read_boxes_inplace__tiled(kgem, bo, src_dx, src_dy,
+				      pixmap, dst_dx, dst_dy, box, n))
+		return;
+
 	if (!kgem_bo_can_map(kgem, bo))
 		return;
 
@@ -89,30 +315,35 @@ static void read_boxes_inplace(struct kgem *kgem,
 	if (src == NULL)
 		return;
 
-	do {
+	for (i = 0; i < n; i++) {
 		DBG(("%s: copying box (%d, %d), (%d, %d)\n",
-		     __FUNCTION__, box->x1, box->y1, box->x2, box->y2));
+		     __FUNCTION__, box[i].x1, box[i].y1, box[i].x2, box[i].y2));
 
-		assert(box->x2 > box->x1);
-		assert(box->y2 > box->y1);
+		assert(box[i].x2 > box[i].x1);
+		assert(box[i].y2 > box[i].y1);
 
-		assert(box->x1 + src_dx >= 0);
-		assert(box->y1 + src_dy >= 0);
-		assert(box->x2 + src_dx <= pixmap->drawable.width);
-		assert(box->y2 + src_dy <= pixmap->drawable.height);
+		assert(box[i].x1 + src_dx >= 0);
+		assert(box[i].y1 + src_dy >= 0);
+		assert(box[i].x2 + src_dx <= pixmap->drawable.width);
+		assert(box[i].y2 + src_dy <= pixmap->drawable.height);
 
-		assert(box->x1 + dst_dx >= 0);
-		assert(box->y1 + dst_dy >= 0);
-		assert(box->x2 + dst_dx <= pixmap->drawable.width);
-		assert(box->y2 + dst_dy <= pixmap->drawable.height);
+		assert(box[i].x1 + dst_dx >= 0);
+		assert(box[i].y1 + dst_dy >= 0);
+		assert(box[i].x2 + dst_dx <= pixmap->drawable.width);
+		assert(box[i].y2 + dst_dy <= pixmap->drawable.height);
+	}
 
-		memcpy_blt(src, dst, bpp,
-			   src_pitch, dst_pitch,
-			   box->x1 + src_dx, box->y1 + src_dy,
-			   box->x1 + dst_dx, box->y1 + dst_dy,
-			   box->x2 - box->x1, box->y2 - box->y1);
-		box++;
-	} while (--n);
+	c.copy = copy_box__blt;
+	c.src = src;
+	c.dst = pixmap->devPrivate.ptr;
+	c.bpp = pixmap->drawable.bitsPerPixel;
+	c.src_stride = bo->pitch;
+	c.dst_stride = pixmap->devKind;
+	c.src_dx = src_dx;
+	c.src_dy = src_dy;
+	c.dst_dx = dst_dx;
+	c.dst_dy = dst_dy;
+	copy_boxes(&c, box, n);
 }
 
 static bool download_inplace(struct kgem *kgem, struct kgem_bo *bo)
@@ -126,6 +357,12 @@ static bool download_inplace(struct kgem *kgem, struct kgem_bo *bo)
 	if (FORCE_INPLACE)
 		return FORCE_INPLACE > 0;
 
+	/* Detiling on the CPU is cheaper than blitting to a linear bo and
+	 * waiting for the copy, as either way we wait upon the GPU first.
+	 */
+	if (download_inplace__tiled(kgem, bo))
+		return true;
+
 	if (kgem->can_blt_cpu && kgem->max_cpu_size)
 		return false;
 
@@ -489,6 +726,26 @@ fallback:
 	sna->blt_state.fill_bo = 0;
 }
 
+/* Staging for one tile of a large upload, taken from the upload ring so
+ * that it can be filled whilst the GPU copies from the previous tile.
+ */
+static struct kgem_bo *
+upload_ring_create(struct kgem *kgem, int width, int height, int bpp,
+		   void **ptr)
+{
+	struct kgem_bo *bo;
+	int stride;
+
+	stride = ALIGN(width, 2) * bpp >> 3;
+	stride = ALIGN(stride, 4);
+
+	bo = kgem_get_upload_bo(kgem, stride * height, ptr);
+	if (bo)
+		bo->pitch = stride;
+
+	return bo;
+}
+
 static bool upload_inplace__tiled(struct kgem *kgem, struct kgem_bo *bo)
 {
 #ifndef __x86_64__
@@ -503,7 +760,7 @@ static bool upload_inplace__tiled(struct kgem *kgem, struct kgem_bo *bo)
 	if (kgem->gen < 050) /* bit17 swizzling :( */
 		return false;
 
-	if (bo->tiling != I915_TILING_X)
+	if (bo->tiling != I915_TILING_X && bo->tiling != I915_TILING_Y)
 		return false;
 
 	if (bo->scanout)
@@ -518,24 +775,40 @@ write_boxes_inplace__tiled(struct kgem *kgem,
                            struct kgem_bo *bo, int16_t dst_dx, int16_t dst_dy,
                            const BoxRec *box, int n)
 {
+	struct copy_boxes c;
 	uint8_t *dst;
-	int swizzle;
 
-	assert(bo->tiling == I915_TILING_X);
+	switch (bo->tiling) {
+	case I915_TILING_X:
+		c.tile = memcpy_to_tiled_x;
+		break;
+	case I915_TILING_Y:
+		c.tile = memcpy_to_tiled_y;
+		break;
+	default:
+		assert(0);
+		return false;
+	}
 
 	dst = __kgem_bo_map__cpu(kgem, bo);
 	if (dst == NULL)
 		return false;
 
 	kgem_bo_sync__cpu(kgem, bo);
-	swizzle = kgem_bo_get_swizzling(kgem, bo);
-	do {
-		memcpy_to_tiled_x(src, dst, bpp, swizzle, stride, bo->pitch,
-				  box->x1 + src_dx, box->y1 + src_dy,
-				  box->x1 + dst_dx, box->y1 + dst_dy,
-				  box->x2 - box->x1, box->y2 - box->y1);
-		box++;
-	} while (--n);
+
+	c.copy = copy_box__tiled;
+	c.src = src;
+	c.dst = dst;
+	c.bpp = bpp;
+	c.swizzle = kgem_bo_get_swizzling(kgem, bo);
+	c.src_stride = stride;
+	c.dst_stride = bo->pitch;
+	c.src_dx = src_dx;
+	c.src_dy = src_dy;
+	c.dst_dx = dst_dx;
+	c.dst_dy = dst_dy;
+	copy_boxes(&c, box, n);
+
 	__kgem_bo_unmap__cpu(kgem, bo, dst);
 
 	return true;
@@ -546,7 +819,9 @@ static bool write_boxes_inplace(struct kgem *kgem,
 				struct kgem_bo *bo, int16_t dst_dx, int16_t dst_dy,
 				const BoxRec *box, int n)
 {
+	struct copy_boxes c;
 	void *dst;
+	int i;
 
 	DBG(("%s x %d, handle=%d, tiling=%d\n",
 	     __FUNCTION__, n, bo->handle, bo->tiling));
@@ -567,32 +842,37 @@ static bool write_boxes_inplace(struct kgem *kgem,
 
 	assert(dst != src);
 
-	do {
+	for (i = 0; i < n; i++) {
 		DBG(("%s: (%d, %d) -> (%d, %d) x (%d, %d) [bpp=%d, src_pitch=%d, dst_pitch=%d]\n", __FUNCTION__,
-		     box->x1 + src_dx, box->y1 + src_dy,
-		     box->x1 + dst_dx, box->y1 + dst_dy,
-		     box->x2 - box->x1, box->y2 - box->y1,
+		     box[i].x1 + src_dx, box[i].y1 + src_dy,
+		     box[i].x1 + dst_dx, box[i].y1 + dst_dy,
+		     box[i].x2 - box[i].x1, box[i].y2 - box[i].y1,
 		     bpp, stride, bo->pitch));
 
-		assert(box->x2 > box->x1);
-		assert(box->y2 > box->y1);
+		assert(box[i].x2 > box[i].x1);
+		assert(box[i].y2 > box[i].y1);
 
-		assert(box->x1 + dst_dx >= 0);
-		assert((box->x2 + dst_dx)*bpp <= 8*bo->pitch);
-		assert(box->y1 + dst_dy >= 0);
-		assert((box->y2 + dst_dy)*bo->pitch <= kgem_bo_size(bo));
+		assert(box[i].x1 + dst_dx >= 0);
+		assert((box[i].x2 + dst_dx)*bpp <= 8*bo->pitch);
+		assert(box[i].y1 + dst_dy >= 0);
+		assert((box[i].y2 + dst_dy)*bo->pitch <= kgem_bo_size(bo));
 
-		assert(box->x1 + src_dx >= 0);
-		assert((box->x2 + src_dx)*bpp <= 8*stride);
-		assert(box->y1 + src_dy >= 0);
+		assert(box[i].x1 + src_dx >= 0);
+		assert((box[i].x2 + src_dx)*bpp <= 8*stride);
+		assert(box[i].y1 + src_dy >= 0);
+	}
 
-		memcpy_blt(src, dst, bpp,
-			   stride, bo->pitch,
-			   box->x1 + src_dx, box->y1 + src_dy,
-			   box->x1 + dst_dx, box->y1 + dst_dy,
-			   box->x2 - box->x1, box->y2 - box->y1);
-		box++;
-	} while (--n);
+	c.copy = copy_box__blt;
+	c.src = src;
+	c.dst = dst;
+	c.bpp = bpp;
+	c.src_stride = stride;
+	c.dst_stride = bo->pitch;
+	c.src_dx = src_dx;
+	c.src_dy = src_dy;
+	c.dst_dx = dst_dx;
+	c.dst_dy = dst_dy;
+	copy_boxes(&c, box, n);
 	return true;
 }
 
@@ -697,6 +977,8 @@ fallback:
 		     sna->render.max_3d_size, sna->render.max_3d_size));
 		if (must_tile(sna, tmp.drawable.width, tmp.drawable.height)) {
 			BoxRec tile, stack[64], *clipped, *c;
+			struct copy_boxes cb;
+			bool pipelined;
 			int cpp, step;
 
 tile:
@@ -732,18 +1014,6 @@ tile:
 					tmp.drawable.width  = tile.x2 - tile.x1;
 					tmp.drawable.height = tile.y2 - tile.y1;
 
-					src_bo = kgem_create_buffer_2d(kgem,
-								       tmp.drawable.width,
-								       tmp.drawable.height,
-								       tmp.drawable.bitsPerPixel,
-								       KGEM_BUFFER_WRITE_INPLACE,
-								       &ptr);
-					if (!src_bo) {
-						if (clipped != stack)
-							free(clipped);
-						goto fallback;
-					}
-
 					c = clipped;
 					for (n = 0; n < nbox; n++) {
 						*c = box[n];
@@ -757,24 +1027,52 @@ tile:
 						     src_dx, src_dy,
 						     c->x1 - tile.x1,
 						     c->y1 - tile.y1));
-						memcpy_blt(src, ptr, tmp.drawable.bitsPerPixel,
-							   stride, src_bo->pitch,
-							   c->x1 + src_dx,
-							   c->y1 + src_dy,
-							   c->x1 - tile.x1,
-							   c->y1 - tile.y1,
-							   c->x2 - c->x1,
-							   c->y2 - c->y1);
 						c++;
 					}
+					if (c == clipped)
+						continue;
 
-					if (c != clipped)
-						n = sna->render.copy_boxes(sna, GXcopy,
-									   &tmp, src_bo, -tile.x1, -tile.y1,
-									   dst, dst_bo, dst_dx, dst_dy,
-									   clipped, c - clipped, 0);
-					else
-						n = 1;
+					src_bo = upload_ring_create(kgem,
+								    tmp.drawable.width,
+								    tmp.drawable.height,
+								    tmp.drawable.bitsPerPixel,
+								    &ptr);
+					pipelined = src_bo != NULL;
+					if (!pipelined)
+						src_bo = kgem_create_buffer_2d(kgem,
+									       tmp.drawable.width,
+									       tmp.drawable.height,
+									       tmp.drawable.bitsPerPixel,
+									       KGEM_BUFFER_WRITE_INPLACE,
+									       &ptr);
+					if (!src_bo) {
+						if (clipped != stack)
+							free(clipped);
+						goto fallback;
+					}
+
+					cb.copy = copy_box__blt;
+					cb.src = src;
+					cb.dst = ptr;
+					cb.bpp = tmp.drawable.bitsPerPixel;
+					cb.src_stride = stride;
+					cb.dst_stride = src_bo->pitch;
+					cb.src_dx = src_dx;
+					cb.src_dy = src_dy;
+					cb.dst_dx = -tile.x1;
+					cb.dst_dy = -tile.y1;
+					copy_boxes(&cb, clipped, c - clipped);
+
+					n = sna->render.copy_boxes(sna, GXcopy,
+								   &tmp, src_bo, -tile.x1, -tile.y1,
+								   dst, dst_bo, dst_dx, dst_dy,
+								   clipped, c - clipped, 0);
+
+					/* Start the GPU copying this tile whilst
+					 * we fill the next.
+					 */
+					if (n && pipelined)
+						kgem_submit(kgem);
 
 					kgem_bo_destroy(&sna->kgem, src_bo);
 
@@ -952,7 +1250,9 @@ write_boxes_inplace__xor(struct kgem *kgem,
 			 const BoxRec *box, int n,
 			 uint32_t and, uint32_t or)
 {
+	struct copy_boxes c;
 	void *dst;
+	int i;
 
 	DBG(("%s x %d, tiling=%d\n", __FUNCTION__, n, bo->tiling));
 
@@ -962,33 +1262,39 @@ write_boxes_inplace__xor(struct kgem *kgem,
 	if (dst == NULL)
 		return;
 
-	do {
+	for (i = 0; i < n; i++) {
 		DBG(("%s: (%d, %d) -> (%d, %d) x (%d, %d) [bpp=%d, src_pitch=%d, dst_pitch=%d]\n", __FUNCTION__,
-		     box->x1 + src_dx, box->y1 + src_dy,
-		     box->x1 + dst_dx, box->y1 + dst_dy,
-		     box->x2 - box->x1, box->y2 - box->y1,
+		     box[i].x1 + src_dx, box[i].y1 + src_dy,
+		     box[i].x1 + dst_dx, box[i].y1 + dst_dy,
+		     box[i].x2 - box[i].x1, box[i].y2 - box[i].y1,
 		     bpp, stride, bo->pitch));
 
-		assert(box->x2 > box->x1);
-		assert(box->y2 > box->y1);
+		assert(box[i].x2 > box[i].x1);
+		assert(box[i].y2 > box[i].y1);
 
-		assert(box->x1 + dst_dx >= 0);
-		assert((box->x2 + dst_dx)*bpp <= 8*bo->pitch);
-		assert(box->y1 + dst_dy >= 0);
-		assert((box->y2 + dst_dy)*bo->pitch <= kgem_bo_size(bo));
+		assert(box[i].x1 + dst_dx >= 0);
+		assert((box[i].x2 + dst_dx)*bpp <= 8*bo->pitch);
+		assert(box[i].y1 + dst_dy >= 0);
+		assert((box[i].y2 + dst_dy)*bo->pitch <= kgem_bo_size(bo));
 
-		assert(box->x1 + src_dx >= 0);
-		assert((box->x2 + src_dx)*bpp <= 8*stride);
-		assert(box->y1 + src_dy >= 0);
+		assert(box[i].x1 + src_dx >= 0);
+		assert((box[i].x2 + src_dx)*bpp <= 8*stride);
+		assert(box[i].y1 + src_dy >= 0);
+	}
 
-		memcpy_xor(src, dst, bpp,
-			   stride, bo->pitch,
-			   box->x1 + src_dx, box->y1 + src_dy,
-			   box->x1 + dst_dx, box->y1 + dst_dy,
-			   box->x2 - box->x1, box->y2 - box->y1,
-			   and, or);
-		box++;
-	} while (--n);
+	c.copy = copy_box__xor;
+	c.src = src;
+	c.dst = dst;
+	c.bpp = bpp;
+	c.src_stride = stride;
+	c.dst_stride = bo->pitch;
+	c.src_dx = src_dx;
+	c.src_dy = src_dy;
+	c.dst_dx = dst_dx;
+	c.dst_dy = dst_dy;
+	c.and = and;
+	c.or = or;
+	copy_boxes(&c, box, n);
 }
 
 static bool upload_inplace__xor(struct kgem *kgem,
@@ -1437,16 +1743,26 @@ bool sna_replace(struct sna *sna,
 		}
 
 		if (kgem_bo_is_mappable(kgem, bo)) {
+			struct copy_boxes c;
+			BoxRec box;
+
 			dst = kgem_bo_map(kgem, bo);
 			if (!dst)
 				goto err;
 
-			memcpy_blt(src, dst, pixmap->drawable.bitsPerPixel,
-				   stride, bo->pitch,
-				   0, 0,
-				   0, 0,
-				   pixmap->drawable.width,
-				   pixmap->drawable.height);
+			box.x1 = box.y1 = 0;
+			box.x2 = pixmap->drawable.width;
+			box.y2 = pixmap->drawable.height;
+
+			c.copy = copy_box__blt;
+			c.src = src;
+			c.dst = dst;
+			c.bpp = pixmap->drawable.bitsPerPixel;
+			c.src_stride = stride;
+			c.dst_stride = bo->pitch;
+			c.src_dx = c.src_dy = 0;
+			c.dst_dx = c.dst_dy = 0;
+			copy_boxes(&c, &box, 1);
 		} else {
 			BoxRec box;
 
@@ -1508,13 +1824,24 @@ struct kgem_bo *sna_replace__xor(struct sna *sna,
 	if (kgem_bo_is_mappable(kgem, bo)) {
 		dst = kgem_bo_map(kgem, bo);
 		if (dst) {
-			memcpy_xor(src, dst, pixmap->drawable.bitsPerPixel,
-				   stride, bo->pitch,
-				   0, 0,
-				   0, 0,
-				   pixmap->drawable.width,
-				   pixmap->drawable.height,
-				   and, or);
+			struct copy_boxes c;
+			BoxRec box;
+
+			box.x1 = box.y1 = 0;
+			box.x2 = pixmap->drawable.width;
+			box.y2 = pixmap->drawable.height;
+
+			c.copy = copy_box__xor;
+			c.src = src;
+			c.dst = dst;
+			c.bpp = pixmap->drawable.bitsPerPixel;
+			c.src_stride = stride;
+			c.dst_stride = bo->pitch;
+			c.src_dx = c.src_dy = 0;
+			c.dst_dx = c.dst_dy = 0;
+			c.and = and;
+			c.or = or;
+			copy_boxes(&c, &box, 1);
 		}
 	} else {
 		BoxRec box;
@@ -12,6 +12,13 @@
 
 #define GRADIENT_CACHE_SIZE 16
 
+#define GLYPH_CACHE_PICTURE_SIZE 1024
+#define GLYPH_CACHE_MAX_PAGES 4
+#define GLYPH_MIN_SIZE 8
+#define GLYPH_MAX_SIZE 256
+#define GLYPH_CACHE_SIZE (GLYPH_CACHE_PICTURE_SIZE * GLYPH_CACHE_PICTURE_SIZE / (GLYPH_MIN_SIZE * GLYPH_MIN_SIZE))
+#define GLYPH_NUM_SIZES 6 /* 8, 16, 32, 64, 128 and 256 */
+
 #define GXinvalid 0xff
 
 struct sna;
@@ -306,10 +313,20 @@ struct sna_render {
 	} gradient_cache;
 
 	struct sna_glyph_cache{
-		PicturePtr picture;
+		PicturePtr picture[GLYPH_CACHE_MAX_PAGES];
 		struct sna_glyph **glyphs;
-		uint16_t count;
-		uint16_t evict;
+		uint8_t *used; /* referenced since the clock last passed */
+		uint32_t count;
+		uint32_t evict[GLYPH_NUM_SIZES];
+		uint8_t num_pages, max_pages;
+
+		struct sna_glyph_stats {
+			unsigned long hits;
+			unsigned long misses;
+			unsigned long evictions;
+			unsigned long uploads; /* copy operations */
+			uint64_t uploaded; /* bytes */
+		} stats;
 	} glyph[2];
 	pixman_image_t *white_image;
 	PicturePtr white_picture;
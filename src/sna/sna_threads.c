@@ -25,109 +25,492 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1 /* for sched_getcpu() and pthread_setaffinity_np() */
+#endif
+
 #include "sna.h"
 
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <dirent.h>
+#include <sched.h>
 
 static int max_threads = -1;
 
+/* Each worker owns a deque of tasks. New tasks are dealt out to the workers
+ * in turn and pushed onto the tail of their deque; a worker pops from its
+ * own tail and, once that is empty, steals from the head of another's.
+ * The thread that submitted the work also steals whilst it waits, so that
+ * a caller may split its operation into many more tasks than there are
+ * threads and the load balances itself.
+ */
+#define MAX_TASKS 64 /* per worker, must be a power-of-two */
+#define TASKS_PER_THREAD 4
+#define MAX_SPIN 16 /* retries before an idle worker sleeps */
+
+struct task {
+	void (*func)(void *arg);
+	void *arg;
+};
+
 static struct thread {
     pthread_t thread;
     pthread_mutex_t mutex;
-    pthread_cond_t cond;
 
-    void (*func)(void *arg);
-    void *arg;
+    unsigned head, tail;
+    struct task deque[MAX_TASKS];
 } *threads;
 
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	int sleeping;
+	unsigned next;
+
+	atomic_t queued; /* tasks sitting in a deque */
+	atomic_t pending; /* tasks not yet completed */
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+};
+
+static bool task_push(struct thread *t, void (*func)(void *arg), void *arg)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->tail - t->head < MAX_TASKS) {
+		struct task *task = &t->deque[t->tail++ & (MAX_TASKS - 1)];
+		task->func = func;
+		task->arg = arg;
+		ret = true;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return ret;
+}
+
+static bool task_pop(struct thread *t, struct task *task)
+{
+	bool ret = false;
+
+	if (t->head == t->tail)
+		return false;
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->head != t->tail) {
+		*task = t->deque[--t->tail & (MAX_TASKS - 1)];
+		ret = true;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return ret;
+}
+
+static bool task_steal(struct thread *t, struct task *task)
+{
+	bool ret = false;
+
+	if (t->head == t->tail)
+		return false;
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->head != t->tail) {
+		*task = t->deque[t->head++ & (MAX_TASKS - 1)];
+		ret = true;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return ret;
+}
+
+static bool task_find(struct thread *self, struct task *task)
+{
+	int n, first;
+
+	if (atomic_read(&pool.queued) == 0)
+		return false;
+
+	if (self && task_pop(self, task))
+		goto found;
+
+	first = self ? self - threads + 1 : 0;
+	for (n = 0; n < max_threads; n++) {
+		struct thread *victim = &threads[(first + n) % max_threads];
+		if (victim != self && task_steal(victim, task))
+			goto found;
+	}
+
+	return false;
+
+found:
+	atomic_dec(&pool.queued, 1);
+	return true;
+}
+
+/* Whether a task has actually been pushed, as pool.queued is raised
+ * before the submitter pushes its task.
+ */
+static bool task_available(void)
+{
+	int n;
+
+	for (n = 0; n < max_threads; n++)
+		if (threads[n].head != threads[n].tail)
+			return true;
+
+	return false;
+}
+
+static void task_run(struct task *task)
+{
+	task->func(task->arg);
+
+	if (atomic_dec_and_test(&pool.pending)) {
+		pthread_mutex_lock(&pool.mutex);
+		pthread_cond_broadcast(&pool.done);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+}
+
 static void *__run__(void *arg)
 {
 	struct thread *t = arg;
 	sigset_t signals;
+	int spin = 0;
 
 	/* Disable all signals in the slave threads as X uses them for IO */
 	sigfillset(&signals);
 	pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
-	pthread_mutex_lock(&t->mutex);
 	while (1) {
-		while (t->func == NULL)
-			pthread_cond_wait(&t->cond, &t->mutex);
-		pthread_mutex_unlock(&t->mutex);
+		struct task task;
 
-		assert(t->func);
-		t->func(t->arg);
+		if (task_find(t, &task)) {
+			task_run(&task);
+			spin = 0;
+			continue;
+		}
 
-		pthread_mutex_lock(&t->mutex);
-		t->func = NULL;
-		pthread_cond_signal(&t->cond);
+		/* A task may be about to be pushed, so retry briefly */
+		if (atomic_read(&pool.queued) && ++spin < MAX_SPIN) {
+			sched_yield();
+			continue;
+		}
+		spin = 0;
+
+		/* Submitters signal under the mutex after pushing, so checking
+		 * the deques whilst holding it cannot miss a wakeup.
+		 */
+		pthread_mutex_lock(&pool.mutex);
+		pool.sleeping++;
+		while (!task_available())
+			pthread_cond_wait(&pool.work, &pool.mutex);
+		pool.sleeping--;
+		pthread_mutex_unlock(&pool.mutex);
 	}
-	pthread_mutex_unlock(&t->mutex);
 
 	return NULL;
 }
 
-#if defined(__GNUC__)
-#define popcount(x) __builtin_popcount(x)
-#else
-static int popcount(unsigned int x)
+#define MAX_CPUS 1024
+#define BITS_PER_LONG (8*sizeof(unsigned long))
+
+struct cpumask {
+	unsigned long bits[MAX_CPUS / BITS_PER_LONG];
+};
+
+static inline void cpumask_set(struct cpumask *mask, int cpu)
+{
+	mask->bits[cpu / BITS_PER_LONG] |= 1UL << (cpu % BITS_PER_LONG);
+}
+
+static inline void cpumask_clear(struct cpumask *mask, int cpu)
 {
-	int count = 0;
+	mask->bits[cpu / BITS_PER_LONG] &= ~(1UL << (cpu % BITS_PER_LONG));
+}
 
-	while (x) {
-		count += x&1;
-		x >>= 1;
-	}
+static inline bool cpumask_test(const struct cpumask *mask, int cpu)
+{
+	return mask->bits[cpu / BITS_PER_LONG] & (1UL << (cpu % BITS_PER_LONG));
+}
+
+static void cpumask_and(struct cpumask *dst, const struct cpumask *src)
+{
+	unsigned n;
+
+	for (n = 0; n < ARRAY_SIZE(dst->bits); n++)
+		dst->bits[n] &= src->bits[n];
+}
+
+static int cpumask_count(const struct cpumask *mask)
+{
+	int cpu, count = 0;
+
+	for (cpu = 0; cpu < MAX_CPUS; cpu++)
+		count += cpumask_test(mask, cpu);
 
 	return count;
 }
+
+static FILE *sysfs_open(const char *fmt, ...)
+{
+	char path[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(path, sizeof(path), fmt, ap);
+	va_end(ap);
+
+	return fopen(path, "r");
+}
+
+/* Parse a sysfs cpu list, e.g. "0-3,8-11" */
+static bool cpumask_read(struct cpumask *mask, FILE *file)
+{
+	size_t len = 0;
+	char *line = NULL, *s;
+	bool ret = false;
+
+	memset(mask, 0, sizeof(*mask));
+	if (file == NULL)
+		return false;
+
+	if (getline(&line, &len, file) == -1)
+		goto out;
+
+	s = line;
+	while (*s >= '0' && *s <= '9') {
+		long first, last;
+
+		first = last = strtol(s, &s, 10);
+		if (*s == '-')
+			last = strtol(s + 1, &s, 10);
+		if (last >= MAX_CPUS)
+			last = MAX_CPUS - 1;
+
+		while (first <= last)
+			cpumask_set(mask, first++);
+
+		if (*s == ',')
+			s++;
+		ret = true;
+	}
+
+out:
+	free(line);
+	fclose(file);
+	return ret;
+}
+
+static bool cpu_siblings(int cpu, struct cpumask *mask)
+{
+	return cpumask_read(mask,
+			    sysfs_open("/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu));
+}
+
+/* The cpus sharing the largest data cache with cpu */
+static bool cpu_llc(int cpu, struct cpumask *mask)
+{
+	int index, best = 0;
+
+	for (index = 0; ; index++) {
+		struct cpumask shared;
+		char type[32];
+		FILE *file;
+		int level;
+
+		file = sysfs_open("/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+				  cpu, index);
+		if (file == NULL)
+			break;
+		if (fscanf(file, "%d", &level) != 1)
+			level = 0;
+		fclose(file);
+
+		file = sysfs_open("/sys/devices/system/cpu/cpu%d/cache/index%d/type",
+				  cpu, index);
+		if (file) {
+			if (fscanf(file, "%31s", type) == 1 &&
+			    strcmp(type, "Instruction") == 0)
+				level = 0;
+			fclose(file);
+		}
+
+		if (level > best &&
+		    cpumask_read(&shared,
+				 sysfs_open("/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+					    cpu, index))) {
+			*mask = shared;
+			best = level;
+		}
+	}
+
+	return best > 0;
+}
+
+/* The cpus in the same memory node as cpu */
+static bool cpu_node(int cpu, struct cpumask *mask)
+{
+	struct dirent *de;
+	bool found = false;
+	DIR *dir;
+
+	dir = opendir("/sys/devices/system/node");
+	if (dir == NULL)
+		return false;
+
+	while (!found && (de = readdir(dir))) {
+		int node;
+
+		if (sscanf(de->d_name, "node%d", &node) != 1)
+			continue;
+
+		if (cpumask_read(mask,
+				 sysfs_open("/sys/devices/system/node/node%d/cpulist", node)))
+			found = cpumask_test(mask, cpu);
+	}
+	closedir(dir);
+
+	return found;
+}
+
+static int home_cpu(void)
+{
+#if defined(__linux__)
+	int cpu = sched_getcpu();
+	if (cpu >= 0 && cpu < MAX_CPUS)
+		return cpu;
 #endif
+	return 0;
+}
 
-static int
-num_cores(void)
+/* Pick one cpu from each physical core (ignoring SMT siblings) that we are
+ * allowed to run upon, and that shares the chosen locality with the X
+ * server. The core running the X server is placed last so that it is the
+ * last to receive a worker.
+ */
+static int choose_cores(int affinity, int *cores)
 {
-	FILE *file = fopen("/proc/cpuinfo", "r");
-	int count = 0;
-	if (file) {
-		size_t len = 0;
-		char *line = NULL;
-		uint32_t processors = 0, cores = 0;
-		while (getline(&line, &len, file) != -1) {
-			int id;
-			if (sscanf(line, "physical id : %d", &id) == 1) {
-				if (id >= 32)
-					return 0;
-				processors |= 1 << id;
-			} else if (sscanf(line, "core id : %d", &id) == 1) {
-				if (id >= 32)
-					return 0;
-				cores |= 1 << id;
-			}
+	struct cpumask online, domain, seen;
+	int cpu, home, home_core = -1, count = 0;
+
+	if (!cpumask_read(&online, fopen("/sys/devices/system/cpu/online", "r")))
+		return 0;
+
+#if defined(__linux__) && defined(CPU_ISSET)
+	{
+		cpu_set_t allowed;
+
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+			for (cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++)
+				if (!CPU_ISSET(cpu, &allowed))
+					cpumask_clear(&online, cpu);
 		}
-		free(line);
-		fclose(file);
+	}
+#endif
+
+	home = home_cpu();
+	switch (affinity) {
+	case SNA_AFFINITY_LLC:
+		if (cpu_llc(home, &domain))
+			cpumask_and(&online, &domain);
+		break;
+	case SNA_AFFINITY_NODE:
+		if (cpu_node(home, &domain))
+			cpumask_and(&online, &domain);
+		break;
+	}
+
+	memset(&seen, 0, sizeof(seen));
+	for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct cpumask siblings;
+		unsigned n;
+
+		if (!cpumask_test(&online, cpu) || cpumask_test(&seen, cpu))
+			continue;
 
-		DBG(("%s: processors=0x%08x, cores=0x%08x\n",
-		     __FUNCTION__, processors, cores));
+		if (!cpu_siblings(cpu, &siblings))
+			cpumask_set(&siblings, cpu);
 
-		count = popcount(processors) * popcount(cores);
+		for (n = 0; n < ARRAY_SIZE(seen.bits); n++)
+			seen.bits[n] |= siblings.bits[n];
+
+		if (cpumask_test(&siblings, home))
+			home_core = count;
+		cores[count++] = cpu;
+	}
+
+	if (home_core != -1 && home_core != count - 1) {
+		cpu = cores[home_core];
+		memmove(cores + home_core, cores + home_core + 1,
+			(count - home_core - 1) * sizeof(*cores));
+		cores[count - 1] = cpu;
 	}
+
+	DBG(("%s: found %d cores (of %d online cpus), home cpu %d, affinity %d\n",
+	     __FUNCTION__, count, cpumask_count(&online), home, affinity));
 	return count;
 }
 
-void sna_threads_init(void)
+static bool pin_thread(pthread_t thread, int cpu)
 {
+#if defined(__linux__) && defined(CPU_SET)
+	struct cpumask siblings;
+	cpu_set_t set;
 	int n;
 
-	if (max_threads != -1)
-		return;
+	if (!cpu_siblings(cpu, &siblings))
+		cpumask_set(&siblings, cpu);
+
+	CPU_ZERO(&set);
+	for (n = 0; n < MAX_CPUS && n < CPU_SETSIZE; n++)
+		if (cpumask_test(&siblings, n))
+			CPU_SET(n, &set);
+
+	if (pthread_setaffinity_np(thread, sizeof(set), &set) == 0)
+		return true;
+
+	DBG(("%s: failed to bind thread to cpu %d\n", __FUNCTION__, cpu));
+#endif
+	return false;
+}
+
+/* Returns the number of workers, and updates affinity to that which was
+ * actually applied to them.
+ */
+int sna_threads_init(int count, int *affinity)
+{
+	static int applied = SNA_AFFINITY_NONE;
+	int cores[MAX_CPUS];
+	int num_cores, n;
+
+	if (max_threads != -1) {
+		*affinity = applied;
+		return max_threads;
+	}
 
-	max_threads = num_cores();
-	if (max_threads == 0)
-		max_threads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
-	if (max_threads <= 1)
+	num_cores = choose_cores(*affinity, cores);
+	if (num_cores == 0)
+		*affinity = SNA_AFFINITY_NONE;
+
+	/* An explicit count is the number of workers to spawn alongside
+	 * the server thread; the probed count includes it, so a single
+	 * core is left to the server alone.
+	 */
+	max_threads = count;
+	if (max_threads < 0) {
+		max_threads = num_cores;
+		if (max_threads == 0)
+			max_threads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+		if (max_threads <= 1)
+			goto bail;
+	}
+	if (max_threads <= 0)
 		goto bail;
 
 	DBG(("%s: creating a thread pool of %d threads\n",
@@ -139,66 +522,72 @@ void sna_threads_init(void)
 
 	for (n = 0; n < max_threads; n++) {
 		pthread_mutex_init(&threads[n].mutex, NULL);
-		pthread_cond_init(&threads[n].cond, NULL);
+		threads[n].head = threads[n].tail = 0;
+	}
 
-		threads[n].func = NULL;
+	for (n = 0; n < max_threads; n++) {
 		if (pthread_create(&threads[n].thread, NULL,
 				   __run__, &threads[n]))
 			goto bail;
+
+		if (*affinity != SNA_AFFINITY_NONE &&
+		    !pin_thread(threads[n].thread, cores[n % num_cores]))
+			*affinity = SNA_AFFINITY_NONE;
 	}
 
-	return;
+	applied = *affinity;
+	return max_threads;
 
 bail:
+	*affinity = applied;
 	max_threads = 0;
+	return 0;
 }
 
 void sna_threads_run(void (*func)(void *arg), void *arg)
 {
-	int n;
+	struct thread *t;
 
 	assert(max_threads > 0);
 
-	for (n = 0; n < max_threads; n++) {
-		if (threads[n].func)
-			continue;
+	atomic_inc(&pool.pending);
+	atomic_inc(&pool.queued);
 
-		pthread_mutex_lock(&threads[n].mutex);
-		if (threads[n].func) {
-			pthread_mutex_unlock(&threads[n].mutex);
-			continue;
-		}
+	t = &threads[pool.next++ % max_threads];
+	if (!task_push(t, func, arg)) {
+		struct task task;
 
-		goto execute;
+		/* The worker is already swamped, so do the work ourselves */
+		atomic_dec(&pool.queued, 1);
+		task.func = func;
+		task.arg = arg;
+		task_run(&task);
+		return;
 	}
 
-	n = rand() % max_threads;
-	pthread_mutex_lock(&threads[n].mutex);
-	while (threads[n].func)
-		pthread_cond_wait(&threads[n].cond, &threads[n].mutex);
-
-execute:
-	threads[n].func = func;
-	threads[n].arg = arg;
-	pthread_cond_signal(&threads[n].cond);
-	pthread_mutex_unlock(&threads[n].mutex);
+	pthread_mutex_lock(&pool.mutex);
+	if (pool.sleeping)
+		pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.mutex);
 }
 
 void sna_threads_wait(void)
 {
-	int n;
+	struct task task;
 
 	assert(max_threads > 0);
 
-	for (n = 0; n < max_threads; n++) {
-		if (threads[n].func == NULL)
-			continue;
+	/* Help out with any outstanding work rather than sleep */
+	while (task_find(NULL, &task))
+		task_run(&task);
 
-		pthread_mutex_lock(&threads[n].mutex);
-		while (threads[n].func)
-			pthread_cond_wait(&threads[n].cond, &threads[n].mutex);
-		pthread_mutex_unlock(&threads[n].mutex);
-	}
+	if (atomic_read(&pool.pending) == 0)
+		return;
+
+	pthread_mutex_lock(&pool.mutex);
+	while (atomic_read(&pool.pending))
+		pthread_cond_wait(&pool.done, &pool.mutex);
+	pthread_mutex_unlock(&pool.mutex);
 }
 
 int sna_use_threads(int width, int height, int threshold)
@@ -212,8 +601,20 @@ int sna_use_threads(int width, int height, int threshold)
 	if (num_threads <= 0)
 		return 1;
 
-	if (num_threads > max_threads)
-		num_threads = max_threads;
+	/* Oversubscribe so that an expensive band can be balanced by
+	 * the others being stolen by idle threads.
+	 */
+	if (num_threads > (max_threads + 1) * TASKS_PER_THREAD)
+		num_threads = (max_threads + 1) * TASKS_PER_THREAD;
+
+	/* Callers split the height into num_threads bands of equal
+	 * (rounded-up) height, with the caller taking the last; make sure
+	 * that the last band is not empty.
+	 */
+	while (num_threads > 1 &&
+	       (num_threads - 1) * ((height + num_threads - 1) / num_threads) >= height)
+		num_threads--;
+
 	return num_threads;
 }
 